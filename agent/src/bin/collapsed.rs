@@ -0,0 +1,77 @@
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::{Path, PathBuf};
+use std::process::exit;
+
+use iwm::common::collector::SampleType;
+use iwm::ebpf::pprof::collapsed::{list_files, CollapsedReader};
+
+// Converts the collapsed files written by the ebpf component.
+//
+//   collapsed folded <file or dir>             folded stacks on stdout, allocations by bytes
+//   collapsed pprof <file or dir> <out dir>    one pprof file per profile
+fn usage() -> ! {
+    eprintln!("usage: collapsed folded <file|dir>");
+    eprintln!("       collapsed pprof <file|dir> <out dir>");
+    exit(2)
+}
+
+fn inputs(path: &Path) -> Vec<PathBuf> {
+    if path.is_dir() {
+        list_files(path)
+    } else {
+        vec![path.to_path_buf()]
+    }
+}
+
+fn main() {
+    let args: Vec<String> = std::env::args().collect();
+    if args.len() < 3 {
+        usage();
+    }
+    let out_dir = match args[1].as_str() {
+        "folded" => None,
+        "pprof" if args.len() > 3 => Some(PathBuf::from(&args[3])),
+        _ => usage(),
+    };
+    if let Some(dir) = &out_dir {
+        fs::create_dir_all(dir).unwrap();
+    }
+
+    let stdout = io::stdout();
+    let mut out = BufWriter::new(stdout.lock());
+    let mut n = 0;
+    for path in inputs(Path::new(&args[2])) {
+        let mut reader = match CollapsedReader::open(&path) {
+            Ok(reader) => reader,
+            Err(err) => {
+                eprintln!("{:?}: {}", path, err);
+                continue;
+            }
+        };
+        loop {
+            let profile = match reader.next_profile() {
+                Ok(Some(profile)) => profile,
+                Ok(None) => break,
+                Err(err) => {
+                    eprintln!("{:?}: {}", path, err);
+                    break;
+                }
+            };
+            match &out_dir {
+                Some(dir) => {
+                    let file = dir.join(format!("profile-{}-{}.pb", profile.time_nanos, n));
+                    fs::write(&file, profile.to_pprof()).unwrap();
+                }
+                None => {
+                    let value = if profile.sample_type == SampleType::Mem { 1 } else { 0 };
+                    writeln!(out, "# {} {:?}", profile.labels, profile.sample_type).unwrap();
+                    profile.write_folded(&mut out, value).unwrap();
+                }
+            }
+            n += 1;
+        }
+    }
+    out.flush().unwrap();
+    eprintln!("{} profiles", n);
+}
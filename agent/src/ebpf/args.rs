@@ -1,9 +1,14 @@
+use std::path::PathBuf;
 use std::time::Duration;
+use iwm::ebpf::map_sizes::MapSizeOptions;
+use iwm::ebpf::pprof::collapsed::CollapsedFileOptions;
 use iwm::ebpf::sd::target::EbpfTarget;
+use iwm::ebpf::symtab::debuginfod::DebuginfodOptions;
 use crate::appender::Appendable;
 
 pub struct Arguments {
     pub forward_to: Vec<Box<dyn Appendable>>,
+    pub collapsed_file: Option<CollapsedFileOptions>,
     pub targets: Option<Vec<EbpfTarget>>,
     pub collect_interval: Option<Duration>,
     pub sample_rate: Option<i32>,
@@ -16,4 +21,28 @@ pub struct Arguments {
     pub collect_kernel_profile: Option<bool>,
     pub demangle: Option<String>,
     pub python_enabled: Option<bool>,
+    pub per_cpu_counts: Option<bool>,
+    pub lru_counts: Option<bool>,
+    pub use_ringbuf: Option<bool>,
+    pub pid_events_per_sec: Option<u64>,
+    pub pid_events_flush_interval: Option<Duration>,
+    pub map_sizes: Option<MapSizeOptions>,
+    pub cgroup_filter: Option<bool>,
+    pub python_stack_depth: Option<u32>,
+    pub python_bpf_loop: Option<bool>,
+    pub python_symbols_path: Option<PathBuf>,
+    pub symbol_index_path: Option<PathBuf>,
+    pub debuginfod: Option<DebuginfodOptions>,
+    pub symbolize_workers: Option<usize>,
+    pub off_cpu: Option<bool>,
+    pub off_cpu_min_duration: Option<Duration>,
+    pub alloc_profiling: Option<bool>,
+    pub alloc_sample_bytes: Option<u64>,
+    pub dwarf_unwinding: Option<bool>,
+    pub stack_snapshots: Option<bool>,
+    pub stack_snapshot_size: Option<u32>,
+    pub stack_snapshot_bytes_per_sec: Option<u64>,
+    pub cpu_budget: Option<f64>,
+    pub min_sample_rate: Option<u32>,
+    pub bpf_stats: Option<bool>,
 }
@@ -1,10 +1,11 @@
 #[allow(unused_imports)]
 use std::{
     sync::Arc,
-    time::Duration,
+    time::{Duration, Instant},
 };
 
 use std::fs::File;
+use std::path::PathBuf;
 use std::sync::Mutex;
 use std::borrow::Borrow;
 
@@ -13,14 +14,17 @@ use std::borrow::Borrow;
 use log::{error};
 use tokio::time::interval;
 use iwm::common::collector;
+use iwm::ebpf::map_sizes::MapSizeOptions;
 use iwm::ebpf::metrics::ebpf_metrics::EbpfMetrics;
 use iwm::ebpf::metrics::metrics::ProfileMetrics;
 
 use iwm::ebpf::{pprof};
 use iwm::ebpf::pprof::BuildersOptions;
+use iwm::ebpf::pprof::collapsed::{CollapsedFileOptions, CollapsedWriter};
 
 use iwm::ebpf::sd::target::{LABEL_SERVICE_NAME, TargetFinder, TargetsOptions};
-use iwm::ebpf::session::{Session, SessionDebugInfo, SessionOptions};
+use iwm::ebpf::session::{CountsMapType, Session, SessionDebugInfo, SessionOptions};
+use iwm::ebpf::symtab::debuginfod::DebuginfodOptions;
 use iwm::ebpf::symtab::elf_module::SymbolOptions;
 use iwm::ebpf::symtab::gcache::{GCacheOptions};
 use iwm::ebpf::symtab::symbols::CacheOptions;
@@ -41,6 +45,8 @@ pub mod push_api {
 #[derive(Clone)]
 pub struct Arguments {
     pub forward_to: Arc<Vec<Box<FanOutClient>>>,
+    // also append every round to rotated collapsed files, with no forward_to only there
+    pub collapsed_file: Option<CollapsedFileOptions>,
     pub targets: Vec<Target>,
     pub collect_interval: Duration,
     pub sample_rate: i32,
@@ -51,7 +57,34 @@ pub struct Arguments {
     pub cache_rounds: i32,
     pub collect_user_profile: bool,
     pub collect_kernel_profile: bool,
-    pub python_enabled: bool
+    pub python_enabled: bool,
+    pub per_cpu_counts: bool,
+    // with per_cpu_counts, evict old keys instead of dropping new ones, counts are then approximate
+    pub lru_counts: bool,
+    pub use_ringbuf: bool,
+    pub pid_events_per_sec: u64,
+    pub pid_events_flush_interval: Duration,
+    // max_entries of the BPF maps, unset ones are derived from the cpus, memory and processes
+    pub map_sizes: MapSizeOptions,
+    pub cgroup_filter: bool,
+    pub python_stack_depth: u32,
+    pub python_bpf_loop: bool,
+    pub python_symbols_path: Option<PathBuf>,
+    pub symbol_index_path: Option<PathBuf>,
+    // debuginfod servers and cache for stripped ELFs, None keeps to the local files
+    pub debuginfod: Option<DebuginfodOptions>,
+    pub symbolize_workers: usize,
+    pub off_cpu: bool,
+    pub off_cpu_min_duration: Duration,
+    pub alloc_profiling: bool,
+    pub alloc_sample_bytes: u64,
+    pub dwarf_unwinding: bool,
+    pub stack_snapshots: bool,
+    pub stack_snapshot_size: u32,
+    pub stack_snapshot_bytes_per_sec: u64,
+    pub cpu_budget: f64,
+    pub min_sample_rate: u32,
+    pub bpf_stats: bool,
 }
 
 pub struct EbpfLinuxComponent<'a> {
@@ -60,6 +93,7 @@ pub struct EbpfLinuxComponent<'a> {
     pub session: Arc<Mutex<Session<'a>>>,
 
     appendable: Box<Fanout>,
+    collapsed: Option<CollapsedWriter>,
     debug_info: DebugInfo,
     metrics: Arc<EbpfMetrics>
 }
@@ -120,12 +154,17 @@ impl EbpfLinuxComponent<'_> {
         let ms = Arc::new(EbpfMetrics::new(opts.registerer.borrow()));
         let sesstion_opts = convert_session_options(&args.clone(), ms.clone().profile_metrics.clone());
         let session = Session::new(target_finder, sesstion_opts).unwrap();
+        let collapsed = match &args.collapsed_file {
+            Some(options) => Some(CollapsedWriter::new(options.clone())?),
+            None => None,
+        };
 
         Ok(Self {
             options: opts.clone(),
             args: args.clone(),
             session: Arc::new(Mutex::new(session)),
             appendable: Box::new(Fanout::new(args.clone().forward_to, opts.id, opts.registerer.clone())),
+            collapsed,
             debug_info: DebugInfo { targets: vec![], session: SessionDebugInfo::default() },
             metrics: ms.clone()
         })
@@ -133,15 +172,30 @@ impl EbpfLinuxComponent<'_> {
 
     fn collect_profiles(&mut self) -> Result<()> {
         let builders = Arc::new(Mutex::new(pprof::ProfileBuilders::new(
-            BuildersOptions { sample_rate: 97, per_pid_profile: false }
+            BuildersOptions {
+                sample_rate: 97,
+                per_pid_profile: false,
+                alloc_sample_bytes: self.args.alloc_sample_bytes,
+            }
         )));
         {
             let mut s = self.session.lock().unwrap();
             collector::collect(builders.clone(), &mut s).unwrap();
         }
 
+        let overhead = &self.metrics.profile_metrics.overhead;
+        let mut build_time = Duration::ZERO;
+        let mut upload_time = Duration::ZERO;
         let bb = builders.clone();
         let b = bb.lock().unwrap();
+        if let Some(collapsed) = &mut self.collapsed {
+            if let Err(err) = collapsed.write_round(&b) {
+                error!("ebpf collapsed write err {}", err);
+            }
+        }
+        if self.args.forward_to.is_empty() {
+            return Ok(());
+        }
         for (_, builder) in &b.builders {
             //dbg!(&builder.pprof_builder.profile.string_table);
             let sn = builder.labels.get(LABEL_SERVICE_NAME);
@@ -154,24 +208,31 @@ impl EbpfLinuxComponent<'_> {
                 .with_label_values(&[service_name])
                 .inc_by(builder.pprof_builder.profile.sample.len() as f64);
 
+            let build_start = Instant::now();
             let mut buf = vec![];
             //info!("{:?}",&builder.pprof_builder.profile);
             builder.write(&mut buf);
+            build_time += build_start.elapsed();
 
             let raw_profile: Vec<u8> = buf.into();
             self.metrics.pprof_bytes_total.with_label_values(&[service_name]).inc_by(raw_profile.len() as f64);
             let samples = vec![
                 push_api::RawSample { raw_profile, id: "".to_string() }
             ];
+            let upload_start = Instant::now();
             let appender = self.appendable.appender();
-            if let Err(err) = appender.append(
+            let res = appender.append(
                 builder.labels.clone(),
                 samples
-            ) {
+            );
+            upload_time += upload_start.elapsed();
+            if let Err(err) = res {
                 error!("ebpf pprof write err {}", err);
                 return Err(OSError(format!("{}", err)));
             }
         }
+        overhead.pprof_build_duration.observe(build_time.as_secs_f64());
+        overhead.upload_duration.observe(upload_time.as_secs_f64());
         Ok(())
     }
 
@@ -189,7 +250,7 @@ impl EbpfLinuxComponent<'_> {
     }
 }
 
-fn convert_session_options(_args: &Arguments, ms: Arc<ProfileMetrics>) -> SessionOptions {
+fn convert_session_options(args: &Arguments, ms: Arc<ProfileMetrics>) -> SessionOptions {
     let keep_rounds = 3;
     SessionOptions {
         collect_user: true,
@@ -211,5 +272,34 @@ fn convert_session_options(_args: &Arguments, ms: Arc<ProfileMetrics>) -> Sessio
             symbol_options: SymbolOptions::default()
         },
         metrics: ms,
+        counts_map_type: if args.per_cpu_counts && args.lru_counts {
+            CountsMapType::LruPerCpu
+        } else if args.per_cpu_counts {
+            CountsMapType::PerCpu
+        } else {
+            CountsMapType::Shared
+        },
+        use_ringbuf: args.use_ringbuf,
+        pid_events_per_sec: args.pid_events_per_sec,
+        pid_events_flush_interval: args.pid_events_flush_interval,
+        map_sizes: args.map_sizes,
+        cgroup_filter: args.cgroup_filter,
+        python_stack_depth: args.python_stack_depth,
+        python_bpf_loop: args.python_bpf_loop,
+        python_symbols_path: args.python_symbols_path.clone(),
+        symbol_index_path: args.symbol_index_path.clone(),
+        debuginfod: args.debuginfod.clone(),
+        symbolize_workers: args.symbolize_workers,
+        off_cpu: args.off_cpu,
+        off_cpu_min_duration: args.off_cpu_min_duration,
+        alloc_profiling: args.alloc_profiling,
+        alloc_sample_bytes: args.alloc_sample_bytes,
+        dwarf_unwinding: args.dwarf_unwinding,
+        stack_snapshots: args.stack_snapshots,
+        stack_snapshot_size: args.stack_snapshot_size,
+        stack_snapshot_bytes_per_sec: args.stack_snapshot_bytes_per_sec,
+        cpu_budget: args.cpu_budget,
+        min_sample_rate: args.min_sample_rate,
+        bpf_stats: args.bpf_stats,
     }
 }
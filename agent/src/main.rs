@@ -1,9 +1,9 @@
 use std::any::Any;
 use std::collections::HashMap;
 use std::{panic, thread};
-use std::ops::Deref;
 
 
+use std::path::PathBuf;
 use std::sync::{Arc, Mutex};
 use std::time::Duration;
 use log::{error, info};
@@ -22,8 +22,8 @@ use agent::ebpf::ebpf_linux;
 use agent::ebpf::ebpf_linux::{EbpfLinuxComponent};
 use agent::write::write;
 use agent::write::write::WriteComponent;
-use iwm::ebpf::ring::reader::Reader;
-use iwm::ebpf::sync::PidOp;
+use iwm::ebpf::map_sizes::MapSizeOptions;
+use iwm::ebpf::sync::{decode_pid_events, PID_EVENT_BATCH_SIZE};
 
 fn my_get_service_data(_name: &str) -> Result<Box<dyn Any>, String> {
     // Implement your logic here
@@ -31,13 +31,6 @@ fn my_get_service_data(_name: &str) -> Result<Box<dyn Any>, String> {
     Ok(Box::new(0))
 }
 
-#[derive(Debug, Default, Copy, Clone)]
-#[repr(C)]
-pub struct pid_event {
-    pub op: u32,
-    pub pid: u32,
-}
-
 #[tokio::main]
 #[allow(dead_code)]
 #[allow(unused_variables)]
@@ -77,12 +70,14 @@ async fn main() -> Result<(), ()> {
             max_backoff: Duration::from_secs(300),
             max_backoff_retries: 10,
             ..Default::default()
-        }])
+        }]),
+        ..Default::default()
     };
     let (mut write_component, fanout_client) = WriteComponent::new(option.clone(), write_args).await.unwrap();
 
     let argument = ebpf_linux::Arguments {
         forward_to: Arc::new(Vec::from([Box::new(fanout_client)])),
+        collapsed_file: None,
         targets,
         collect_interval: Duration::from_secs(15),
         sample_rate: 97,
@@ -93,20 +88,57 @@ async fn main() -> Result<(), ()> {
         cache_rounds: 3,
         collect_user_profile: true,
         collect_kernel_profile: true,
-        python_enabled: true
+        python_enabled: true,
+        per_cpu_counts: false,
+        lru_counts: false,
+        use_ringbuf: true,
+        pid_events_per_sec: 200,
+        pid_events_flush_interval: Duration::from_millis(50),
+        map_sizes: MapSizeOptions {
+            pids: Some(16384),
+            ..Default::default()
+        },
+        cgroup_filter: true,
+        python_stack_depth: 128,
+        python_bpf_loop: true,
+        python_symbols_path: Some(PathBuf::from(&option.data_path).join("python_symbols")),
+        symbol_index_path: Some(PathBuf::from(&option.data_path).join("symbol_index")),
+        debuginfod: None,
+        symbolize_workers: 0,
+        off_cpu: false,
+        off_cpu_min_duration: Duration::from_millis(1),
+        alloc_profiling: false,
+        alloc_sample_bytes: 512 * 1024,
+        dwarf_unwinding: false,
+        stack_snapshots: false,
+        stack_snapshot_size: 8 * 1024,
+        stack_snapshot_bytes_per_sec: 4 * 1024 * 1024,
+        cpu_budget: 0.0,
+        min_sample_rate: 11,
+        bpf_stats: false,
     };
     let mut ebpf_component = EbpfLinuxComponent::new(option.clone(), argument).await.unwrap();
 
     info!("Server started");
     write_component.run().await;
 
-    let events_reader = {
+    let (events_reader, python_events, snapshots) = {
         let mut s = ebpf_component.session.lock().unwrap();
         s.start().unwrap();
-        Arc::new(Mutex::new(Reader::new(
-            s.bpf.maps().events().deref()
-        ).unwrap()))
+        (
+            Arc::new(Mutex::new(s.events_reader().unwrap())),
+            s.python_events_consumer().unwrap(),
+            s.stack_snapshot_consumer().unwrap(),
+        )
     };
+    // python samples only touch the shared samples map, never the session
+    if let Some(mut consumer) = python_events {
+        thread::spawn(move || consumer.run());
+    }
+    // snapshots are queued and unwound by the next collection
+    if let Some(mut consumer) = snapshots {
+        thread::spawn(move || consumer.run());
+    }
     let s = ebpf_component.session.clone();
     thread::spawn(move || {
         loop {
@@ -120,40 +152,19 @@ async fn main() -> Result<(), ()> {
                             );
                     }
 
+                    let mut events = Vec::with_capacity(record.raw_samples.len() * PID_EVENT_BATCH_SIZE);
                     for rs in record.raw_samples.iter() {
-                        let raw_sample = rs.to_vec();
-                        if raw_sample.len() < 8 {
-                            error!("perf event record too small: {}", raw_sample.len());
-                            continue;
-                        }
-
-                        let e = pid_event {
-                            op: u32::from_le_bytes([raw_sample[0], raw_sample[1], raw_sample[2], raw_sample[3]]),
-                            pid: u32::from_le_bytes([raw_sample[4], raw_sample[5], raw_sample[6], raw_sample[7]])
-                        };
-                        dbg!(&e.pid);
-                        if e.op == PidOp::RequestUnknownProcessInfo.to_u32() {
-                            let mut ss = s.lock().unwrap();
-                            match ss.process_pid_info_requests(e.pid) {
-                                Ok(_) => {}
-                                Err(_) => { error!("pid info request queue full, dropping request: {}", e.pid); }
-                            }
-                        } else if e.op == PidOp::Dead.to_u32() {
-                            let mut ss = s.lock().unwrap();
-                            match ss.process_dead_pids_events(e.pid) {
-                                Ok(_) => {}
-                                Err(_) => { error!("dead pid info queue full, dropping event: {}", e.pid); }
-                            }
-                        } else if e.op == PidOp::RequestExecProcessInfo.to_u32() {
-                            let mut ss = s.lock().unwrap();
-                            match ss.process_pid_exec_requests(e.pid) {
-                                Ok(_) => {}
-                                Err(_) => { error!("pid exec request queue full, dropping event: {}", e.pid); }
-                            }
-                        } else {
-                            error!("unknown perf event record: op={}, pid={}", e.op, e.pid);
+                        if !decode_pid_events(rs, &mut events) {
+                            error!("perf event record too small: {}", rs.len());
                         }
                     }
+                    if events.is_empty() {
+                        continue;
+                    }
+                    let mut ss = s.lock().unwrap();
+                    if let Err(err) = ss.process_pid_events(&events) {
+                        error!("processing pid events: {}", err);
+                    }
                 }
                 Err(err) => {
                     error!("reading from perf event reader: {}", err);
@@ -4,21 +4,25 @@ use std::collections::HashMap;
 use std::sync::{Arc};
 use std::time::Duration;
 use std::borrow::Borrow;
-use log::{info, warn};
+use log::{debug, info, warn};
 
 
+use tokio::sync::mpsc::error::TrySendError;
+use tokio::sync::{mpsc, Semaphore};
+use tonic::codec::CompressionEncoding;
 use tonic::transport::Channel;
 use iwm::common::labels::Labels;
 use iwm::ebpf::metrics::write_metrics::WriteMetrics;
 use iwm::ebpf::sd::target::{METRIC_NAME, RESERVED_LABEL_PREFIX};
 
+use iwm::error::Error::WriteError;
 use iwm::error::Result;
 
 use crate::common::registry::{Options};
 use crate::common::component::Component;
 use crate::appender::{Appendable, Appender};
 use crate::ebpf::ebpf_linux::push_api::pusher_service_client::PusherServiceClient;
-use crate::ebpf::ebpf_linux::push_api::{LabelPair, PushRequest, PushResponse, RawProfileSeries, RawSample};
+use crate::ebpf::ebpf_linux::push_api::{LabelPair, PushRequest, RawProfileSeries, RawSample};
 
 
 #[derive(Debug, Clone)]
@@ -50,6 +54,12 @@ impl Default for EndpointOptions {
 pub struct Arguments {
     pub external_labels: HashMap<String, String>,
     pub endpoints: Vec<EndpointOptions>,
+    // profiles waiting for upload per endpoint, newer ones are dropped while it is full
+    pub queue_size: usize,
+    // profiles of different targets sent in one push request
+    pub max_batch_size: usize,
+    // push requests in flight per endpoint
+    pub max_in_flight: usize,
 }
 
 impl Default for Arguments {
@@ -57,6 +67,9 @@ impl Default for Arguments {
         Self {
             external_labels: HashMap::new(),
             endpoints: Vec::new(),
+            queue_size: 256,
+            max_batch_size: 32,
+            max_in_flight: 4,
         }
     }
 }
@@ -90,9 +103,12 @@ impl Component for WriteComponent {
     }
 }
 
+// append only queues the profiles. Every endpoint has an upload task batching what is queued into
+// push requests, so collection never waits on the network; a slow endpoint fills its queue and
+// its newest profiles are dropped and counted instead.
 #[derive(Clone)]
 pub struct FanOutClient {
-    clients: Vec<PusherServiceClient<Channel>>,
+    queues: Vec<(String, mpsc::Sender<RawProfileSeries>)>,
     config: Arguments,
     opts: Options,
     metrics: Arc<WriteMetrics>,
@@ -118,29 +134,31 @@ impl Appender for FanOutClient {
         for (name, value) in &self.config.external_labels {
             lbs_builder.insert(name.clone(), value.clone());
         }
-        let labels = lbs_builder.keys().map(|key| {
-            LabelPair {
-                name: key.clone(),
-                value: lbs_builder.get(key).unwrap().clone(),
-            }
+        let labels = lbs_builder.into_iter().map(|(name, value)| {
+            LabelPair { name, value }
         }).collect();
-        //dbg!(&labels);
-        let samples: Vec<RawSample> = samples.iter().map(|sample| {
+        let samples: Vec<RawSample> = samples.into_iter().map(|sample| {
             RawSample {
-                raw_profile: sample.raw_profile.clone(),
+                raw_profile: sample.raw_profile,
                 id: "0".to_string(),
             }
         }).collect();
+        let series = RawProfileSeries { labels, samples };
 
-        //dbg!(samples.len());
-        let req = PushRequest {
-            series: vec![RawProfileSeries {
-                labels,
-                samples,
-            }],
-        };
-        //info!("{:?}", &req);
-        self.push(req).unwrap();
+        for (url, queue) in self.queues.iter() {
+            match queue.try_send(series.clone()) {
+                Ok(()) => {}
+                Err(TrySendError::Full(series)) => {
+                    let (size, profiles) = series_size(&series);
+                    debug!("upload queue of {} is full, dropping {} profiles", url, profiles);
+                    self.metrics.dropped_profiles.with_label_values(&[url]).inc_by(profiles as f64);
+                    self.metrics.dropped_bytes.with_label_values(&[url]).inc_by(size as f64);
+                }
+                Err(TrySendError::Closed(_)) => {
+                    return Err(WriteError(format!("upload queue of {} is closed", url)));
+                }
+            }
+        }
         Ok(())
     }
 }
@@ -160,44 +178,78 @@ impl FanOutClient {
         //     let client = PusherServiceClient::connect(&endpoint).await.unwrap();
         //     clients.push(client);
         // }
+        let mut queues = Vec::with_capacity(clients.len());
+        for (client, endpoint) in clients.into_iter().zip(config.endpoints.iter()) {
+            let (tx, rx) = mpsc::channel(config.queue_size.max(1));
+            let uploader = Uploader {
+                client: client.send_compressed(CompressionEncoding::Gzip),
+                endpoint: endpoint.clone(),
+                max_batch_size: config.max_batch_size.max(1),
+                in_flight: Arc::new(Semaphore::new(config.max_in_flight.max(1))),
+                metrics: metrics.clone(),
+            };
+            tokio::spawn(uploader.run(rx));
+            queues.push((endpoint.url.clone(), tx));
+        }
         Ok(Self {
-            clients, config, opts, metrics,
+            queues, config, opts, metrics,
         })
     }
+}
 
-    fn push(&self, req: PushRequest) -> Result<PushResponse> {
+struct Uploader {
+    client: PusherServiceClient<Channel>,
+    endpoint: EndpointOptions,
+    max_batch_size: usize,
+    in_flight: Arc<Semaphore>,
+    metrics: Arc<WriteMetrics>,
+}
 
-        //info!("{:?}",&req);
-        self.clients.iter().enumerate().for_each(|(i, client)| {
-            let r = req.clone();
-            let mut client = client.clone();
-            let config = self.config.endpoints[i].clone();
+impl Uploader {
+    async fn run(self, mut queue: mpsc::Receiver<RawProfileSeries>) {
+        while let Some(series) = queue.recv().await {
+            let mut batch = vec![series];
+            while batch.len() < self.max_batch_size {
+                match queue.try_recv() {
+                    Ok(series) => batch.push(series),
+                    Err(_) => break,
+                }
+            }
+            // waiting here lets the queue fill up while the endpoint is slow
+            let permit = self.in_flight.clone().acquire_owned().await.unwrap();
+            let req = PushRequest { series: batch };
+            let mut client = self.client.clone();
+            let url = self.endpoint.url.clone();
+            let timeout = self.endpoint.remote_timeout;
             let metrics = self.metrics.clone();
-
             tokio::spawn(async move {
-                let (req_size, profile_count) = request_size(&r);
-                let result = PusherServiceClient::push(&mut client, r.clone()).await;
-                if result.is_ok() {
-                    metrics.sent_bytes.with_label_values(&[&config.url]).inc_by(req_size as f64);
-                    metrics.sent_profiles.with_label_values(&[&config.url]).inc_by(profile_count as f64);
-                } else if let Err(err) = result {
-                    info!("{}", &config.url);
-                    warn!("failed to push to endpoint: {:?}", err);
-                    //errors.push(err.clone());
-                    metrics.retries.with_label_values(&[&config.url]).inc();
+                let (req_size, profile_count) = request_size(&req);
+                match tokio::time::timeout(timeout, client.push(req)).await {
+                    Ok(Ok(_)) => {
+                        metrics.sent_bytes.with_label_values(&[&url]).inc_by(req_size as f64);
+                        metrics.sent_profiles.with_label_values(&[&url]).inc_by(profile_count as f64);
+                    }
+                    Ok(Err(err)) => {
+                        info!("{}", &url);
+                        warn!("failed to push to endpoint: {:?}", err);
+                        metrics.retries.with_label_values(&[&url]).inc();
+                    }
+                    Err(_) => {
+                        warn!("push to {} timed out after {:?}", url, timeout);
+                        metrics.retries.with_label_values(&[&url]).inc();
+                    }
                 }
+                drop(permit);
             });
-            ()
-        });
-
-        // if !errors.is_empty() {
-        //     return Err(WriteError(format!("errors occurred during pushing: {:?}", errors)));
-        // }
-
-        Ok(PushResponse::default())
+        }
     }
 }
 
+fn series_size(series: &RawProfileSeries) -> (i64, i64) {
+    let size = series.samples.iter().map(|s| s.raw_profile.len() as i64).sum();
+    (size, series.samples.len() as i64)
+}
+
 fn request_size(req: &PushRequest) -> (i64, i64) {
     let mut size = 0;
     let mut profiles = 0;
@@ -0,0 +1,155 @@
+#![allow(dead_code)]
+
+use std::fmt::Write;
+
+// Inputs are generated from a fixed seed so runs compare against each other.
+pub const SEED: u64 = 0x9e3779b97f4a7c15;
+
+// xorshift64*, good enough to spread addresses and stacks
+pub struct Rng(u64);
+
+impl Rng {
+    pub fn new(seed: u64) -> Self {
+        Rng(seed.max(1))
+    }
+
+    pub fn next(&mut self) -> u64 {
+        self.0 ^= self.0 >> 12;
+        self.0 ^= self.0 << 25;
+        self.0 ^= self.0 >> 27;
+        self.0.wrapping_mul(0x2545f4914f6cdd1d)
+    }
+
+    pub fn below(&mut self, n: u64) -> u64 {
+        self.next() % n.max(1)
+    }
+}
+
+// Profiles are dominated by a few hot stacks with a long tail, ranks are drawn with a
+// probability proportional to 1 / rank^s.
+pub struct Zipf {
+    cdf: Vec<f64>,
+}
+
+impl Zipf {
+    pub fn new(n: usize, s: f64) -> Self {
+        let mut cdf = Vec::with_capacity(n);
+        let mut total = 0.0;
+        for rank in 1..=n {
+            total += 1.0 / (rank as f64).powf(s);
+            cdf.push(total);
+        }
+        for c in cdf.iter_mut() {
+            *c /= total;
+        }
+        Zipf { cdf }
+    }
+
+    pub fn sample(&self, rng: &mut Rng) -> usize {
+        let u = (rng.next() >> 11) as f64 / (1u64 << 53) as f64;
+        self.cdf.partition_point(|c| *c < u).min(self.cdf.len() - 1)
+    }
+}
+
+// Sorted start addresses the way an ELF symbol table fills a PCIndex.
+pub fn symbol_addresses(n: usize, base: u64, rng: &mut Rng) -> Vec<u64> {
+    let mut addr = base;
+    (0..n)
+        .map(|_| {
+            addr += 16 + rng.below(512) * 16;
+            addr
+        })
+        .collect()
+}
+
+// /proc/pid/maps of a process with many mapped libraries and anonymous regions, in the
+// proportions seen on JVMs and large python services.
+pub fn proc_maps(lines: usize, rng: &mut Rng) -> String {
+    let mut maps = String::with_capacity(lines * 100);
+    let mut addr: u64 = 0x55d0_0000_0000;
+    let mut inode = 1_000_000;
+    let mut i = 0;
+    while i < lines {
+        let size = (1 + rng.below(256)) * 0x1000;
+        match rng.below(10) {
+            // a library mapped as read, exec, read only and read write segments
+            0..=3 => {
+                inode += 1;
+                let lib = format!("/usr/lib/x86_64-linux-gnu/libsynthetic{}.so.{}", inode % 5000, rng.below(9));
+                let mut offset = 0;
+                for perms in ["r--p", "r-xp", "r--p", "rw-p"] {
+                    let _ = writeln!(
+                        maps,
+                        "{:x}-{:x} {} {:08x} fd:01 {}                    {}",
+                        addr,
+                        addr + size,
+                        perms,
+                        offset,
+                        inode,
+                        lib
+                    );
+                    addr += size;
+                    offset += size;
+                    i += 1;
+                }
+            }
+            4 => {
+                let _ = writeln!(maps, "{:x}-{:x} r-xp 00000000 00:00 0                          [vdso]", addr, addr + 0x2000);
+                addr += 0x2000;
+                i += 1;
+            }
+            _ => {
+                let _ = writeln!(maps, "{:x}-{:x} rw-p 00000000 00:00 0 ", addr, addr + size);
+                addr += size;
+                i += 1;
+            }
+        }
+        addr += rng.below(16) * 0x1000;
+    }
+    maps
+}
+
+// /proc/kallsyms with the usual mix of text and data symbols, followed by unsorted module symbols.
+pub fn kallsyms(symbols: usize, rng: &mut Rng) -> (String, Vec<u64>) {
+    let mut data = String::with_capacity(symbols * 48);
+    let mut text = Vec::with_capacity(symbols);
+    let text_types = ["T", "t", "W"];
+    let data_types = ["D", "d", "B", "b", "R", "r"];
+    let kernel = symbols * 9 / 10;
+    for (i, addr) in symbol_addresses(kernel, 0xffff_ffff_8100_0000, rng).into_iter().enumerate() {
+        if rng.below(4) == 0 {
+            let typ = data_types[rng.below(data_types.len() as u64) as usize];
+            let _ = writeln!(data, "{:016x} {} synthetic_data_{}", addr, typ, i);
+        } else {
+            let typ = text_types[rng.below(text_types.len() as u64) as usize];
+            let _ = writeln!(data, "{:016x} {} synthetic_kernel_function_{}", addr, typ, i);
+            text.push(addr);
+        }
+    }
+    let mut modules = symbol_addresses(symbols - kernel, 0xffff_ffff_c000_0000, rng);
+    let len = modules.len();
+    for i in 0..len {
+        modules.swap(i, rng.below(len as u64) as usize);
+    }
+    for (i, addr) in modules.into_iter().enumerate() {
+        let _ = writeln!(data, "{:016x} t synthetic_module_function_{}\t[synthetic_mod{}]", addr, i, i % 64);
+        text.push(addr);
+    }
+    text.sort_unstable();
+    (data, text)
+}
+
+// Raw stacks as the BPF stack map stores them, leaf first and zero padded to 127 entries.
+pub fn raw_stacks(count: usize, ips: &[u64], rng: &mut Rng) -> Vec<Vec<u8>> {
+    (0..count)
+        .map(|_| {
+            let depth = 4 + rng.below(40) as usize;
+            let mut stack = vec![0u8; 127 * 8];
+            for frame in 0..depth {
+                let ip = ips[rng.below(ips.len() as u64) as usize] + 1 + rng.below(15);
+                stack[frame * 8..frame * 8 + 8].copy_from_slice(&ip.to_le_bytes());
+            }
+            stack
+        })
+        .collect()
+}
@@ -0,0 +1,238 @@
+use std::io::Cursor;
+use std::path::Path;
+use std::sync::Arc;
+
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput};
+
+use iwm::common::collector::{ProfileSample, SampleType};
+use iwm::ebpf::pprof::collapsed::{list_files, CollapsedProfile, CollapsedReader};
+use iwm::ebpf::pprof::{BuildersOptions, ProfileBuilders};
+use iwm::ebpf::sd::target::EbpfTarget;
+use iwm::ebpf::session::{symbolize, DiscoveryTarget, StackResolver, SymbolizeOptions};
+use iwm::ebpf::symtab::kallsyms::new_kallsyms_from_data;
+
+mod common;
+
+use common::{Rng, Zipf, SEED};
+
+const TARGETS: usize = 8;
+const FRAMES: usize = 20_000;
+const STACKS: usize = 5_000;
+// samples of a round at 97Hz, 15s and a few busy cpus
+const SAMPLES: usize = 50_000;
+
+fn targets() -> Vec<EbpfTarget> {
+    (0..TARGETS)
+        .map(|i| {
+            let mut target = DiscoveryTarget::new();
+            target.insert("service_name".to_string(), format!("synthetic-service-{}", i));
+            target.insert("namespace".to_string(), "bench".to_string());
+            target.insert("pod".to_string(), format!("synthetic-pod-{}", i));
+            EbpfTarget::new(format!("{:064x}", i), 1000 + i as u32, target)
+        })
+        .collect()
+}
+
+// Stacks share their roots and differ towards the leaves, like real call trees.
+fn stacks(rng: &mut Rng) -> Vec<Vec<Arc<str>>> {
+    let frames: Vec<Arc<str>> = (0..FRAMES)
+        .map(|i| Arc::from(format!("synthetic::module{}::function_{}", i % 97, i)))
+        .collect();
+    let roots = Zipf::new(64, 1.0);
+    let inner = Zipf::new(FRAMES, 1.1);
+    (0..STACKS)
+        .map(|_| {
+            let depth = 4 + rng.below(60) as usize;
+            let mut stack: Vec<Arc<str>> = (0..depth).map(|_| frames[inner.sample(rng)].clone()).collect();
+            stack.push(frames[roots.sample(rng)].clone());
+            stack
+        })
+        .collect()
+}
+
+struct Draw {
+    target: usize,
+    stack: usize,
+    value: u64,
+}
+
+// Which stack of which target every sample of the round is, a few stacks take most samples.
+fn draws(n: usize, rng: &mut Rng) -> Vec<Draw> {
+    let by_target = Zipf::new(TARGETS, 0.8);
+    let by_stack = Zipf::new(STACKS, 1.2);
+    (0..n)
+        .map(|_| Draw {
+            target: by_target.sample(rng),
+            stack: by_stack.sample(rng),
+            value: 1 + rng.below(4),
+        })
+        .collect()
+}
+
+fn aggregate(builders: &mut ProfileBuilders, targets: &[EbpfTarget], stacks: &[Vec<Arc<str>>], draws: &[Draw]) {
+    for d in draws.iter() {
+        builders.add_sample(ProfileSample {
+            target: &targets[d.target],
+            pid: 1000 + d.target as u32,
+            sample_type: SampleType::Cpu,
+            aggregation: true,
+            stack: &stacks[d.stack],
+            value: d.value,
+            value2: 0,
+        });
+    }
+}
+
+fn new_builders() -> ProfileBuilders {
+    ProfileBuilders::new(BuildersOptions {
+        sample_rate: 97,
+        per_pid_profile: true,
+        alloc_sample_bytes: 512 * 1024,
+    })
+}
+
+fn add_sample(c: &mut Criterion) {
+    let mut rng = Rng::new(SEED);
+    let targets = targets();
+    let stacks = stacks(&mut rng);
+
+    let mut group = c.benchmark_group("pprof/add_sample");
+    for n in [1_000usize, SAMPLES] {
+        let draws = draws(n, &mut rng);
+        group.throughput(Throughput::Elements(n as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(n), &draws, |b, draws| {
+            b.iter_batched(
+                new_builders,
+                |mut builders| {
+                    aggregate(&mut builders, &targets, &stacks, draws);
+                    builders
+                },
+                BatchSize::LargeInput,
+            )
+        });
+    }
+    group.finish();
+}
+
+fn encode(c: &mut Criterion) {
+    let mut rng = Rng::new(SEED);
+    let targets = targets();
+    let stacks = stacks(&mut rng);
+    let mut builders = new_builders();
+    aggregate(&mut builders, &targets, &stacks, &draws(SAMPLES, &mut rng));
+
+    let mut group = c.benchmark_group("pprof");
+    group.throughput(Throughput::Elements(builders.builders.len() as u64));
+    group.bench_function("write", |b| {
+        let mut buf = Vec::new();
+        b.iter(|| {
+            for builder in builders.builders.values() {
+                buf.clear();
+                builder.write(&mut buf);
+                black_box(&buf);
+            }
+        })
+    });
+    group.finish();
+}
+
+// A collection round after the counts and stacks maps were read: every stack id is symbolized
+// once, the samples are aggregated into the builders of their targets and each profile encoded.
+fn round(c: &mut Criterion) {
+    let mut rng = Rng::new(SEED);
+    let (data, text) = common::kallsyms(200_000, &mut rng);
+    let resolver = StackResolver::Kernel(Arc::new(new_kallsyms_from_data(Cursor::new(data.as_bytes())).unwrap()));
+    let options = SymbolizeOptions {
+        unknown_symbol_module_offset: false,
+        unknown_symbol_address: false,
+    };
+    let raw = common::raw_stacks(STACKS, &text, &mut rng);
+    let targets = targets();
+    let draws = draws(SAMPLES, &mut rng);
+
+    let mut group = c.benchmark_group("round");
+    group.throughput(Throughput::Elements(SAMPLES as u64));
+    group.sample_size(20);
+    group.bench_function("replay", |b| {
+        let mut buf = Vec::new();
+        b.iter(|| {
+            let stacks: Vec<Vec<Arc<str>>> = raw
+                .iter()
+                .map(|stack| symbolize(stack, &resolver, options).frames.to_vec())
+                .collect();
+            let mut builders = new_builders();
+            aggregate(&mut builders, &targets, &stacks, &draws);
+            for builder in builders.builders.values() {
+                buf.clear();
+                builder.write(&mut buf);
+                black_box(&buf);
+            }
+        })
+    });
+    group.finish();
+}
+
+// Rounds recorded by the collapsed file sink, IWM_COLLAPSED_FILES names a file or a directory of
+// them. Skipped when it is not set.
+fn recorded(c: &mut Criterion) {
+    let path = match std::env::var("IWM_COLLAPSED_FILES") {
+        Ok(path) => path,
+        Err(_) => return,
+    };
+    let path = Path::new(&path);
+    let files = if path.is_dir() { list_files(path) } else { vec![path.to_path_buf()] };
+    let mut profiles: Vec<CollapsedProfile> = Vec::new();
+    for file in files.iter() {
+        let mut reader = CollapsedReader::open(file).unwrap();
+        while let Some(profile) = reader.next_profile().unwrap() {
+            profiles.push(profile);
+        }
+    }
+    if profiles.is_empty() {
+        return;
+    }
+    let targets: Vec<EbpfTarget> = profiles
+        .iter()
+        .map(|p| {
+            let target: DiscoveryTarget = p.labels.0.iter().map(|l| (l.name.clone(), l.value.clone())).collect();
+            EbpfTarget::new(String::new(), 0, target)
+        })
+        .collect();
+    let samples: usize = profiles.iter().map(|p| p.samples.len()).sum();
+
+    let mut group = c.benchmark_group("recorded");
+    group.throughput(Throughput::Elements(samples as u64));
+    group.sample_size(10);
+    group.bench_function("aggregate", |b| {
+        b.iter(|| {
+            let mut builders = new_builders();
+            for (profile, target) in profiles.iter().zip(targets.iter()) {
+                // cpu samples are counts again, as the session hands them over
+                let period = if profile.sample_type == SampleType::Cpu { profile.period.max(1) } else { 1 };
+                for (stack, values) in profile.samples.iter() {
+                    builders.add_sample(ProfileSample {
+                        target,
+                        pid: 0,
+                        sample_type: profile.sample_type,
+                        aggregation: true,
+                        stack,
+                        value: (values[0] / period) as u64,
+                        value2: values.get(1).copied().unwrap_or(0) as u64,
+                    });
+                }
+            }
+            black_box(builders)
+        })
+    });
+    group.bench_function("to_pprof", |b| {
+        b.iter(|| {
+            for profile in profiles.iter() {
+                black_box(profile.to_pprof());
+            }
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, add_sample, encode, round, recorded);
+criterion_main!(benches);
@@ -0,0 +1,139 @@
+use std::io::Cursor;
+
+use criterion::{black_box, criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use prometheus::Registry;
+
+use iwm::ebpf::metrics::symtab::SymtabMetrics;
+use iwm::ebpf::symtab::elf::pcindex::PCIndex;
+use iwm::ebpf::symtab::elf_module::SymbolOptions;
+use iwm::ebpf::symtab::gcache::GCacheOptions;
+use iwm::ebpf::symtab::kallsyms::new_kallsyms_from_data;
+use iwm::ebpf::symtab::proc::parse_proc_maps_executable_modules;
+use iwm::ebpf::symtab::symbols::{CacheOptions, SymbolCache};
+use iwm::ebpf::symtab::symtab::SymbolTable;
+
+mod common;
+
+use common::{Rng, SEED};
+
+const LOOKUPS: usize = 4096;
+
+fn lookups(addrs: &[u64], rng: &mut Rng) -> Vec<u64> {
+    let first = addrs[0];
+    let span = addrs[addrs.len() - 1] - first + 4096;
+    (0..LOOKUPS).map(|_| first + rng.below(span)).collect()
+}
+
+// Small tables are binary searched, large ones go through the eytzinger layout built by freeze.
+fn pcindex(c: &mut Criterion) {
+    let mut group = c.benchmark_group("pcindex/find_index");
+    group.throughput(Throughput::Elements(LOOKUPS as u64));
+    for (name, base) in [("32", 0x40_0000u64), ("64", 0x7f00_0000_0000u64)] {
+        for len in [1_000usize, 100_000, 1_000_000] {
+            let mut rng = Rng::new(SEED);
+            let addrs = common::symbol_addresses(len, base, &mut rng);
+            let mut index = PCIndex::new(len);
+            for (i, addr) in addrs.iter().enumerate() {
+                index.set(i, *addr);
+            }
+            index.freeze();
+            let pcs = lookups(&addrs, &mut rng);
+            group.bench_with_input(BenchmarkId::new(name, len), &pcs, |b, pcs| {
+                b.iter(|| {
+                    for pc in pcs.iter() {
+                        black_box(index.find_index(*pc));
+                    }
+                })
+            });
+        }
+    }
+    group.finish();
+}
+
+// Every line goes through parse_proc_map_line.
+fn proc_maps(c: &mut Criterion) {
+    let mut group = c.benchmark_group("proc_maps/parse");
+    for lines in [200usize, 5_000, 50_000] {
+        let maps = common::proc_maps(lines, &mut Rng::new(SEED));
+        group.throughput(Throughput::Bytes(maps.len() as u64));
+        group.bench_with_input(BenchmarkId::new("all", lines), &maps, |b, maps| {
+            b.iter(|| parse_proc_maps_executable_modules(black_box(maps), false).unwrap())
+        });
+        group.bench_with_input(BenchmarkId::new("executable", lines), &maps, |b, maps| {
+            b.iter(|| parse_proc_maps_executable_modules(black_box(maps), true).unwrap())
+        });
+    }
+    group.finish();
+}
+
+fn kallsyms(c: &mut Criterion) {
+    let (data, text) = common::kallsyms(200_000, &mut Rng::new(SEED));
+
+    let mut group = c.benchmark_group("kallsyms");
+    group.throughput(Throughput::Bytes(data.len() as u64));
+    group.bench_function("parse", |b| {
+        b.iter(|| new_kallsyms_from_data(Cursor::new(black_box(data.as_bytes()))).unwrap())
+    });
+
+    let table = new_kallsyms_from_data(Cursor::new(data.as_bytes())).unwrap();
+    let pcs = lookups(&text, &mut Rng::new(SEED));
+    group.throughput(Throughput::Elements(pcs.len() as u64));
+    group.bench_function("resolve", |b| {
+        b.iter(|| {
+            for pc in pcs.iter() {
+                black_box(table.resolve(*pc));
+            }
+        })
+    });
+    group.finish();
+}
+
+// ProcTable needs the mapped files to be there, it resolves addresses of the benchmark itself and
+// of the libraries it links.
+fn proc_table(c: &mut Criterion) {
+    let keep_rounds = 3;
+    let metrics = SymtabMetrics::new(&Registry::new());
+    let options = CacheOptions {
+        pid_cache_options: GCacheOptions { size: 32, keep_rounds },
+        build_id_cache_options: GCacheOptions { size: 64, keep_rounds },
+        same_file_cache_options: GCacheOptions { size: 64, keep_rounds },
+        symbol_options: SymbolOptions::default(),
+    };
+    let mut cache = SymbolCache::new(options, None, None, &metrics).unwrap();
+    let pid = std::process::id();
+
+    let maps = std::fs::read_to_string(format!("/proc/{}/maps", pid)).unwrap();
+    let mut pcs: Vec<u64> = Vec::with_capacity(LOOKUPS);
+    let mut rng = Rng::new(SEED);
+    // executable file mappings, "start-end r-xp offset dev inode /path"
+    let ranges: Vec<(u64, u64)> = maps
+        .lines()
+        .map(|line| line.split_ascii_whitespace().collect::<Vec<_>>())
+        .filter(|parts| parts.len() >= 6 && parts[1].contains('x') && parts[5].starts_with('/'))
+        .filter_map(|parts| {
+            let (start, end) = parts[0].split_once('-')?;
+            Some((u64::from_str_radix(start, 16).ok()?, u64::from_str_radix(end, 16).ok()?))
+        })
+        .collect();
+    for _ in 0..LOOKUPS {
+        let (start, end) = ranges[rng.below(ranges.len() as u64) as usize];
+        pcs.push(start + rng.below(end - start));
+    }
+
+    let mut group = c.benchmark_group("proc_table");
+    group.throughput(Throughput::Elements(pcs.len() as u64));
+    let table = cache.get_proc_table(pid).unwrap();
+    table.lock().unwrap().refresh();
+    group.bench_function("resolve", |b| {
+        b.iter(|| {
+            let mut table = table.lock().unwrap();
+            for pc in pcs.iter() {
+                black_box(table.resolve(*pc));
+            }
+        })
+    });
+    group.finish();
+}
+
+criterion_group!(benches, pcindex, proc_maps, kallsyms, proc_table);
+criterion_main!(benches);
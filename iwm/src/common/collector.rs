@@ -9,6 +9,8 @@ use crate::error::Result;
 pub enum SampleType {
     Cpu = 0,
     Mem = 1,
+    // nanoseconds spent blocked
+    OffCpu = 2,
 }
 
 #[derive(Debug)]
@@ -17,13 +19,16 @@ pub struct ProfileSample<'a> {
     pub pid: u32,
     pub sample_type: SampleType,
     pub aggregation: bool,
-    pub stack: Vec<String>,
+    // leaf first, frames are shared between the samples of a collection round and the buffer
+    // is reused for the next sample once the callback returns
+    pub stack: &'a [Arc<str>],
     pub value: u64,
     pub value2: u64,
 }
 
 pub const SAMPLE_TYPE_CPU: SampleType = SampleType::Cpu;
 pub const SAMPLE_TYPE_MEM: SampleType = SampleType::Mem;
+pub const SAMPLE_TYPE_OFF_CPU: SampleType = SampleType::OffCpu;
 
 pub trait SamplesCollector {
     fn collect_profiles<F>(&mut self, callback: F)-> Result<()>
@@ -45,8 +50,20 @@ impl SamplesCollector for Session<'_> {
             sym_cache.next_round();
             self.round_number += 1;
         }
-        self.collect_regular_profile(callback).unwrap();
+        // cpu counts of a lowered sample rate are scaled back up to the configured one
+        let scale = self.cpu_sample_scale();
+        let callback = |mut sample: ProfileSample| {
+            if scale != 1.0 && sample.sample_type == SampleType::Cpu {
+                sample.value = (sample.value as f64 * scale).round() as u64;
+            }
+            callback(sample)
+        };
+        self.collect_regular_profile(&callback).unwrap();
+        self.collect_python_profile(&callback).unwrap();
+        self.collect_snapshot_profile(&callback).unwrap();
         self.cleanup();
+        self.record_overhead_metrics();
+        self.adjust_sample_rate();
         Ok(())
     }
 }
\ No newline at end of file
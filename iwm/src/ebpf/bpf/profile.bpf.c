@@ -9,12 +9,154 @@
 
 #define PF_KTHREAD 0x00200000
 
+#define NSEC_PER_SEC 1000000000ULL
+
+// Perf event and kprobe programs never nest on a cpu (bpf_prog_active), so the per-cpu
+// batch and limiter below are not updated concurrently.
+static __always_inline bool pid_event_allowed(u32 pid) {
+    if (pid_events_per_sec == 0) {
+        return true;
+    }
+    u32 zero = 0;
+    struct pid_event_limiter *limiter = bpf_map_lookup_elem(&pid_event_limiters, &zero);
+    if (limiter == NULL) {
+        return true;
+    }
+    u64 now = bpf_ktime_get_ns();
+    u64 cost = NSEC_PER_SEC / pid_events_per_sec;
+    u64 budget = limiter->budget_ns + (now - limiter->last_ns);
+    if (budget > NSEC_PER_SEC) {
+        // allow bursts of one second worth of events
+        budget = NSEC_PER_SEC;
+    }
+    limiter->last_ns = now;
+    if (budget < cost) {
+        u8 one = 1;
+        limiter->budget_ns = budget;
+        if (bpf_map_update_elem(&pid_events_refused, &pid, &one, BPF_NOEXIST) == 0) {
+            limiter->dropped++;
+        }
+        return false;
+    }
+    limiter->budget_ns = budget - cost;
+    bpf_map_delete_elem(&pid_events_refused, &pid);
+    return true;
+}
+
+static __always_inline struct pid_event_batch *get_pid_event_batch() {
+    u32 zero = 0;
+    return bpf_map_lookup_elem(&pid_event_batches, &zero);
+}
+
+static __always_inline void flush_pid_events(void *ctx, struct pid_event_batch *batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    batch->op = OP_PID_EVENT_BATCH;
+    if (use_ringbuf) {
+        bpf_ringbuf_output(&events_rb, batch, sizeof(struct pid_event_batch), 0);
+    } else {
+        bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, batch, sizeof(struct pid_event_batch));
+    }
+    batch->count = 0;
+}
+
+// called on every sample so that a partially filled batch does not wait for the next event
+static __always_inline void flush_stale_pid_events(void *ctx) {
+    struct pid_event_batch *batch = get_pid_event_batch();
+    if (batch == NULL || batch->count == 0) {
+        return;
+    }
+    if (bpf_ktime_get_ns() - batch->first_ns >= pid_events_flush_ns) {
+        flush_pid_events(ctx, batch);
+    }
+}
+
+static __always_inline void submit_pid_event(void *ctx, uint32_t op, uint32_t pid) {
+    struct pid_event_batch *batch = get_pid_event_batch();
+    if (batch == NULL) {
+        return;
+    }
+    u64 now = bpf_ktime_get_ns();
+    u32 i = batch->count;
+    if (i >= PID_EVENT_BATCH_SIZE) {
+        flush_pid_events(ctx, batch);
+        i = 0;
+    }
+    if (i == 0) {
+        batch->first_ns = now;
+    }
+    batch->events[i & (PID_EVENT_BATCH_SIZE - 1)].op = op;
+    batch->events[i & (PID_EVENT_BATCH_SIZE - 1)].pid = pid;
+    batch->count = i + 1;
+    if (batch->count >= PID_EVENT_BATCH_SIZE || now - batch->first_ns >= pid_events_flush_ns) {
+        flush_pid_events(ctx, batch);
+    }
+}
+
+static __always_inline u32 active_generation() {
+    u32 zero = 0;
+    u32 *idx = bpf_map_lookup_elem(&active_idx, &zero);
+    if (idx == NULL) {
+        return 0;
+    }
+    return *idx & 1;
+}
+
+// pids whose native stacks are collected, by any unwinder
+static __always_inline bool native_profiled(struct pid_config *config) {
+    return config->profile_type == PROFILING_TYPE_FRAMEPOINTERS
+        || config->profile_type == PROFILING_TYPE_PYTHON
+        || config->profile_type == PROFILING_TYPE_DWARF
+        || config->profile_type == PROFILING_TYPE_STACK_SNAPSHOT;
+}
+
+// A key added by another cpu since the lookup is not a failure, the map being full is.
+static __always_inline void insert_count(void *counts, struct sample_key *key, void *value) {
+    long err = bpf_map_update_elem(counts, key, value, BPF_NOEXIST);
+    if (err && err != -ERR_EEXIST)
+        count_map_error(&map_errors, MAP_ERROR_COUNTS);
+}
+
+static __always_inline void increment_count(void *counts, struct sample_key *key) {
+    u32 *val, one = 1;
+    // counts may be a per-cpu hash, the atomic add keeps the shared variant exact as well
+    val = bpf_map_lookup_elem(counts, key);
+    if (val)
+        __sync_fetch_and_add(val, 1);
+    else
+        insert_count(counts, key, &one);
+}
+
+static __always_inline void count_sample(struct bpf_perf_event_data *ctx, struct pid_config *config, u32 tgid,
+                                         void *stacks, void *counts) {
+    struct sample_key key = {};
+
+    key.pid = tgid;
+    key.kern_stack = -1;
+    key.user_stack = -1;
+    key.cgroup_id = bpf_get_current_cgroup_id();
+
+    if (config->collect_kernel) {
+        key.kern_stack = get_stackid_counted(ctx, stacks, KERN_STACKID_FLAGS, &map_errors);
+    }
+    if (config->collect_user) {
+        key.user_stack = get_stackid_counted(ctx, stacks, USER_STACKID_FLAGS, &map_errors);
+    }
+    increment_count(counts, &key);
+}
+
 SEC("perf_event")
 int do_perf_event(struct bpf_perf_event_data *ctx) {
+    // before any filter, a cpu gone idle would hold its batch until it runs a profiled task again
+    flush_stale_pid_events(ctx);
+
+    if (cgroup_skipped()) {
+        return 0;
+    }
+
     u32 tgid = 0;
     current_pid(&tgid);
-    struct sample_key key = {};
-    u32 *val, one = 1;
 
     struct task_struct *task = (struct task_struct *)bpf_get_current_task();
     if (tgid == 0 || task == 0) {
@@ -34,6 +176,10 @@ int do_perf_event(struct bpf_perf_event_data *ctx) {
 
     struct pid_config *config = bpf_map_lookup_elem(&pids, &tgid);
     if (config == NULL) {
+        // without a token the pid is left out of the map, a later sample asks again
+        if (!pid_event_allowed(tgid)) {
+            return 0;
+        }
         struct pid_config unknown = {
                 .profile_type = PROFILING_TYPE_UNKNOWN,
                 .collect_kernel = 0,
@@ -44,11 +190,7 @@ int do_perf_event(struct bpf_perf_event_data *ctx) {
             bpf_dbg_printk("failed to update pids map. probably concurrent update\n");
             return 0;
         }
-        struct pid_event event = {
-                .op  = OP_REQUEST_UNKNOWN_PROCESS_INFO,
-                .pid = tgid
-        };
-        bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event, sizeof(event));
+        submit_pid_event(ctx, OP_REQUEST_UNKNOWN_PROCESS_INFO, tgid);
         return 0;
     }
 
@@ -61,27 +203,508 @@ int do_perf_event(struct bpf_perf_event_data *ctx) {
         return 0;
     }
 
-    if (config->profile_type == PROFILING_TYPE_FRAMEPOINTERS) {
-        key.pid = tgid;
-        key.kern_stack = -1;
-        key.user_stack = -1;
+    if (config->profile_type == PROFILING_TYPE_DWARF) {
+        bpf_tail_call(ctx, &progs, PROG_IDX_DWARF);
+        // unwind_dwarf is not installed, the frame pointers are still better than nothing
+    }
+
+    if (config->profile_type == PROFILING_TYPE_STACK_SNAPSHOT) {
+        bpf_tail_call(ctx, &progs, PROG_IDX_STACK_SNAPSHOT);
+    }
+
+    if (native_profiled(config)) {
+        // both branches are kept so the verifier sees a constant map pointer on each path
+        if (active_generation()) {
+            count_sample(ctx, config, tgid, &stacks1, &counts1);
+        } else {
+            count_sample(ctx, config, tgid, &stacks0, &counts0);
+        }
+    }
+    return 0;
+}
+
+static __always_inline void get_off_cpu_stacks(void *ctx, struct pid_config *config, struct sample_key *key,
+                                               void *stacks) {
+    if (config->collect_kernel) {
+        key->kern_stack = get_stackid_counted(ctx, stacks, KERN_STACKID_FLAGS, &map_errors);
+    }
+    if (config->collect_user) {
+        key->user_stack = get_stackid_counted(ctx, stacks, USER_STACKID_FLAGS, &map_errors);
+    }
+}
+
+#define TASK_RUNNING 0
+
+// task_struct.state before 5.14
+struct task_struct___pre514 {
+    long state;
+} __attribute__((preserve_access_index));
+
+static __always_inline unsigned int task_state(struct task_struct *task) {
+    if (bpf_core_field_exists(task->__state)) {
+        return BPF_CORE_READ(task, __state);
+    }
+    return BPF_CORE_READ((struct task_struct___pre514 *)task, state);
+}
+
+// prev is still current, so the stacks are those of the point where it blocks
+static __always_inline void off_cpu_begin(void *ctx, struct task_struct *prev, u64 now, u32 generation) {
+    if (prev->flags & PF_KTHREAD) {
+        return;
+    }
+    u32 tgid = prev->tgid;
+    u32 tid = prev->pid;
+    if (tgid == 0) {
+        return;
+    }
+    if (cgroup_skipped()) {
+        return;
+    }
+    // pids are only requested by do_perf_event, off-cpu follows the ones already profiled
+    struct pid_config *config = bpf_map_lookup_elem(&pids, &tgid);
+    if (config == NULL) {
+        return;
+    }
+    if (!native_profiled(config)) {
+        return;
+    }
+
+    struct off_cpu_entry entry = {};
+    entry.start_ns = now;
+    entry.generation = generation;
+    entry.key.pid = tgid;
+    entry.key.kern_stack = -1;
+    entry.key.user_stack = -1;
+    entry.key.cgroup_id = bpf_get_current_cgroup_id();
+    // both branches are kept so the verifier sees a constant map pointer on each path
+    if (generation) {
+        get_off_cpu_stacks(ctx, config, &entry.key, &off_cpu_stacks1);
+    } else {
+        get_off_cpu_stacks(ctx, config, &entry.key, &off_cpu_stacks0);
+    }
+    bpf_map_update_elem(&off_cpu_start, &tid, &entry, BPF_ANY);
+}
+
+static __always_inline void off_cpu_count(void *counts, struct sample_key *key, u64 delta) {
+    u64 *val = bpf_map_lookup_elem(counts, key);
+    if (val)
+        __sync_fetch_and_add(val, delta);
+    else
+        insert_count(counts, key, &delta);
+}
+
+// Only loaded in off-cpu mode. Involuntary switches and yields are not counted, the task was still
+// runnable. Blocks spanning a generation flip are moved to the new one by userspace.
+SEC("tp_btf/sched_switch")
+int BPF_PROG(sched_switch, bool preempt, struct task_struct *prev, struct task_struct *next) {
+    u64 now = bpf_ktime_get_ns();
+    u32 generation = active_generation();
+
+    if (!preempt && task_state(prev) != TASK_RUNNING) {
+        off_cpu_begin(ctx, prev, now, generation);
+    }
+
+    u32 tid = next->pid;
+    struct off_cpu_entry *started = bpf_map_lookup_elem(&off_cpu_start, &tid);
+    if (started == NULL) {
+        return 0;
+    }
+    struct off_cpu_entry entry = *started;
+    bpf_map_delete_elem(&off_cpu_start, &tid);
+    // the entry was not moved yet, its stack ids point into a drained generation
+    if (entry.generation != generation || now - entry.start_ns < off_cpu_min_ns) {
+        return 0;
+    }
+    if (generation) {
+        off_cpu_count(&off_cpu_counts1, &entry.key, now - entry.start_ns);
+    } else {
+        off_cpu_count(&off_cpu_counts0, &entry.key, now - entry.start_ns);
+    }
+    return 0;
+}
+
+static __always_inline void count_alloc(void *ctx, struct pid_config *config, u32 tgid, void *stacks,
+                                        void *counts, u64 objects, u64 bytes) {
+    struct sample_key key = {};
+    key.pid = tgid;
+    key.kern_stack = -1;
+    key.user_stack = -1;
+    key.cgroup_id = bpf_get_current_cgroup_id();
+    if (config->collect_user) {
+        key.user_stack = get_stackid_counted(ctx, stacks, USER_STACKID_FLAGS, &map_errors);
+    }
+
+    struct alloc_value *val = bpf_map_lookup_elem(counts, &key);
+    if (val) {
+        __sync_fetch_and_add(&val->objects, objects);
+        __sync_fetch_and_add(&val->bytes, bytes);
+    } else {
+        struct alloc_value v = {.objects = objects, .bytes = bytes};
+        insert_count(counts, &key, &v);
+    }
+}
+
+// The distance between samples is uniform in [1, 2 * alloc_sample_bytes], so an allocation smaller
+// than alloc_sample_bytes is sampled with a probability proportional to its size and the sample
+// stands for alloc_sample_bytes bytes. Larger ones are always sampled and count as themselves.
+// The sampler is racy when a task is preempted in here, that only shifts the next sample.
+static __always_inline void sample_alloc(struct pt_regs *ctx, u64 size) {
+    if (size == 0 || alloc_sample_bytes == 0) {
+        return;
+    }
+    u32 zero = 0;
+    s64 *left = bpf_map_lookup_elem(&alloc_samplers, &zero);
+    if (left == NULL) {
+        return;
+    }
+    // a countdown is never 0 once started, the first one starts anywhere in the period so the
+    // first allocation on each cpu is not always sampled
+    if (*left == 0) {
+        *left = (s64) (bpf_get_prandom_u32() % alloc_sample_bytes) + 1;
+    }
+    *left -= (s64) size;
+    if (*left > 0) {
+        return;
+    }
+    *left = (s64) (bpf_get_prandom_u32() % (2 * alloc_sample_bytes)) + 1;
+
+    u32 tgid = 0;
+    current_pid(&tgid);
+    // the probes are attached per pid, this only skips pids whose profiling stopped
+    struct pid_config *config = bpf_map_lookup_elem(&pids, &tgid);
+    if (config == NULL) {
+        return;
+    }
+    if (!native_profiled(config)) {
+        return;
+    }
+    u64 bytes = size > alloc_sample_bytes ? size : alloc_sample_bytes;
+    u64 objects = bytes / size;
+    if (active_generation()) {
+        count_alloc(ctx, config, tgid, &stacks1, &alloc_counts1, objects, bytes);
+    } else {
+        count_alloc(ctx, config, tgid, &stacks0, &alloc_counts0, objects, bytes);
+    }
+}
+
+// Attached by userspace to the libc of each allocation profiled pid, never auto-attached.
+SEC("uprobe")
+int BPF_KPROBE(malloc_enter, size_t size) {
+    sample_alloc(ctx, size);
+    return 0;
+}
 
-        if (config->collect_kernel) {
-            key.kern_stack = bpf_get_stackid(ctx, &stacks, KERN_STACKID_FLAGS);
+SEC("uprobe")
+int BPF_KPROBE(calloc_enter, size_t n, size_t size) {
+    sample_alloc(ctx, (u64) n * size);
+    return 0;
+}
+
+SEC("uprobe")
+int BPF_KPROBE(realloc_enter, void *ptr, size_t size) {
+    sample_alloc(ctx, size);
+    return 0;
+}
+
+#if defined(__TARGET_ARCH_x86)
+
+// bpf_loop is not in the bundled helper definitions, available since linux 5.17
+static long (*bpf_loop_helper)(__u32 nr_loops, void *callback_fn, void *callback_ctx, __u64 flags) = (void *) 181;
+
+struct dwarf_walk {
+    struct dwarf_unwind_state *state;
+    struct unwind_info *info;
+};
+
+// The registers of the user part of the current task, from the sample or from the kernel entry
+// when the sample hit the kernel.
+static __always_inline void sampled_user_regs(struct bpf_perf_event_data *ctx, struct pt_regs *regs) {
+    if ((ctx->regs.cs & 3) == 3) {
+        regs->ip = ctx->regs.ip;
+        regs->sp = ctx->regs.sp;
+        regs->bp = ctx->regs.bp;
+    } else {
+        struct task_struct *task = bpf_get_current_task_btf();
+        bpf_probe_read_kernel(regs, sizeof(*regs), (void *) bpf_task_pt_regs(task));
+    }
+}
+
+// The last row at or before pc in the table of the mapping containing pc.
+static __always_inline struct unwind_row *find_unwind_row(struct unwind_info *info, u64 pc) {
+    struct unwind_mapping *m = NULL;
+    for (u32 i = 0; i < UNWIND_MAX_MAPPINGS; i++) {
+        if (i >= info->len) {
+            break;
+        }
+        if (pc >= info->mappings[i].begin && pc < info->mappings[i].end) {
+            m = &info->mappings[i];
+            break;
+        }
+    }
+    if (m == NULL || m->rows == 0) {
+        return NULL;
+    }
+    u64 addr = pc - m->bias;
+    u32 lo = m->first_row;
+    u32 hi = m->first_row + m->rows;
+    for (u32 i = 0; i < UNWIND_SEARCH_STEPS; i++) {
+        if (lo + 1 >= hi) {
+            break;
+        }
+        u32 mid = lo + (hi - lo) / 2;
+        struct unwind_row *row = bpf_map_lookup_elem(&unwind_rows, &mid);
+        if (row == NULL) {
+            return NULL;
+        }
+        if (row->pc <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
         }
-        if (config->collect_user) {
-            key.user_stack = bpf_get_stackid(ctx, &stacks, USER_STACKID_FLAGS);
+    }
+    struct unwind_row *row = bpf_map_lookup_elem(&unwind_rows, &lo);
+    if (row == NULL || row->pc > addr) {
+        return NULL;
+    }
+    return row;
+}
+
+// Records the current frame and steps to its caller, returning 1 once the walk is over.
+static long unwind_dwarf_frame(__u32 i, void *data) {
+    struct dwarf_walk *walk = data;
+    struct dwarf_unwind_state *state = walk->state;
+    u32 len = state->len;
+    if (len >= PERF_MAX_STACK_DEPTH || state->ip == 0) {
+        return 1;
+    }
+    state->stack.ips[len] = state->ip;
+    state->len = len + 1;
+    state->hash = (state->hash ^ state->ip) * 0x100000001b3ULL;
+
+    // return addresses may point right after the end of the calling function
+    u64 pc = len == 0 ? state->ip : state->ip - 1;
+    struct unwind_row *row = find_unwind_row(walk->info, pc);
+    u64 cfa = 0;
+    u64 bp = state->bp;
+    u64 ra = 0;
+    if (row != NULL && row->cfa_type == DWARF_CFA_END) {
+        return 1;
+    }
+    if (row == NULL || row->cfa_type == DWARF_CFA_NONE) {
+        // code without unwind info, jitted or hand written, may still keep frame pointers
+        if (state->bp == 0) {
+            return 1;
+        }
+        cfa = state->bp + 16;
+        if (bpf_probe_read_user(&bp, sizeof(bp), (void *) state->bp)) {
+            return 1;
+        }
+    } else {
+        if (row->cfa_type == DWARF_CFA_RSP) {
+            cfa = state->sp + row->cfa_offset;
+        } else {
+            cfa = state->bp + row->cfa_offset;
+        }
+        if (row->rbp_type == DWARF_RBP_CFA_OFFSET
+            && bpf_probe_read_user(&bp, sizeof(bp), (void *) (cfa + row->rbp_offset))) {
+            return 1;
+        }
+    }
+    // the return address is always at cfa - 8 on x86_64
+    if (bpf_probe_read_user(&ra, sizeof(ra), (void *) (cfa - 8))) {
+        return 1;
+    }
+    state->ip = ra;
+    state->sp = cfa;
+    state->bp = bp;
+    return 0;
+}
+
+static __always_inline void count_dwarf_sample(struct bpf_perf_event_data *ctx, struct pid_config *config,
+                                               struct dwarf_unwind_state *state, void *stacks,
+                                               void *dwarf_stacks, void *counts) {
+    struct sample_key key = {};
+    key.pid = state->pid;
+    key.kern_stack = -1;
+    key.user_stack = -1;
+    key.cgroup_id = bpf_get_current_cgroup_id();
+    if (config->collect_kernel) {
+        key.kern_stack = get_stackid_counted(ctx, stacks, KERN_STACKID_FLAGS, &map_errors);
+    }
+    if (config->collect_user && state->len > 0) {
+        u32 id = (u32) (state->hash ^ (state->hash >> 32));
+        state->stack.hash = state->hash;
+        long err = bpf_map_update_elem(dwarf_stacks, &id, &state->stack, BPF_NOEXIST);
+        if (err == -ERR_EEXIST) {
+            // a stack colliding on the id is left alone, this sample then has no user stack
+            struct dwarf_stack *stored = bpf_map_lookup_elem(dwarf_stacks, &id);
+            if (stored != NULL && stored->hash == state->hash) {
+                err = 0;
+            }
+        }
+        if (err == 0) {
+            key.user_stack = DWARF_STACK_ID_BIT | id;
+        } else {
+            count_map_error(&map_errors, MAP_ERROR_STACKS);
+        }
+    }
+    increment_count(counts, &key);
+}
+
+// Tail called by do_perf_event for PROFILING_TYPE_DWARF pids. Userspace installs it into
+// progs[PROG_IDX_DWARF] when the kernel has bpf_loop and disables autoload otherwise.
+SEC("perf_event")
+int unwind_dwarf(struct bpf_perf_event_data *ctx) {
+    u32 tgid = 0;
+    current_pid(&tgid);
+    struct pid_config *config = bpf_map_lookup_elem(&pids, &tgid);
+    if (config == NULL) {
+        return 0;
+    }
+    u32 zero = 0;
+    struct dwarf_unwind_state *state = bpf_map_lookup_elem(&dwarf_unwind_states, &zero);
+    if (state == NULL) {
+        return 0;
+    }
+    state->pid = tgid;
+    state->len = 0;
+    state->hash = 0xcbf29ce484222325ULL;
+    state->ip = 0;
+
+    struct unwind_info *info = bpf_map_lookup_elem(&unwind_infos, &tgid);
+    if (config->collect_user && info != NULL) {
+        struct pt_regs regs = {};
+        sampled_user_regs(ctx, &regs);
+        state->ip = regs.ip;
+        state->sp = regs.sp;
+        state->bp = regs.bp;
+        struct dwarf_walk walk = {.state = state, .info = info};
+        bpf_loop_helper(PERF_MAX_STACK_DEPTH, unwind_dwarf_frame, &walk, 0);
+        u32 len = state->len;
+        if (len < PERF_MAX_STACK_DEPTH) {
+            state->stack.ips[len] = 0;
         }
+    }
 
-        val = bpf_map_lookup_elem(&counts, &key);
-        if (val)
-            (*val)++;
-        else
-            bpf_map_update_elem(&counts, &key, &one, BPF_NOEXIST);
+    // both branches are kept so the verifier sees a constant map pointer on each path
+    if (active_generation()) {
+        count_dwarf_sample(ctx, config, state, &stacks1, &dwarf_stacks1, &counts1);
+    } else {
+        count_dwarf_sample(ctx, config, state, &stacks0, &dwarf_stacks0, &counts0);
     }
     return 0;
 }
 
+static __always_inline bool snapshot_allowed(u64 size) {
+    if (snapshot_bytes_per_sec == 0) {
+        return true;
+    }
+    u32 zero = 0;
+    struct snapshot_limiter *limiter = bpf_map_lookup_elem(&snapshot_limiters, &zero);
+    if (limiter == NULL) {
+        return false;
+    }
+    u64 now = bpf_ktime_get_ns();
+    u64 elapsed = now - limiter->last_ns;
+    if (elapsed > NSEC_PER_SEC) {
+        elapsed = NSEC_PER_SEC;
+    }
+    // allow bursts of one second worth of bytes
+    u64 budget = limiter->budget_bytes + elapsed * snapshot_bytes_per_sec / NSEC_PER_SEC;
+    if (budget > snapshot_bytes_per_sec) {
+        budget = snapshot_bytes_per_sec;
+    }
+    limiter->last_ns = now;
+    if (budget < size) {
+        limiter->budget_bytes = budget;
+        limiter->dropped++;
+        return false;
+    }
+    limiter->budget_bytes = budget - size;
+    return true;
+}
+
+// Tail called by do_perf_event for PROFILING_TYPE_STACK_SNAPSHOT pids. Userspace installs it into
+// progs[PROG_IDX_STACK_SNAPSHOT] when stack snapshots are enabled and disables autoload otherwise.
+// Samples over the byte budget are dropped, not counted with frame pointers.
+SEC("perf_event")
+int stack_snapshot(struct bpf_perf_event_data *ctx) {
+    u32 tgid = 0;
+    current_pid(&tgid);
+    struct pid_config *config = bpf_map_lookup_elem(&pids, &tgid);
+    if (config == NULL) {
+        return 0;
+    }
+    u32 size = snapshot_stack_size;
+    if (size > SNAPSHOT_MAX_STACK_SIZE) {
+        size = SNAPSHOT_MAX_STACK_SIZE;
+    }
+    if (!config->collect_user) {
+        size = 0;
+    }
+    if (!snapshot_allowed(offsetof(struct stack_snapshot, stack) + size)) {
+        return 0;
+    }
+    u32 zero = 0;
+    struct stack_snapshot *s = bpf_map_lookup_elem(&snapshot_heap, &zero);
+    if (s == NULL) {
+        return 0;
+    }
+    s->pid = tgid;
+    s->kern_len = 0;
+    s->stack_len = 0;
+    if (config->collect_kernel) {
+        long n = bpf_get_stack(ctx, s->kern_ips, sizeof(s->kern_ips), 0);
+        if (n > 0) {
+            s->kern_len = n;
+        }
+    }
+    struct pt_regs regs = {};
+    if (size > 0) {
+        sampled_user_regs(ctx, &regs);
+    }
+    s->ip = regs.ip;
+    s->sp = regs.sp;
+    s->bp = regs.bp;
+    // the stack may end before size bytes above sp, smaller reads are tried until one fits
+    for (int i = 0; i < 4 && size > 0; i++) {
+        if (size > SNAPSHOT_MAX_STACK_SIZE) {
+            break;
+        }
+        if (bpf_probe_read_user(s->stack, size, (void *) regs.sp) == 0) {
+            s->stack_len = size;
+            break;
+        }
+        size /= 2;
+    }
+    u32 len = s->stack_len;
+    if (len > SNAPSHOT_MAX_STACK_SIZE) {
+        return 0;
+    }
+    u64 record_size = offsetof(struct stack_snapshot, stack) + len;
+    if (use_ringbuf) {
+        bpf_ringbuf_output(&snapshot_events_rb, s, record_size, 0);
+    } else {
+        bpf_perf_event_output(ctx, &snapshot_events, BPF_F_CURRENT_CPU, s, record_size);
+    }
+    return 0;
+}
+
+#else
+
+// the tables are only compiled for x86_64, userspace never selects PROFILING_TYPE_DWARF or
+// PROFILING_TYPE_STACK_SNAPSHOT elsewhere
+SEC("perf_event")
+int unwind_dwarf(struct bpf_perf_event_data *ctx) {
+    return 0;
+}
+
+SEC("perf_event")
+int stack_snapshot(struct bpf_perf_event_data *ctx) {
+    return 0;
+}
+
+#endif
 
 SEC("kprobe/disassociate_ctty")
 int BPF_KPROBE(disassociate_ctty, int on_exit) {
@@ -94,11 +717,7 @@ int BPF_KPROBE(disassociate_ctty, int on_exit) {
     if (pid == 0) {
         return 0;
     }
-    struct pid_event event = {
-        .op  = OP_PID_DEAD,
-        .pid = pid
-    };
-    bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event, sizeof(event));
+    submit_pid_event(ctx, OP_PID_DEAD, pid);
     return 0;
 }
 
@@ -110,11 +729,12 @@ int BPF_KPROBE(execve, void *_) {
     if (pid == 0) {
         return 0;
     }
-    struct pid_event event = {
-            .op  = OP_REQUEST_EXEC_PROCESS_INFO,
-            .pid = pid
-    };
-    bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event, sizeof(event));
+    if (!pid_event_allowed(pid)) {
+        // forget the pid, the next sample requests the info of the new image instead
+        bpf_map_delete_elem(&pids, &pid);
+        return 0;
+    }
+    submit_pid_event(ctx, OP_REQUEST_EXEC_PROCESS_INFO, pid);
     return 0;
 }
 
@@ -126,11 +746,12 @@ int BPF_KPROBE(execveat, void *_) {
     if (pid == 0) {
         return 0;
     }
-    struct pid_event event = {
-            .op  = OP_REQUEST_EXEC_PROCESS_INFO,
-            .pid = pid
-    };
-    bpf_perf_event_output(ctx, &events, BPF_F_CURRENT_CPU, &event, sizeof(event));
+    if (!pid_event_allowed(pid)) {
+        // forget the pid, the next sample requests the info of the new image instead
+        bpf_map_delete_elem(&pids, &pid);
+        return 0;
+    }
+    submit_pid_event(ctx, OP_REQUEST_EXEC_PROCESS_INFO, pid);
     return 0;
 }
 
@@ -23,6 +23,8 @@ struct sample_key {
     __u32 flags;
     __s64 kern_stack;
     __s64 user_stack;
+    // cgroup (v2) of the sampled task, userspace resolves the target labels with it
+    __u64 cgroup_id;
 };
 struct sample_key k__;
 
@@ -30,6 +32,8 @@ struct sample_key k__;
 #define PROFILING_TYPE_FRAMEPOINTERS 2
 #define PROFILING_TYPE_PYTHON 3
 #define PROFILING_TYPE_ERROR 4
+#define PROFILING_TYPE_DWARF 5
+#define PROFILING_TYPE_STACK_SNAPSHOT 6
 
 struct pid_config {
     uint8_t profile_type;
@@ -49,38 +53,362 @@ struct pid_event {
 };
 struct pid_event e__;
 
+// pid events are not sent one by one: every cpu collects them in a pid_event_batch
+// which is flushed when it is full or older than pid_events_flush_ns.
+#define OP_PID_EVENT_BATCH 4
+#define PID_EVENT_BATCH_SIZE 16
+
+struct pid_event_batch {
+    uint32_t op;
+    uint32_t count;
+    uint64_t first_ns;
+    struct pid_event events[PID_EVENT_BATCH_SIZE];
+};
+struct pid_event_batch eb__;
+
+// per-cpu token bucket for process info requests, the budget is kept in nanoseconds
+struct pid_event_limiter {
+    uint64_t budget_ns;
+    uint64_t last_ns;
+    uint64_t dropped;
+};
+struct pid_event_limiter l__;
+
+// process info requests allowed per second on each cpu, 0 disables the limit
+const volatile uint64_t pid_events_per_sec = 0;
+const volatile uint64_t pid_events_flush_ns = 50 * 1000 * 1000;
+
+// LRU so that entries of exited processes are recycled instead of rejecting new pids once full,
+// max_entries is overridden by userspace before load
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __type(key, u32);
     __type(value, struct pid_config);
     __uint(max_entries, 1024);
 } pids SEC(".maps");
 
+// When set, samples of cgroups (v2) marked CGROUP_FILTER_SKIP in cgroup_filter are dropped first
+// thing. Cgroups userspace has not looked at yet, e.g. of containers started after the last target
+// update, are not in it and go through the pid path. An LRU, evicted cgroups do the same.
+const volatile bool filter_cgroups = false;
+
+#define CGROUP_FILTER_SKIP 0
+#define CGROUP_FILTER_TARGET 1
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, u64);
+    __type(value, u8);
+    __uint(max_entries, 4096);
+} cgroup_filter SEC(".maps");
+
+static __always_inline bool cgroup_skipped() {
+    if (!filter_cgroups) {
+        return false;
+    }
+    u64 cgroup_id = bpf_get_current_cgroup_id();
+    u8 *filter = bpf_map_lookup_elem(&cgroup_filter, &cgroup_id);
+    return filter != NULL && *filter == CGROUP_FILTER_SKIP;
+}
+
 struct {
     __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
     __uint(key_size, sizeof(u32));
     __uint(value_size, sizeof(u32));
 } events SEC(".maps");
 
+// Set by userspace before load on kernels with BPF_MAP_TYPE_RINGBUF (5.8+). When unset, events_rb is
+// turned into a dummy array by userspace and the ring buffer branches are pruned by the verifier.
+const volatile bool use_ringbuf = false;
+
+#define EVENTS_RINGBUF_SIZE (256 * 1024)
 
 struct {
-    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, EVENTS_RINGBUF_SIZE);
+} events_rb SEC(".maps");
+
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct pid_event_batch);
     __uint(max_entries, 1);
+} pid_event_batches SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct pid_event_limiter);
+    __uint(max_entries, 1);
+} pid_event_limiters SEC(".maps");
+
+// pids whose event was refused by the limiter. A refused pid asks again on its next sample, the
+// entry keeps pid_event_limiter.dropped at one per event instead of one per sample.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, u32);
+    __type(value, u8);
+    __uint(max_entries, 1024);
+} pid_events_refused SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(max_entries, 3);
     __type(key, int);
     __array(values, int (void *));
 } progs SEC(".maps");
 
 
 #define PROG_IDX_PYTHON 0
+#define PROG_IDX_DWARF 1
+#define PROG_IDX_STACK_SNAPSHOT 2
 
 #include "stacks.h"
 
+// counts and stacks are double-buffered: do_perf_event writes into the generation selected by
+// active_idx[0] while userspace drains the other one, then flips the index for the next round.
+#define PROFILE_GENERATIONS 2
 
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __type(key, struct sample_key);
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, u32);
     __type(value, u32);
-    __uint(max_entries, PROFILE_MAPS_SIZE);
-} counts SEC(".maps");
+    __uint(max_entries, 1);
+} active_idx SEC(".maps");
+
+#define DEFINE_COUNTS_MAP(name)                          \
+struct {                                                 \
+    __uint(type, BPF_MAP_TYPE_HASH);                     \
+    __type(key, struct sample_key);                      \
+    __type(value, u32);                                  \
+    __uint(max_entries, PROFILE_MAPS_SIZE);              \
+} name SEC(".maps");
+
+DEFINE_COUNTS_MAP(counts0)
+DEFINE_COUNTS_MAP(counts1)
+DEFINE_STACKS_MAP(stacks0)
+DEFINE_STACKS_MAP(stacks1)
+DEFINE_MAP_ERRORS_MAP(map_errors)
+
+// Off-cpu time: when a targeted task blocks its stacks are taken into off_cpu_stacks of the active
+// generation and kept in off_cpu_start by thread id. When it runs again the blocked nanoseconds are
+// added to off_cpu_counts of the same generation. Draining a generation moves the entries still
+// blocked in it to the next one, their stacks then come from userspace. Stacks of blocks that are
+// never counted (too short, evicted, carried) are only referenced by off-cpu, so userspace clears
+// the whole drained off_cpu_stacks instead of tracking them.
+struct off_cpu_entry {
+    __u64 start_ns;
+    __u32 generation;
+    __u32 padding_;
+    struct sample_key key;
+};
+struct off_cpu_entry o__;
+
+// blocked periods shorter than this are not recorded
+const volatile uint64_t off_cpu_min_ns = 0;
+
+#define OFF_CPU_MAX_THREADS 16384
+
+// LRU so that threads exiting while blocked do not leak their entry
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, u32);
+    __type(value, struct off_cpu_entry);
+    __uint(max_entries, OFF_CPU_MAX_THREADS);
+} off_cpu_start SEC(".maps");
+
+#define DEFINE_OFF_CPU_COUNTS_MAP(name)                  \
+struct {                                                 \
+    __uint(type, BPF_MAP_TYPE_HASH);                     \
+    __type(key, struct sample_key);                      \
+    __type(value, u64);                                  \
+    __uint(max_entries, PROFILE_MAPS_SIZE);              \
+} name SEC(".maps");
+
+DEFINE_OFF_CPU_COUNTS_MAP(off_cpu_counts0)
+DEFINE_OFF_CPU_COUNTS_MAP(off_cpu_counts1)
+DEFINE_STACKS_MAP(off_cpu_stacks0)
+DEFINE_STACKS_MAP(off_cpu_stacks1)
+
+// Allocations: the malloc family uprobes take a sample every alloc_sample_bytes allocated bytes
+// on average and add the objects and bytes it stands for to alloc_counts of the active generation.
+struct alloc_value {
+    __u64 objects;
+    __u64 bytes;
+};
+
+const volatile uint64_t alloc_sample_bytes = 512 * 1024;
+
+// bytes left until the next sample, per cpu
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, s64);
+    __uint(max_entries, 1);
+} alloc_samplers SEC(".maps");
+
+#define DEFINE_ALLOC_COUNTS_MAP(name)                    \
+struct {                                                 \
+    __uint(type, BPF_MAP_TYPE_HASH);                     \
+    __type(key, struct sample_key);                      \
+    __type(value, struct alloc_value);                   \
+    __uint(max_entries, PROFILE_MAPS_SIZE);              \
+} name SEC(".maps");
+
+DEFINE_ALLOC_COUNTS_MAP(alloc_counts0)
+DEFINE_ALLOC_COUNTS_MAP(alloc_counts1)
+
+// DWARF unwinding: userspace compiles the .eh_frame of the binaries mapped by PROFILING_TYPE_DWARF
+// pids into unwind_row ranges of unwind_rows, each pid gets an unwind_info pointing at the ranges
+// of its executable mappings. Rows are sorted by pc, a row applies until the next one.
+#define DWARF_CFA_END 0        // outermost frame, the return address is undefined
+#define DWARF_CFA_RSP 1        // cfa = rsp + cfa_offset
+#define DWARF_CFA_RBP 2        // cfa = rbp + cfa_offset
+#define DWARF_CFA_NONE 3       // no usable rule, unwound with frame pointers
+#define DWARF_RBP_UNCHANGED 0
+#define DWARF_RBP_CFA_OFFSET 1 // rbp is saved at cfa + rbp_offset
+
+struct unwind_row {
+    __u64 pc;
+    __u8 cfa_type;
+    __u8 rbp_type;
+    __s16 cfa_offset;
+    __s16 rbp_offset;
+    __u16 padding_;
+};
+struct unwind_row ur__;
+
+#define UNWIND_MAX_MAPPINGS 32
+// enough for binary searches over 2^20 rows
+#define UNWIND_SEARCH_STEPS 20
+
+struct unwind_mapping {
+    __u64 begin;
+    __u64 end;
+    // the address in the file of pc is pc - bias
+    __u64 bias;
+    __u32 first_row;
+    __u32 rows;
+};
+
+struct unwind_info {
+    __u32 len;
+    __u32 padding_;
+    struct unwind_mapping mappings[UNWIND_MAX_MAPPINGS];
+};
+struct unwind_info ui__;
+
+// max_entries of both are overridden by userspace before load
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, u32);
+    __type(value, struct unwind_row);
+    __uint(max_entries, 256 * 1024);
+} unwind_rows SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, u32);
+    __type(value, struct unwind_info);
+    __uint(max_entries, 1024);
+} unwind_infos SEC(".maps");
+
+// Stacks unwound in BPF can't go into a stack trace map. They are kept by hash in dwarf_stacks of
+// the active generation and the sample key refers to them with DWARF_STACK_ID_BIT set. The map is
+// keyed by 32 bits of the hash, the full one tells a collision from the same stack.
+#define DWARF_STACK_ID_BIT (1LL << 32)
+
+struct dwarf_stack {
+    __u64 ips[PERF_MAX_STACK_DEPTH];
+    __u64 hash;
+};
+
+#define DEFINE_DWARF_STACKS_MAP(name)                    \
+struct {                                                 \
+    __uint(type, BPF_MAP_TYPE_HASH);                     \
+    __type(key, u32);                                    \
+    __type(value, struct dwarf_stack);                   \
+    __uint(max_entries, PROFILE_MAPS_SIZE);              \
+} name SEC(".maps");
+
+DEFINE_DWARF_STACKS_MAP(dwarf_stacks0)
+DEFINE_DWARF_STACKS_MAP(dwarf_stacks1)
+
+struct dwarf_unwind_state {
+    __u64 ip;
+    __u64 sp;
+    __u64 bp;
+    __u64 hash;
+    __u32 pid;
+    __u32 len;
+    struct dwarf_stack stack;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct dwarf_unwind_state);
+    __uint(max_entries, 1);
+} dwarf_unwind_states SEC(".maps");
+
+// Stack snapshots: PROFILING_TYPE_STACK_SNAPSHOT samples send the user registers, the top of the
+// user stack and the kernel stack to userspace, which unwinds them with the .eh_frame of the pid.
+// Records are sent without the unused tail of stack.
+#define SNAPSHOT_MAX_STACK_SIZE (16 * 1024)
+
+struct stack_snapshot {
+    __u32 pid;
+    __u32 kern_len;
+    __u64 ip;
+    __u64 sp;
+    __u64 bp;
+    __u32 stack_len;
+    __u32 padding_;
+    __u64 kern_ips[PERF_MAX_STACK_DEPTH];
+    __u8 stack[SNAPSHOT_MAX_STACK_SIZE];
+};
+struct stack_snapshot ss__;
+
+// bytes of user stack copied per sample, up to SNAPSHOT_MAX_STACK_SIZE
+const volatile uint32_t snapshot_stack_size = 8 * 1024;
+// snapshot bytes each cpu may send per second, userspace splits the configured total
+const volatile uint64_t snapshot_bytes_per_sec = 0;
+
+// per-cpu token bucket like pid_event_limiter, the budget is kept in bytes
+struct snapshot_limiter {
+    uint64_t budget_bytes;
+    uint64_t last_ns;
+    uint64_t dropped;
+};
+struct snapshot_limiter sl__;
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct snapshot_limiter);
+    __uint(max_entries, 1);
+} snapshot_limiters SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, struct stack_snapshot);
+    __uint(max_entries, 1);
+} snapshot_heap SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+    __uint(key_size, sizeof(u32));
+    __uint(value_size, sizeof(u32));
+} snapshot_events SEC(".maps");
+
+#define SNAPSHOT_RINGBUF_SIZE (4 * 1024 * 1024)
+
+// like events_rb, turned into a dummy array by userspace when unused
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, SNAPSHOT_RINGBUF_SIZE);
+} snapshot_events_rb SEC(".maps");
 
 #endif // PROFILE_BPF_H
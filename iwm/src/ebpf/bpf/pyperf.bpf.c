@@ -10,9 +10,13 @@
 #include "pystr.h"
 #include "pyoffsets.h"
 
+// frames the bpf_loop walker reads at most, and the capacity of py_event.stack
+#define PYTHON_STACK_MAX_LEN 512
+// unrolled frames of read_python_stack, the tail call walker of kernels without bpf_loop. Kept at
+// what the verifier of those kernels is known to accept, the chain gets longer instead.
 #define PYTHON_STACK_FRAMES_PER_PROG 25
-#define PYTHON_STACK_PROG_CNT 3
-#define PYTHON_STACK_MAX_LEN (PYTHON_STACK_FRAMES_PER_PROG * PYTHON_STACK_PROG_CNT)
+#define PYTHON_STACK_PROG_CNT \
+    ((PYTHON_STACK_MAX_LEN + PYTHON_STACK_FRAMES_PER_PROG - 1) / PYTHON_STACK_FRAMES_PER_PROG)
 #define PYTHON_CLASS_NAME_LEN 32
 #define PYTHON_FUNCTION_NAME_LEN 64
 #define PYTHON_FILE_NAME_LEN 128
@@ -52,6 +56,10 @@ typedef struct {
     py_version version;
     struct libc libc;
     int32_t tssKey;
+    // copied from the pid_config of the process, see profile.bpf.h
+    uint8_t collect_user;
+    uint8_t collect_kernel;
+    uint8_t padding_[2];
 } py_pid_data;
 
 typedef struct {
@@ -77,6 +85,8 @@ typedef struct {
     uint8_t reserved3;
     uint32_t pid;
     int64_t kern_stack;
+    // native frames, merged with the python frames by userspace
+    int64_t user_stack;
     // instead of storing symbol name here directly, we add it to another
     // hashmap with Symbols and only store the ids here
     uint32_t stack_len;
@@ -91,6 +101,8 @@ typedef struct {
   } STR_CONCAT(compile_time_condition_check, __COUNTER__);
 // See comments in get_frame_data
 FAIL_COMPILATION_IF(sizeof(py_symbol) == sizeof(struct bpf_perf_event_value))
+// MAX_TAIL_CALL_CNT is 32 before 5.17, do_perf_event -> pyperf_collect -> read_python_stack take two
+FAIL_COMPILATION_IF(PYTHON_STACK_PROG_CNT + 2 > 32)
 
 typedef struct {
     int64_t symbol_counter;
@@ -98,6 +110,8 @@ typedef struct {
     uint32_t cur_cpu;
     uint64_t frame_ptr;
     int64_t python_stack_prog_call_cnt;
+    // scratch symbol for get_names, kept here instead of on the stack
+    py_symbol sym;
     py_event event;
 } py_sample_state_t;
 
@@ -108,25 +122,78 @@ struct {
     __uint(max_entries, 1);
 } py_state_heap SEC(".maps");
 
+DEFINE_STACKS_MAP(stacks)
+DEFINE_MAP_ERRORS_MAP(py_map_errors)
+
 typedef uint32_t py_symbol_id;
 
+// LRU so a full map evicts cold symbols instead of failing inserts; userspace keeps the
+// reverse id -> symbol table and can seed it back after a restart.
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
     __type(key, py_symbol);
     __type(value, py_symbol_id);
+    // overridden by userspace before load
     __uint(max_entries, 16384);
 } py_symbols SEC(".maps");
 
+// Symbols inserted into py_symbols by id, so userspace reads the few ids it does not know yet
+// instead of all of py_symbols. Userspace deletes the entries it took, the LRU drops the rest.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, py_symbol_id);
+    __type(value, py_symbol);
+    // overridden by userspace before load
+    __uint(max_entries, 4096);
+} py_symbols_by_id SEC(".maps");
+
+enum {
+    PY_CODE_FIRST_ARG_OTHER = 0,
+    PY_CODE_FIRST_ARG_SELF = 1,
+    PY_CODE_FIRST_ARG_CLS = 2,
+};
+
+typedef struct {
+    uint32_t pid;
+    uint32_t __padding;
+    uint64_t code_ptr;
+    // type of self/cls for methods, 0 for the per code object entry
+    uint64_t class_ptr;
+} py_code_key;
+
+typedef struct {
+    py_symbol_id symbol_id;
+    // PY_CODE_FIRST_ARG_*, for methods the symbol id is looked up again with class_ptr set
+    uint32_t first_arg;
+    // co_name and co_filename of the code object the entry was made for
+    uint64_t name_ptr;
+    uint64_t file_ptr;
+} py_code_value;
+
+// Caches the symbol id of a code object so hot frames skip reading and hashing the names.
+// Code objects can be freed and their address reused by another one, a hit only counts when the
+// code object still points at the same name and file objects.
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __type(key, py_code_key);
+    __type(value, py_code_value);
+    __uint(max_entries, 65536);
+} py_code_cache SEC(".maps");
 
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
     __type(key, pid_t);
     __type(value, py_pid_data);
+    // overridden by userspace before load
     __uint(max_entries, 10240);
 } py_pid_config SEC(".maps");
 
 #define PYTHON_PROG_IDX_READ_PYTHON_STACK 0
 
+// Number of python frames collected, at most PYTHON_STACK_MAX_LEN. The tail call walker rounds it
+// up to a multiple of PYTHON_STACK_FRAMES_PER_PROG.
+const volatile uint32_t python_stack_max_len = 128;
+
 int read_python_stack(struct bpf_perf_event_data *ctx);
 
 
@@ -148,6 +215,26 @@ struct {
     __uint(value_size, sizeof(u32));
 } py_events SEC(".maps");
 
+// see use_ringbuf in profile.bpf.h
+const volatile bool use_ringbuf = false;
+
+#define PY_EVENTS_RINGBUF_SIZE (1024 * 1024)
+
+struct {
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, PY_EVENTS_RINGBUF_SIZE);
+} py_events_rb SEC(".maps");
+
+// The event is assembled in py_state_heap across tail calls and a ring buffer reservation can't
+// outlive the program that made it, so the ring buffer path copies only the used part of the stack.
+static __always_inline void output_event(void *ctx, py_event *event, u64 size) {
+    if (use_ringbuf) {
+        bpf_ringbuf_output(&py_events_rb, event, size, 0);
+    } else {
+        bpf_perf_event_output(ctx, &py_events, BPF_F_CURRENT_CPU, event, size);
+    }
+}
+
 static __always_inline int get_thread_state(
         py_pid_data *pid_data,
         void **out_thread_state) {
@@ -157,7 +244,12 @@ static __always_inline int get_thread_state(
 static __always_inline int submit_sample(
         void *ctx,
         py_sample_state_t *state) {
-    bpf_perf_event_output(ctx, &py_events, BPF_F_CURRENT_CPU, &state->event, sizeof(py_event));
+    u64 size = sizeof(py_event);
+    u32 len = state->event.stack_len;
+    if (len < PYTHON_STACK_MAX_LEN) {
+        size = offsetof(py_event, stack) + len * sizeof(py_symbol_id);
+    }
+    output_event(ctx, &state->event, size);
     return 0;
 }
 
@@ -166,8 +258,7 @@ static __always_inline int submit_error_sample(
         py_sample_state_t *state, uint8_t err) {
     state->event.stack_status = STACK_STATUS_ERROR;
     state->event.err = err;
-    bpf_perf_event_output(ctx, &py_events, BPF_F_CURRENT_CPU, &state->event,
-                          offsetof(py_event, kern_stack) + sizeof(state->event.kern_stack));
+    output_event(ctx, &state->event, offsetof(py_event, stack_len));
     return -1;
 }
 
@@ -216,7 +307,7 @@ static __always_inline int get_top_frame(py_pid_data *pid_data, py_sample_state_
     return 0;
 }
 
-static __always_inline int pyperf_collect_impl(struct bpf_perf_event_data *ctx, pid_t pid, bool collect_kern_stack) {
+static __always_inline int pyperf_collect_impl(struct bpf_perf_event_data *ctx, pid_t pid) {
     py_pid_data *pid_data = bpf_map_lookup_elem(&py_pid_config, &pid);
     if (!pid_data) {
         return 0;
@@ -230,11 +321,16 @@ static __always_inline int pyperf_collect_impl(struct bpf_perf_event_data *ctx,
 
     py_event *event = &state->event;
     event->pid = pid;
-    if (collect_kern_stack) {
-        event->kern_stack = bpf_get_stackid(ctx, &stacks, KERN_STACKID_FLAGS);
+    if (pid_data->collect_kernel) {
+        event->kern_stack = get_stackid_counted(ctx, &stacks, KERN_STACKID_FLAGS, &py_map_errors);
     } else {
         event->kern_stack = -1;
     }
+    if (pid_data->collect_user) {
+        event->user_stack = get_stackid_counted(ctx, &stacks, USER_STACKID_FLAGS, &py_map_errors);
+    } else {
+        event->user_stack = -1;
+    }
 
 
     // Read PyThreadState of this Thread from TLS
@@ -265,7 +361,7 @@ int pyperf_collect(struct bpf_perf_event_data *ctx) {
     if (pid == 0) {
         return 0;
     }
-    return pyperf_collect_impl(ctx, (pid_t) pid, false); // todo allow configuring it
+    return pyperf_collect_impl(ctx, (pid_t) pid);
 }
 
 
@@ -323,19 +419,46 @@ static __always_inline int check_first_arg(void *code_ptr,
     return 0;
 }
 
+// Reads $frame->f_localsplus[0] for cls, or its ob_type for self.
+static __always_inline int get_class_ptr(
+        void *cur_frame,
+        py_offset_config *offsets,
+        bool first_self,
+        void **out_class_ptr) {
+    void *ptr;
+    if (bpf_probe_read_user(
+            &ptr, sizeof(void *), (void *) (cur_frame + offsets->VFrame_localsplus))) {
+        bpf_dbg_printk("failed to read f_localsplus at %x\n", cur_frame + offsets->VFrame_localsplus);
+        return -1;
+    }
+    if (ptr && first_self) {
+        // we are working with an instance, first we need to get type
+        if (bpf_probe_read_user(&ptr, sizeof(void *), ptr + offsets->PyObject_ob_type)) {
+            bpf_dbg_printk("failed to read ob_type at %x\n", ptr);
+            return -1;
+        }
+    }
+    *out_class_ptr = ptr;
+    return 0;
+}
+
 // return -PY_ERR_XX on error, 0 on success
 static __always_inline int get_names(
         void *cur_frame,
         void *code_ptr,
         py_offset_config *offsets,
         py_symbol *symbol,
-        void *ctx) {
+        void *ctx,
+        uint32_t *out_first_arg,
+        void **out_class_ptr) {
 
     bool first_self;
     bool first_cls;
     if (check_first_arg(code_ptr, offsets, symbol, &first_self, &first_cls)) {
         return -PY_ERROR_FIRST_ARG;
     }
+    *out_first_arg = first_self ? PY_CODE_FIRST_ARG_SELF : first_cls ? PY_CODE_FIRST_ARG_CLS : PY_CODE_FIRST_ARG_OTHER;
+    *out_class_ptr = 0;
 
     // We re-use the same py_symbol instance across loop iterations, which means
     // we will have left-over data in the struct. Although this won't affect
@@ -345,24 +468,21 @@ static __always_inline int get_names(
     // (ab)use this behavior to clear the memory. It requires the size of py_symbol
     // to be different from struct bpf_perf_event_value, which we check at
     // compilation time using the FAIL_COMPILATION_IF macro.
-    bpf_perf_prog_read_value(ctx, (struct bpf_perf_event_value *) symbol, sizeof(py_symbol));
+    // The bpf_loop walker has no ctx, it relies on bpf_probe_read_kernel clearing on error instead.
+    if (ctx) {
+        bpf_perf_prog_read_value(ctx, (struct bpf_perf_event_value *) symbol, sizeof(py_symbol));
+    } else {
+        bpf_probe_read_kernel(symbol, sizeof(py_symbol), 0);
+    }
 
     // Read class name from $frame->f_localsplus[0]->ob_type->tp_name.
     if (first_self || first_cls) {
         void *ptr;
-        if (bpf_probe_read_user(
-                &ptr, sizeof(void *), (void *) (cur_frame + offsets->VFrame_localsplus))) {
-            bpf_dbg_printk("failed to read f_localsplus at %x\n", cur_frame + offsets->VFrame_localsplus);
+        if (get_class_ptr(cur_frame, offsets, first_self, &ptr)) {
             return -PY_ERROR_CLASS_NAME;
         }
+        *out_class_ptr = ptr;
         if (ptr) {
-            if (first_self) {
-                // we are working with an instance, first we need to get type
-                if (bpf_probe_read_user(&ptr, sizeof(void *), ptr + offsets->PyObject_ob_type)) {
-                    bpf_dbg_printk("failed to read ob_type at %x\n", ptr);
-                    return -PY_ERROR_CLASS_NAME;
-                }
-            }
             // https://github.com/python/cpython/blob/d73501602f863a54c872ce103cd3fa119e38bac9/Include/cpython/object.h#L106
             if (bpf_probe_read_user(&ptr, sizeof(void *), ptr + offsets->PyTypeObject_tp_name)) {
                 bpf_dbg_printk("failed to read tp_name at %x\n", ptr);
@@ -409,16 +529,125 @@ static __always_inline int get_names(
     return 0;
 }
 
-// get_frame_data reads current PyFrameObject filename/name and updates
-// stack_info->frame_ptr with pointer to next PyFrameObject
+// To avoid duplicate ids, every CPU needs to use different ids when inserting
+// into the hashmap. Set to the number of possible cpus by userspace before load.
+const volatile uint32_t py_num_cpu = 512;
+
+static __always_inline int get_symbol_id(
+        py_sample_state_t *state,
+        py_symbol *sym,
+        py_symbol_id *out_symbol_id) {
+
+    py_symbol_id *symbol_id_ptr = bpf_map_lookup_elem(&py_symbols, sym);
+    if (symbol_id_ptr) {
+        *out_symbol_id = *symbol_id_ptr;
+        return 0;
+    }
+    // the symbol is new, bump the counter
+    state->symbol_counter++;
+    py_symbol_id symbol_id = state->symbol_counter * py_num_cpu + state->cur_cpu;
+    if (bpf_map_update_elem(&py_symbols, sym, &symbol_id, BPF_NOEXIST) == 0) {
+        bpf_map_update_elem(&py_symbols_by_id, &symbol_id, sym, BPF_ANY);
+        *out_symbol_id = symbol_id;
+        return 0;
+    }
+    symbol_id_ptr = bpf_map_lookup_elem(&py_symbols, sym);
+    if (symbol_id_ptr) {
+        *out_symbol_id = *symbol_id_ptr;
+        return 0;
+    }
+    count_map_error(&py_map_errors, MAP_ERROR_PY_SYMBOLS);
+    *out_symbol_id = 0;
+    return -1;
+}
+
+static __always_inline bool code_symbol_valid(py_code_value *cached, void *name_ptr, void *file_ptr) {
+    return cached->name_ptr == (uint64_t) name_ptr && cached->file_ptr == (uint64_t) file_ptr;
+}
+
+static __always_inline int cache_code_symbol(
+        py_code_key *key,
+        py_symbol_id symbol_id,
+        uint32_t first_arg,
+        void *class_ptr,
+        void *name_ptr,
+        void *file_ptr) {
+    py_code_value value = {
+            .symbol_id = symbol_id,
+            .first_arg = first_arg,
+            .name_ptr = (uint64_t) name_ptr,
+            .file_ptr = (uint64_t) file_ptr,
+    };
+    bpf_map_update_elem(&py_code_cache, key, &value, BPF_ANY);
+    if (first_arg != PY_CODE_FIRST_ARG_OTHER && class_ptr) {
+        key->class_ptr = (uint64_t) class_ptr;
+        bpf_map_update_elem(&py_code_cache, key, &value, BPF_ANY);
+    }
+    return 0;
+}
+
+// Resolves the symbol id of a code object through py_code_cache, reading the names only on a miss.
+// returns -PY_ERR_XXX on error, 0 on success
+static __always_inline int get_code_symbol_id(
+        py_sample_state_t *state,
+        void *cur_frame,
+        void *code_ptr,
+        void *ctx,
+        py_symbol_id *out_symbol_id) {
+    py_offset_config *offsets = &state->offsets;
+    py_code_key key = {.pid = state->event.pid, .code_ptr = (uint64_t) code_ptr};
+    void *name_ptr = 0;
+    void *file_ptr = 0;
+    if (bpf_probe_read_user(&name_ptr, sizeof(void *), code_ptr + offsets->PyCodeObject_co_name)) {
+        return -PY_ERROR_NAME;
+    }
+    if (bpf_probe_read_user(&file_ptr, sizeof(void *), code_ptr + offsets->PyCodeObject_co_filename)) {
+        return -PY_ERROR_FILE_NAME;
+    }
+    py_code_value *cached = bpf_map_lookup_elem(&py_code_cache, &key);
+    if (cached && code_symbol_valid(cached, name_ptr, file_ptr)) {
+        if (cached->first_arg == PY_CODE_FIRST_ARG_OTHER) {
+            *out_symbol_id = cached->symbol_id;
+            return 0;
+        }
+        void *class_ptr;
+        if (get_class_ptr(cur_frame, offsets, cached->first_arg == PY_CODE_FIRST_ARG_SELF, &class_ptr)) {
+            return -PY_ERROR_CLASS_NAME;
+        }
+        if (class_ptr) {
+            key.class_ptr = (uint64_t) class_ptr;
+            cached = bpf_map_lookup_elem(&py_code_cache, &key);
+            if (cached && code_symbol_valid(cached, name_ptr, file_ptr)) {
+                *out_symbol_id = cached->symbol_id;
+                return 0;
+            }
+            key.class_ptr = 0;
+        }
+    }
+
+    uint32_t first_arg;
+    void *class_ptr;
+    int res = get_names(cur_frame, code_ptr, offsets, &state->sym, ctx, &first_arg, &class_ptr);
+    if (res < 0) {
+        return res;
+    }
+    if (get_symbol_id(state, &state->sym, out_symbol_id)) {
+        return -PY_ERROR_SYMBOL;
+    }
+    return cache_code_symbol(&key, *out_symbol_id, first_arg, class_ptr, name_ptr, file_ptr);
+}
+
+// get_frame_data resolves the symbol id of the current PyFrameObject and updates
+// state->frame_ptr with pointer to next PyFrameObject
 // since 311 frame_ptr is pointing to _PyInterpreterFrame
 // returns -PY_ERR_XXX on error, 1 on success, 0 if no more frames
 static __always_inline int get_frame_data(
-        void **frame_ptr,
-        py_offset_config *offsets,
-        py_symbol *symbol,
-        // ctx is only used to call helper to clear symbol, see documentation below
-        void *ctx) {
+        py_sample_state_t *state,
+        // ctx is only used to call helper to clear symbol, see get_names
+        void *ctx,
+        py_symbol_id *out_symbol_id) {
+    void **frame_ptr = (void **) &state->frame_ptr;
+    py_offset_config *offsets = &state->offsets;
     void *code_ptr;
     void *cur_frame = *frame_ptr;
     if (!cur_frame) {
@@ -456,7 +685,7 @@ static __always_inline int get_frame_data(
         return 0; // todo learn when this happens, c extension?
     }
 
-    int res = get_names(cur_frame, code_ptr, offsets, symbol, ctx);
+    int res = get_code_symbol_id(state, cur_frame, code_ptr, ctx, out_symbol_id);
     if (res < 0) {
         return res;
     }
@@ -469,38 +698,6 @@ static __always_inline int get_frame_data(
 
     return 1;
 }
-// should be enough
-#define PY_NUM_CPU 512
-
-// To avoid duplicate ids, every CPU needs to use different ids when inserting
-// into the hashmap. NUM_CPUS is defined at PyPerf backend side and passed
-// through CFlag.
-static __always_inline int get_symbol_id(
-        py_sample_state_t *state,
-        py_symbol *sym,
-        py_symbol_id *out_symbol_id) {
-
-    py_symbol_id *symbol_id_ptr = bpf_map_lookup_elem(&py_symbols, sym);
-    if (symbol_id_ptr) {
-        *out_symbol_id = *symbol_id_ptr;
-        return 0;
-    }
-    // the symbol is new, bump the counter
-    state->symbol_counter++;
-    py_symbol_id symbol_id = state->symbol_counter * PY_NUM_CPU + state->cur_cpu;
-    if (bpf_map_update_elem(&py_symbols, sym, &symbol_id, BPF_NOEXIST) == 0) {
-        *out_symbol_id = symbol_id;
-        return 0;
-    }
-    symbol_id_ptr = bpf_map_lookup_elem(&py_symbols, sym);
-    if (symbol_id_ptr) {
-        *out_symbol_id = *symbol_id_ptr;
-        return 0;
-    }
-    *out_symbol_id = 0;
-    return -1;
-}
-
 SEC("perf_event")
 int read_python_stack(struct bpf_perf_event_data *ctx) {
     GET_STATE();
@@ -508,11 +705,11 @@ int read_python_stack(struct bpf_perf_event_data *ctx) {
     state->python_stack_prog_call_cnt++;
     py_event *sample = &state->event;
 
-    py_symbol sym = {};
     int last_res;
 #pragma unroll
     for (int i = 0; i < PYTHON_STACK_FRAMES_PER_PROG; i++) {
-        last_res = get_frame_data((void **) &state->frame_ptr, &state->offsets, &sym, ctx);
+        py_symbol_id symbol_id;
+        last_res = get_frame_data(state, ctx, &symbol_id);
         if (last_res < 0) {
             return submit_error_sample(ctx, state, (uint8_t) (-last_res));
         }
@@ -520,10 +717,6 @@ int read_python_stack(struct bpf_perf_event_data *ctx) {
             break;
         }
         if (last_res == 1) {
-            py_symbol_id symbol_id;
-            if (get_symbol_id(state, &sym, &symbol_id)) {
-                return submit_error_sample(ctx, state, PY_ERROR_SYMBOL);
-            }
             uint32_t cur_len = sample->stack_len;
             if (cur_len < PYTHON_STACK_MAX_LEN) {
                 sample->stack[cur_len] = symbol_id;
@@ -539,7 +732,8 @@ int read_python_stack(struct bpf_perf_event_data *ctx) {
     }
 
     if (sample->stack_status == STACK_STATUS_TRUNCATED &&
-        state->python_stack_prog_call_cnt < PYTHON_STACK_PROG_CNT) {
+        state->python_stack_prog_call_cnt < PYTHON_STACK_PROG_CNT &&
+        state->python_stack_prog_call_cnt * PYTHON_STACK_FRAMES_PER_PROG < python_stack_max_len) {
         // read next batch of frames
         bpf_tail_call(ctx, &py_progs, PYTHON_PROG_IDX_READ_PYTHON_STACK);
         return -1;
@@ -548,6 +742,54 @@ int read_python_stack(struct bpf_perf_event_data *ctx) {
     return submit_sample(ctx, state);
 }
 
+// bpf_loop is not in the bundled helper definitions, available since linux 5.17
+static long (*bpf_loop_helper)(__u32 nr_loops, void *callback_fn, void *callback_ctx, __u64 flags) = (void *) 181;
+
+struct py_stack_walk {
+    py_sample_state_t *state;
+    int last_res;
+};
+
+static long walk_python_frame(__u32 i, void *data) {
+    struct py_stack_walk *walk = data;
+    py_sample_state_t *state = walk->state;
+    py_symbol_id symbol_id;
+    walk->last_res = get_frame_data(state, 0, &symbol_id);
+    if (walk->last_res <= 0) {
+        return 1;
+    }
+    uint32_t cur_len = state->event.stack_len;
+    if (cur_len < PYTHON_STACK_MAX_LEN) {
+        state->event.stack[cur_len] = symbol_id;
+        state->event.stack_len++;
+    }
+    return 0;
+}
+
+// Same walk as read_python_stack without unrolling or tail calls. Userspace puts it into
+// py_progs[PYTHON_PROG_IDX_READ_PYTHON_STACK] when the kernel supports bpf_loop, and disables
+// autoload otherwise.
+SEC("perf_event")
+int read_python_stack_loop(struct bpf_perf_event_data *ctx) {
+    GET_STATE();
+
+    struct py_stack_walk walk = {.state = state, .last_res = 1};
+    uint32_t max_len = python_stack_max_len;
+    if (max_len > PYTHON_STACK_MAX_LEN) {
+        max_len = PYTHON_STACK_MAX_LEN;
+    }
+    bpf_loop_helper(max_len, walk_python_frame, &walk, 0);
+    if (walk.last_res < 0) {
+        return submit_error_sample(ctx, state, (uint8_t) (-walk.last_res));
+    }
+    if (walk.last_res == 0) {
+        state->event.stack_status = STACK_STATUS_COMPLETE;
+    } else {
+        state->event.stack_status = STACK_STATUS_TRUNCATED;
+    }
+    return submit_sample(ctx, state);
+}
+
 #endif // PYPERF_H
 
 char _license[] SEC("license") = "GPL";
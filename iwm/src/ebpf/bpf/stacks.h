@@ -7,13 +7,47 @@
 #define KERN_STACKID_FLAGS (0 | BPF_F_FAST_STACK_CMP)
 #define USER_STACKID_FLAGS (0 | BPF_F_FAST_STACK_CMP | BPF_F_USER_STACK)
 
+#define DEFINE_STACKS_MAP(name)                                   \
+struct {                                                          \
+    __uint(type, BPF_MAP_TYPE_STACK_TRACE);                       \
+    __uint(key_size, sizeof(u32));                                \
+    __uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(u64));       \
+    __uint(max_entries, PROFILE_MAPS_SIZE);                       \
+} name SEC(".maps");
 
-struct {
-    __uint(type, BPF_MAP_TYPE_STACK_TRACE);
-    __uint(key_size, sizeof(u32));
-    __uint(value_size, PERF_MAX_STACK_DEPTH * sizeof(u64));
-    __uint(max_entries, PROFILE_MAPS_SIZE);
-} stacks SEC(".maps");
+#define ERR_ENOMEM  12
+#define ERR_EEXIST  17
+
+// inserts that failed because a map was full, counted per cpu in a map_errors array
+enum {
+    MAP_ERROR_COUNTS = 0,
+    MAP_ERROR_STACKS = 1,
+    MAP_ERROR_PY_SYMBOLS = 2,
+    MAP_ERROR_MAX = 3,
+};
+
+#define DEFINE_MAP_ERRORS_MAP(name)                               \
+struct {                                                          \
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);                      \
+    __type(key, u32);                                             \
+    __type(value, u64);                                           \
+    __uint(max_entries, MAP_ERROR_MAX);                           \
+} name SEC(".maps");
+
+static __always_inline void count_map_error(void *errors, u32 which) {
+    u64 *v = bpf_map_lookup_elem(errors, &which);
+    if (v)
+        (*v)++;
+}
+
+// -EEXIST is a bucket taken by another stack, which BPF_F_REUSE_STACKID would overwrite, and
+// -ENOMEM a full map. Missing stacks (-EFAULT) are not an error of the map.
+static __always_inline long get_stackid_counted(void *ctx, void *stacks, u64 flags, void *errors) {
+    long id = bpf_get_stackid(ctx, stacks, flags);
+    if (id == -ERR_EEXIST || id == -ERR_ENOMEM)
+        count_map_error(errors, MAP_ERROR_STACKS);
+    return id;
+}
 
 
 #endif
\ No newline at end of file
@@ -1,267 +1,186 @@
+use std::borrow::Cow;
 use std::collections::HashMap;
 use std::fs;
-use std::str;
-use std::string::String;
+use std::path::Path;
 
-use gimli::{AttributeValue, constants::DW_AT_byte_size, constants::DW_AT_data_member_location, constants::DW_AT_name, Dwarf, EndianSlice, LittleEndian};
-use object::Object;
+use gimli::{AttributeValue, EndianSlice, RunTimeEndian, UnitOffset};
+use object::{Object, ObjectSection};
 
-use crate::error::Error::InvalidData;
+use crate::error::Error::{ELFError, InvalidData, NotFound};
 use crate::error::Result;
 
-impl Typ {
-    fn get_field(&self, name: &str) -> Option<&Field> {
-        self.fields.iter().find(|field| field.name == name)
-    }
-}
-
-#[derive(Debug)]
-struct Field {
-    name: String,
-    offset: u64,
-}
-
-#[derive(Debug)]
-struct Typedef {
-    name: String,
-    type_offsets: Vec<u32>,
+// A struct (or typedef of a struct) and the members whose offsets are needed.
+pub struct Need {
+    pub name: &'static str,
+    pub fields: &'static [&'static str],
 }
 
-#[derive(Debug)]
-struct Typ {
-    name: String,
-    fields: Vec<Field>,
-    size: i64,
+#[derive(Debug, Default, Clone)]
+pub struct TypeOffsets {
+    pub size: i64,
+    pub fields: HashMap<String, i64>,
 }
 
-#[derive(Debug)]
-struct Index {
-    offset_to_type: HashMap<u32, Typ>,
-    typedefs: HashMap<String, Typedef>,
+impl TypeOffsets {
+    // -1 when the member does not exist, matching the convention of py_offset_config
+    pub fn field(&self, name: &str) -> i64 {
+        self.fields.get(name).cloned().unwrap_or(-1)
+    }
 }
 
-impl Index {
-    fn new() -> Self {
-        Self {
-            offset_to_type: HashMap::new(),
-            typedefs: HashMap::new(),
-        }
-    }
+pub type Index = HashMap<String, TypeOffsets>;
 
-    fn get_type_by_name(&self, name: &str) -> Option<&Typ> {
-        let typedef = self.typedefs.get(name).unwrap();
-        let mut types = Vec::new();
-        for &offset in &typedef.type_offsets {
-            if let Some(typ) = self.offset_to_type.get(&offset) {
-                types.push(typ);
-            }
-        }
-        types.first().cloned()
+// Reads member offsets and sizes of the needed types from the DWARF of an ELF file.
+// Types that are not found are missing from the result.
+pub fn dump(elf_path: &Path, needs: &[Need]) -> Result<Index> {
+    let data = fs::read(elf_path).map_err(|e| ELFError(format!("{:?}: {}", elf_path, e)))?;
+    let file = object::File::parse(&*data).map_err(|e| ELFError(format!("{:?}: {}", elf_path, e)))?;
+    if file.section_by_name(".debug_info").is_none() {
+        return Err(NotFound(format!("{:?} has no debug info", elf_path)));
     }
-}
-
-fn struct_member_offsets_from_dwarf(data: &Dwarf<&str>) -> Result<Index> {
+    let endian = if file.is_little_endian() {
+        RunTimeEndian::Little
+    } else {
+        RunTimeEndian::Big
+    };
+    let load_section = |id: gimli::SectionId| -> std::result::Result<Cow<[u8]>, gimli::Error> {
+        Ok(file
+            .section_by_name(id.name())
+            .and_then(|s| s.uncompressed_data().ok())
+            .unwrap_or(Cow::Borrowed(&[][..])))
+    };
+    let dwarf_cow = gimli::Dwarf::load(load_section).map_err(dwarf_error)?;
+    let dwarf = dwarf_cow.borrow(|section| EndianSlice::new(&*section, endian));
+
+    let wanted: HashMap<&str, &Need> = needs.iter().map(|n| (n.name, n)).collect();
     let mut res = Index::new();
-
-    for unit in data.units() {
-        let abbrevs = unit.abbreviations().unwrap();
+    let mut units = dwarf.units();
+    while let Some(header) = units.next().map_err(dwarf_error)? {
+        let unit = dwarf.unit(header).map_err(dwarf_error)?;
+        // wanted named structs and anonymous ones, which may be the target of a wanted typedef
+        let mut structs: HashMap<UnitOffset, (Option<String>, TypeOffsets)> = HashMap::new();
+        let mut typedefs: Vec<(String, UnitOffset)> = Vec::new();
+        // depth and offset of the struct whose members are being read
+        let mut current: Option<(isize, UnitOffset)> = None;
+        let mut depth: isize = 0;
         let mut entries = unit.entries();
-
-        while let Some(entry) = entries.next().unwrap() {
-            let attrs = entry.attrs(&abbrevs).unwrap();
-
+        while let Some((delta, entry)) = entries.next_dfs().map_err(dwarf_error)? {
+            depth += delta;
+            if let Some((d, _)) = current {
+                if depth <= d {
+                    current = None;
+                }
+            }
             match entry.tag() {
-                gimli::DW_TAG_structure_type | gimli::DW_TAG_typedef => {
-                    let name = match attrs.get(DW_AT_name) {
-                        Some(AttributeValue::DebugStrRef(name_offset)) => {
-                            let debug_str = data.debug_str().unwrap();
-                            debug_str.get_str(*name_offset).unwrap().to_string()
+                gimli::DW_TAG_structure_type | gimli::DW_TAG_union_type if current.is_none() => {
+                    let declaration = entry.attr_value(gimli::DW_AT_declaration).map_err(dwarf_error)?;
+                    if let Some(AttributeValue::Flag(true)) = declaration {
+                        continue;
+                    }
+                    let name = entry_name(&dwarf, &unit, entry)?;
+                    if let Some(name) = &name {
+                        if !wanted.contains_key(name.as_str()) || res.contains_key(name) {
+                            continue;
                         }
-                        _ => continue,
-                    };
-
-                    let byte_size = match attrs.get(DW_AT_byte_size) {
-                        Some(AttributeValue::Udata(size)) => *size as i64,
-                        _ => 0,
+                    }
+                    let size = entry
+                        .attr_value(gimli::DW_AT_byte_size)
+                        .map_err(dwarf_error)?
+                        .and_then(|v| v.udata_value())
+                        .unwrap_or(0) as i64;
+                    structs.insert(entry.offset(), (name, TypeOffsets { size, fields: HashMap::new() }));
+                    current = Some((depth, entry.offset()));
+                }
+                gimli::DW_TAG_member => {
+                    let (d, offset) = match current {
+                        Some(c) => c,
+                        None => continue,
                     };
-
-                    if byte_size == 0 {
+                    if depth != d + 1 {
                         continue;
                     }
-                    let mut fields = Vec::new();
-                    for attr in attrs {
-                        if let (DW_AT_name, Some(AttributeValue::DebugStrRef(name_offset))) = attr {
-                            let name = data.debug_str().unwrap().get_str(*name_offset).unwrap().to_string();
-
-                            if let (DW_AT_data_member_location, Some(AttributeValue::Exprloc(data))) = attr {
-                                let offset = parse_expr(data)?;
-                                fields.push(Field { name, offset });
-                            }
-                        }
+                    let name = match entry_name(&dwarf, &unit, entry)? {
+                        Some(name) => name,
+                        None => continue,
+                    };
+                    let location = entry.attr_value(gimli::DW_AT_data_member_location).map_err(dwarf_error)?;
+                    let member_offset = match location {
+                        Some(AttributeValue::Exprloc(expr)) => parse_plus_uconst(expr.0.slice())?,
+                        Some(v) => v.udata_value().unwrap_or(0) as i64,
+                        // members of unions have no location
+                        None => 0,
+                    };
+                    if let Some((_, t)) = structs.get_mut(&offset) {
+                        t.fields.insert(name, member_offset);
                     }
-
-                    let typ = Typ {
-                        name,
-                        fields,
-                        size: byte_size,
+                }
+                gimli::DW_TAG_typedef => {
+                    let name = match entry_name(&dwarf, &unit, entry)? {
+                        Some(name) => name,
+                        None => continue,
                     };
-
-                    if let Some(typedef) = attrs.get(DW_AT_name) {
-                        if let Some(AttributeValue::DebugStrRef(type_name_offset)) = typedef {
-                            let name = data.debug_str()?.get_str(*type_name_offset)?.to_string();
-
-                            if let Some(AttributeValue::UnitRef(type_offset)) = attrs.get(gimli::DW_AT_type) {
-                                let typedef = res.typedefs.entry(name.clone()).or_insert_with(|| Typedef {
-                                    name,
-                                    type_offsets: Vec::new(),
-                                });
-
-                                typedef.type_offsets.push(*type_offset);
-                            }
-                        }
+                    if !wanted.contains_key(name.as_str()) {
+                        continue;
+                    }
+                    let target = entry.attr_value(gimli::DW_AT_type).map_err(dwarf_error)?;
+                    if let Some(AttributeValue::UnitRef(target)) = target {
+                        typedefs.push((name, target));
                     }
-
-                    let offset = entry.offset();
-                    res.offset_to_type.insert(offset, typ);
                 }
                 _ => {}
             }
         }
-    }
-    Ok(res)
-}
-
-fn parse_expr(data: &[u8]) -> Result<u64> {
-    let mut reader = gimli::EndianBuf::new(data, gimli::RunTimeEndian::Little);
-    let mut expr = Vec::new();
-
-    while let Ok(oper) = gimli::Reader::read_uleb128(&mut reader) {
-        match oper {
-            0 => break,
-            2 => expr.push(0x90),
-            _ => expr.push(oper as u8),
-        }
-    }
-
-    let mut stack = Vec::new();
-
-    for &op in &expr {
-        match op {
-            0x90 => {
-                let v = stack.pop().ok_or(InvalidData("Empty stack".to_string()))?;
-                stack.push(v + 1);
+        for (name, target) in typedefs {
+            if let Some((_, t)) = structs.get(&target) {
+                res.entry(name).or_insert_with(|| t.clone());
             }
-            0x9c => {
-                let b = stack.pop().ok_or(InvalidData("Empty stack".to_string()))?;
-                let a = stack.pop().ok_or(InvalidData("Empty stack".to_string()))?;
-                stack.push(a + b);
+        }
+        for (_, (name, t)) in structs {
+            if let Some(name) = name {
+                res.entry(name).or_insert(t);
             }
-            op => stack.push(op as u64),
+        }
+        if needs.iter().all(|n| res.contains_key(n.name)) {
+            break;
         }
     }
-
-    if stack.len() != 1 {
-        return Err(InvalidData("Invalid expression".to_string()));
+    for n in needs {
+        if let Some(t) = res.get_mut(n.name) {
+            t.fields.retain(|f, _| n.fields.contains(&f.as_str()));
+        }
     }
-
-    Ok(stack[0])
+    Ok(res)
 }
 
-#[derive(Debug)]
-struct FieldDump {
-    name: String,
-    offset: i32,
+fn entry_name<R: gimli::Reader>(
+    dwarf: &gimli::Dwarf<R>,
+    unit: &gimli::Unit<R>,
+    entry: &gimli::DebuggingInformationEntry<R>,
+) -> Result<Option<String>> {
+    let attr = match entry.attr_value(gimli::DW_AT_name).map_err(dwarf_error)? {
+        Some(attr) => attr,
+        None => return Ok(None),
+    };
+    let s = dwarf.attr_string(unit, attr).map_err(dwarf_error)?;
+    Ok(Some(s.to_string_lossy().map_err(dwarf_error)?.into_owned()))
 }
 
-fn dump(elf_path: &str, fields: &[Need], types: &Index) -> Result<Vec<FieldDump>> {
-
-    let elf_file = fs::File::open(elf_path)?;
-
-    let dwarf = Dwarf::load(|id| -> Result<_, gimli::Error> {
-        let endian = LittleEndian;
-        let bytes = elf_file.section_data_by_name(id.name()).map_or(Ok(&[][..]), |data| Ok(data))?;
-        Ok(EndianSlice::new(bytes, endian))
-    })?;
-
-    let types = struct_member_offsets_from_dwarf(&dwarf)?;
-
-    let mut field_dumps = Vec::new();
-    for need in fields {
-        let typ = types.get_type_by_name(&need.name)
-            .or_else(|| types.get_type_by_name(&need.pretty_name));
-
-        let mut e: Vec<FieldDump> = Vec::new();
-        if let Some(typ) = typ {
-            for need_field in &need.fields {
-                let o = if let Some(f) = typ.get_field(&need_field.name) {
-                    f.offset as i32
-                } else {
-                    -1
-                };
-                let pname = if need_field.print_name.is_empty() {
-                    format!("{}{}", type_name(&need), field_name(&need_field.name))
-                } else {
-                    need_field.print_name.clone()
-                };
-                e.push(FieldDump { name: pname, offset: o });
-            }
-            if need.size {
-                let sz_name = format!("{}Size", type_name(&need));
-                let size = if typ.size == 0 { -1 } else { typ.size as i32 };
-                e.push(FieldDump { name: sz_name, offset: size });
-            }
+// DWARF 2 style member locations are a DW_OP_plus_uconst expression
+fn parse_plus_uconst(expr: &[u8]) -> Result<i64> {
+    const DW_OP_PLUS_UCONST: u8 = 0x23;
+    if expr.first() != Some(&DW_OP_PLUS_UCONST) {
+        return Err(InvalidData(format!("unsupported member location {:?}", expr)));
+    }
+    let mut value: u64 = 0;
+    for (i, b) in expr[1..].iter().enumerate() {
+        value |= ((b & 0x7f) as u64) << (7 * i);
+        if b & 0x80 == 0 {
+            return Ok(value as i64);
         }
-        field_dumps.extend(e);
     }
-    Ok(field_dumps)
-}
-
-#[derive(Debug)]
-struct Need {
-    name: String,
-    pretty_name: String,
-    fields: Vec<NeedField>,
-    size: bool,
-}
-
-#[derive(Debug)]
-struct NeedField {
-    name: String,
-    print_name: String,
+    Err(InvalidData("truncated member location".to_string()))
 }
 
-#[derive(Debug)]
-struct Version {
-    major: i32,
-    minor: i32,
-    patch: i32,
+fn dwarf_error(e: gimli::Error) -> crate::error::Error {
+    ELFError(format!("dwarf: {}", e))
 }
-
-fn type_name(need: &Need) -> String {
-    let n = if need.pretty_name.is_empty() { need.name.clone() } else { need.pretty_name.clone() };
-    let mut n = n.trim_matches(&['_', '_'] as &[_]).to_owned();
-    let parts: Vec<&str> = n.split('_').collect();
-    let mut result = String::new();
-
-    for part in parts {
-        let (first, rest) = part.split_at(1);
-        result.push_str(&first.to_uppercase());
-        result.push_str(rest);
-    }
-
-    result
-}
-
-fn field_name(field: &str) -> String {
-    let mut field = field.trim_start_matches('_');
-    let parts: Vec<&str> = field.split('_').collect();
-    let mut result = String::new();
-
-    for part in parts {
-        let (first, rest) = part.split_at(1);
-        result.push_str(&first.to_uppercase());
-        result.push_str(rest);
-    }
-
-    result
-}
\ No newline at end of file
@@ -1 +1 @@
-mod dwarfdump;
\ No newline at end of file
+pub mod dwarfdump;
@@ -0,0 +1,158 @@
+use std::fs;
+
+use log::info;
+
+// must match PERF_MAX_STACK_DEPTH in stacks.h
+const STACK_ENTRY_BYTES: u64 = 127 * 8;
+// dwarf_stack of profile.bpf.h, the ips and their hash
+const DWARF_STACK_ENTRY_BYTES: u64 = 128 * 8;
+// kernel bookkeeping of a hash map element, roughly
+const ELEMENT_OVERHEAD_BYTES: u64 = 64;
+// sample_key of profile.bpf.h
+const SAMPLE_KEY_BYTES: u64 = 32;
+// values of off_cpu_counts and alloc_counts
+const OFF_CPU_VALUE_BYTES: u64 = 8;
+const ALLOC_VALUE_BYTES: u64 = 16;
+// must match PROFILE_GENERATIONS in profile.bpf.h
+const PROFILE_GENERATIONS: u64 = 2;
+// class, function and file names of py_symbol in pyperf.bpf.c and the id
+const PY_SYMBOL_ENTRY_BYTES: u64 = 32 + 64 + 128 + 8;
+// must match PY_SYMBOLS_BY_ID_SHARE in python/pyperf.rs
+const PY_SYMBOLS_BY_ID_SHARE: u64 = 4;
+
+// A round at 97Hz over 15s takes up to 1455 samples per cpu, most of them share their keys.
+const PROFILE_ENTRIES_PER_CPU: u64 = 512;
+const MIN_PROFILE_ENTRIES: u64 = 2048;
+const MAX_PROFILE_ENTRIES: u64 = 256 * 1024;
+const MIN_PID_ENTRIES: u64 = 4096;
+const MAX_PID_ENTRIES: u64 = 64 * 1024;
+const MIN_PY_SYMBOLS: u64 = 4096;
+const MAX_PY_SYMBOLS: u64 = 256 * 1024;
+// the maps may lock up to this share of the memory the agent is allowed
+const MEMORY_SHARE: u64 = 16;
+
+// max_entries of the maps sized at load time, the programs are compiled with 16384, 1024, 16384
+// and 10240.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct MapSizes {
+    // the counts and stacks maps of both generations, off-cpu, allocation and dwarf ones included,
+    // and the stacks of pyperf
+    pub profile: u32,
+    // pids and unwind_infos
+    pub pids: u32,
+    pub py_symbols: u32,
+    pub py_pid_config: u32,
+}
+
+// Fixed sizes for a node class, whatever is left unset is derived from the host.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct MapSizeOptions {
+    pub profile: Option<u32>,
+    pub pids: Option<u32>,
+    pub py_symbols: Option<u32>,
+    pub py_pid_config: Option<u32>,
+    // processes expected to be profiled, the processes running at load time when unset
+    pub expected_pids: Option<u32>,
+}
+
+impl MapSizes {
+    // per_cpu_counts: the counts maps keep a value per possible cpu
+    pub fn new(options: &MapSizeOptions, per_cpu_counts: bool) -> Self {
+        let cpus = libbpf_rs::num_possible_cpus().unwrap_or(1).max(1) as u64;
+        let memory = memory_limit();
+        let pids = options.expected_pids.map(u64::from).unwrap_or_else(running_processes);
+        let budget = memory / MEMORY_SHARE;
+
+        let profile_entry = profile_entry_bytes(per_cpu_counts);
+        let profile = fit(cpus * PROFILE_ENTRIES_PER_CPU, MIN_PROFILE_ENTRIES, MAX_PROFILE_ENTRIES, budget / 2 / profile_entry);
+        // python symbols grow with the code running, not with the cpus sampling it
+        let py_symbols = fit(pids * 64, MIN_PY_SYMBOLS, MAX_PY_SYMBOLS, budget / 8 / py_symbol_entry_bytes());
+        // short lived processes keep their entries until the LRU evicts them
+        let pid_entries = fit(pids * 4, MIN_PID_ENTRIES, MAX_PID_ENTRIES, MAX_PID_ENTRIES);
+
+        let sizes = Self {
+            profile: options.profile.unwrap_or(profile as u32).max(1),
+            pids: options.pids.unwrap_or(pid_entries as u32).max(1),
+            py_symbols: options.py_symbols.unwrap_or(py_symbols as u32).max(1),
+            py_pid_config: options.py_pid_config.unwrap_or(pid_entries as u32).max(1),
+        };
+        info!(
+            "map sizes for {} cpus, {} MiB of memory and {} processes: {:?}",
+            cpus,
+            memory >> 20,
+            pids,
+            sizes
+        );
+        sizes
+    }
+
+    // Upper bound of the memory the sized maps lock, for RLIMIT_MEMLOCK on kernels that charge it.
+    pub fn locked_bytes(&self, per_cpu_counts: bool) -> u64 {
+        let profile = self.profile as u64 * profile_entry_bytes(per_cpu_counts);
+        let py = self.py_symbols as u64 * py_symbol_entry_bytes();
+        profile + py
+    }
+}
+
+// What one entry of MapSizes::profile costs over all the maps sized by it: in each generation two
+// stacks (samples, off-cpu), a dwarf stacks and three counts maps (samples, off-cpu, allocations),
+// then the stacks of pyperf. Only the sample counts keep a value per cpu.
+fn profile_entry_bytes(per_cpu_counts: bool) -> u64 {
+    let cpus = libbpf_rs::num_possible_cpus().unwrap_or(1).max(1) as u64;
+    let counts_value = if per_cpu_counts { 8 * cpus } else { 8 };
+    let stacks = STACK_ENTRY_BYTES + ELEMENT_OVERHEAD_BYTES;
+    let dwarf_stacks = DWARF_STACK_ENTRY_BYTES + ELEMENT_OVERHEAD_BYTES;
+    let counts = 3 * (SAMPLE_KEY_BYTES + ELEMENT_OVERHEAD_BYTES) + counts_value + OFF_CPU_VALUE_BYTES + ALLOC_VALUE_BYTES;
+    PROFILE_GENERATIONS * (2 * stacks + dwarf_stacks + counts) + stacks
+}
+
+// One entry of MapSizes::py_symbols, in py_symbols and its share of py_symbols_by_id.
+fn py_symbol_entry_bytes() -> u64 {
+    let entry = PY_SYMBOL_ENTRY_BYTES + ELEMENT_OVERHEAD_BYTES;
+    entry + entry / PY_SYMBOLS_BY_ID_SHARE
+}
+
+// Rounded to a power of two, the kernel does so for the stack trace maps anyway.
+fn fit(wanted: u64, min: u64, max: u64, memory_cap: u64) -> u64 {
+    let cap = prev_power_of_two(memory_cap.max(min));
+    wanted.next_power_of_two().min(cap).clamp(min, max)
+}
+
+fn prev_power_of_two(n: u64) -> u64 {
+    if n == 0 {
+        return 0;
+    }
+    1 << (63 - n.leading_zeros())
+}
+
+// The memory limit of the cgroup (v2) of the agent, MemTotal when there is none.
+fn memory_limit() -> u64 {
+    let total = fs::read_to_string("/proc/meminfo")
+        .ok()
+        .and_then(|meminfo| {
+            let line = meminfo.lines().find(|l| l.starts_with("MemTotal:"))?;
+            let kb: u64 = line.split_ascii_whitespace().nth(1)?.parse().ok()?;
+            Some(kb * 1024)
+        })
+        .unwrap_or(1 << 30);
+    let limit = fs::read_to_string("/proc/self/cgroup").ok().and_then(|cgroup| {
+        let path = cgroup.lines().find_map(|line| line.strip_prefix("0::"))?;
+        let max = fs::read_to_string(format!("/sys/fs/cgroup{}/memory.max", path.trim_end())).ok()?;
+        max.trim().parse::<u64>().ok()
+    });
+    match limit {
+        Some(limit) => limit.min(total),
+        None => total,
+    }
+}
+
+fn running_processes() -> u64 {
+    fs::read_dir("/proc")
+        .map(|entries| {
+            entries
+                .flatten()
+                .filter(|e| e.file_name().to_str().map_or(false, |n| n.bytes().all(|b| b.is_ascii_digit())))
+                .count() as u64
+        })
+        .unwrap_or(0)
+}
@@ -1,16 +1,29 @@
 
+use prometheus::Counter;
+
+use crate::ebpf::metrics::overhead::OverheadMetrics;
+use crate::ebpf::metrics::python::PythonMetrics;
 use crate::ebpf::metrics::registry::Registerer;
 
 use crate::ebpf::metrics::symtab::SymtabMetrics;
 
 #[derive(Clone)]
 pub struct ProfileMetrics {
-    pub symtab: SymtabMetrics
+    pub symtab: SymtabMetrics,
+    pub pid_events_dropped: Counter,
+    pub python: PythonMetrics,
+    pub overhead: OverheadMetrics,
 }
 
 impl ProfileMetrics {
     pub fn new(reg: &dyn Registerer) -> Self {
         let symtab = SymtabMetrics::new(reg);
-        ProfileMetrics { symtab }
+        let pid_events_dropped = reg.register_counter(
+            "iwm_pid_events_dropped_total",
+            "Total number of process info requests dropped by the in-kernel rate limiter"
+        );
+        let python = PythonMetrics::new(reg);
+        let overhead = OverheadMetrics::new(reg);
+        ProfileMetrics { symtab, pid_events_dropped, python, overhead }
     }
 }
\ No newline at end of file
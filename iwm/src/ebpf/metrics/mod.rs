@@ -1,6 +1,7 @@
 pub mod metrics;
 pub mod symtab;
 pub mod python;
+pub mod overhead;
 pub mod registry;
 pub mod ebpf_metrics;
 pub mod write_metrics;
@@ -0,0 +1,60 @@
+use prometheus::{exponential_buckets, CounterVec, Histogram};
+
+use crate::ebpf::metrics::registry::Registerer;
+
+// Where the agent spends its time: the BPF programs, which need run time stats enabled, and the
+// stages of a collection round.
+#[derive(Clone)]
+pub struct OverheadMetrics {
+    pub bpf_run_time: CounterVec,
+    pub bpf_run_count: CounterVec,
+    pub bpf_map_errors: CounterVec,
+    pub drain_duration: Histogram,
+    pub symbolize_duration: Histogram,
+    pub pprof_build_duration: Histogram,
+    pub upload_duration: Histogram,
+}
+
+impl OverheadMetrics {
+    pub fn new(reg: &dyn Registerer) -> OverheadMetrics {
+        // 1ms to about 30s
+        let buckets = || exponential_buckets(0.001, 2.0, 16).unwrap();
+        OverheadMetrics {
+            bpf_run_time: reg.register_counter_vec(
+                "iwm_bpf_program_run_seconds_total",
+                "Total time spent running a BPF program, tail calls included",
+                &["program"]
+            ),
+            bpf_run_count: reg.register_counter_vec(
+                "iwm_bpf_program_runs_total",
+                "Total number of runs of a BPF program",
+                &["program"]
+            ),
+            bpf_map_errors: reg.register_counter_vec(
+                "iwm_bpf_map_insert_errors_total",
+                "Total number of entries BPF programs failed to insert because a map was full",
+                &["map"]
+            ),
+            drain_duration: reg.register_histogram_buckets(
+                "iwm_round_drain_seconds",
+                "Time spent reading and clearing the counts and stacks maps in a round",
+                buckets()
+            ),
+            symbolize_duration: reg.register_histogram_buckets(
+                "iwm_round_symbolize_seconds",
+                "Time spent symbolizing the stacks of a round",
+                buckets()
+            ),
+            pprof_build_duration: reg.register_histogram_buckets(
+                "iwm_round_pprof_build_seconds",
+                "Time spent encoding the pprof profiles of a round",
+                buckets()
+            ),
+            upload_duration: reg.register_histogram_buckets(
+                "iwm_round_upload_seconds",
+                "Time spent handing the profiles of a round to the writers",
+                buckets()
+            ),
+        }
+    }
+}
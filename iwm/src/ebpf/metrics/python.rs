@@ -18,8 +18,8 @@ impl PythonMetrics {
     pub fn new(reg: &dyn Registerer) -> PythonMetrics {
         PythonMetrics {
             pid_data_error: reg.register_counter_vec(
-                "iwm_ebpf_active_targets",
-                "Current number of active targets being tracked by the ebpf component",
+                "iwm_pyperf_pid_data_errors_total",
+                "Total number of errors while reading the offsets of a python process",
                 &["service_name"]
             ),
             lost_samples: reg.register_counter(
@@ -5,6 +5,7 @@ pub trait Registerer {
     fn register_counter(&self, name: &str, help: &str) -> Counter;
     fn register_counter_vec(&self, name: &str, help: &str, labels: &[&str]) -> CounterVec;
     fn register_histogram(&self, name: &str, help: &str) -> Histogram;
+    fn register_histogram_buckets(&self, name: &str, help: &str, buckets: Vec<f64>) -> Histogram;
 }
 
 impl Registerer for Registry {
@@ -35,4 +36,10 @@ impl Registerer for Registry {
         self.register(Box::new(histogram.clone())).unwrap();
         histogram
     }
+
+    fn register_histogram_buckets(&self, name: &str, help: &str, buckets: Vec<f64>) -> Histogram {
+        let histogram = Histogram::with_opts(HistogramOpts::new(name, help).buckets(buckets)).unwrap();
+        self.register(Box::new(histogram.clone())).unwrap();
+        histogram
+    }
 }
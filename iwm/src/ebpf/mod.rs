@@ -5,10 +5,28 @@ pub mod session;
 pub mod pprof;
 pub mod sync;
 pub mod wait_group;
+pub mod work_pool;
 pub mod symtab;
 pub mod ring;
+pub mod python;
+pub mod dwarfdump;
+pub mod unwind;
+pub mod overhead;
+pub mod map_sizes;
 
 pub(crate) const PERF_EVENT_IOC_ENABLE: core::ffi::c_int = 9216;
 pub(crate) const PERF_EVENT_IOC_DISABLE: core::ffi::c_int = 9217;
 pub(crate) const PERF_EVENT_IOC_SET_BPF: core::ffi::c_int = 1074013192;
+pub(crate) const PERF_EVENT_IOC_PERIOD: core::ffi::c_int = 1074275332;
 
+
+// Returns once the BPF programs running now are done, so none of them still uses a map entry or
+// index replaced before the call. MEMBARRIER_CMD_GLOBAL waits for an RCU grace period, which every
+// program run is inside of. Where it is not available a sample is given ample time instead.
+pub(crate) fn wait_for_bpf_programs() {
+    const MEMBARRIER_CMD_GLOBAL: libc::c_long = 1;
+    let ret = unsafe { libc::syscall(libc::SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0 as libc::c_long) };
+    if ret != 0 {
+        std::thread::sleep(std::time::Duration::from_millis(10));
+    }
+}
@@ -0,0 +1,197 @@
+use std::collections::HashMap;
+use std::ffi::c_void;
+use std::mem;
+use std::os::fd::{FromRawFd, OwnedFd, RawFd};
+use std::time::Instant;
+
+use libbpf_rs::{libbpf_sys, Map, MapFlags};
+use log::{debug, info};
+
+use crate::ebpf::metrics::overhead::OverheadMetrics;
+
+// must match MAP_ERROR_MAX in stacks.h
+pub const MAP_ERROR_MAX: usize = 3;
+pub const MAP_ERROR_COUNTS: usize = 0;
+pub const MAP_ERROR_STACKS: usize = 1;
+pub const MAP_ERROR_PY_SYMBOLS: usize = 2;
+
+// changes smaller than this are not worth reprogramming every perf event
+const MIN_RATE_CHANGE: f64 = 0.1;
+// steps per collection are bounded, the overhead of a round is a noisy measurement
+const MAX_RATE_DECREASE: f64 = 0.5;
+const MAX_RATE_INCREASE: f64 = 1.25;
+
+// Keeps the agent within a share of the host CPU by lowering the perf event frequency under load
+// and raising it back up to the configured rate once there is room again. The overhead is the CPU
+// time of the agent process plus the run time of the BPF programs, which the kernel only
+// accounts while run time stats are enabled, see enable_bpf_stats.
+pub struct RateController {
+    max_rate: u32,
+    min_rate: u32,
+    // fraction of the host CPU
+    budget: f64,
+    rate: u32,
+    cpus: f64,
+    last: Option<Usage>,
+}
+
+#[derive(Clone, Copy)]
+struct Usage {
+    at: Instant,
+    agent_ns: u64,
+    bpf_ns: u64,
+}
+
+impl RateController {
+    pub fn new(max_rate: u32, min_rate: u32, budget: f64) -> Self {
+        let cpus = unsafe { libc::sysconf(libc::_SC_NPROCESSORS_ONLN) }.max(1) as f64;
+        Self {
+            max_rate,
+            min_rate: min_rate.clamp(1, max_rate.max(1)),
+            budget,
+            rate: max_rate,
+            cpus,
+            last: None,
+        }
+    }
+
+    pub fn rate(&self) -> u32 {
+        self.rate
+    }
+
+    // Factor bringing counts taken at the current rate back to the configured one.
+    pub fn scale(&self) -> f64 {
+        self.max_rate as f64 / self.rate.max(1) as f64
+    }
+
+    // Measures the overhead since the previous call and returns the new rate when it changes.
+    pub fn update(&mut self, prog_fds: &[RawFd]) -> Option<u32> {
+        let now = Usage {
+            at: Instant::now(),
+            agent_ns: agent_cpu_ns(),
+            bpf_ns: bpf_run_time_ns(prog_fds),
+        };
+        let last = self.last.replace(now)?;
+        let wall_ns = now.at.duration_since(last.at).as_nanos() as f64;
+        if wall_ns <= 0.0 {
+            return None;
+        }
+        let used_ns = now.agent_ns.saturating_sub(last.agent_ns) + now.bpf_ns.saturating_sub(last.bpf_ns);
+        let usage = used_ns as f64 / (wall_ns * self.cpus);
+        let factor = if usage > 0.0 {
+            (self.budget / usage).clamp(MAX_RATE_DECREASE, MAX_RATE_INCREASE)
+        } else {
+            MAX_RATE_INCREASE
+        };
+        let rate = ((self.rate as f64 * factor).round() as u32).clamp(self.min_rate, self.max_rate);
+        debug!(
+            "overhead {:.3}% of {} cpus, budget {:.3}%, rate {}",
+            usage * 100.0,
+            self.cpus,
+            self.budget * 100.0,
+            self.rate
+        );
+        let change = (rate as f64 - self.rate as f64).abs() / self.rate as f64;
+        if rate == self.rate || (change < MIN_RATE_CHANGE && rate != self.min_rate && rate != self.max_rate) {
+            return None;
+        }
+        info!(
+            "overhead {:.3}% over a budget of {:.3}%, sample rate {} -> {}",
+            usage * 100.0,
+            self.budget * 100.0,
+            self.rate,
+            rate
+        );
+        self.rate = rate;
+        Some(rate)
+    }
+}
+
+// user and system time of all the threads of the agent
+fn agent_cpu_ns() -> u64 {
+    let mut usage: libc::rusage = unsafe { mem::zeroed() };
+    if unsafe { libc::getrusage(libc::RUSAGE_SELF, &mut usage) } != 0 {
+        return 0;
+    }
+    let ns = |t: libc::timeval| t.tv_sec as u64 * 1_000_000_000 + t.tv_usec as u64 * 1000;
+    ns(usage.ru_utime) + ns(usage.ru_stime)
+}
+
+// Tail calls run within the program that made them and are accounted to it.
+fn bpf_run_time_ns(prog_fds: &[RawFd]) -> u64 {
+    prog_fds.iter().filter_map(|fd| prog_run_stats(*fd)).map(|(ns, _)| ns).sum()
+}
+
+// Run time in nanoseconds and number of runs of a program since it was loaded.
+pub fn prog_run_stats(fd: RawFd) -> Option<(u64, u64)> {
+    let mut info: libbpf_sys::bpf_prog_info = unsafe { mem::zeroed() };
+    let mut len = mem::size_of::<libbpf_sys::bpf_prog_info>() as u32;
+    let ret = unsafe { libbpf_sys::bpf_obj_get_info_by_fd(fd, &mut info as *mut _ as *mut c_void, &mut len) };
+    if ret != 0 {
+        return None;
+    }
+    Some((info.run_time_ns, info.run_cnt))
+}
+
+// Run time stats stay enabled for every program of the host while the returned fd is open. Needs
+// 5.8+, older kernels only have the kernel.bpf_stats_enabled sysctl.
+pub fn enable_bpf_stats() -> Option<OwnedFd> {
+    let fd = unsafe { libbpf_sys::bpf_enable_stats(libbpf_sys::BPF_STATS_RUN_TIME) };
+    if fd < 0 {
+        info!("bpf run time stats not available: {}", -fd);
+        return None;
+    }
+    Some(unsafe { OwnedFd::from_raw_fd(fd) })
+}
+
+// Totals of a map_errors array of stacks.h over all cpus.
+pub fn read_map_errors(map: &Map) -> [u64; MAP_ERROR_MAX] {
+    let mut totals = [0u64; MAP_ERROR_MAX];
+    for (i, total) in totals.iter_mut().enumerate() {
+        let values = match map.lookup_percpu(&(i as u32).to_ne_bytes(), MapFlags::ANY) {
+            Ok(Some(values)) => values,
+            _ => continue,
+        };
+        *total = values
+            .iter()
+            .filter(|v| v.len() >= 8)
+            .map(|v| u64::from_ne_bytes(v[..8].try_into().unwrap()))
+            .sum();
+    }
+    totals
+}
+
+// The kernel counters only grow, the prometheus counters are increased by the difference to the
+// previous round.
+#[derive(Default)]
+pub struct CostTracker {
+    programs: HashMap<String, (u64, u64)>,
+    map_errors: HashMap<&'static str, u64>,
+}
+
+impl CostTracker {
+    pub fn record_program(&mut self, name: &str, fd: RawFd, metrics: &OverheadMetrics) {
+        let (ns, runs) = match prog_run_stats(fd) {
+            Some(stats) => stats,
+            None => return,
+        };
+        let last = self.programs.entry(name.to_string()).or_insert((0, 0));
+        metrics
+            .bpf_run_time
+            .with_label_values(&[name])
+            .inc_by(ns.saturating_sub(last.0) as f64 / 1e9);
+        metrics
+            .bpf_run_count
+            .with_label_values(&[name])
+            .inc_by(runs.saturating_sub(last.1) as f64);
+        *last = (ns, runs);
+    }
+
+    pub fn record_map_errors(&mut self, map: &'static str, total: u64, metrics: &OverheadMetrics) {
+        let last = self.map_errors.entry(map).or_insert(0);
+        if total > *last {
+            metrics.bpf_map_errors.with_label_values(&[map]).inc_by((total - *last) as f64);
+        }
+        *last = total;
+    }
+}
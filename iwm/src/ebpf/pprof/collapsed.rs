@@ -0,0 +1,409 @@
+use std::collections::HashMap;
+use std::fs::{self, File};
+use std::io::{self, BufReader, BufWriter, Read, Write};
+use std::path::{Path, PathBuf};
+use std::sync::Arc;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+
+use log::{error, info};
+
+use crate::common::collector::SampleType;
+use crate::common::labels::{Label, Labels};
+use crate::ebpf::pprof::{ProfileBuilder, ProfileBuilders};
+use crate::error::Error::{InvalidData, OSError};
+use crate::error::Result;
+
+// Collapsed profile files keep the profiles of every round as written by the builders, frames
+// and stacks straight from what they interned, no pprof encoding on the collection path.
+//
+// file    = "IWMC" version:u8 record*
+// record  = length:u32le kind:u8 payload            length counts kind and payload
+// frames  = count (string)*                         numbered on from the frames before them
+// profile = time_nanos sample_type:u8 period count (name value)* samples
+// samples = count (depth frame* value{1,2})*        allocations have two values
+// string  = length utf-8
+//
+// Numbers are LEB128 varints unless noted. Frame numbers are per file, so a file is read from its
+// start; a record cut short by a crash ends the file.
+const MAGIC: &[u8; 4] = b"IWMC";
+const VERSION: u8 = 1;
+const RECORD_FRAMES: u8 = 1;
+const RECORD_PROFILE: u8 = 2;
+const MAX_RECORD_SIZE: usize = 1 << 30;
+pub const FILE_EXTENSION: &str = "iwmc";
+
+#[derive(Debug, Clone)]
+pub struct CollapsedFileOptions {
+    pub dir: PathBuf,
+    // a new file is started once the current one is this large or old
+    pub max_file_size: u64,
+    pub max_file_age: Duration,
+    // the oldest files are removed past this many, 0 keeps them all
+    pub max_files: usize,
+}
+
+impl Default for CollapsedFileOptions {
+    fn default() -> Self {
+        Self {
+            dir: PathBuf::from("/var/lib/iwm/profiles"),
+            max_file_size: 64 << 20,
+            max_file_age: Duration::from_secs(3600),
+            max_files: 24,
+        }
+    }
+}
+
+pub struct CollapsedWriter {
+    options: CollapsedFileOptions,
+    file: Option<BufWriter<File>>,
+    opened: Instant,
+    written: u64,
+    // frame numbers of the current file
+    frames: HashMap<Arc<str>, u64>,
+    new_frames: Vec<Arc<str>>,
+    by_location: Vec<u64>,
+    buf: Vec<u8>,
+}
+
+impl CollapsedWriter {
+    pub fn new(options: CollapsedFileOptions) -> Result<Self> {
+        fs::create_dir_all(&options.dir).map_err(|e| OSError(format!("create {:?}: {}", options.dir, e)))?;
+        Ok(Self {
+            options,
+            file: None,
+            opened: Instant::now(),
+            written: 0,
+            frames: HashMap::new(),
+            new_frames: Vec::new(),
+            by_location: Vec::new(),
+            buf: Vec::with_capacity(64 * 1024),
+        })
+    }
+
+    // Appends the profiles of a round. A failed write drops the file, the next round starts a
+    // new one.
+    pub fn write_round(&mut self, builders: &ProfileBuilders) -> Result<()> {
+        if builders.builders.is_empty() {
+            return Ok(());
+        }
+        self.rotate()?;
+        let mut res = Ok(());
+        for (key, builder) in builders.builders.iter() {
+            res = self.write_profile(key.sample_type, builder);
+            if res.is_err() {
+                break;
+            }
+        }
+        if res.is_ok() {
+            res = self.file.as_mut().unwrap().flush().map_err(|e| OSError(e.to_string()));
+        }
+        if res.is_err() {
+            self.file = None;
+        }
+        res
+    }
+
+    fn rotate(&mut self) -> Result<()> {
+        if self.file.is_some()
+            && self.written < self.options.max_file_size
+            && self.opened.elapsed() < self.options.max_file_age
+        {
+            return Ok(());
+        }
+        self.file = None;
+        let now = SystemTime::now().duration_since(UNIX_EPOCH).unwrap_or_default();
+        // zero padded so the names sort by time
+        let path = self.options.dir.join(format!("profiles-{:020}.{}", now.as_millis(), FILE_EXTENSION));
+        let mut file = BufWriter::new(File::create(&path).map_err(|e| OSError(format!("create {:?}: {}", path, e)))?);
+        file.write_all(MAGIC).and_then(|_| file.write_all(&[VERSION])).map_err(|e| OSError(e.to_string()))?;
+        info!("collapsed profiles are written to {:?}", path);
+        self.file = Some(file);
+        self.opened = Instant::now();
+        self.written = MAGIC.len() as u64 + 1;
+        self.frames.clear();
+        self.remove_old_files();
+        Ok(())
+    }
+
+    fn remove_old_files(&self) {
+        if self.options.max_files == 0 {
+            return;
+        }
+        let mut files = list_files(&self.options.dir);
+        if files.len() <= self.options.max_files {
+            return;
+        }
+        let remove = files.len() - self.options.max_files;
+        for path in files.drain(..remove) {
+            if let Err(err) = fs::remove_file(&path) {
+                error!("remove {:?}: {}", path, err);
+            }
+        }
+    }
+
+    fn write_profile(&mut self, sample_type: SampleType, builder: &ProfileBuilder) -> Result<()> {
+        // location ids start at 1 and number the frames of the builder
+        self.by_location.clear();
+        self.by_location.resize(builder.locations.len() + 1, 0);
+        self.new_frames.clear();
+        for (frame, id) in builder.locations.iter() {
+            let n = match self.frames.get(frame) {
+                Some(n) => *n,
+                None => {
+                    let n = self.frames.len() as u64;
+                    self.frames.insert(frame.clone(), n);
+                    self.new_frames.push(frame.clone());
+                    n
+                }
+            };
+            self.by_location[*id as usize] = n;
+        }
+
+        if !self.new_frames.is_empty() {
+            self.buf.clear();
+            put_varint(&mut self.buf, self.new_frames.len() as u64);
+            for frame in self.new_frames.iter() {
+                put_str(&mut self.buf, frame);
+            }
+            self.append_record(RECORD_FRAMES)?;
+        }
+
+        let profile = &builder.pprof_builder.profile;
+        let buf = &mut self.buf;
+        buf.clear();
+        put_varint(buf, profile.time_nanos as u64);
+        buf.push(sample_type as u8);
+        put_varint(buf, profile.period as u64);
+        put_varint(buf, builder.labels.len() as u64);
+        for label in builder.labels.0.iter() {
+            put_str(buf, &label.name);
+            put_str(buf, &label.value);
+        }
+        put_varint(buf, profile.sample.len() as u64);
+        for sample in profile.sample.iter() {
+            put_varint(buf, sample.location_id.len() as u64);
+            for id in sample.location_id.iter() {
+                put_varint(buf, self.by_location[*id as usize]);
+            }
+            for v in sample.value.iter() {
+                put_varint(buf, *v as u64);
+            }
+        }
+        self.append_record(RECORD_PROFILE)
+    }
+
+    fn append_record(&mut self, kind: u8) -> Result<()> {
+        let file = self.file.as_mut().unwrap();
+        let len = (self.buf.len() + 1) as u32;
+        file.write_all(&len.to_le_bytes())
+            .and_then(|_| file.write_all(&[kind]))
+            .and_then(|_| file.write_all(&self.buf))
+            .map_err(|e| OSError(e.to_string()))?;
+        self.written += 4 + len as u64;
+        Ok(())
+    }
+}
+
+// The collapsed files of a directory, oldest first.
+pub fn list_files(dir: &Path) -> Vec<PathBuf> {
+    let mut files: Vec<PathBuf> = match fs::read_dir(dir) {
+        Ok(entries) => entries
+            .flatten()
+            .map(|e| e.path())
+            .filter(|p| p.extension().map_or(false, |ext| ext == FILE_EXTENSION))
+            .collect(),
+        Err(_) => Vec::new(),
+    };
+    files.sort();
+    files
+}
+
+#[derive(Debug, Clone)]
+pub struct CollapsedProfile {
+    pub time_nanos: i64,
+    pub sample_type: SampleType,
+    pub period: i64,
+    pub labels: Labels,
+    // stacks leaf first like ProfileSample, values as in the pprof samples
+    pub samples: Vec<(Vec<Arc<str>>, Vec<i64>)>,
+}
+
+impl CollapsedProfile {
+    pub fn to_pprof(&self) -> Vec<u8> {
+        let mut builder = ProfileBuilder::new(self.labels.clone(), self.sample_type, self.period, self.time_nanos);
+        for (stack, values) in self.samples.iter() {
+            builder.add_stack(stack, values);
+        }
+        let mut buf = Vec::new();
+        builder.write(&mut buf);
+        buf
+    }
+
+    // One "root;...;leaf value" line per stack, value picks one of the sample values.
+    pub fn write_folded<W: Write>(&self, w: &mut W, value: usize) -> io::Result<()> {
+        for (stack, values) in self.samples.iter() {
+            let mut first = true;
+            for frame in stack.iter().rev() {
+                if !first {
+                    w.write_all(b";")?;
+                }
+                first = false;
+                w.write_all(frame.as_bytes())?;
+            }
+            writeln!(w, " {}", values.get(value).copied().unwrap_or(0))?;
+        }
+        Ok(())
+    }
+}
+
+pub struct CollapsedReader<R: Read> {
+    r: R,
+    frames: Vec<Arc<str>>,
+    buf: Vec<u8>,
+}
+
+impl CollapsedReader<BufReader<File>> {
+    pub fn open(path: &Path) -> Result<Self> {
+        let file = File::open(path).map_err(|e| OSError(format!("open {:?}: {}", path, e)))?;
+        Self::new(BufReader::new(file))
+    }
+}
+
+impl<R: Read> CollapsedReader<R> {
+    pub fn new(mut r: R) -> Result<Self> {
+        let mut header = [0u8; 5];
+        r.read_exact(&mut header).map_err(|e| InvalidData(format!("collapsed header: {}", e)))?;
+        if &header[..4] != MAGIC {
+            return Err(InvalidData("not a collapsed profile file".to_string()));
+        }
+        if header[4] != VERSION {
+            return Err(InvalidData(format!("collapsed file version {}", header[4])));
+        }
+        Ok(Self { r, frames: Vec::new(), buf: Vec::new() })
+    }
+
+    // The next profile of the file, None past its last complete record.
+    pub fn next_profile(&mut self) -> Result<Option<CollapsedProfile>> {
+        loop {
+            let mut len = [0u8; 4];
+            if !self.read_full(&mut len)? {
+                return Ok(None);
+            }
+            let len = u32::from_le_bytes(len) as usize;
+            if len == 0 || len > MAX_RECORD_SIZE {
+                return Err(InvalidData(format!("collapsed record of {} bytes", len)));
+            }
+            let mut buf = std::mem::take(&mut self.buf);
+            buf.resize(len, 0);
+            if !self.read_full(&mut buf)? {
+                return Ok(None);
+            }
+            let mut data = &buf[1..];
+            let res = match buf[0] {
+                RECORD_FRAMES => self.read_frames(&mut data).map(|_| None),
+                RECORD_PROFILE => self.read_profile(&mut data).map(Some),
+                // written by a newer version
+                _ => Ok(None),
+            };
+            self.buf = buf;
+            if let Some(profile) = res? {
+                return Ok(Some(profile));
+            }
+        }
+    }
+
+    // false when the file ends before buf is filled
+    fn read_full(&mut self, buf: &mut [u8]) -> Result<bool> {
+        match self.r.read_exact(buf) {
+            Ok(()) => Ok(true),
+            Err(e) if e.kind() == io::ErrorKind::UnexpectedEof => Ok(false),
+            Err(e) => Err(OSError(e.to_string())),
+        }
+    }
+
+    fn read_frames(&mut self, data: &mut &[u8]) -> Result<()> {
+        let count = get_varint(data)?;
+        for _ in 0..count {
+            self.frames.push(Arc::from(get_str(data)?));
+        }
+        Ok(())
+    }
+
+    fn read_profile(&self, data: &mut &[u8]) -> Result<CollapsedProfile> {
+        let time_nanos = get_varint(data)? as i64;
+        let sample_type = match get_u8(data)? {
+            0 => SampleType::Cpu,
+            1 => SampleType::Mem,
+            2 => SampleType::OffCpu,
+            t => return Err(InvalidData(format!("collapsed sample type {}", t))),
+        };
+        let values = if sample_type == SampleType::Mem { 2 } else { 1 };
+        let period = get_varint(data)? as i64;
+        let mut labels = Vec::new();
+        for _ in 0..get_varint(data)? {
+            let name = get_str(data)?.to_string();
+            let value = get_str(data)?.to_string();
+            labels.push(Label::new(name, value));
+        }
+        let count = get_varint(data)? as usize;
+        let mut samples = Vec::with_capacity(count.min(data.len()));
+        for _ in 0..count {
+            let depth = get_varint(data)? as usize;
+            let mut stack = Vec::with_capacity(depth.min(data.len()));
+            for _ in 0..depth {
+                let n = get_varint(data)? as usize;
+                let frame = self.frames.get(n).ok_or_else(|| InvalidData(format!("collapsed frame {}", n)))?;
+                stack.push(frame.clone());
+            }
+            let mut v = Vec::with_capacity(values);
+            for _ in 0..values {
+                v.push(get_varint(data)? as i64);
+            }
+            samples.push((stack, v));
+        }
+        Ok(CollapsedProfile { time_nanos, sample_type, period, labels: Labels::new(labels), samples })
+    }
+}
+
+fn put_varint(buf: &mut Vec<u8>, mut v: u64) {
+    while v >= 0x80 {
+        buf.push((v as u8) | 0x80);
+        v >>= 7;
+    }
+    buf.push(v as u8);
+}
+
+fn put_str(buf: &mut Vec<u8>, s: &str) {
+    put_varint(buf, s.len() as u64);
+    buf.extend_from_slice(s.as_bytes());
+}
+
+fn get_u8(data: &mut &[u8]) -> Result<u8> {
+    let d: &[u8] = *data;
+    let (b, rest) = d.split_first().ok_or_else(|| InvalidData("collapsed record too short".to_string()))?;
+    *data = rest;
+    Ok(*b)
+}
+
+fn get_varint(data: &mut &[u8]) -> Result<u64> {
+    let mut v = 0u64;
+    for shift in (0..64).step_by(7) {
+        let b = get_u8(data)?;
+        v |= ((b & 0x7f) as u64) << shift;
+        if b & 0x80 == 0 {
+            return Ok(v);
+        }
+    }
+    Err(InvalidData("collapsed varint too long".to_string()))
+}
+
+fn get_str<'a>(data: &mut &'a [u8]) -> Result<&'a str> {
+    let len = get_varint(data)? as usize;
+    if len > data.len() {
+        return Err(InvalidData("collapsed record too short".to_string()));
+    }
+    let d: &'a [u8] = *data;
+    let (s, rest) = d.split_at(len);
+    *data = rest;
+    std::str::from_utf8(s).map_err(|e| InvalidData(e.to_string()))
+}
@@ -1,7 +1,9 @@
 
+use std::collections::hash_map::DefaultHasher;
 use std::collections::HashMap;
 use std::hash::{Hash, Hasher};
-use std::io::Write;
+use std::mem;
+use std::sync::Arc;
 use std::time::{Duration, SystemTime, UNIX_EPOCH};
 
 
@@ -10,8 +12,9 @@ use prost::Message;
 
 use profile::{Function, Location, ValueType, Sample, Line};
 
-use crate::common::collector::{ProfileSample, SAMPLE_TYPE_CPU, SampleType};
+use crate::common::collector::{ProfileSample, SampleType};
 use crate::common::labels::Labels;
+use crate::ebpf::sd::target::{METRIC_NAME, MEMORY_METRIC_VALUE, METRIC_VALUE, OFF_CPU_METRIC_VALUE};
 use crate::ebpf::pprof::pprof::PProfBuilder;
 use crate::ebpf::pprof::profile::Mapping;
 
@@ -19,11 +22,14 @@ pub mod profile {
     include!("../../gen/profile/profile.v1.rs");
 }
 pub mod pprof;
+pub mod collapsed;
 
 #[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
 pub struct BuildersOptions {
     pub sample_rate: i64,
     pub per_pid_profile: bool,
+    // the bytes one allocation sample stands for, as configured in the session
+    pub alloc_sample_bytes: u64,
 }
 
 #[derive(Debug, Copy, Clone, PartialEq, Eq, Hash)]
@@ -46,13 +52,13 @@ impl ProfileBuilders {
         }
     }
 
-    pub(crate) fn add_sample(&mut self, sample: ProfileSample) {
+    pub fn add_sample(&mut self, sample: ProfileSample) {
         let bb = self.builder_for_sample(&sample);
         bb.create_sample(sample);
     }
 
     fn builder_for_sample(&mut self, sample: &ProfileSample) -> &mut ProfileBuilder {
-        let (labels_hash, labels) = sample.target.clone().labels();
+        let (labels_hash, mut labels) = sample.target.clone().labels();
 
         let mut k = BuilderHashKey {
             labels_hash,
@@ -63,66 +69,46 @@ impl ProfileBuilders {
             k.pid = sample.pid;
         }
 
+        let sample_type = sample.sample_type;
+        let sample_rate = self.opt.sample_rate;
+        let alloc_sample_bytes = self.opt.alloc_sample_bytes as i64;
         self.builders.entry(k).or_insert_with(|| {
-            let mut b = PProfBuilder::default();
-            let mut from_b = |s: &str| { b.add_string(&s.to_string()) };
-            let (sample_type, period_type, period) = {
-                if sample.sample_type == SAMPLE_TYPE_CPU {
-                    (
-                        vec![ValueType { r#type: from_b("cpu"), unit: from_b("nanoseconds") }],
-                        ValueType { r#type: from_b("cpu"), unit: from_b("nanoseconds") },
-                        (Duration::from_secs(1).as_nanos() as i64) / self.opt.sample_rate,
-                    )
-                } else {
-                    (
-                        vec![
-                            ValueType { r#type: from_b("alloc_objects"), unit: from_b("count") },
-                            ValueType { r#type: from_b("alloc_space"), unit: from_b("bytes"), },
-                        ],
-                        ValueType { r#type: from_b("space"), unit: from_b("bytes") },
-                        512 * 1024,
-                    )
-                }
+            let period = match sample_type {
+                SampleType::Cpu => (Duration::from_secs(1).as_nanos() as i64) / sample_rate,
+                // values are already nanoseconds
+                SampleType::OffCpu => 1,
+                SampleType::Mem => alloc_sample_bytes,
+            };
+            // off-cpu and allocation profiles of a target are series of their own
+            let metric = match sample_type {
+                SampleType::Cpu => None,
+                SampleType::OffCpu => Some(OFF_CPU_METRIC_VALUE),
+                SampleType::Mem => Some(MEMORY_METRIC_VALUE),
             };
-            b.profile.mapping = vec!(Mapping{
-                id: 1,
-                memory_start: 0,
-                memory_limit: 0,
-                file_offset: 0,
-                filename: 0,
-                build_id: 0,
-                has_functions: false,
-                has_filenames: false,
-                has_line_numbers: false,
-                has_inline_frames: false,
-            });
-            b.profile.sample_type = sample_type;
-            b.profile.time_nanos = SystemTime::now()
+            if let Some(metric) = metric {
+                if labels.get(METRIC_NAME).map_or(false, |v| v == METRIC_VALUE) {
+                    labels.set(METRIC_NAME, metric);
+                }
+            }
+            let time_nanos = SystemTime::now()
                 .duration_since(UNIX_EPOCH)
                 .expect("Time went backwards")
                 .as_nanos() as i64;
-            b.profile.period = period;
-            b.profile.period_type = Some(period_type);
-
-            ProfileBuilder {
-                labels: labels.clone(),
-                tmp_location_ids: Vec::with_capacity(128),
-                tmp_locations: Vec::with_capacity(128),
-                pprof_builder: b,
-                ..Default::default()
-            }
+            ProfileBuilder::new(labels.clone(), sample_type, period, time_nanos)
         })
     }
 }
 
+// Frames are keyed by the Arc<str> shared across the round and samples by the hash of their
+// location ids, so a sample whose stack was seen before allocates nothing.
 #[derive(Clone)]
 pub struct ProfileBuilder {
-    pub locations: HashMap<String, Location>,
-    pub functions: HashMap<String, Function>,
-    pub sample_hash_to_sample: HashMap<u64, Sample>,
+    // every frame has one function and one location, both with this id
+    pub locations: HashMap<Arc<str>, u64>,
+    // index in profile.sample
+    pub sample_hash_to_sample: HashMap<u64, usize>,
     pub labels: Labels,
 
-    pub tmp_locations: Vec<Location>,
     pub tmp_location_ids: Vec<u64>,
 
     pub pprof_builder: PProfBuilder
@@ -132,10 +118,8 @@ impl Default for ProfileBuilder {
     fn default() -> Self {
         Self {
             locations: HashMap::new(),
-            functions: HashMap::new(),
             sample_hash_to_sample: HashMap::new(),
             labels: Labels(vec![]),
-            tmp_locations: vec![],
             tmp_location_ids: vec![],
             pprof_builder: Default::default(),
         }
@@ -143,86 +127,146 @@ impl Default for ProfileBuilder {
 }
 
 impl ProfileBuilder {
-
-    fn create_sample(&mut self, input_sample: ProfileSample) {
-        // info!("{:?}", input_sample);
-        let mut sample = Sample {
-            value: if input_sample.sample_type == SampleType::Cpu { vec![0] } else { vec![0, 0] },
-            location_id: Vec::new(),
-            label: vec![],
+    // An empty profile of one sample type, period is what a cpu sample value is multiplied by.
+    pub fn new(labels: Labels, sample_type: SampleType, period: i64, time_nanos: i64) -> Self {
+        let mut b = PProfBuilder::default();
+        let mut from_b = |s: &str| { b.add_string(&s.to_string()) };
+        let (sample_types, period_type) = match sample_type {
+            SampleType::Cpu => (
+                vec![ValueType { r#type: from_b("cpu"), unit: from_b("nanoseconds") }],
+                ValueType { r#type: from_b("cpu"), unit: from_b("nanoseconds") },
+            ),
+            SampleType::OffCpu => (
+                vec![ValueType { r#type: from_b("off_cpu"), unit: from_b("nanoseconds") }],
+                ValueType { r#type: from_b("off_cpu"), unit: from_b("nanoseconds") },
+            ),
+            SampleType::Mem => (
+                vec![
+                    ValueType { r#type: from_b("alloc_objects"), unit: from_b("count") },
+                    ValueType { r#type: from_b("alloc_space"), unit: from_b("bytes"), },
+                ],
+                ValueType { r#type: from_b("space"), unit: from_b("bytes") },
+            ),
         };
-        self.add_value(&input_sample, &mut sample);
-        for s in input_sample.stack {
-            sample.location_id.push(self.add_location(s.as_str()).id);
+        b.profile.mapping = vec!(Mapping{
+            id: 1,
+            memory_start: 0,
+            memory_limit: 0,
+            file_offset: 0,
+            filename: 0,
+            build_id: 0,
+            has_functions: false,
+            has_filenames: false,
+            has_line_numbers: false,
+            has_inline_frames: false,
+        });
+        b.profile.sample_type = sample_types;
+        b.profile.time_nanos = time_nanos;
+        b.profile.period = period;
+        b.profile.period_type = Some(period_type);
+
+        ProfileBuilder {
+            labels,
+            tmp_location_ids: Vec::with_capacity(128),
+            pprof_builder: b,
+            ..Default::default()
         }
-        self.pprof_builder.profile.sample.push(sample);
     }
 
-    fn add_value(&mut self, input_sample: &ProfileSample, sample: &mut Sample) {
-        if input_sample.sample_type == SampleType::Cpu {
-            sample.value[0] += (input_sample.value as i64) * self.pprof_builder.profile.period;
-        } else {
-            sample.value[0] += input_sample.value as i64;
-            sample.value[1] += input_sample.value2 as i64;
-        }
+    fn create_sample(&mut self, input_sample: ProfileSample) {
+        let values = if input_sample.sample_type == SampleType::Mem { 2 } else { 1 };
+        let index = self.sample_index(input_sample.stack, values);
+        self.add_value(&input_sample, index);
     }
 
-    fn new_sample(&self, input_sample: &ProfileSample) -> Sample {
-        let mut sample = Sample::default();
-        if input_sample.sample_type == SampleType::Cpu {
-            sample.value = vec![0];
-        } else {
-            sample.value = vec![0, 0];
+    // Adds values as they are found in the pprof samples, cpu ones already multiplied by the period.
+    pub fn add_stack(&mut self, stack: &[Arc<str>], values: &[i64]) {
+        let index = self.sample_index(stack, values.len());
+        let sample = &mut self.pprof_builder.profile.sample[index];
+        for (v, add) in sample.value.iter_mut().zip(values) {
+            *v += add;
         }
-        sample.location_id = vec![0; input_sample.stack.len()];
-        sample
     }
 
-    fn add_location(&mut self, function: &str) -> Location {
-        if let Some(loc) = self.locations.get(function) {
-            return loc.clone();
+    fn sample_index(&mut self, stack: &[Arc<str>], values: usize) -> usize {
+        let mut ids = mem::take(&mut self.tmp_location_ids);
+        ids.clear();
+        for s in stack {
+            ids.push(self.add_location(s));
         }
+        let mut hasher = DefaultHasher::new();
+        ids.hash(&mut hasher);
+        let hash = hasher.finish();
 
-        let id = (self.pprof_builder.profile.location.len() + 1) as u64;
-        //dbg!(&self.profile);
-        let loc = Location {
-            id,
-            mapping_id: 0,
-            line: vec![Line {
-                function_id: self.add_function(function).id,
-                ..Default::default()
-            }].into(),
-            ..Default::default()
+        let samples = &self.pprof_builder.profile.sample;
+        let index = match self.sample_hash_to_sample.get(&hash) {
+            Some(&i) if samples[i].location_id == ids => i,
+            // a colliding stack keeps a sample of its own
+            Some(_) => self.push_sample(values, &ids),
+            None => {
+                let i = self.push_sample(values, &ids);
+                self.sample_hash_to_sample.insert(hash, i);
+                i
+            }
         };
+        self.tmp_location_ids = ids;
+        index
+    }
 
-        self.locations.insert(function.to_string(), loc.clone());
-        self.pprof_builder.profile.location.push(loc.clone());
-        loc
+    fn push_sample(&mut self, values: usize, location_ids: &[u64]) -> usize {
+        let samples = &mut self.pprof_builder.profile.sample;
+        samples.push(Sample {
+            value: vec![0; values],
+            location_id: location_ids.to_vec(),
+            label: vec![],
+        });
+        samples.len() - 1
     }
 
-    fn add_function(&mut self, function: &str) -> Function {
-        if let Some(func) = self.functions.get(function) {
-            return func.clone();
+    fn add_value(&mut self, input_sample: &ProfileSample, index: usize) {
+        let period = self.pprof_builder.profile.period;
+        let sample = &mut self.pprof_builder.profile.sample[index];
+        match input_sample.sample_type {
+            SampleType::Cpu => sample.value[0] += (input_sample.value as i64) * period,
+            SampleType::OffCpu => sample.value[0] += input_sample.value as i64,
+            SampleType::Mem => {
+                sample.value[0] += input_sample.value as i64;
+                sample.value[1] += input_sample.value2 as i64;
+            }
         }
-        let id = (self.pprof_builder.profile.function.len() + 1) as u64;
+    }
 
-        let f = function.to_string();
-        let n = self.pprof_builder.add_string(&f);
-        let func = Function {
+    fn add_location(&mut self, function: &Arc<str>) -> u64 {
+        if let Some(id) = self.locations.get(function) {
+            return *id;
+        }
+
+        let id = (self.pprof_builder.profile.location.len() + 1) as u64;
+        let name = self.pprof_builder.add_string(function);
+        self.pprof_builder.profile.function.push(Function {
             id,
-            name: n,
+            name,
             system_name: 0,
             filename: 0,
             start_line: 0
-        };
-        self.functions.insert(function.to_string(), func.clone());
-        self.pprof_builder.profile.function.push(func.clone());
-        func
+        });
+        self.pprof_builder.profile.location.push(Location {
+            id,
+            mapping_id: 0,
+            line: vec![Line {
+                function_id: id,
+                ..Default::default()
+            }],
+            ..Default::default()
+        });
+        self.locations.insert(function.clone(), id);
+        id
     }
 
-    pub fn write(&self, dst: &mut dyn Write) {
-        //info!("{:?}", &self.pprof_builder.profile);
-        let data = self.pprof_builder.profile.encode_to_vec();
-        dst.write(data.as_slice()).unwrap();
+    // Encodes straight into dst, sized once up front.
+    pub fn write(&self, dst: &mut Vec<u8>) {
+        let profile = &self.pprof_builder.profile;
+        dst.reserve(profile.encoded_len());
+        profile.encode(dst).unwrap();
     }
 }
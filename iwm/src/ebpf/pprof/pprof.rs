@@ -34,7 +34,7 @@ pub struct FunctionMirror {
 }
 
 impl PProfBuilder {
-    pub fn add_string(&mut self, s: &String) -> i64 {
+    pub fn add_string(&mut self, s: &str) -> i64 {
         let v = self.strings.get(s);
         if let Some(v) = v {
             return *v;
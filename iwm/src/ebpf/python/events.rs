@@ -0,0 +1,114 @@
+use std::collections::HashMap;
+use std::mem;
+use std::sync::{Arc, Mutex};
+
+use log::error;
+
+use crate::ebpf::metrics::python::PythonMetrics;
+use crate::ebpf::python::symbols::PySymbolID;
+use crate::ebpf::ring::reader::EventsReader;
+
+// must match py_event in pyperf.bpf.c
+pub const STACK_STATUS_COMPLETE: u8 = 0;
+pub const STACK_STATUS_ERROR: u8 = 1;
+pub const STACK_STATUS_TRUNCATED: u8 = 2;
+// offsetof(py_event, stack_len), error samples end there
+const PY_EVENT_ERROR_SIZE: usize = 24;
+// offsetof(py_event, stack)
+const PY_EVENT_HEADER_SIZE: usize = 28;
+
+#[derive(Debug)]
+pub struct PyEvent {
+    pub stack_status: u8,
+    pub err: u8,
+    pub pid: u32,
+    pub kern_stack: i64,
+    pub user_stack: i64,
+    // leaf first
+    pub stack: Vec<PySymbolID>,
+}
+
+pub fn decode_py_event(raw: &[u8]) -> Option<PyEvent> {
+    if raw.len() < PY_EVENT_ERROR_SIZE {
+        return None;
+    }
+    let mut event = PyEvent {
+        stack_status: raw[0],
+        err: raw[1],
+        pid: u32::from_ne_bytes(raw[4..8].try_into().unwrap()),
+        kern_stack: i64::from_ne_bytes(raw[8..16].try_into().unwrap()),
+        user_stack: i64::from_ne_bytes(raw[16..24].try_into().unwrap()),
+        stack: Vec::new(),
+    };
+    if event.stack_status == STACK_STATUS_ERROR || raw.len() < PY_EVENT_HEADER_SIZE {
+        return Some(event);
+    }
+    let len = u32::from_ne_bytes(raw[24..28].try_into().unwrap()) as usize;
+    let available = (raw.len() - PY_EVENT_HEADER_SIZE) / mem::size_of::<PySymbolID>();
+    event.stack = raw[PY_EVENT_HEADER_SIZE..]
+        .chunks_exact(mem::size_of::<PySymbolID>())
+        .take(len.min(available))
+        .map(|c| PySymbolID::from_ne_bytes(c.try_into().unwrap()))
+        .collect();
+    Some(event)
+}
+
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
+pub struct PyStackKey {
+    pub pid: u32,
+    pub kern_stack: i64,
+    pub user_stack: i64,
+    pub stack: Vec<PySymbolID>,
+}
+
+// py_events carry one sample each, they are counted here until the next collection.
+pub type PySamples = HashMap<PyStackKey, u64>;
+
+// Reads py_events on its own thread so the session mutex is never held while waiting on the
+// buffer, only the samples map is shared with the session.
+pub struct PyEventsConsumer {
+    pub(crate) reader: EventsReader,
+    pub(crate) samples: Arc<Mutex<PySamples>>,
+    pub(crate) metrics: PythonMetrics,
+}
+
+impl PyEventsConsumer {
+    pub fn run(&mut self) {
+        let mut events = Vec::new();
+        loop {
+            let record = match self.reader.read_events() {
+                Ok(record) => record,
+                Err(err) => {
+                    error!("reading python events: {}", err);
+                    continue;
+                }
+            };
+            if record.lost_samples != 0 {
+                self.metrics.lost_samples.inc_by(record.lost_samples as f64);
+            }
+            events.clear();
+            for raw in record.raw_samples.iter() {
+                match decode_py_event(raw) {
+                    Some(e) if e.stack_status == STACK_STATUS_ERROR => {
+                        self.metrics.stacktrace_error.inc();
+                    }
+                    Some(e) => events.push(e),
+                    None => error!("python event too small: {}", raw.len()),
+                }
+            }
+            if events.is_empty() {
+                continue;
+            }
+            let mut samples = self.samples.lock().unwrap();
+            for e in events.drain(..) {
+                let key = PyStackKey {
+                    pid: e.pid,
+                    kern_stack: e.kern_stack,
+                    user_stack: e.user_stack,
+                    stack: e.stack,
+                };
+                *samples.entry(key).or_insert(0) += 1;
+            }
+        }
+    }
+}
@@ -0,0 +1,6 @@
+pub mod events;
+pub mod offsets;
+pub mod procinfo;
+pub mod pyperf;
+pub mod stack;
+pub mod symbols;
@@ -0,0 +1,198 @@
+use std::path::Path;
+
+use crate::ebpf::dwarfdump::dwarfdump::{dump, Index, Need};
+use crate::error::Error::NotFound;
+use crate::error::Result;
+
+// Mirrors of pyoffsets.h and py_pid_data in pyperf.bpf.c
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct PyOffsetConfig {
+    pub py_thread_state_frame: i16,
+    pub py_thread_state_cframe: i16,
+    pub py_cframe_current_frame: i16,
+    pub py_code_object_co_filename: i16,
+    pub py_code_object_co_name: i16,
+    pub py_code_object_co_varnames: i16,
+    pub py_code_object_co_localsplusnames: i16,
+    pub py_tuple_object_ob_item: i16,
+    pub py_var_object_ob_size: i16,
+    pub py_object_ob_type: i16,
+    pub py_type_object_tp_name: i16,
+    pub vframe_code: i16,
+    pub vframe_previous: i16,
+    pub vframe_localsplus: i16,
+    pub py_interpreter_frame_owner: i16,
+    pub py_ascii_object_size: i16,
+    pub py_compact_unicode_object_size: i16,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone, PartialEq, Eq, Hash)]
+pub struct PyVersion {
+    pub major: u32,
+    pub minor: u32,
+    pub patch: u32,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct Libc {
+    pub musl: bool,
+    pub pthread_size: i16,
+    // tsd for musl, specific_1stblock for glibc
+    pub pthread_specific1stblock: i16,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct PyPidData {
+    pub offsets: PyOffsetConfig,
+    pub version: PyVersion,
+    pub libc: Libc,
+    pub tss_key: i32,
+    pub collect_user: u8,
+    pub collect_kernel: u8,
+    pub padding: [u8; 2],
+}
+
+impl PyPidData {
+    pub fn as_bytes(&self) -> &[u8] {
+        unsafe {
+            std::slice::from_raw_parts(
+                (self as *const PyPidData) as *const u8,
+                std::mem::size_of::<PyPidData>(),
+            )
+        }
+    }
+}
+
+// Offsets of _PyRuntime.<..>.autoTSSkey._key, the pthread key of the current PyThreadState.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct PyRuntimeOffsets {
+    pub auto_tss_key: i64,
+    pub tss_key: i64,
+}
+
+const PYTHON_NEEDS: &[Need] = &[
+    Need { name: "_ts", fields: &["frame", "cframe", "current_frame"] },
+    Need { name: "_PyCFrame", fields: &["current_frame"] },
+    Need { name: "PyCodeObject", fields: &["co_filename", "co_name", "co_varnames", "co_localsplusnames"] },
+    Need { name: "PyTupleObject", fields: &["ob_item"] },
+    Need { name: "PyVarObject", fields: &["ob_size"] },
+    Need { name: "_object", fields: &["ob_type"] },
+    Need { name: "_typeobject", fields: &["tp_name"] },
+    Need { name: "_frame", fields: &["f_code", "f_back", "f_localsplus"] },
+    Need { name: "_PyInterpreterFrame", fields: &["f_code", "f_executable", "previous", "localsplus", "owner"] },
+    Need { name: "PyASCIIObject", fields: &[] },
+    Need { name: "PyCompactUnicodeObject", fields: &[] },
+    Need { name: "pyruntimestate", fields: &["gilstate", "autoTSSkey"] },
+    Need { name: "_gilstate_runtime_state", fields: &["autoTSSkey"] },
+    Need { name: "_Py_tss_t", fields: &["_key"] },
+];
+
+fn field(index: &Index, typ: &str, name: &str) -> i64 {
+    index.get(typ).map(|t| t.field(name)).unwrap_or(-1)
+}
+
+fn size(index: &Index, typ: &str) -> i64 {
+    index.get(typ).map(|t| t.size).filter(|s| *s > 0).unwrap_or(-1)
+}
+
+// Reads the offsets pyperf needs from the DWARF of libpython or the python executable.
+pub fn python_offsets(elf: &Path, version: &PyVersion) -> Result<(PyOffsetConfig, PyRuntimeOffsets)> {
+    let index = dump(elf, PYTHON_NEEDS)?;
+    for required in ["_ts", "PyCodeObject", "_object", "_typeobject", "pyruntimestate", "_Py_tss_t"] {
+        if !index.contains_key(required) {
+            return Err(NotFound(format!("{:?}: no {} in debug info", elf, required)));
+        }
+    }
+    let py311 = (version.major, version.minor) >= (3, 11);
+    let py313 = (version.major, version.minor) >= (3, 13);
+    let (thread_state_frame, thread_state_cframe) = if py313 {
+        (field(&index, "_ts", "current_frame"), -1)
+    } else if py311 {
+        (-1, field(&index, "_ts", "cframe"))
+    } else {
+        (field(&index, "_ts", "frame"), -1)
+    };
+    let (vframe, code, previous, localsplus) = if py311 {
+        let code = if py313 { "f_executable" } else { "f_code" };
+        ("_PyInterpreterFrame", code, "previous", "localsplus")
+    } else {
+        ("_frame", "f_code", "f_back", "f_localsplus")
+    };
+    let offsets = PyOffsetConfig {
+        py_thread_state_frame: thread_state_frame as i16,
+        py_thread_state_cframe: thread_state_cframe as i16,
+        py_cframe_current_frame: field(&index, "_PyCFrame", "current_frame") as i16,
+        py_code_object_co_filename: field(&index, "PyCodeObject", "co_filename") as i16,
+        py_code_object_co_name: field(&index, "PyCodeObject", "co_name") as i16,
+        py_code_object_co_varnames: field(&index, "PyCodeObject", "co_varnames") as i16,
+        py_code_object_co_localsplusnames: field(&index, "PyCodeObject", "co_localsplusnames") as i16,
+        py_tuple_object_ob_item: field(&index, "PyTupleObject", "ob_item") as i16,
+        py_var_object_ob_size: field(&index, "PyVarObject", "ob_size") as i16,
+        py_object_ob_type: field(&index, "_object", "ob_type") as i16,
+        py_type_object_tp_name: field(&index, "_typeobject", "tp_name") as i16,
+        vframe_code: field(&index, vframe, code) as i16,
+        vframe_previous: field(&index, vframe, previous) as i16,
+        vframe_localsplus: field(&index, vframe, localsplus) as i16,
+        py_interpreter_frame_owner: if py311 { field(&index, "_PyInterpreterFrame", "owner") as i16 } else { -1 },
+        py_ascii_object_size: size(&index, "PyASCIIObject") as i16,
+        py_compact_unicode_object_size: size(&index, "PyCompactUnicodeObject") as i16,
+    };
+    if offsets.vframe_code < 0 || offsets.vframe_previous < 0 || offsets.py_code_object_co_name < 0 {
+        return Err(NotFound(format!("{:?}: incomplete frame offsets {:?}", elf, offsets)));
+    }
+
+    // 3.12 moved autoTSSkey from _PyRuntime.gilstate to _PyRuntime
+    let mut auto_tss_key = field(&index, "pyruntimestate", "autoTSSkey");
+    if auto_tss_key < 0 {
+        let gilstate = field(&index, "pyruntimestate", "gilstate");
+        let key = field(&index, "_gilstate_runtime_state", "autoTSSkey");
+        if gilstate < 0 || key < 0 {
+            return Err(NotFound(format!("{:?}: autoTSSkey not found", elf)));
+        }
+        auto_tss_key = gilstate + key;
+    }
+    let runtime = PyRuntimeOffsets {
+        auto_tss_key,
+        tss_key: field(&index, "_Py_tss_t", "_key"),
+    };
+    Ok((offsets, runtime))
+}
+
+// struct pthread offsets of musl and glibc, see pthread_amd64.h / pthread_arm64.h
+pub fn libc_offsets(elf: &Path, musl: bool) -> Result<Libc> {
+    let needs = [Need { name: "pthread", fields: &["specific_1stblock", "tsd"] }];
+    if let Ok(index) = dump(elf, &needs) {
+        let field_name = if musl { "tsd" } else { "specific_1stblock" };
+        let offset = field(&index, "pthread", field_name);
+        if offset >= 0 {
+            return Ok(Libc {
+                musl,
+                pthread_size: size(&index, "pthread") as i16,
+                pthread_specific1stblock: offset as i16,
+            });
+        }
+    }
+    default_libc_offsets(musl).ok_or_else(|| NotFound(format!("{:?}: struct pthread offsets not found", elf)))
+}
+
+// Release libcs are stripped; these layouts have been stable for years on x86_64
+// (glibc 2.17+ specific_1stblock, musl 1.2 tsd). On x86_64 the thread pointer is the struct
+// pthread itself, so its size is not needed.
+#[cfg(target_arch = "x86_64")]
+fn default_libc_offsets(musl: bool) -> Option<Libc> {
+    Some(Libc {
+        musl,
+        pthread_size: 0,
+        pthread_specific1stblock: if musl { 0x80 } else { 0x310 },
+    })
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn default_libc_offsets(_musl: bool) -> Option<Libc> {
+    None
+}
@@ -0,0 +1,191 @@
+use std::fs;
+use std::os::unix::fs::FileExt;
+use std::path::{Path, PathBuf};
+
+use memmap2::Mmap;
+use object::{Object, ObjectSegment, ObjectSymbol};
+
+use crate::ebpf::python::offsets::PyVersion;
+use crate::ebpf::symtab::proc::parse_proc_maps_executable_modules;
+use crate::ebpf::symtab::procmap::ProcMap;
+use crate::error::Error::{ELFError, NotFound, ProcError};
+use crate::error::Result;
+
+lazy_static::lazy_static! {
+    static ref PYTHON_RE: regex::Regex =
+        regex::Regex::new(r"/(?:lib)?python(\d)\.(\d+)(?:[a-z]*)(?:\.so[.\d]*)?$").unwrap();
+    static ref MUSL_RE: regex::Regex = regex::Regex::new(r"/ld-musl-[^/]+\.so[.\d]*$").unwrap();
+    static ref GLIBC_RE: regex::Regex = regex::Regex::new(r"/libc(?:-[\d.]+)?\.so[.\d]*$").unwrap();
+}
+
+// A file mapped into the process, with the address it is loaded at.
+#[derive(Debug, Clone)]
+pub struct MappedElf {
+    // path inside the process mount namespace, as in /proc/pid/maps
+    pub path: String,
+    // the same file seen from the agent, through /proc/pid/root
+    pub host_path: PathBuf,
+    pub dev: u64,
+    pub inode: u64,
+    pub start: u64,
+}
+
+#[derive(Debug, Clone)]
+pub struct PyProcInfo {
+    pub version: PyVersion,
+    // libpython if the interpreter is linked dynamically, the python executable otherwise
+    pub python: MappedElf,
+    pub libc: MappedElf,
+    pub musl: bool,
+}
+
+pub fn get_py_proc_info(pid: u32) -> Result<PyProcInfo> {
+    let maps = fs::read_to_string(format!("/proc/{}/maps", pid))
+        .map_err(|e| ProcError(format!("read maps of {}: {}", pid, e)))?;
+    let maps = parse_proc_maps_executable_modules(&maps, false)?;
+    let root = PathBuf::from(format!("/proc/{}/root", pid));
+
+    let mut python: Option<(MappedElf, PyVersion)> = None;
+    let mut libc: Option<(MappedElf, bool)> = None;
+    for m in maps.iter().filter(|m| m.offset == 0 && m.pathname.starts_with('/')) {
+        if let Some(c) = PYTHON_RE.captures(&m.pathname) {
+            let version = PyVersion {
+                major: c[1].parse().unwrap_or(0),
+                minor: c[2].parse().unwrap_or(0),
+                patch: 0,
+            };
+            // prefer libpython over the executable, which is then only a small launcher
+            let is_lib = m.pathname.contains("libpython");
+            if python.is_none() || is_lib {
+                python = Some((mapped_elf(&root, m), version));
+            }
+        } else if MUSL_RE.is_match(&m.pathname) {
+            libc = Some((mapped_elf(&root, m), true));
+        } else if libc.is_none() && GLIBC_RE.is_match(&m.pathname) {
+            libc = Some((mapped_elf(&root, m), false));
+        }
+    }
+    let (python, version) = python.ok_or_else(|| NotFound(format!("no python mapped in {}", pid)))?;
+    if version.major != 3 || version.minor < 6 {
+        return Err(NotFound(format!("unsupported python version {:?}", version)));
+    }
+    let (libc, musl) = libc.ok_or_else(|| NotFound(format!("no libc mapped in {}", pid)))?;
+    Ok(PyProcInfo { version, python, libc, musl })
+}
+
+// The libc mapped by the process and whether it is musl.
+pub fn get_libc(pid: u32) -> Result<(MappedElf, bool)> {
+    let maps = fs::read_to_string(format!("/proc/{}/maps", pid))
+        .map_err(|e| ProcError(format!("read maps of {}: {}", pid, e)))?;
+    let maps = parse_proc_maps_executable_modules(&maps, false)?;
+    let root = PathBuf::from(format!("/proc/{}/root", pid));
+    let mut libc: Option<(MappedElf, bool)> = None;
+    for m in maps.iter().filter(|m| m.offset == 0 && m.pathname.starts_with('/')) {
+        if MUSL_RE.is_match(&m.pathname) {
+            libc = Some((mapped_elf(&root, m), true));
+        } else if libc.is_none() && GLIBC_RE.is_match(&m.pathname) {
+            libc = Some((mapped_elf(&root, m), false));
+        }
+    }
+    libc.ok_or_else(|| NotFound(format!("no libc mapped in {}", pid)))
+}
+
+fn mapped_elf(root: &Path, m: &ProcMap) -> MappedElf {
+    MappedElf {
+        path: m.pathname.clone(),
+        host_path: root.join(m.pathname.trim_start_matches('/')),
+        dev: m.dev,
+        inode: m.inode,
+        start: m.start_addr,
+    }
+}
+
+// The file holding the DWARF of an ELF: itself when not stripped, otherwise the separate debug
+// file found by build id under /usr/lib/debug of the same mount namespace.
+pub fn debug_file(pid: u32, elf: &MappedElf) -> Option<PathBuf> {
+    let data = fs::read(&elf.host_path).ok()?;
+    let file = object::File::parse(&*data).ok()?;
+    if file.section_by_name(".debug_info").is_some() {
+        return Some(elf.host_path.clone());
+    }
+    let build_id = file.build_id().ok()??;
+    if build_id.len() < 2 {
+        return None;
+    }
+    let hex: String = build_id.iter().map(|b| format!("{:02x}", b)).collect();
+    let path = PathBuf::from(format!(
+        "/proc/{}/root/usr/lib/debug/.build-id/{}/{}.debug",
+        pid,
+        &hex[..2],
+        &hex[2..]
+    ));
+    if path.exists() {
+        Some(path)
+    } else {
+        None
+    }
+}
+
+// Runtime address of a symbol of a mapped ELF.
+pub fn symbol_address(elf: &MappedElf, name: &str) -> Result<u64> {
+    let data = fs::read(&elf.host_path).map_err(|e| ELFError(format!("{:?}: {}", elf.host_path, e)))?;
+    let file = object::File::parse(&*data).map_err(|e| ELFError(format!("{:?}: {}", elf.host_path, e)))?;
+    let sym = file
+        .dynamic_symbols()
+        .chain(file.symbols())
+        .find(|s| s.name().map(|n| n == name).unwrap_or(false))
+        .ok_or_else(|| NotFound(format!("{} not found in {:?}", name, elf.host_path)))?;
+    // the mapping at offset 0 starts at the first PT_LOAD, page aligned
+    let first_load = file
+        .segments()
+        .map(|s| s.address())
+        .min()
+        .ok_or_else(|| ELFError(format!("{:?} has no segments", elf.host_path)))?;
+    let page = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as u64;
+    let base = elf.start.wrapping_sub(first_load & !(page - 1));
+    Ok(base.wrapping_add(sym.address()))
+}
+
+// File offsets of dynamic symbols, as uprobes take them, None for the ones not defined here.
+pub fn symbol_file_offsets(elf: &MappedElf, names: &[&str]) -> Result<Vec<Option<u64>>> {
+    let file = fs::File::open(&elf.host_path).map_err(|e| ELFError(format!("{:?}: {}", elf.host_path, e)))?;
+    // Only the dynamic symbols and program headers are touched, so libc is not copied. The mapping
+    // lives for this call, package managers replace libc by a rename and never truncate it.
+    let data = unsafe { Mmap::map(&file) }.map_err(|e| ELFError(format!("{:?}: {}", elf.host_path, e)))?;
+    let file = object::File::parse(&*data).map_err(|e| ELFError(format!("{:?}: {}", elf.host_path, e)))?;
+    let mut offsets = vec![None; names.len()];
+    for sym in file.dynamic_symbols().filter(|s| s.is_definition()) {
+        let i = match sym.name().ok().and_then(|n| names.iter().position(|name| *name == n)) {
+            Some(i) if offsets[i].is_none() => i,
+            _ => continue,
+        };
+        offsets[i] = file
+            .segments()
+            .find(|s| sym.address() >= s.address() && sym.address() < s.address() + s.size())
+            .map(|segment| sym.address() - segment.address() + segment.file_range().0);
+    }
+    Ok(offsets)
+}
+
+pub fn read_process_memory(pid: u32, addr: u64, buf: &mut [u8]) -> Result<()> {
+    let mem = fs::File::open(format!("/proc/{}/mem", pid))
+        .map_err(|e| ProcError(format!("open mem of {}: {}", pid, e)))?;
+    mem.read_exact_at(buf, addr)
+        .map_err(|e| ProcError(format!("read mem of {} at {:x}: {}", pid, addr, e)))
+}
+
+// Py_Version exists since 3.11 and is encoded like PY_VERSION_HEX.
+pub fn read_patch_version(pid: u32, python: &MappedElf, version: &mut PyVersion) {
+    if (version.major, version.minor) < (3, 11) {
+        return;
+    }
+    if let Ok(addr) = symbol_address(python, "Py_Version") {
+        let mut buf = [0u8; 4];
+        if read_process_memory(pid, addr, &mut buf).is_ok() {
+            let hex = u32::from_ne_bytes(buf);
+            if hex >> 24 == version.major && (hex >> 16) & 0xff == version.minor {
+                version.patch = (hex >> 8) & 0xff;
+            }
+        }
+    }
+}
@@ -0,0 +1,367 @@
+use std::collections::{HashMap, HashSet};
+use std::mem;
+use std::os::fd::{AsFd, AsRawFd, RawFd};
+use std::path::PathBuf;
+use std::ptr;
+use std::sync::{Arc, Mutex};
+
+use libbpf_rs::libbpf_sys;
+use libbpf_rs::skel::{OpenSkel, SkelBuilder};
+use libbpf_rs::MapFlags;
+use log::{debug, error, info};
+
+use crate::ebpf::metrics::python::PythonMetrics;
+use crate::ebpf::overhead::{read_map_errors, MAP_ERROR_MAX};
+use crate::ebpf::python::events::{PyEventsConsumer, PySamples};
+use crate::ebpf::python::offsets::{libc_offsets, python_offsets, Libc, PyOffsetConfig, PyPidData, PyRuntimeOffsets};
+use crate::ebpf::python::procinfo::{debug_file, get_py_proc_info, read_patch_version, read_process_memory, symbol_address, MappedElf, PyProcInfo};
+use crate::ebpf::python::symbols::{code_cache_ids, seed_symbol_counter, PySymbolID, PySymbolTable};
+use crate::ebpf::ring::reader::{EventsReader, Reader};
+use crate::ebpf::ring::ringbuf::{disable_ringbuf_map, ringbuf_supported, RingBuffer};
+use crate::error::Error::{MapError, NotFound, SessionError};
+use crate::error::Result;
+
+pub mod skel {
+    include!("../bpf/pyperf.skel.rs");
+}
+
+use skel::*;
+
+// must match pyperf.bpf.c
+pub const PYTHON_STACK_MAX_LEN: u32 = 512;
+const PYTHON_PROG_IDX_READ_PYTHON_STACK: u32 = 0;
+// py_symbols_by_id is this share of py_symbols, see map_sizes.rs
+const PY_SYMBOLS_BY_ID_SHARE: u32 = 4;
+
+// bpf_loop is available since linux 5.17
+pub fn bpf_loop_supported() -> bool {
+    unsafe {
+        libbpf_sys::libbpf_probe_bpf_helper(
+            libbpf_sys::BPF_PROG_TYPE_PERF_EVENT,
+            libbpf_sys::BPF_FUNC_loop,
+            ptr::null(),
+        ) == 1
+    }
+}
+
+// Sets the python stack depth and keeps read_python_stack_loop from being loaded on kernels
+// that would reject it. Returns whether the bpf_loop walker is used.
+pub fn configure_stack_walker(open_skel: &mut OpenPyperfSkel, max_len: u32, use_bpf_loop: bool) -> Result<bool> {
+    open_skel.rodata_mut().python_stack_max_len = max_len.min(PYTHON_STACK_MAX_LEN);
+    let use_bpf_loop = use_bpf_loop && bpf_loop_supported();
+    if !use_bpf_loop {
+        open_skel
+            .progs_mut()
+            .read_python_stack_loop()
+            .set_autoload(false)
+            .map_err(|e| SessionError(format!("disable read_python_stack_loop: {:?}", e)))?;
+    }
+    Ok(use_bpf_loop)
+}
+
+// py_progs is initialized with the unrolled tail call walker, replace it with the bpf_loop one.
+pub fn install_stack_walker(skel: &PyperfSkel, use_bpf_loop: bool) -> Result<()> {
+    if !use_bpf_loop {
+        return Ok(());
+    }
+    let fd = skel.progs().read_python_stack_loop().as_fd().as_raw_fd();
+    skel.maps()
+        .py_progs()
+        .update(
+            &PYTHON_PROG_IDX_READ_PYTHON_STACK.to_ne_bytes(),
+            &fd.to_ne_bytes(),
+            MapFlags::ANY,
+        )
+        .map_err(|e| MapError(format!("install read_python_stack_loop: {:?}", e)))
+}
+
+#[derive(Clone)]
+pub struct PyperfOptions {
+    pub use_ringbuf: bool,
+    pub stack_depth: u32,
+    pub use_bpf_loop: bool,
+    // where the python symbol table is kept across restarts, None disables it
+    pub symbols_path: Option<PathBuf>,
+    pub full_file_path: bool,
+    pub keep_rounds: u32,
+    // max_entries of py_symbols, py_pid_config and of the stacks of the native frames
+    pub symbols_size: u32,
+    pub pid_config_size: u32,
+    pub stacks_size: u32,
+    pub metrics: PythonMetrics,
+}
+
+// Owns the pyperf programs. profile.bpf.c tail calls pyperf_collect for pids with
+// PROFILING_TYPE_PYTHON, which need a py_pid_config entry filled by add_pid.
+pub struct Pyperf<'a> {
+    skel: PyperfSkel<'a>,
+    ringbuf: bool,
+    options: PyperfOptions,
+    symbols: PySymbolTable,
+    samples: Arc<Mutex<PySamples>>,
+    // parsing DWARF is expensive, results are kept per interpreter and libc file (dev, inode)
+    python_offsets: HashMap<(u64, u64), Option<(PyOffsetConfig, PyRuntimeOffsets)>>,
+    libc_offsets: HashMap<(u64, u64), Option<Libc>>,
+    // stack ids still in the stacks map after the last sweep, see sweep_stacks
+    stale_stacks: HashSet<u32>,
+}
+
+impl<'a> Pyperf<'a> {
+    pub fn new(options: PyperfOptions) -> Result<Self> {
+        let builder = PyperfSkelBuilder::default();
+        let mut open_skel = builder
+            .open()
+            .map_err(|e| SessionError(format!("open pyperf: {:?}", e)))?;
+        let ringbuf = options.use_ringbuf && ringbuf_supported();
+        open_skel.rodata_mut().use_ringbuf = ringbuf;
+        if !ringbuf {
+            disable_ringbuf_map(open_skel.maps_mut().py_events_rb())?;
+        }
+        let use_bpf_loop = configure_stack_walker(&mut open_skel, options.stack_depth, options.use_bpf_loop)?;
+        let num_cpu = libbpf_rs::num_possible_cpus().unwrap_or(1).max(1) as u32;
+        open_skel.rodata_mut().py_num_cpu = num_cpu;
+        open_skel
+            .maps_mut()
+            .py_symbols()
+            .set_max_entries(options.symbols_size)
+            .map_err(|e| MapError(format!("set py_symbols size: {:?}", e)))?;
+        // only holds the symbols inserted since the last round
+        open_skel
+            .maps_mut()
+            .py_symbols_by_id()
+            .set_max_entries((options.symbols_size / PY_SYMBOLS_BY_ID_SHARE).max(1))
+            .map_err(|e| MapError(format!("set py_symbols_by_id size: {:?}", e)))?;
+        open_skel
+            .maps_mut()
+            .py_pid_config()
+            .set_max_entries(options.pid_config_size)
+            .map_err(|e| MapError(format!("set py_pid_config size: {:?}", e)))?;
+        open_skel
+            .maps_mut()
+            .stacks()
+            .set_max_entries(options.stacks_size)
+            .map_err(|e| MapError(format!("set pyperf stacks size: {:?}", e)))?;
+        let skel = open_skel
+            .load()
+            .map_err(|e| SessionError(format!("load pyperf: {:?}", e)))?;
+        install_stack_walker(&skel, use_bpf_loop)?;
+        info!("pyperf loaded, ringbuf: {}, bpf_loop: {}", ringbuf, use_bpf_loop);
+
+        let mut symbols = PySymbolTable::new(options.full_file_path, options.keep_rounds);
+        if let Some(path) = options.symbols_path.as_ref().filter(|p| p.exists()) {
+            match symbols.load(path) {
+                Ok(()) => {
+                    let seeded = symbols.seed_map(skel.maps().py_symbols());
+                    if let Err(err) = seed_symbol_counter(skel.maps().py_state_heap(), symbols.next_symbol_counter(num_cpu)) {
+                        error!("seed python symbol counter: {}", err);
+                    }
+                    debug!("seeded {} python symbols", seeded);
+                }
+                Err(err) => error!("load python symbols: {}", err),
+            }
+        }
+
+        Ok(Self {
+            skel,
+            ringbuf,
+            options,
+            symbols,
+            samples: Default::default(),
+            python_offsets: HashMap::new(),
+            libc_offsets: HashMap::new(),
+            stale_stacks: HashSet::new(),
+        })
+    }
+
+    // The program to put into progs[PROG_IDX_PYTHON] of profile.bpf.c
+    pub fn collect_prog_fd(&self) -> RawFd {
+        self.skel.progs().pyperf_collect().as_fd().as_raw_fd()
+    }
+
+    // Names and fds of the loaded programs, for their run time metrics.
+    pub fn programs(&self) -> Vec<(String, RawFd)> {
+        self.skel
+            .obj
+            .progs_iter()
+            .map(|p| (p.name().to_string(), p.as_fd().as_raw_fd()))
+            .collect()
+    }
+
+    pub fn map_errors(&self) -> [u64; MAP_ERROR_MAX] {
+        read_map_errors(self.skel.maps().py_map_errors())
+    }
+
+    pub fn events_consumer(&self) -> Result<PyEventsConsumer> {
+        let reader = if self.ringbuf {
+            EventsReader::RingBuffer(RingBuffer::new(self.skel.maps().py_events_rb())?)
+        } else {
+            EventsReader::PerfEventArray(Reader::new(self.skel.maps().py_events())?)
+        };
+        Ok(PyEventsConsumer {
+            reader,
+            samples: self.samples.clone(),
+            metrics: self.options.metrics.clone(),
+        })
+    }
+
+    pub fn add_pid(&mut self, pid: u32, collect_user: bool, collect_kernel: bool) -> Result<()> {
+        let info = get_py_proc_info(pid)?;
+        let mut version = info.version;
+        read_patch_version(pid, &info.python, &mut version);
+        let (offsets, runtime) = self.get_python_offsets(pid, &info)?;
+        let libc = self.get_libc_offsets(pid, &info)?;
+        let tss_key = read_tss_key(pid, &info.python, &runtime)?;
+        let data = PyPidData {
+            offsets,
+            version,
+            libc,
+            tss_key,
+            collect_user: collect_user as u8,
+            collect_kernel: collect_kernel as u8,
+            padding: [0; 2],
+        };
+        debug!("python pid {}: {:?} {:?}", pid, version, info.python.path);
+        self.skel
+            .maps()
+            .py_pid_config()
+            .update(&pid.to_ne_bytes(), data.as_bytes(), MapFlags::ANY)
+            .map_err(|e| MapError(format!("update py_pid_config: {:?}", e)))
+    }
+
+    pub fn remove_pid(&self, pid: u32) {
+        let _ = self.skel.maps().py_pid_config().delete(&pid.to_ne_bytes());
+    }
+
+    fn get_python_offsets(&mut self, pid: u32, info: &PyProcInfo) -> Result<(PyOffsetConfig, PyRuntimeOffsets)> {
+        let key = (info.python.dev, info.python.inode);
+        if let Some(cached) = self.python_offsets.get(&key) {
+            return cached.ok_or_else(|| NotFound(format!("no python offsets for {}", info.python.path)));
+        }
+        let res = debug_file(pid, &info.python)
+            .ok_or_else(|| NotFound(format!("no debug info for {}", info.python.path)))
+            .and_then(|path| python_offsets(&path, &info.version));
+        self.python_offsets.insert(key, res.as_ref().ok().cloned());
+        res
+    }
+
+    fn get_libc_offsets(&mut self, pid: u32, info: &PyProcInfo) -> Result<Libc> {
+        let key = (info.libc.dev, info.libc.inode);
+        if let Some(cached) = self.libc_offsets.get(&key) {
+            return cached.ok_or_else(|| NotFound(format!("no pthread offsets for {}", info.libc.path)));
+        }
+        let path = debug_file(pid, &info.libc).unwrap_or_else(|| info.libc.host_path.clone());
+        let res = libc_offsets(&path, info.musl);
+        self.libc_offsets.insert(key, res.as_ref().ok().cloned());
+        res
+    }
+
+    pub fn take_samples(&self) -> PySamples {
+        mem::take(&mut *self.samples.lock().unwrap())
+    }
+
+    // Makes sure every id is in the symbol table. New ids are looked up one by one, py_symbols is
+    // only read as a whole for ids py_symbols_by_id lost.
+    pub fn prepare_symbols<'b>(&mut self, ids: impl Iterator<Item = &'b PySymbolID>) {
+        let missing: HashSet<PySymbolID> = ids.filter(|id| !self.symbols.contains(**id)).copied().collect();
+        if missing.is_empty() {
+            return;
+        }
+        let maps = self.skel.maps();
+        let left = self.symbols.take_new(maps.py_symbols_by_id(), &missing);
+        if left == 0 {
+            return;
+        }
+        match self.symbols.sync_map(maps.py_symbols()) {
+            Ok(n) => debug!("synced {} python symbols for {} unknown ids", n, left),
+            Err(err) => error!("sync python symbols: {}", err),
+        }
+    }
+
+    // Names of a leaf first id stack, returned root first.
+    pub fn resolve_stack(&mut self, stack: &[PySymbolID], service_name: &str) -> Vec<Arc<str>> {
+        let m = &self.options.metrics;
+        m.symbol_lookup
+            .with_label_values(&[service_name])
+            .inc_by(stack.len() as f64);
+        let mut res = Vec::with_capacity(stack.len());
+        for id in stack.iter().rev() {
+            match self.symbols.resolve(*id) {
+                Some(name) => res.push(Arc::from(name)),
+                None => {
+                    m.unknown_symbols.with_label_values(&[service_name]).inc();
+                    res.push(Arc::from("[unknown]"));
+                }
+            }
+        }
+        res
+    }
+
+    pub fn get_stack(&self, stack_id: i64) -> Option<Vec<u8>> {
+        if stack_id < 0 {
+            return None;
+        }
+        self.skel
+            .maps()
+            .stacks()
+            .lookup(&(stack_id as u32).to_ne_bytes(), MapFlags::ANY)
+            .unwrap_or(None)
+    }
+
+    pub fn clear_stacks(&self, stack_ids: impl Iterator<Item = u32>) {
+        let m = self.skel.maps();
+        let stacks = m.stacks();
+        for id in stack_ids {
+            let _ = stacks.delete(&id.to_ne_bytes());
+        }
+    }
+
+    // Events lost on the buffer and error events skipped by PyEventsConsumer hold stack ids nobody
+    // clears. Called after clear_stacks, the ids left then are theirs or those of events still on
+    // the buffer, which are read within the round. Ids left by two sweeps in a row are deleted.
+    pub fn sweep_stacks(&mut self) {
+        let maps = self.skel.maps();
+        let stacks = maps.stacks();
+        let present: HashSet<u32> = stacks
+            .keys()
+            .filter_map(|k| Some(u32::from_ne_bytes(k.as_slice().try_into().ok()?)))
+            .collect();
+        let mut swept = 0;
+        for id in present.intersection(&self.stale_stacks) {
+            if stacks.delete(&id.to_ne_bytes()).is_ok() {
+                swept += 1;
+            }
+        }
+        if swept != 0 {
+            debug!("pyperf stacks swept: {}", swept);
+        }
+        self.stale_stacks = present.difference(&self.stale_stacks).copied().collect();
+    }
+
+    pub fn next_round(&mut self) {
+        self.symbols.next_round();
+    }
+
+    pub fn cleanup(&mut self) {
+        let maps = self.skel.maps();
+        self.symbols.cleanup(|| code_cache_ids(maps.py_code_cache()));
+        if !self.symbols.is_dirty() {
+            return;
+        }
+        if let Some(path) = self.options.symbols_path.clone() {
+            if let Err(err) = self.symbols.save(&path) {
+                error!("save python symbols: {}", err);
+            }
+        }
+    }
+}
+
+// Reads _PyRuntime.autoTSSkey._key, the pthread key under which every thread keeps its PyThreadState.
+fn read_tss_key(pid: u32, python: &MappedElf, runtime: &PyRuntimeOffsets) -> Result<i32> {
+    if runtime.tss_key < 0 {
+        return Err(NotFound("Py_tss_t._key offset not found".to_string()));
+    }
+    let addr = symbol_address(python, "_PyRuntime")? + (runtime.auto_tss_key + runtime.tss_key) as u64;
+    let mut buf = [0u8; 4];
+    read_process_memory(pid, addr, &mut buf)?;
+    Ok(i32::from_ne_bytes(buf))
+}
@@ -0,0 +1,34 @@
+// Interpreter functions running python frames. Native frames between the first and the last of
+// them belong to the interpreter itself and are replaced by the python frames.
+const EVAL_FRAME_PREFIXES: [&str; 4] = [
+    "_PyEval_EvalFrame",
+    "PyEval_EvalFrame",
+    "_PyEval_Vector",
+    "PyEval_EvalCode",
+];
+
+pub fn is_eval_frame(name: &str) -> bool {
+    EVAL_FRAME_PREFIXES.iter().any(|p| name.starts_with(p))
+}
+
+// Merges a symbolized native user stack with the python frames of the same sample, both root
+// first. The result is the native prefix up to the first eval frame (process startup, embedding
+// code), the python frames, then the native suffix after the last eval frame (C extensions,
+// builtins). Without a resolvable eval frame the native frames are kept as a prefix.
+pub fn merge_native_python<S: AsRef<str> + Clone>(native: &[S], python: &[S]) -> Vec<S> {
+    let mut res = Vec::with_capacity(native.len() + python.len());
+    let first = native.iter().position(|s| is_eval_frame(s.as_ref()));
+    let last = native.iter().rposition(|s| is_eval_frame(s.as_ref()));
+    match (first, last) {
+        (Some(first), Some(last)) => {
+            res.extend_from_slice(&native[..first]);
+            res.extend_from_slice(python);
+            res.extend_from_slice(&native[last + 1..]);
+        }
+        _ => {
+            res.extend_from_slice(native);
+            res.extend_from_slice(python);
+        }
+    }
+    res
+}
@@ -0,0 +1,461 @@
+use std::collections::{HashMap, HashSet};
+use std::ffi::c_void;
+use std::fs;
+use std::io::{Read, Write};
+use std::mem;
+use std::os::fd::{AsFd, AsRawFd};
+use std::path::Path;
+
+use libbpf_rs::libbpf_sys::{bpf_map_batch_opts, bpf_map_lookup_batch, size_t};
+use libbpf_rs::{MapFlags, MapHandle};
+use log::{debug, error};
+
+use crate::error::Error::{InvalidData, MapError, OSError};
+use crate::error::Result;
+
+// must match pyperf.bpf.c
+pub const PYTHON_CLASS_NAME_LEN: usize = 32;
+pub const PYTHON_FUNCTION_NAME_LEN: usize = 64;
+pub const PYTHON_FILE_NAME_LEN: usize = 128;
+
+// pystr.h
+const PYSTR_TYPE_1BYTE: u8 = 1;
+const PYSTR_TYPE_2BYTE: u8 = 2;
+const PYSTR_TYPE_4BYTE: u8 = 4;
+const PYSTR_TYPE_ASCII: u8 = 8;
+const PYSTR_TYPE_UTF8: u8 = 16;
+const PYSTR_TYPE_NOT_COMPACT: u8 = 32;
+
+pub type PySymbolID = u32;
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone, PartialEq, Eq, Hash)]
+pub struct PyStrType {
+    pub typ: u8,
+    pub size_codepoints: u8,
+}
+
+// Mirror of py_symbol in pyperf.bpf.c, the raw bytes are the key of the py_symbols map.
+#[repr(C)]
+#[derive(Copy, Clone, PartialEq, Eq, Hash)]
+pub struct PySymbol {
+    pub classname: [u8; PYTHON_CLASS_NAME_LEN],
+    pub name: [u8; PYTHON_FUNCTION_NAME_LEN],
+    pub file: [u8; PYTHON_FILE_NAME_LEN],
+    pub classname_type: PyStrType,
+    pub name_type: PyStrType,
+    pub file_type: PyStrType,
+    pub padding: PyStrType,
+}
+
+impl Default for PySymbol {
+    fn default() -> Self {
+        unsafe { mem::zeroed() }
+    }
+}
+
+impl PySymbol {
+    pub fn from_bytes(bytes: &[u8]) -> Option<Self> {
+        if bytes.len() != mem::size_of::<PySymbol>() {
+            return None;
+        }
+        Some(unsafe { std::ptr::read_unaligned(bytes.as_ptr() as *const PySymbol) })
+    }
+
+    pub fn as_bytes(&self) -> &[u8] {
+        unsafe {
+            std::slice::from_raw_parts(self as *const _ as *const u8, mem::size_of::<PySymbol>())
+        }
+    }
+
+    // "file classname.name" or "file name"
+    pub fn frame_name(&self, full_file_path: bool) -> String {
+        let file = py_str(&self.file, self.file_type);
+        let file = if full_file_path {
+            file.as_str()
+        } else {
+            file.rsplit('/').next().unwrap_or_default()
+        };
+        let name = py_str(&self.name, self.name_type);
+        let classname = py_str(&self.classname, self.classname_type);
+        if classname.is_empty() {
+            format!("{} {}", file, name)
+        } else {
+            format!("{} {}.{}", file, classname, name)
+        }
+    }
+}
+
+// Decodes a string copied by pystr_read or bpf_probe_read_user_str.
+fn py_str(buf: &[u8], typ: PyStrType) -> String {
+    let n = typ.size_codepoints as usize;
+    if typ.typ & PYSTR_TYPE_NOT_COMPACT != 0 {
+        return "[not_compact]".to_string();
+    }
+    if typ.typ & PYSTR_TYPE_UTF8 != 0 {
+        let end = buf.iter().position(|b| *b == 0).unwrap_or(buf.len()).min(n.max(1) * 4);
+        return String::from_utf8_lossy(&buf[..end.min(buf.len())]).into_owned();
+    }
+    match typ.typ & !PYSTR_TYPE_ASCII {
+        PYSTR_TYPE_1BYTE => buf[..n.min(buf.len())].iter().map(|b| *b as char).collect(),
+        PYSTR_TYPE_2BYTE => buf
+            .chunks_exact(2)
+            .take(n)
+            .filter_map(|c| char::from_u32(u16::from_ne_bytes([c[0], c[1]]) as u32))
+            .collect(),
+        PYSTR_TYPE_4BYTE => buf
+            .chunks_exact(4)
+            .take(n)
+            .filter_map(|c| char::from_u32(u32::from_ne_bytes([c[0], c[1], c[2], c[3]])))
+            .collect(),
+        _ => String::new(),
+    }
+}
+
+struct Entry {
+    symbol: PySymbol,
+    name: String,
+    round: u32,
+}
+
+// Reverse table of the py_symbols map: the bpf side only reports symbol ids, names are looked up
+// here. py_symbols is an LRU map, evicted symbols get a fresh id when they are seen again, so
+// entries not referenced for keep_rounds rounds are dropped.
+pub struct PySymbolTable {
+    by_id: HashMap<PySymbolID, Entry>,
+    full_file_path: bool,
+    round: u32,
+    keep_rounds: u32,
+    // symbols were added since the last save
+    dirty: bool,
+    // round of the last sync_map that read py_symbols
+    synced_round: Option<u32>,
+}
+
+// rounds between two reads of all of py_symbols
+const FULL_SYNC_ROUNDS: u32 = 8;
+
+const PY_SYMBOLS_FILE_MAGIC: &[u8; 8] = b"IWMPYSYM";
+const PY_SYMBOLS_FILE_VERSION: u32 = 1;
+
+impl PySymbolTable {
+    pub fn new(full_file_path: bool, keep_rounds: u32) -> Self {
+        Self {
+            by_id: HashMap::new(),
+            full_file_path,
+            round: 0,
+            keep_rounds,
+            dirty: false,
+            synced_round: None,
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.by_id.len()
+    }
+
+    pub fn insert(&mut self, id: PySymbolID, symbol: PySymbol) {
+        let round = self.round;
+        if let Some(e) = self.by_id.get_mut(&id) {
+            if e.symbol == symbol {
+                e.round = round;
+                return;
+            }
+        }
+        let name = symbol.frame_name(self.full_file_path);
+        self.by_id.insert(id, Entry { symbol, name, round });
+        self.dirty = true;
+    }
+
+    pub fn is_dirty(&self) -> bool {
+        self.dirty
+    }
+
+    // Takes the symbols of ids out of py_symbols_by_id, returns how many are still unknown.
+    pub fn take_new(&mut self, by_id: &MapHandle, ids: &HashSet<PySymbolID>) -> usize {
+        let mut left = 0;
+        for id in ids {
+            let key = id.to_ne_bytes();
+            match by_id.lookup(&key, MapFlags::ANY).unwrap_or(None).and_then(|v| PySymbol::from_bytes(&v)) {
+                Some(symbol) => {
+                    self.insert(*id, symbol);
+                    let _ = by_id.delete(&key);
+                }
+                None => left += 1,
+            }
+        }
+        left
+    }
+
+    // Rebuilds the reverse table from py_symbols, for ids py_symbols_by_id evicted before they
+    // were taken. Reading the whole map is costly, it is done once every FULL_SYNC_ROUNDS rounds
+    // at most and the ids stay unknown meanwhile.
+    pub fn sync_map(&mut self, py_symbols: &MapHandle) -> Result<usize> {
+        let round = self.round;
+        if self.synced_round.map_or(false, |r| round.saturating_sub(r) < FULL_SYNC_ROUNDS) {
+            return Ok(0);
+        }
+        self.synced_round = Some(round);
+        match self.sync_map_batch(py_symbols) {
+            Ok(n) => Ok(n),
+            Err(err) => {
+                debug!("py_symbols batch lookup failed: {:?}, falling back to per key lookup", err);
+                let mut n = 0;
+                let keys: Vec<Vec<u8>> = py_symbols.keys().collect();
+                for key in keys.iter() {
+                    let value = match py_symbols.lookup(key, MapFlags::ANY) {
+                        Ok(Some(value)) if value.len() == 4 => value,
+                        _ => continue,
+                    };
+                    if let Some(symbol) = PySymbol::from_bytes(key) {
+                        self.insert(u32::from_ne_bytes(value[..4].try_into().unwrap()), symbol);
+                        n += 1;
+                    }
+                }
+                Ok(n)
+            }
+        }
+    }
+
+    fn sync_map_batch(&mut self, py_symbols: &MapHandle) -> Result<usize> {
+        let (keys, ids) = lookup_batch::<PySymbol, PySymbolID>(py_symbols)?;
+        let n = keys.len();
+        for (symbol, id) in keys.into_iter().zip(ids) {
+            self.insert(id, symbol);
+        }
+        Ok(n)
+    }
+
+    pub fn resolve(&mut self, id: PySymbolID) -> Option<&str> {
+        let round = self.round;
+        self.by_id.get_mut(&id).map(|e| {
+            e.round = round;
+            e.name.as_str()
+        })
+    }
+
+    pub fn contains(&self, id: PySymbolID) -> bool {
+        self.by_id.contains_key(&id)
+    }
+
+    pub fn next_round(&mut self) {
+        self.round += 1;
+    }
+
+    // py_code_cache hands out ids without touching py_symbols, its hot symbols are the first ones
+    // the LRU evicts. cached_ids is only called when something would be dropped, ids it returns
+    // are kept as they may be known nowhere else.
+    pub fn cleanup(&mut self, cached_ids: impl FnOnce() -> HashSet<PySymbolID>) {
+        let round = self.round;
+        let keep_rounds = self.keep_rounds;
+        let before = self.by_id.len();
+        if self.by_id.values().all(|e| round.saturating_sub(e.round) <= keep_rounds) {
+            return;
+        }
+        let cached = cached_ids();
+        self.by_id.retain(|id, e| {
+            if round.saturating_sub(e.round) <= keep_rounds {
+                return true;
+            }
+            // looked at again keep_rounds from now
+            if cached.contains(id) {
+                e.round = round;
+                return true;
+            }
+            false
+        });
+        if before != self.by_id.len() {
+            debug!("python symbols gc: {} -> {}", before, self.by_id.len());
+        }
+    }
+
+    // The per-cpu symbol counter has to start above every id handed out before, see get_symbol_id.
+    // Ids saved by a run with another number of cpus are covered as well.
+    pub fn next_symbol_counter(&self, num_cpu: u32) -> i64 {
+        self.by_id
+            .keys()
+            .map(|id| (id / num_cpu.max(1)) as i64 + 1)
+            .max()
+            .unwrap_or(0)
+    }
+
+    pub fn load(&mut self, path: &Path) -> Result<()> {
+        let mut data = Vec::new();
+        fs::File::open(path)
+            .and_then(|mut f| f.read_to_end(&mut data))
+            .map_err(|e| OSError(format!("read {:?}: {}", path, e)))?;
+        let sym_size = mem::size_of::<PySymbol>();
+        let header = PY_SYMBOLS_FILE_MAGIC.len() + 12;
+        if data.len() < header || &data[..8] != PY_SYMBOLS_FILE_MAGIC {
+            return Err(InvalidData(format!("{:?}: not a python symbols file", path)));
+        }
+        let read_u32 = |off: usize| u32::from_le_bytes(data[off..off + 4].try_into().unwrap());
+        if read_u32(8) != PY_SYMBOLS_FILE_VERSION || read_u32(12) as usize != sym_size {
+            return Err(InvalidData(format!("{:?}: incompatible python symbols file", path)));
+        }
+        let count = read_u32(16) as usize;
+        let record = 4 + sym_size;
+        if data.len() < header + count * record {
+            return Err(InvalidData(format!("{:?}: truncated python symbols file", path)));
+        }
+        for i in 0..count {
+            let off = header + i * record;
+            let id = read_u32(off);
+            if let Some(symbol) = PySymbol::from_bytes(&data[off + 4..off + record]) {
+                self.insert(id, symbol);
+            }
+        }
+        debug!("loaded {} python symbols from {:?}", count, path);
+        self.dirty = false;
+        Ok(())
+    }
+
+    pub fn save(&mut self, path: &Path) -> Result<()> {
+        let sym_size = mem::size_of::<PySymbol>();
+        let mut data = Vec::with_capacity(20 + self.by_id.len() * (4 + sym_size));
+        data.extend_from_slice(PY_SYMBOLS_FILE_MAGIC);
+        data.extend_from_slice(&PY_SYMBOLS_FILE_VERSION.to_le_bytes());
+        data.extend_from_slice(&(sym_size as u32).to_le_bytes());
+        data.extend_from_slice(&(self.by_id.len() as u32).to_le_bytes());
+        for (id, e) in self.by_id.iter() {
+            data.extend_from_slice(&id.to_le_bytes());
+            data.extend_from_slice(e.symbol.as_bytes());
+        }
+        let tmp = path.with_extension("tmp");
+        fs::File::create(&tmp)
+            .and_then(|mut f| f.write_all(&data))
+            .and_then(|_| fs::rename(&tmp, path))
+            .map_err(|e| OSError(format!("write {:?}: {}", path, e)))?;
+        self.dirty = false;
+        Ok(())
+    }
+
+    // Re-inserts the known symbols into py_symbols after a restart so running processes keep
+    // their ids and the strings are not copied out of the target processes again.
+    pub fn seed_map(&self, py_symbols: &MapHandle) -> usize {
+        let max_entries = py_symbols.info().map(|i| i.info.max_entries as usize).unwrap_or(0);
+        let mut seeded = 0;
+        for (id, e) in self.by_id.iter() {
+            if seeded >= max_entries {
+                break;
+            }
+            let res = py_symbols.update(e.symbol.as_bytes(), &id.to_ne_bytes(), MapFlags::NO_EXIST);
+            if let Err(err) = res {
+                debug!("seed python symbol {} err: {:?}", id, err);
+                continue;
+            }
+            seeded += 1;
+        }
+        seeded
+    }
+}
+
+// Mirrors of py_code_key and py_code_value in pyperf.bpf.c.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct PyCodeKey {
+    pub pid: u32,
+    pub padding: u32,
+    pub code_ptr: u64,
+    pub class_ptr: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct PyCodeValue {
+    pub symbol_id: PySymbolID,
+    pub first_arg: u32,
+    pub name_ptr: u64,
+    pub file_ptr: u64,
+}
+
+// The symbol ids py_code_cache can still return, read in batches and key by key if the kernel
+// has no batch lookup.
+pub fn code_cache_ids(py_code_cache: &MapHandle) -> HashSet<PySymbolID> {
+    match lookup_batch::<PyCodeKey, PyCodeValue>(py_code_cache) {
+        Ok((_, values)) => values.iter().map(|v| v.symbol_id).collect(),
+        Err(err) => {
+            debug!("py_code_cache batch lookup failed: {:?}, falling back to per key lookup", err);
+            let keys: Vec<Vec<u8>> = py_code_cache.keys().collect();
+            keys.iter()
+                .filter_map(|key| match py_code_cache.lookup(key, MapFlags::ANY) {
+                    Ok(Some(value)) if value.len() >= 4 => Some(u32::from_ne_bytes(value[..4].try_into().unwrap())),
+                    _ => None,
+                })
+                .collect()
+        }
+    }
+}
+
+// Copies a hash map without deleting from it. K and V must be plain data laid out as the map's
+// key and value.
+fn lookup_batch<K: Default + Copy, V: Default + Copy>(m: &MapHandle) -> Result<(Vec<K>, Vec<V>)> {
+    let map_size = m.info().map(|i| i.info.max_entries as usize).unwrap_or(0);
+    let mut keys: Vec<K> = vec![K::default(); map_size];
+    let mut values: Vec<V> = vec![V::default(); map_size];
+    // the hash map batch cursor is a bucket index, a key sized buffer is always large enough
+    let mut in_batch = K::default();
+    let mut out_batch = K::default();
+    let opts = bpf_map_batch_opts {
+        sz: mem::size_of::<bpf_map_batch_opts>() as size_t,
+        elem_flags: MapFlags::ANY.bits(),
+        flags: MapFlags::ANY.bits(),
+    };
+    let mut total = 0usize;
+    let mut first = true;
+    while total < map_size {
+        let mut count = (map_size - total) as u32;
+        let ret = unsafe {
+            bpf_map_lookup_batch(
+                m.as_fd().as_raw_fd(),
+                if first {
+                    std::ptr::null_mut()
+                } else {
+                    &mut in_batch as *mut _ as *mut c_void
+                },
+                &mut out_batch as *mut _ as *mut c_void,
+                keys[total..].as_mut_ptr() as *mut c_void,
+                values[total..].as_mut_ptr() as *mut c_void,
+                &mut count,
+                &opts,
+            )
+        };
+        if ret < 0 && -ret != libc::ENOENT {
+            if total == 0 {
+                return Err(MapError((-ret).to_string()));
+            }
+            error!("batch lookup stopped early err: {}", -ret);
+            break;
+        }
+        total += count as usize;
+        if ret < 0 {
+            break;
+        }
+        in_batch = out_batch;
+        first = false;
+    }
+    keys.truncate(total);
+    values.truncate(total);
+    Ok((keys, values))
+}
+
+// Sets symbol_counter, the first field of py_sample_state_t, on every cpu of py_state_heap.
+pub fn seed_symbol_counter(py_state_heap: &MapHandle, counter: i64) -> Result<()> {
+    let key = 0u32.to_ne_bytes();
+    let mut values = py_state_heap
+        .lookup_percpu(&key, MapFlags::ANY)
+        .map_err(|e| MapError(format!("lookup py_state_heap: {:?}", e)))?
+        .ok_or_else(|| MapError("py_state_heap is empty".to_string()))?;
+    for v in values.iter_mut() {
+        if v.len() >= mem::size_of::<i64>() {
+            let current = i64::from_ne_bytes(v[..8].try_into().unwrap());
+            v[..8].copy_from_slice(&current.max(counter).to_ne_bytes());
+        }
+    }
+    py_state_heap
+        .update_percpu(&key, &values, MapFlags::ANY)
+        .map_err(|e| {
+            error!("seed symbol counter: {:?}", e);
+            MapError(format!("update py_state_heap: {:?}", e))
+        })
+}
@@ -2,6 +2,7 @@ pub mod reader;
 pub mod sys;
 pub mod perf_buffer;
 pub mod perf_event;
+pub mod ringbuf;
 
 use crate::error::Result;
 use std::{
@@ -13,7 +13,9 @@ use libbpf_sys::{PERF_COUNT_SW_CPU_CLOCK};
 
 
 use crate::ebpf::ring::sys::perf_event_open;
+use crate::ebpf::PERF_EVENT_IOC_PERIOD;
 
+use crate::error::Error::OSError;
 use crate::error::Result;
 
 #[derive(Debug)]
@@ -30,8 +32,8 @@ impl PerfEvent {
 			PERF_COUNT_SW_CPU_CLOCK as u64,
 			-1,
 			cpu,
-			sample_rate,
-			None,
+			0,
+			Some(sample_rate),
 			false,
 			false,
 			0
@@ -49,6 +51,15 @@ impl PerfEvent {
 		Ok(PerfEvent { fd, link: Some(link), ioctl: false })
 	}
 
+	// The event was opened in frequency mode, the new period is taken as a frequency.
+	pub fn set_frequency(&self, sample_rate: u64) -> Result<()> {
+		let err = unsafe { libc::ioctl(self.fd, PERF_EVENT_IOC_PERIOD as _, &sample_rate as *const u64) };
+		if err == -1 {
+			return Err(OSError(format!("fail to call PERF_EVENT_IOC_PERIOD: {}", std::io::Error::last_os_error())));
+		}
+		Ok(())
+	}
+
 	fn close(&mut self) -> Result<()> {
 		unsafe {
 			libc::close(self.fd);
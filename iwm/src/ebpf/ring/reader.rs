@@ -12,6 +12,7 @@ use polling::{Event, Poller, PollMode};
 
 
 use crate::ebpf::ring::perf_buffer::{Events, PerfBuffer};
+use crate::ebpf::ring::ringbuf::RingBuffer;
 use crate::ebpf::ring::sys::bpf_map_update_elem;
 use crate::error::Error::MustBePaused;
 use crate::error::Result;
@@ -56,6 +57,11 @@ pub struct Reader {
 
 impl Reader {
     pub fn new(array: &MapHandle) -> Result<Self> {
+        Self::with_pages(array, 4)
+    }
+
+    // pages is the size of every per-cpu buffer, a power of two
+    pub fn with_pages(array: &MapHandle, pages: usize) -> Result<Self> {
         let n_cpu = array.info().unwrap().info.max_entries;
 
         let poller = Arc::new(Poller::new().unwrap());
@@ -66,7 +72,7 @@ impl Reader {
         let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
 
         for i in 0..n_cpu {
-            let ring = PerfBuffer::new(i as i32, page_size, 4).unwrap();
+            let ring = PerfBuffer::new(i as i32, page_size, pages).unwrap();
             buffer_size = ring.size.clone();
             unsafe {
                 poller.add_with_mode(ring.fd, Event::all(i as usize), PollMode::Level).unwrap();
@@ -132,4 +138,19 @@ impl Reader {
     pub(crate) fn buffer_size(&self) -> usize {
         self.buffer_size
     }
-}
\ No newline at end of file
+}
+// EventsReader hides which transport the bpf program was loaded with:
+// one perf buffer per cpu, or a single BPF_MAP_TYPE_RINGBUF shared by all cpus.
+pub enum EventsReader {
+    PerfEventArray(Reader),
+    RingBuffer(RingBuffer),
+}
+
+impl EventsReader {
+    pub fn read_events(&mut self) -> Result<Record> {
+        match self {
+            EventsReader::PerfEventArray(reader) => reader.read_events(),
+            EventsReader::RingBuffer(reader) => reader.read_events(),
+        }
+    }
+}
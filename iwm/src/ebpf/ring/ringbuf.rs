@@ -0,0 +1,186 @@
+use std::{
+	ffi::c_void,
+	io,
+	os::fd::{AsFd, AsRawFd, BorrowedFd, RawFd},
+	ptr, slice,
+	sync::atomic::{AtomicU64, Ordering},
+	time::Duration,
+};
+
+use bytes::BytesMut;
+use libbpf_rs::{MapHandle, MapType, OpenMap};
+use libc::{munmap, MAP_FAILED, MAP_SHARED, PROT_READ, PROT_WRITE};
+use polling::{Event, PollMode, Poller};
+
+use crate::ebpf::ring::mmap;
+use crate::ebpf::ring::reader::Record;
+use crate::error::Error::PerfBufferError;
+use crate::error::Result;
+
+// include/uapi/linux/bpf.h
+const BPF_RINGBUF_BUSY_BIT: u32 = 1 << 31;
+const BPF_RINGBUF_DISCARD_BIT: u32 = 1 << 30;
+const BPF_RINGBUF_HDR_SZ: usize = 8;
+
+// maximum number of records handed out by one read_events call
+const MAX_RECORDS_PER_READ: usize = 256;
+
+// RingBuffer reads a BPF_MAP_TYPE_RINGBUF map shared by all cpus.
+// The kernel maps the data area twice back to back, so a record is always contiguous in memory.
+pub struct RingBuffer {
+	fd: RawFd,
+	poller: Poller,
+	deadline: Option<Duration>,
+	page_size: usize,
+	mask: usize,
+	// consumer page, the only part writable from user space
+	consumer: *mut c_void,
+	// producer page followed by the doubly mapped data area
+	producer: *mut c_void,
+}
+
+// The mappings are only touched through &mut self
+unsafe impl Send for RingBuffer {}
+
+impl RingBuffer {
+	pub fn new(map: &MapHandle) -> Result<Self> {
+		let size = map.info().unwrap().info.max_entries as usize;
+		if !size.is_power_of_two() {
+			return Err(PerfBufferError(format!("InvalidRingSize {}", size)));
+		}
+		let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+		let fd = map.as_fd();
+
+		let consumer = unsafe { mmap(ptr::null_mut(), page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) };
+		if consumer == MAP_FAILED {
+			return Err(PerfBufferError(io::Error::last_os_error().to_string()));
+		}
+		let producer = unsafe {
+			mmap(
+				ptr::null_mut(),
+				page_size + 2 * size,
+				PROT_READ,
+				MAP_SHARED,
+				fd,
+				page_size as libc::off_t,
+			)
+		};
+		if producer == MAP_FAILED {
+			let err = io::Error::last_os_error().to_string();
+			unsafe { munmap(consumer, page_size) };
+			return Err(PerfBufferError(err));
+		}
+
+		let poller = Poller::new().unwrap();
+		unsafe {
+			poller.add_with_mode(fd.as_raw_fd(), Event::readable(0), PollMode::Level).unwrap();
+		}
+
+		Ok(RingBuffer {
+			fd: fd.as_raw_fd(),
+			poller,
+			deadline: None,
+			page_size,
+			mask: size - 1,
+			consumer,
+			producer,
+		})
+	}
+
+	fn consumer_pos(&self) -> &AtomicU64 {
+		unsafe { &*(self.consumer as *const AtomicU64) }
+	}
+
+	fn producer_pos(&self) -> &AtomicU64 {
+		unsafe { &*(self.producer as *const AtomicU64) }
+	}
+
+	// Blocks until at least one record is available and returns the records committed so far.
+	pub fn read_events(&mut self) -> Result<Record> {
+		let mut events = polling::Events::new();
+		loop {
+			let mut raw_samples = Vec::new();
+			self.consume(&mut raw_samples);
+			if !raw_samples.is_empty() {
+				return Ok(Record {
+					cpu: -1,
+					raw_samples,
+					lost_samples: 0,
+					remaining: 0,
+				});
+			}
+			events.clear();
+			self.poller.wait(&mut events, self.deadline).unwrap();
+		}
+	}
+
+	fn consume(&mut self, out: &mut Vec<BytesMut>) {
+		let data = self.producer as usize + self.page_size;
+		let mut cons = self.consumer_pos().load(Ordering::Acquire) as usize;
+		while out.len() < MAX_RECORDS_PER_READ {
+			let prod = self.producer_pos().load(Ordering::Acquire) as usize;
+			if cons >= prod {
+				break;
+			}
+			let hdr = unsafe { &*((data + (cons & self.mask)) as *const AtomicU32Header) };
+			let len = hdr.len.load(Ordering::Acquire);
+			if len & BPF_RINGBUF_BUSY_BIT != 0 {
+				// reserved but not yet submitted, records after it are not visible yet
+				break;
+			}
+			let sample_len = (len & !(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT)) as usize;
+			if len & BPF_RINGBUF_DISCARD_BIT == 0 {
+				let start = data + (cons & self.mask) + BPF_RINGBUF_HDR_SZ;
+				out.push(BytesMut::from(unsafe { slice::from_raw_parts(start as *const u8, sample_len) }));
+			}
+			cons += round_up(sample_len + BPF_RINGBUF_HDR_SZ, 8);
+			self.consumer_pos().store(cons as u64, Ordering::Release);
+		}
+	}
+}
+
+// BPF_MAP_TYPE_RINGBUF is available since linux 5.8
+pub fn ringbuf_supported() -> bool {
+	unsafe { libbpf_sys::libbpf_probe_bpf_map_type(libbpf_sys::BPF_MAP_TYPE_RINGBUF, ptr::null()) == 1 }
+}
+
+// Turns a ring buffer map into a tiny array so the object still loads on kernels without ring
+// buffers. The programs must not reach the code using it, see use_ringbuf in profile.bpf.h.
+pub fn disable_ringbuf_map(map: &mut OpenMap) -> Result<()> {
+	map.set_type(MapType::Array)
+		.and_then(|_| map.set_key_size(4))
+		.and_then(|_| map.set_value_size(4))
+		.and_then(|_| map.set_max_entries(1))
+		.map_err(|e| PerfBufferError(format!("disable ring buffer map: {:?}", e)))
+}
+
+#[repr(C)]
+struct AtomicU32Header {
+	len: std::sync::atomic::AtomicU32,
+	pg_off: u32,
+}
+
+fn round_up(n: usize, align: usize) -> usize {
+	(n + align - 1) & !(align - 1)
+}
+
+impl AsRawFd for RingBuffer {
+	fn as_raw_fd(&self) -> RawFd {
+		self.fd
+	}
+}
+
+impl AsFd for RingBuffer {
+	fn as_fd(&self) -> BorrowedFd<'_> {
+		unsafe { BorrowedFd::borrow_raw(self.fd) }
+	}
+}
+
+impl Drop for RingBuffer {
+	fn drop(&mut self) {
+		unsafe {
+			munmap(self.consumer, self.page_size);
+			munmap(self.producer, self.page_size + 2 * (self.mask + 1));
+		}
+	}
+}
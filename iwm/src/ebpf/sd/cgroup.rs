@@ -0,0 +1,68 @@
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::os::unix::fs::MetadataExt;
+use std::path::{Path, PathBuf};
+
+use crate::ebpf::sd::container_id::get_container_id_from_cgroup;
+
+pub const CGROUP2_ROOT: &str = "/sys/fs/cgroup";
+
+// container cgroups sit a few levels below the root, e.g.
+// kubepods.slice/kubepods-burstable.slice/kubepods-burstable-pod<uid>.slice/cri-containerd-<id>.scope
+const MAX_CGROUP_WALK_DEPTH: usize = 8;
+
+pub type CgroupID = u64;
+
+// bpf_get_current_cgroup_id only identifies containers on the unified (v2) hierarchy
+pub fn is_cgroup2_unified(root: &Path) -> bool {
+    root.join("cgroup.controllers").exists()
+}
+
+// The cgroup id of a cgroup2 directory is its inode number.
+pub fn cgroup_id(path: &Path) -> Option<CgroupID> {
+    fs::metadata(path).ok().map(|m| m.ino())
+}
+
+// Walks the cgroup2 hierarchy once and returns the ids of the cgroups belonging to the given
+// containers, including nested cgroups created inside a container.
+pub fn container_cgroup_ids(root: &Path, cids: &HashSet<String>) -> HashMap<String, Vec<CgroupID>> {
+    let mut res: HashMap<String, Vec<CgroupID>> = HashMap::new();
+    if cids.is_empty() {
+        return res;
+    }
+    let mut stack: Vec<(PathBuf, usize, Option<String>)> = vec![(root.to_path_buf(), 0, None)];
+    while let Some((dir, depth, owner)) = stack.pop() {
+        let entries = match fs::read_dir(&dir) {
+            Ok(entries) => entries,
+            Err(_) => continue,
+        };
+        for entry in entries.flatten() {
+            let is_dir = entry.file_type().map(|t| t.is_dir()).unwrap_or(false);
+            if !is_dir {
+                continue;
+            }
+            let name = entry.file_name();
+            let owner = owner.clone().or_else(|| {
+                get_container_id_from_cgroup(&format!("/{}", name.to_string_lossy()))
+                    .filter(|cid| cids.contains(cid))
+            });
+            let path = entry.path();
+            if let Some(cid) = &owner {
+                if let Ok(m) = entry.metadata() {
+                    res.entry(cid.clone()).or_default().push(m.ino());
+                }
+            }
+            if depth + 1 < MAX_CGROUP_WALK_DEPTH {
+                stack.push((path, depth + 1, owner));
+            }
+        }
+    }
+    res
+}
+
+// Resolves the cgroup2 id of a process from the "0::<path>" line of /proc/pid/cgroup.
+pub fn pid_cgroup_id(root: &Path, pid: u32) -> Option<CgroupID> {
+    let data = fs::read_to_string(format!("/proc/{}/cgroup", pid)).ok()?;
+    let path = data.lines().find_map(|line| line.strip_prefix("0::"))?;
+    cgroup_id(&root.join(path.trim().trim_start_matches('/')))
+}
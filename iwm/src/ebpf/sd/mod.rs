@@ -1,2 +1,3 @@
 pub mod target;
-pub mod container_id;
\ No newline at end of file
+pub mod container_id;
+pub mod cgroup;
@@ -1,7 +1,8 @@
-use std::collections::HashMap;
+use std::collections::{HashMap, HashSet};
 use std::fs::File;
 use std::hash::{Hash};
 use std::num::NonZeroUsize;
+use std::path::Path;
 use std::str::FromStr;
 use std::sync::{Mutex};
 use lru::LruCache;
@@ -9,6 +10,7 @@ use log::{debug, warn, info};
 
 
 use crate::common::labels::Labels;
+use crate::ebpf::sd::cgroup::{container_cgroup_ids, is_cgroup2_unified, pid_cgroup_id, CgroupID, CGROUP2_ROOT};
 use crate::ebpf::sd::container_id::{container_id_from_target, get_container_id_from_pid};
 use crate::ebpf::session::DiscoveryTarget;
 
@@ -18,6 +20,8 @@ pub const LABEL_PID: &str = "__process_pid__";
 pub const LABEL_SERVICE_NAME: &str = "service_name";
 pub const LABEL_SERVICE_NAME_K8S: &str = "__meta_kubernetes_pod_annotation_iwm_io_service_name";
 pub const METRIC_VALUE: &str = "process_cpu";
+pub const OFF_CPU_METRIC_VALUE: &str = "off_cpu";
+pub const MEMORY_METRIC_VALUE: &str = "memory";
 pub const RESERVED_LABEL_PREFIX: &str = "__";
 
 #[derive(Debug, Clone)]
@@ -29,7 +33,7 @@ pub struct EbpfTarget {
 }
 
 impl EbpfTarget {
-    fn new(cid: String, pid: u32, target: DiscoveryTarget) -> Self {
+    pub fn new(cid: String, pid: u32, target: DiscoveryTarget) -> Self {
         let service_name = match target.get(LABEL_SERVICE_NAME) {
             Some(name) if !name.is_empty() => name.clone(),
             _ => infer_service_name(target.clone()),
@@ -117,6 +121,12 @@ pub struct TargetFinder {
     pid2target: HashMap<u32, EbpfTarget>,
     container_id_cache: Mutex<LruCache<u32, String>>,
     default_target: Option<EbpfTarget>,
+    // Container targets by the cgroup id BPF puts in the sample keys, None for cgroups of no
+    // target. Built from the cgroup2 hierarchy on every update, cgroups created since are added
+    // as their samples come in.
+    cgroup2target: Mutex<HashMap<CgroupID, Option<EbpfTarget>>>,
+    // without the unified hierarchy the cgroup ids of BPF don't identify containers
+    cgroup2: bool,
     fs: File
 }
 
@@ -129,6 +139,8 @@ impl TargetFinder {
                 LruCache::new(NonZeroUsize::try_from(container_cache_size).unwrap())
             ),
             default_target: None,
+            cgroup2target: Mutex::new(HashMap::new()),
+            cgroup2: is_cgroup2_unified(Path::new(CGROUP2_ROOT)),
             fs
         }
     }
@@ -150,6 +162,26 @@ impl TargetFinder {
         return None;
     }
 
+    // All the samples of a cgroup belong to the same container, /proc is only read for the first
+    // sample of a cgroup that appeared since the last update. Targets given by pid come first.
+    pub(crate) fn find_target_by_cgroup(&self, pid: &u32, cgroup_id: CgroupID) -> Option<EbpfTarget> {
+        if let Some(target) = self.pid2target.get(pid) {
+            return Some(target.clone());
+        }
+        if !self.cgroup2 || cgroup_id == 0 {
+            return self.find_target(pid);
+        }
+        if let Some(target) = self.cgroup2target.lock().unwrap().get(&cgroup_id) {
+            return target.clone();
+        }
+        let target = self.find_target(pid);
+        // a pid gone before we looked says nothing about its cgroup
+        if target.is_some() || Path::new(&format!("/proc/{}", pid)).exists() {
+            self.cgroup2target.lock().unwrap().insert(cgroup_id, target.clone());
+        }
+        target
+    }
+
     pub(crate) fn remove_dead_pid(&mut self, pid: &u32) {
         self.pid2target.remove(pid);
         let mut cache = self.container_id_cache.lock().unwrap();
@@ -160,6 +192,7 @@ impl TargetFinder {
         info!("target update");
         self.set_targets(args);
         self.resize_container_id_cache(args.container_cache_size);
+        self.set_cgroup_targets();
     }
 
     fn set_targets(&mut self, opts: &TargetsOptions) {
@@ -201,6 +234,21 @@ impl TargetFinder {
         debug!("created targets: {}", self.cid2target.len());
     }
 
+    fn set_cgroup_targets(&mut self) {
+        let mut cgroup2target = HashMap::new();
+        if self.cgroup2 {
+            let cids: HashSet<String> = self.cid2target.keys().cloned().collect();
+            for (cid, ids) in container_cgroup_ids(Path::new(CGROUP2_ROOT), &cids) {
+                let target = self.cid2target.get(&cid).cloned();
+                for id in ids {
+                    cgroup2target.insert(id, target.clone());
+                }
+            }
+        }
+        debug!("cgroups of targets: {}", cgroup2target.len());
+        *self.cgroup2target.lock().unwrap() = cgroup2target;
+    }
+
     fn resize_container_id_cache(&mut self, size: usize) {
         self.container_id_cache.lock().unwrap().resize(NonZeroUsize::try_from(size).unwrap());
     }
@@ -215,6 +263,29 @@ impl TargetFinder {
             .collect()
     }
 
+    // cgroup ids of all current targets, used as the first stage filter in do_perf_event
+    pub(crate) fn cgroup_ids(&self, root: &Path) -> HashSet<CgroupID> {
+        let mut ids: HashSet<CgroupID> = if self.cgroup2 && root == Path::new(CGROUP2_ROOT) {
+            // walked by the last update already
+            self.cgroup2target
+                .lock()
+                .unwrap()
+                .iter()
+                .filter(|(_, target)| target.is_some())
+                .map(|(id, _)| *id)
+                .collect()
+        } else {
+            let cids: HashSet<String> = self.cid2target.keys().cloned().collect();
+            container_cgroup_ids(root, &cids).into_values().flatten().collect()
+        };
+        for pid in self.pid2target.keys() {
+            if let Some(id) = pid_cgroup_id(root, *pid) {
+                ids.insert(id);
+            }
+        }
+        ids
+    }
+
     fn targets(&self) -> Vec<EbpfTarget> {
         self.cid2target.values().cloned().collect()
     }
@@ -10,17 +10,15 @@ use std::ffi::c_void;
 use std::io::Read;
 
 
-use std::os::fd::{AsFd, AsRawFd, RawFd};
-use std::path::Path;
+use std::os::fd::{AsFd, AsRawFd, OwnedFd, RawFd};
+use std::path::{Path, PathBuf};
 use std::sync::mpsc::{channel, Receiver};
+use std::time::{Duration, Instant};
 
 use libbpf_rs::libbpf_sys::bpf_map_batch_opts;
 use libbpf_rs::skel::{OpenSkel, Skel, SkelBuilder};
-use libbpf_rs::{libbpf_sys, Link, MapFlags, Program};
-use libbpf_sys::{
-    __u32, bpf_map_delete_elem, bpf_map_lookup_batch,
-    bpf_map_lookup_elem, size_t,
-};
+use libbpf_rs::{libbpf_sys, Link, MapFlags, MapType, Program};
+use libbpf_sys::{bpf_map_lookup_and_delete_batch, size_t};
 use log::{debug, error, info};
 
 
@@ -30,29 +28,75 @@ use profile::*;
 
 use crate::common::collector::{ProfileSample, SampleType};
 
+use crate::ebpf::map_sizes::{MapSizeOptions, MapSizes};
 use crate::ebpf::metrics::metrics::ProfileMetrics;
+use crate::ebpf::overhead::{
+    enable_bpf_stats, read_map_errors, CostTracker, RateController, MAP_ERROR_COUNTS, MAP_ERROR_PY_SYMBOLS,
+    MAP_ERROR_STACKS,
+};
+use crate::ebpf::python::events::PyEventsConsumer;
+use crate::ebpf::python::procinfo::{get_libc, symbol_file_offsets};
+use crate::ebpf::python::pyperf::{bpf_loop_supported, Pyperf, PyperfOptions};
+use crate::ebpf::python::stack::merge_native_python;
 use crate::ebpf::ring::perf_event::PerfEvent;
-use crate::ebpf::ring::reader::Reader;
+use crate::ebpf::ring::reader::{EventsReader, Reader};
+use crate::ebpf::ring::ringbuf::{disable_ringbuf_map, ringbuf_supported, RingBuffer};
 
 
+use crate::ebpf::sd::cgroup::{is_cgroup2_unified, pid_cgroup_id, CgroupID, CGROUP2_ROOT};
 use crate::ebpf::sd::target::{EbpfTarget, TargetFinder, TargetsOptions};
-use crate::ebpf::session::profile::profile_bss_types::{pid_config, sample_key};
+use crate::ebpf::session::profile::profile_bss_types::{off_cpu_entry, pid_config, pid_event_limiter, sample_key};
+use crate::ebpf::symtab::debuginfod::{DebuginfodFetcher, DebuginfodOptions};
 use crate::ebpf::symtab::elf_cache::ElfCacheDebugInfo;
 use crate::ebpf::symtab::elf_module::ElfTableOptions;
-use crate::ebpf::symtab::gcache::{GCacheDebugInfo, Resource};
+use crate::ebpf::symtab::gcache::GCacheDebugInfo;
+use crate::ebpf::symtab::kallsyms::Kallsyms;
 use crate::ebpf::symtab::perf_symbol_table::PerfSymbolTable;
 use crate::ebpf::symtab::proc::{ProcTable, ProcTableDebugInfo};
 use crate::ebpf::symtab::symbols::{CacheOptions, SymbolCache};
 use crate::ebpf::symtab::symtab::SymbolTable;
-use crate::ebpf::sync::{ProfilingType};
+use crate::ebpf::sync::{PidEvent, PidOp, ProfilingType};
+use crate::ebpf::unwind::snapshot::{
+    stack_snapshots_supported, unwind_snapshot, SnapshotConsumer, SnapshotMapping, SnapshotQueue, SnapshotUnwinder,
+    StackSnapshot,
+};
+use crate::ebpf::unwind::unwinder::DwarfUnwinder;
+use crate::ebpf::wait_for_bpf_programs;
 use crate::ebpf::wait_group::WaitGroup;
-use crate::error::Error::{InvalidData, OSError};
+use crate::ebpf::work_pool::{run_jobs, worker_count};
+use crate::error::Error::{InvalidData, MapError, OSError, SessionError};
 use crate::error::Result;
 
 mod profile {
     include!("bpf/profile.skel.rs");
 }
 
+// must match the DEFINE_COUNTS_MAP / DEFINE_STACKS_MAP generations in profile.bpf.h
+const COUNTS_MAPS: [&str; 2] = ["counts0", "counts1"];
+const STACKS_MAPS: [&str; 2] = ["stacks0", "stacks1"];
+const OFF_CPU_COUNTS_MAPS: [&str; 2] = ["off_cpu_counts0", "off_cpu_counts1"];
+const OFF_CPU_STACKS_MAPS: [&str; 2] = ["off_cpu_stacks0", "off_cpu_stacks1"];
+const ALLOC_COUNTS_MAPS: [&str; 2] = ["alloc_counts0", "alloc_counts1"];
+const DWARF_STACKS_MAPS: [&str; 2] = ["dwarf_stacks0", "dwarf_stacks1"];
+// must match DWARF_STACK_ID_BIT in profile.bpf.h
+const DWARF_STACK_ID_BIT: i64 = 1 << 32;
+// stack ids of blocked threads carried over a drained generation, only known to userspace
+const OFF_CPU_CARRIED_STACK_ID_BIT: i64 = 1 << 33;
+// set by userspace on the ids of drained off-cpu keys, they index OFF_CPU_STACKS_MAPS
+const OFF_CPU_STACK_ID_BIT: i64 = 1 << 34;
+// libc functions whose calls are sampled in allocation profiling
+const ALLOC_FUNCS: [&str; 3] = ["malloc", "calloc", "realloc"];
+// libcs whose ALLOC_FUNCS offsets are remembered, most hosts run a handful of them
+const ALLOC_OFFSETS_MAX_FILES: usize = 256;
+// must match profile.bpf.h
+const PROG_IDX_PYTHON: u32 = 0;
+const PROG_IDX_DWARF: u32 = 1;
+const PROG_IDX_STACK_SNAPSHOT: u32 = 2;
+const CGROUP_FILTER_SKIP: u8 = 0;
+const CGROUP_FILTER_TARGET: u8 = 1;
+// per-cpu buffer of snapshot_events, in pages
+const SNAPSHOT_PERF_BUFFER_PAGES: usize = 64;
+
 #[derive(Clone)]
 pub struct SessionOptions {
     pub collect_user: bool,
@@ -63,6 +107,73 @@ pub struct SessionOptions {
     pub metrics: Arc<ProfileMetrics>,
     pub sample_rate: u32,
     pub cache_options: CacheOptions,
+    pub counts_map_type: CountsMapType,
+    // deliver pid events through a BPF_MAP_TYPE_RINGBUF when the kernel supports it
+    pub use_ringbuf: bool,
+    // process info requests allowed per second on each cpu, 0 disables the limit
+    pub pid_events_per_sec: u64,
+    // how long a cpu may hold back a partially filled batch of pid events
+    pub pid_events_flush_interval: Duration,
+    // max_entries of the maps sized at load time, derived from the host when not given
+    pub map_sizes: MapSizeOptions,
+    // reject samples from cgroups known to hold no target before looking at the task (cgroup v2 only)
+    pub cgroup_filter: bool,
+    // python frames read per sample, up to PYTHON_STACK_MAX_LEN
+    pub python_stack_depth: u32,
+    // walk python stacks with bpf_loop instead of tail calls when the kernel has it
+    pub python_bpf_loop: bool,
+    // keeps python symbol ids stable across restarts, None disables it
+    pub python_symbols_path: Option<PathBuf>,
+    // directory keeping the symbol tables of ELFs with a build id across restarts, None disables it
+    pub symbol_index_path: Option<PathBuf>,
+    // fetch the symbols of stripped ELFs from debuginfod servers, None disables it
+    pub debuginfod: Option<DebuginfodOptions>,
+    // threads symbolizing the pids of a round, 0 uses one per cpu and 1 keeps it on the caller
+    pub symbolize_workers: usize,
+    // also record the time targeted pids spend blocked, needs tp_btf (5.5+ with BTF)
+    pub off_cpu: bool,
+    // blocked periods shorter than this are not recorded
+    pub off_cpu_min_duration: Duration,
+    // sample the libc allocations of targeted pids through uprobes
+    pub alloc_profiling: bool,
+    // average number of allocated bytes between two samples
+    pub alloc_sample_bytes: u64,
+    // unwind native stacks of non python pids from .eh_frame in BPF, for binaries built without
+    // frame pointers. Needs bpf_loop (5.17+) and x86_64
+    pub dwarf_unwinding: bool,
+    // copy the top of the user stack of pids dwarf unwinding can't take and unwind it in
+    // userspace. Needs bpf_task_pt_regs (5.15+) and x86_64
+    pub stack_snapshots: bool,
+    // bytes of user stack copied per sample, up to 16KiB
+    pub stack_snapshot_size: u32,
+    // snapshot bytes sent per second by all cpus together, samples over it are dropped
+    pub stack_snapshot_bytes_per_sec: u64,
+    // share of the host CPU the agent and its BPF programs may use, the sample rate is lowered
+    // down to min_sample_rate to stay within it. 0 keeps sample_rate fixed
+    pub cpu_budget: f64,
+    pub min_sample_rate: u32,
+    // enable BPF run time stats for the per program metrics. They are host-wide: while the agent
+    // runs the kernel takes two timestamps per run of every BPF program on the host, not only of
+    // ours. cpu_budget enables them as well
+    pub bpf_stats: bool,
+}
+
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub enum CountsMapType {
+    // a single BPF_MAP_TYPE_HASH shared by all cpus, incremented atomically
+    Shared,
+    // BPF_MAP_TYPE_PERCPU_HASH, every cpu counts into its own slot and userspace sums them
+    PerCpu,
+    // BPF_MAP_TYPE_LRU_PERCPU_HASH, same as PerCpu but evicts old keys instead of dropping new ones.
+    // The kernel evicts before the map is full and the lost counts are not reported, so the stacks
+    // map is swept every round.
+    LruPerCpu,
+}
+
+impl Default for CountsMapType {
+    fn default() -> Self {
+        CountsMapType::Shared
+    }
 }
 
 enum SampleAggregation {
@@ -105,11 +216,37 @@ pub struct Session<'a> {
     pub(crate) sym_cache: Arc<Mutex<SymbolCache>>,
     tmp: Option<Arc<Mutex<PerfSymbolTable>>>,
     pub bpf: ProfileSkel<'a>,
+    // loaded when python_enabled, pids of ProfilingType::Python are tail called into it
+    pyperf: Option<Pyperf<'a>>,
 
     events_reader: Option<Arc<Mutex<Reader>>>,
 
     options: SessionOptions,
     pub(crate) round_number: u32,
+    // index of the counts/stacks pair do_perf_event currently writes into
+    generation: usize,
+    possible_cpus: usize,
+    map_sizes: MapSizes,
+    ringbuf: bool,
+    // last seen sum of pid_event_limiter.dropped over all cpus
+    pid_events_dropped: u64,
+    cgroup_filter: bool,
+    off_cpu: bool,
+    // stacks of the threads still blocked when their generation was drained, by carried stack id
+    off_cpu_carried: HashMap<i64, Vec<u8>>,
+    off_cpu_carried_seq: u32,
+    // uprobes on the libc allocation functions of each allocation profiled pid
+    alloc_links: HashMap<u32, Vec<Link>>,
+    // file offsets of ALLOC_FUNCS by (dev, inode) of the libc, each libc is parsed once
+    alloc_offsets: HashMap<(u64, u64), Vec<Option<u64>>>,
+    // set when dwarf_unwinding is enabled and supported, owns the unwind tables of the pids
+    dwarf: Option<DwarfUnwinder>,
+    // set when stack_snapshots is enabled and supported
+    snapshots: Option<SnapshotUnwinder>,
+    snapshot_queue: Arc<Mutex<SnapshotQueue>>,
+    // cgroup ids marked CGROUP_FILTER_TARGET and CGROUP_FILTER_SKIP in the cgroup_filter map
+    filtered_cgroups: HashSet<CgroupID>,
+    skipped_cgroups: HashSet<CgroupID>,
     started: bool,
     kprobes: Vec<Link>,
 
@@ -124,22 +261,72 @@ pub struct Session<'a> {
     fds: Vec<RawFd>,
     pids: Arc<Mutex<Pids>>,
     perf_events: Vec<PerfEvent>,
+    // set when cpu_budget is, owns the current sample rate
+    rate_controller: Option<RateController>,
+    // run time stats stay enabled while this is open
+    bpf_stats: Option<OwnedFd>,
+    costs: CostTracker,
 }
 
 impl Session<'_> {
     pub fn new(target_finder: Arc<Mutex<TargetFinder>>, opts: SessionOptions) -> Result<Self> {
+        let debuginfod = match &opts.debuginfod {
+            Some(options) => Some(DebuginfodFetcher::new(options.clone())?),
+            None => None,
+        };
         let sym_cache = Arc::new(Mutex::new(
-            SymbolCache::new(opts.cache_options, &opts.metrics.symtab).unwrap(),
+            SymbolCache::new(opts.cache_options, opts.symbol_index_path.clone(), debuginfod, &opts.metrics.symtab).unwrap(),
         ));
-        bump_memlock_rlimit().unwrap();
+        let per_cpu_counts = opts.counts_map_type != CountsMapType::Shared;
+        let map_sizes = MapSizes::new(&opts.map_sizes, per_cpu_counts);
+        bump_memlock_rlimit(map_sizes.locked_bytes(per_cpu_counts)).unwrap();
         let mut builder = ProfileSkelBuilder::default();
         builder.obj_builder.debug(true);
-        let open_skel = builder.open().unwrap();
+        let mut open_skel = builder.open().unwrap();
+        configure_counts_maps(&mut open_skel, opts.counts_map_type)?;
+        configure_map_sizes(&mut open_skel, &map_sizes)?;
+        let ringbuf = opts.use_ringbuf && ringbuf_supported();
+        open_skel.rodata_mut().use_ringbuf = ringbuf;
+        open_skel.rodata_mut().pid_events_per_sec = opts.pid_events_per_sec;
+        open_skel.rodata_mut().pid_events_flush_ns = opts.pid_events_flush_interval.as_nanos() as u64;
+        let cgroup_filter = opts.cgroup_filter && is_cgroup2_unified(Path::new(CGROUP2_ROOT));
+        if opts.cgroup_filter && !cgroup_filter {
+            info!("cgroup v2 is not mounted at {}, cgroup filter disabled", CGROUP2_ROOT);
+        }
+        open_skel.rodata_mut().filter_cgroups = cgroup_filter;
+        if !ringbuf {
+            disable_ringbuf_map(open_skel.maps_mut().events_rb())?;
+        }
+        let off_cpu = opts.off_cpu && Path::new("/sys/kernel/btf/vmlinux").exists();
+        if opts.off_cpu && !off_cpu {
+            info!("kernel BTF is not available, off-cpu profiling disabled");
+        }
+        configure_off_cpu(&mut open_skel, off_cpu, opts.off_cpu_min_duration)?;
+        configure_alloc_profiling(&mut open_skel, opts.alloc_profiling, opts.alloc_sample_bytes)?;
+        let dwarf = opts.dwarf_unwinding && cfg!(target_arch = "x86_64") && bpf_loop_supported();
+        if opts.dwarf_unwinding && !dwarf {
+            info!("bpf_loop is not available or not on x86_64, dwarf unwinding disabled");
+        }
+        configure_dwarf_unwinding(&mut open_skel, dwarf, map_sizes.pids)?;
+        let snapshots = opts.stack_snapshots && cfg!(target_arch = "x86_64") && stack_snapshots_supported();
+        if opts.stack_snapshots && !snapshots {
+            info!("bpf_task_pt_regs is not available or not on x86_64, stack snapshots disabled");
+        }
+        configure_stack_snapshots(&mut open_skel, snapshots, ringbuf, &opts)?;
         let bpf = open_skel.load().unwrap();
+        let dwarf = if dwarf { install_dwarf_unwinder(&bpf) } else { None };
+        let snapshots = if snapshots { install_stack_snapshots(&bpf) } else { None };
+        let possible_cpus = libbpf_rs::num_possible_cpus().unwrap();
+        let pyperf = if opts.python_enabled {
+            load_pyperf(&bpf, &opts, &map_sizes)
+        } else {
+            None
+        };
 
         Ok(Self {
             started: false,
             bpf,
+            pyperf,
             tmp: None,
             target_finder,
             sym_cache,
@@ -150,12 +337,32 @@ impl Session<'_> {
             pids: Default::default(),
             kprobes: vec![],
             perf_events: vec![],
+            rate_controller: None,
+            bpf_stats: None,
+            costs: CostTracker::default(),
             round_number: 0,
+            generation: 0,
+            possible_cpus,
+            map_sizes,
+            ringbuf,
+            pid_events_dropped: 0,
+            cgroup_filter,
+            off_cpu,
+            off_cpu_carried: HashMap::new(),
+            off_cpu_carried_seq: 0,
+            alloc_links: HashMap::new(),
+            alloc_offsets: HashMap::new(),
+            dwarf,
+            snapshots,
+            snapshot_queue: Default::default(),
+            filtered_cgroups: HashSet::new(),
+            skipped_cgroups: HashSet::new(),
         })
     }
 
     pub fn start(&mut self) -> Result<()> {
-        bump_memlock_rlimit().expect("Failed to increase rlimit");
+        bump_memlock_rlimit(self.map_sizes.locked_bytes(self.options.counts_map_type != CountsMapType::Shared))
+            .expect("Failed to increase rlimit");
         self.bpf.attach().unwrap();
 
         self.perf_events = attach_perf_events(
@@ -163,6 +370,16 @@ impl Session<'_> {
             self.bpf.progs_mut().do_perf_event(),
         )
         .unwrap();
+        if self.options.bpf_stats || self.options.cpu_budget > 0.0 {
+            self.bpf_stats = enable_bpf_stats();
+        }
+        if self.options.cpu_budget > 0.0 {
+            self.rate_controller = Some(RateController::new(
+                self.options.sample_rate,
+                self.options.min_sample_rate,
+                self.options.cpu_budget,
+            ));
+        }
         self.wg.add(4);
 
         self.started = true;
@@ -170,6 +387,45 @@ impl Session<'_> {
         Ok(())
     }
 
+    // Creates the reader for pid events matching the transport the programs were loaded with.
+    pub fn events_reader(&self) -> Result<EventsReader> {
+        if self.ringbuf {
+            return Ok(EventsReader::RingBuffer(RingBuffer::new(
+                self.bpf.maps().events_rb(),
+            )?));
+        }
+        Ok(EventsReader::PerfEventArray(Reader::new(
+            self.bpf.maps().events(),
+        )?))
+    }
+
+    // Creates the consumer of python samples, None when pyperf is not loaded.
+    pub fn python_events_consumer(&self) -> Result<Option<PyEventsConsumer>> {
+        match &self.pyperf {
+            Some(pyperf) => Ok(Some(pyperf.events_consumer()?)),
+            None => Ok(None),
+        }
+    }
+
+    // Creates the consumer of stack snapshots, None when they are disabled.
+    pub fn stack_snapshot_consumer(&self) -> Result<Option<SnapshotConsumer>> {
+        if self.snapshots.is_none() {
+            return Ok(None);
+        }
+        let reader = if self.ringbuf {
+            EventsReader::RingBuffer(RingBuffer::new(self.bpf.maps().snapshot_events_rb())?)
+        } else {
+            EventsReader::PerfEventArray(Reader::with_pages(
+                self.bpf.maps().snapshot_events(),
+                SNAPSHOT_PERF_BUFFER_PAGES,
+            )?)
+        };
+        Ok(Some(SnapshotConsumer {
+            reader,
+            queue: self.snapshot_queue.clone(),
+        }))
+    }
+
     fn stop_locked(&mut self) {
         self.wg.done();
     }
@@ -186,9 +442,13 @@ impl Session<'_> {
 
     pub fn update_targets(&mut self, args: &TargetsOptions) {
         let mut targets = Vec::new();
+        let mut cgroup_ids = None;
         {
             let mut target_finder = self.target_finder.lock().unwrap();
             target_finder.update(args);
+            if self.cgroup_filter {
+                cgroup_ids = Some(target_finder.cgroup_ids(Path::new(CGROUP2_ROOT)));
+            }
 
             let pids = self.pids.lock().unwrap();
             for p in pids.unknown.iter() {
@@ -200,6 +460,9 @@ impl Session<'_> {
                 }
             }
         }
+        if let Some(ids) = cgroup_ids {
+            self.update_cgroup_filter(ids);
+        }
         targets.iter_mut().for_each(|(t, p)| {
             self.start_profiling_locked(&p, t);
             let mut pids = self.pids.lock().unwrap();
@@ -207,20 +470,180 @@ impl Session<'_> {
         });
     }
 
+    // Skipped cgroups may hold new targets now, they go through the pid path again and are skipped
+    // again by skip_cgroups.
+    fn update_cgroup_filter(&mut self, ids: HashSet<CgroupID>) {
+        let m = self.bpf.maps();
+        let filter = m.cgroup_filter();
+        for id in self.skipped_cgroups.drain() {
+            let _ = filter.delete(&id.to_ne_bytes());
+        }
+        for id in self.filtered_cgroups.difference(&ids) {
+            let _ = filter.delete(&id.to_ne_bytes());
+        }
+        for id in ids.difference(&self.filtered_cgroups) {
+            if let Err(err) = filter.update(&id.to_ne_bytes(), &[CGROUP_FILTER_TARGET], MapFlags::ANY) {
+                error!("updating cgroup filter err: {:?}", err);
+            }
+        }
+        debug!("cgroup filter: {} cgroups", ids.len());
+        self.filtered_cgroups = ids;
+    }
+
+    // The cgroups of pids without a target are left to the filter until the next target update.
+    fn skip_cgroups(&mut self, pids: &[u32]) {
+        let m = self.bpf.maps();
+        let filter = m.cgroup_filter();
+        for pid in pids {
+            let id = match pid_cgroup_id(Path::new(CGROUP2_ROOT), *pid) {
+                Some(id) => id,
+                None => continue,
+            };
+            // a target cgroup may hold pids of no target, pid targets for instance
+            if self.filtered_cgroups.contains(&id) || self.skipped_cgroups.contains(&id) {
+                continue;
+            }
+            if filter.update(&id.to_ne_bytes(), &[CGROUP_FILTER_SKIP], MapFlags::NO_EXIST).is_ok() {
+                self.skipped_cgroups.insert(id);
+            }
+        }
+    }
+
     fn start_profiling_locked(&mut self, pid: &u32, target: &EbpfTarget) {
         if !self.started {
             return;
         }
-        let typ = self.select_profiling_type(pid.clone(), target);
-        // if typ.typ == ProfilingType::Python {
-        //     self.try_start_python_profiling(pid, target, typ)
-        // }
+        let mut typ = self.select_profiling_type(pid.clone(), target);
+        if matches!(typ.typ, ProfilingType::Python) {
+            typ = self.try_start_python_profiling(pid.clone(), target, typ);
+        }
+        if matches!(typ.typ, ProfilingType::Dwarf) {
+            typ = self.try_start_dwarf_unwinding(pid.clone(), typ);
+        }
+        if matches!(typ.typ, ProfilingType::StackSnapshot) {
+            typ = self.try_start_stack_snapshots(pid.clone(), typ);
+        }
+        let profiled = matches!(
+            typ.typ,
+            ProfilingType::FramePointers | ProfilingType::Python | ProfilingType::Dwarf | ProfilingType::StackSnapshot
+        );
         self.set_pid_config(
             pid.clone(),
             typ,
             self.options.collect_user,
             self.options.collect_kernel,
         );
+        if profiled && self.options.alloc_profiling {
+            self.start_alloc_profiling(*pid);
+        }
+    }
+
+    // Attaches the allocation uprobes to the libc of the pid. An exec'd pid gets new ones, the old
+    // links are dropped with the previous entry.
+    fn start_alloc_profiling(&mut self, pid: u32) {
+        self.alloc_links.remove(&pid);
+        let libc = match get_libc(pid) {
+            Ok((libc, _)) => libc,
+            Err(err) => {
+                debug!("no allocation profiling for pid {}: {}", pid, err);
+                return;
+            }
+        };
+        let offsets = match self.alloc_offsets.get(&(libc.dev, libc.inode)) {
+            Some(offsets) => offsets.clone(),
+            None => {
+                let offsets = match symbol_file_offsets(&libc, &ALLOC_FUNCS) {
+                    Ok(offsets) => offsets,
+                    Err(err) => {
+                        debug!("no allocation profiling for pid {}: {}", pid, err);
+                        return;
+                    }
+                };
+                if self.alloc_offsets.len() >= ALLOC_OFFSETS_MAX_FILES {
+                    self.alloc_offsets.clear();
+                }
+                self.alloc_offsets.insert((libc.dev, libc.inode), offsets.clone());
+                offsets
+            }
+        };
+        let mut links = Vec::with_capacity(ALLOC_FUNCS.len());
+        for (func, offset) in ALLOC_FUNCS.iter().zip(offsets) {
+            let offset = match offset {
+                Some(offset) => offset,
+                None => {
+                    debug!("pid {}: {} not found in {:?}", pid, func, libc.host_path);
+                    continue;
+                }
+            };
+            let mut progs = self.bpf.progs_mut();
+            let prog = match *func {
+                "malloc" => progs.malloc_enter(),
+                "calloc" => progs.calloc_enter(),
+                _ => progs.realloc_enter(),
+            };
+            match prog.attach_uprobe(false, pid as i32, &libc.host_path, offset as usize) {
+                Ok(link) => links.push(link),
+                Err(err) => error!("attach {} uprobe to pid {}: {:?}", func, pid, err),
+            }
+        }
+        self.alloc_links.insert(pid, links);
+    }
+
+    // Fills py_pid_config for the pid, processes pyperf can't read are profiled with frame pointers.
+    fn try_start_python_profiling(&mut self, pid: u32, target: &EbpfTarget, pi: ProcInfoLite) -> ProcInfoLite {
+        let m = &self.options.metrics.python;
+        let service_name = target.service_name();
+        let pyperf = match self.pyperf.as_mut() {
+            Some(pyperf) => pyperf,
+            None => return ProcInfoLite { typ: ProfilingType::FramePointers, ..pi },
+        };
+        match pyperf.add_pid(pid, self.options.collect_user, self.options.collect_kernel) {
+            Ok(()) => {
+                m.process_init_success.with_label_values(&[&service_name]).inc();
+                pi
+            }
+            Err(err) => {
+                m.pid_data_error.with_label_values(&[&service_name]).inc();
+                error!("python profiling of pid {} failed, using frame pointers: {}", pid, err);
+                ProcInfoLite { typ: ProfilingType::FramePointers, ..pi }
+            }
+        }
+    }
+
+    // Uploads the unwind tables of the pid. Pids whose tables don't fit are left to stack
+    // snapshots when enabled, to frame pointers otherwise.
+    fn try_start_dwarf_unwinding(&mut self, pid: u32, pi: ProcInfoLite) -> ProcInfoLite {
+        let fallback = if self.snapshots.is_some() {
+            ProfilingType::StackSnapshot
+        } else {
+            ProfilingType::FramePointers
+        };
+        let dwarf = match self.dwarf.as_mut() {
+            Some(dwarf) => dwarf,
+            None => return ProcInfoLite { typ: fallback, ..pi },
+        };
+        let m = self.bpf.maps();
+        match dwarf.add_pid(pid, m.unwind_rows(), m.unwind_infos()) {
+            Ok(()) => pi,
+            Err(err) => {
+                debug!("dwarf unwinding of pid {} failed, using {:?}: {}", pid, fallback, err);
+                ProcInfoLite { typ: fallback, ..pi }
+            }
+        }
+    }
+
+    fn try_start_stack_snapshots(&mut self, pid: u32, pi: ProcInfoLite) -> ProcInfoLite {
+        let snapshots = match self.snapshots.as_mut() {
+            Some(snapshots) => snapshots,
+            None => return ProcInfoLite { typ: ProfilingType::FramePointers, ..pi },
+        };
+        match snapshots.add_pid(pid) {
+            Ok(()) => pi,
+            Err(err) => {
+                debug!("stack snapshots of pid {} failed, using frame pointers: {}", pid, err);
+                ProcInfoLite { typ: ProfilingType::FramePointers, ..pi }
+            }
+        }
     }
 
     fn set_pid_config(
@@ -268,6 +691,18 @@ impl Session<'_> {
                         comm,
                         typ: ProfilingType::Python,
                     }
+                } else if self.dwarf.is_some() {
+                    ProcInfoLite {
+                        pid,
+                        comm,
+                        typ: ProfilingType::Dwarf,
+                    }
+                } else if self.snapshots.is_some() {
+                    ProcInfoLite {
+                        pid,
+                        comm,
+                        typ: ProfilingType::StackSnapshot,
+                    }
                 } else {
                     ProcInfoLite {
                         pid,
@@ -286,136 +721,331 @@ impl Session<'_> {
         }
     }
 
-    pub fn process_pid_info_requests(&mut self, pid: u32) -> Result<()> {
-        let already_dead = {
-            let pids = self.pids.lock().unwrap();
-            pids.dead.contains_key(&pid)
-        };
-        if already_dead {
-            debug!("pid info request for dead pid: {}", pid);
+    // Handles the events of one record under a single pass over the pids and target finder locks.
+    pub fn process_pid_events(&mut self, events: &[PidEvent]) -> Result<()> {
+        let mut requests: Vec<u32> = Vec::with_capacity(events.len());
+        {
+            let mut pids = self.pids.lock().unwrap();
+            for e in events {
+                if e.op == PidOp::Dead.to_u32() {
+                    debug!("pid dead: {}", e.pid);
+                    pids.dead.insert(e.pid, ());
+                } else if e.op == PidOp::RequestUnknownProcessInfo.to_u32()
+                    || e.op == PidOp::RequestExecProcessInfo.to_u32()
+                {
+                    requests.push(e.pid);
+                } else {
+                    error!("unknown pid event: op={}, pid={}", e.op, e.pid);
+                }
+            }
+            requests.retain(|pid| !pids.dead.contains_key(pid));
+        }
+        requests.sort_unstable();
+        requests.dedup();
+        if requests.is_empty() {
             return Ok(());
         }
 
-        let target = {
+        let targets: Vec<(u32, Option<EbpfTarget>)> = {
             let target_finder = self.target_finder.lock().unwrap();
-            target_finder.find_target(&pid)
+            requests
+                .iter()
+                .map(|pid| (*pid, target_finder.find_target(pid)))
+                .collect()
         };
-
-        if target.is_none() {
-            self.save_unknown_pid_locked(&pid);
-        } else {
-            debug!("pid info request: pid={}, target={:?}", pid, target);
-            self.start_profiling_locked(&pid, &target.unwrap());
+        let mut unknown = Vec::new();
+        for (pid, target) in targets {
+            match target {
+                Some(target) => self.start_profiling_locked(&pid, &target),
+                None => unknown.push(pid),
+            }
+        }
+        if !unknown.is_empty() {
+            if self.cgroup_filter {
+                self.skip_cgroups(&unknown);
+            }
+            let mut pids = self.pids.lock().unwrap();
+            for pid in unknown {
+                pids.unknown.insert(pid, ());
+            }
         }
         Ok(())
     }
 
-    fn save_unknown_pid_locked(&mut self, pid: &u32) {
-        let mut pids = self.pids.lock().unwrap();
-        pids.unknown.insert(pid.clone(), ());
+    fn counts_map(&self, generation: usize) -> &libbpf_rs::Map {
+        self.bpf.obj.map(COUNTS_MAPS[generation]).unwrap()
     }
 
-    pub fn process_dead_pids_events(&mut self, pid: u32) -> Result<()> {
-        debug!("pid dead: {}", pid);
-        let mut pids = self.pids.lock().unwrap();
-        pids.dead.insert(pid, Default::default());
-        return Ok(());
+    fn stacks_map(&self, generation: usize) -> &libbpf_rs::Map {
+        self.bpf.obj.map(STACKS_MAPS[generation]).unwrap()
     }
 
-    pub fn process_pid_exec_requests(&mut self, pid: u32) -> Result<()> {
-        let already_dead = {
-            let pids = self.pids.lock().unwrap();
-            pids.dead.contains_key(&pid)
-        };
-        if already_dead {
-            debug!("pid info request for dead pid: {}", pid);
-            return Ok(());
+    // Points do_perf_event at the other counts/stacks pair and returns the generation that was
+    // active until now, so it can be drained without racing against new samples.
+    // Programs that read the old index right before the flip may still be writing into the drained
+    // pair, they are waited for so no key is added after its stacks were cleared.
+    fn flip_generation(&mut self) -> Result<usize> {
+        let drained = self.generation;
+        let next = (drained + 1) % COUNTS_MAPS.len();
+        self.bpf
+            .maps()
+            .active_idx()
+            .update(&0u32.to_ne_bytes(), &(next as u32).to_ne_bytes(), MapFlags::ANY)
+            .map_err(|e| MapError(format!("flip active_idx: {:?}", e)))?;
+        self.generation = next;
+        wait_for_bpf_programs();
+        Ok(drained)
+    }
+
+    fn get_counts_map_values(&self, generation: usize) -> Result<(Vec<sample_key>, Vec<u32>)> {
+        match self.drain_counts_map_batch(generation) {
+            Ok(res) => Ok(res),
+            Err(err) => {
+                debug!("batch lookup and delete failed: {:?}, falling back to per key drain", err);
+                self.drain_counts_map_keys(generation)
+            }
         }
+    }
 
-        let target = {
-            let target_finder = self.target_finder.lock().unwrap();
-            target_finder.find_target(&pid)
+    fn drain_counts_map_batch(&self, generation: usize) -> Result<(Vec<sample_key>, Vec<u32>)> {
+        let m = self.counts_map(generation);
+        let map_size = m.info().unwrap().info.max_entries as usize;
+        let value_size = self.counts_value_size();
+
+        let mut keys: Vec<sample_key> = vec![sample_key::default(); map_size];
+        let mut raw_values: Vec<u8> = vec![0; map_size * value_size];
+        // the hash map batch cursor is a bucket index, a key sized buffer is always large enough
+        let mut in_batch = sample_key::default();
+        let mut out_batch = sample_key::default();
+        let opts = bpf_map_batch_opts {
+            sz: mem::size_of::<bpf_map_batch_opts>() as size_t,
+            elem_flags: MapFlags::ANY.bits(),
+            flags: MapFlags::ANY.bits(),
         };
-
-        if target.is_none() {
-            self.save_unknown_pid_locked(&pid);
-        } else {
-            debug!("pid exec request: pid={}, target={:?}", pid, target);
-            self.start_profiling_locked(&pid, &target.unwrap());
+        let mut total = 0usize;
+        let mut first = true;
+        while total < map_size {
+            let mut count = (map_size - total) as u32;
+            let ret = unsafe {
+                bpf_map_lookup_and_delete_batch(
+                    m.as_fd().as_raw_fd(),
+                    if first {
+                        std::ptr::null_mut()
+                    } else {
+                        &mut in_batch as *mut _ as *mut c_void
+                    },
+                    &mut out_batch as *mut _ as *mut c_void,
+                    keys[total..].as_mut_ptr() as *mut c_void,
+                    raw_values[total * value_size..].as_mut_ptr() as *mut c_void,
+                    &mut count,
+                    &opts,
+                )
+            };
+            // count holds the number of returned elements even when the map is exhausted
+            if ret < 0 && -ret != libc::ENOENT {
+                if total == 0 {
+                    return Err(OSError((-ret).to_string()));
+                }
+                error!("batch lookup and delete stopped early err: {}", -ret);
+                break;
+            }
+            total += count as usize;
+            if ret < 0 {
+                break;
+            }
+            in_batch = out_batch;
+            first = false;
         }
-        Ok(())
+        keys.truncate(total);
+        let values = raw_values[..total * value_size]
+            .chunks_exact(value_size)
+            .map(|v| self.sum_counts_value(v))
+            .collect();
+        debug!("getCountsMapValues batch count: {}", total);
+        Ok((keys, values))
     }
 
-    fn get_counts_map_values(&mut self) -> Result<(Vec<sample_key>, Vec<u32>, bool)> {
-        let maps = &self.bpf.maps();
-        let m = maps.counts();
-
-        let map_size = m.info().unwrap().info.max_entries as usize;
+    fn drain_counts_map_keys(&self, generation: usize) -> Result<(Vec<sample_key>, Vec<u32>)> {
+        let m = self.counts_map(generation);
+        let per_cpu = self.options.counts_map_type != CountsMapType::Shared;
+        let mut result_keys: Vec<sample_key> = Vec::new();
+        let mut result_values: Vec<u32> = Vec::new();
+        // the generation is inactive, nothing inserts into it while it is walked
+        let keys: Vec<Vec<u8>> = m.keys().collect();
+        for bytes in keys.iter() {
+            let key = match byte_to_value::<sample_key>(bytes) {
+                Some(key) => key,
+                None => continue,
+            };
+            let value = if per_cpu {
+                m.lookup_percpu(bytes, MapFlags::ANY)
+                    .unwrap_or(None)
+                    .map(|cpus| cpus.iter().map(|v| self.sum_counts_value(v)).sum())
+            } else {
+                m.lookup(bytes, MapFlags::ANY)
+                    .unwrap_or(None)
+                    .map(|v| self.sum_counts_value(&v))
+            };
+            if let Some(value) = value {
+                result_keys.push(*key);
+                result_values.push(value);
+            }
+            let _ = m.delete(bytes);
+        }
+        debug!("getCountsMapValues iter count: {}", result_keys.len());
+        Ok((result_keys, result_values))
+    }
 
-        unsafe {
-            let mut result_keys: Vec<sample_key> = Vec::with_capacity(map_size);
-            let mut result_values: Vec<u32> = Vec::with_capacity(map_size);
+    // Off-cpu counts hold few keys compared to the sample counts, they are walked key by key. Their
+    // stack ids are tagged so they are not mistaken for ids of the sample stacks.
+    fn drain_off_cpu_counts(&self, generation: usize) -> (Vec<sample_key>, Vec<u64>) {
+        let m = self.bpf.obj.map(OFF_CPU_COUNTS_MAPS[generation]).unwrap();
+        let mut result_keys: Vec<sample_key> = Vec::new();
+        let mut result_values: Vec<u64> = Vec::new();
+        let keys: Vec<Vec<u8>> = m.keys().collect();
+        for bytes in keys.iter() {
+            if let (Some(key), Some(value)) = (byte_to_value::<sample_key>(bytes), m.lookup(bytes, MapFlags::ANY).unwrap_or(None)) {
+                if value.len() >= mem::size_of::<u64>() {
+                    let mut key = *key;
+                    for stack_id in [&mut key.user_stack, &mut key.kern_stack] {
+                        if *stack_id >= 0 && *stack_id & OFF_CPU_CARRIED_STACK_ID_BIT == 0 {
+                            *stack_id |= OFF_CPU_STACK_ID_BIT;
+                        }
+                    }
+                    result_keys.push(key);
+                    result_values.push(u64::from_ne_bytes(value[..8].try_into().unwrap()));
+                }
+            }
+            let _ = m.delete(bytes);
+        }
+        debug!("off-cpu counts: {}", result_keys.len());
+        (result_keys, result_values)
+    }
 
-            while let Some(bytes) = m.keys().next() {
-                let key = byte_to_value::<sample_key>(&bytes).unwrap();
-                let mut value: u32 = 0;
-                bpf_map_lookup_elem(
-                    m.as_fd().as_raw_fd(),
-                    key as *const _ as *const c_void,
-                    &mut value as *mut _ as *mut c_void,
-                );
-                bpf_map_delete_elem(
-                    m.as_fd().as_raw_fd(),
-                    key as *const _ as *const c_void
-                );
-                result_keys.push(key.clone());
-                result_values.push(value.clone());
+    // Threads blocked in the drained generation would be dropped when they run again, their stack
+    // ids would point into stacks cleared by now. Their stacks are copied here under carried ids and
+    // the entries moved to the active generation, so a block is counted in the round it ends however
+    // many flips it spans. Carried stacks are kept as long as an entry refers to them.
+    fn carry_off_cpu_entries(&mut self, drained: usize) {
+        let mut carried: HashMap<i64, Vec<u8>> = HashMap::new();
+        let mut renamed: HashMap<i64, i64> = HashMap::new();
+        let mut moved = 0;
+        let m = self.bpf.obj.map("off_cpu_start").unwrap();
+        let keys: Vec<Vec<u8>> = m.keys().collect();
+        for bytes in keys.iter() {
+            let value = match m.lookup(bytes, MapFlags::ANY) {
+                Ok(Some(value)) => value,
+                _ => continue,
+            };
+            let mut entry = match byte_to_value::<off_cpu_entry>(&value) {
+                Some(entry) => *entry,
+                None => continue,
+            };
+            if entry.generation as usize != drained {
+                continue;
+            }
+            for stack_id in [&mut entry.key.user_stack, &mut entry.key.kern_stack] {
+                if *stack_id < 0 || carried.contains_key(stack_id) {
+                    continue;
+                }
+                if *stack_id & OFF_CPU_CARRIED_STACK_ID_BIT != 0 {
+                    match self.off_cpu_carried.remove(stack_id) {
+                        Some(stack) => {
+                            carried.insert(*stack_id, stack);
+                        }
+                        None => *stack_id = -1,
+                    }
+                    continue;
+                }
+                // threads blocked on the same path share their stack ids
+                if let Some(id) = renamed.get(stack_id) {
+                    *stack_id = *id;
+                    continue;
+                }
+                match self.get_stack(drained, OFF_CPU_STACK_ID_BIT | *stack_id) {
+                    Some(stack) => {
+                        self.off_cpu_carried_seq = self.off_cpu_carried_seq.wrapping_add(1);
+                        let id = OFF_CPU_CARRIED_STACK_ID_BIT | self.off_cpu_carried_seq as i64;
+                        renamed.insert(*stack_id, id);
+                        carried.insert(id, stack);
+                        *stack_id = id;
+                    }
+                    None => *stack_id = -1,
+                }
+            }
+            entry.generation = self.generation as u32;
+            // the thread may have run again meanwhile, it was then counted or dropped already
+            if m.update(bytes, any_as_u8_slice(&entry), MapFlags::EXIST).is_ok() {
+                moved += 1;
             }
-            println!("getCountsMapValues iter count: {}", result_keys.len());
-            Ok((result_keys, result_values, true))
         }
+        debug!("off-cpu entries moved: {}, carried stacks: {}", moved, carried.len());
+        self.off_cpu_carried = carried;
     }
 
-    fn clear_counts_map(&mut self, keys: &[sample_key], batch: bool) -> Result<()> {
-        if keys.is_empty() {
-            return Ok(());
+    // Allocation counts as (objects, bytes), walked key by key like the off-cpu ones.
+    fn drain_alloc_counts(&self, generation: usize) -> (Vec<sample_key>, Vec<(u64, u64)>) {
+        let m = self.bpf.obj.map(ALLOC_COUNTS_MAPS[generation]).unwrap();
+        let mut result_keys: Vec<sample_key> = Vec::new();
+        let mut result_values: Vec<(u64, u64)> = Vec::new();
+        let keys: Vec<Vec<u8>> = m.keys().collect();
+        for bytes in keys.iter() {
+            if let (Some(key), Some(value)) = (byte_to_value::<sample_key>(bytes), m.lookup(bytes, MapFlags::ANY).unwrap_or(None)) {
+                if value.len() >= 2 * mem::size_of::<u64>() {
+                    result_keys.push(*key);
+                    result_values.push((
+                        u64::from_ne_bytes(value[..8].try_into().unwrap()),
+                        u64::from_ne_bytes(value[8..16].try_into().unwrap()),
+                    ));
+                }
+            }
+            let _ = m.delete(bytes);
         }
-        if batch {
-            // do nothing, already deleted with GetValueAndDeleteBatch in getCountsMapValues
-            return Ok(());
+        debug!("alloc counts: {}", result_keys.len());
+        (result_keys, result_values)
+    }
+
+    // Size of one counts value as returned by batch lookups: a u32 for the shared map, one
+    // 8 byte aligned slot per possible cpu for per-cpu maps.
+    fn counts_value_size(&self) -> usize {
+        match self.options.counts_map_type {
+            CountsMapType::Shared => mem::size_of::<u32>(),
+            CountsMapType::PerCpu | CountsMapType::LruPerCpu => 8 * self.possible_cpus,
         }
-        let maps = &self.bpf.maps();
-        let m = maps.counts();
+    }
 
-        // m.delete(keys)?;
-        let ret = unsafe {
-            libbpf_sys::bpf_map_delete_elem(m.as_fd().as_raw_fd(), keys.as_ptr() as *const c_void)
+    fn sum_counts_value(&self, value: &[u8]) -> u32 {
+        let stride = match self.options.counts_map_type {
+            CountsMapType::Shared => mem::size_of::<u32>(),
+            CountsMapType::PerCpu | CountsMapType::LruPerCpu => 8,
         };
-        if ret < 0 {
-            // Error code is returned negative, flip to positive to match errno
-            Err(OSError((-ret).to_string()))
-        } else {
-            println!("clearCountsMap count: {}", keys.len());
-            Ok(())
-        }
+        value
+            .chunks(stride)
+            .filter(|slot| slot.len() >= mem::size_of::<u32>())
+            .map(|slot| u32::from_ne_bytes(slot[..4].try_into().unwrap()))
+            .fold(0u32, |acc, v| acc.saturating_add(v))
     }
 
-    fn clear_stacks_map(&mut self, known_keys: &HashMap<u32, bool>) -> Result<()> {
-        let maps = &self.bpf.maps();
-        let m = maps.stacks();
+    fn clear_stacks_map(
+        &self,
+        m: &libbpf_rs::Map,
+        known_keys: &HashMap<u32, bool>,
+        counts_full: bool,
+    ) -> Result<()> {
         let mut cnt = 0;
         let mut errs = 0;
 
-        if self.round_number % 10 == 0 {
-            // do a full reset once in a while
-            while let Some(k) = m.keys().next() {
+        if counts_full {
+            // samples were dropped on a full counts map, their stack ids are not known unless we sweep
+            let keys: Vec<Vec<u8>> = m.keys().collect();
+            for k in keys.iter() {
                 if let Err(_e) = m.delete(k.as_slice()) {
                     errs += 1;
                 } else {
                     cnt += 1;
                 }
             }
-            println!(
+            debug!(
                 "clearStacksMap deleted all stacks count: {} unsuccessful: {}",
                 cnt, errs
             );
@@ -423,13 +1053,13 @@ impl Session<'_> {
         }
 
         for stack_id in known_keys.keys() {
-            if let Err(_e) = m.delete(&stack_id.to_le_bytes()) {
+            if let Err(_e) = m.delete(&stack_id.to_ne_bytes()) {
                 errs += 1;
             } else {
                 cnt += 1;
             }
         }
-        println!(
+        debug!(
             "clearStacksMap deleted known stacks count: {} unsuccessful: {}",
             cnt, errs
         );
@@ -452,75 +1082,415 @@ impl Session<'_> {
     {
         dbg!("collect_regular_profile");
 
-        let mut sb = StackBuilder::new();
+        let drain_start = Instant::now();
         let mut known_stacks: HashMap<u32, bool> = HashMap::new();
-        let (keys, values, batch) = self.get_counts_map_values().unwrap();
-        for (i, ck) in keys.iter().enumerate() {
-            let value = values[i];
-            if ck.user_stack >= 0 {
-                known_stacks.insert(ck.user_stack as u32, true);
+        let mut known_dwarf_stacks: HashMap<u32, bool> = HashMap::new();
+        let generation = self.flip_generation()?;
+        let (mut keys, values) = self.get_counts_map_values(generation)?;
+        // evicted keys of an LRU counts map leave their stack ids behind unnoticed
+        let mut counts_full = self.options.counts_map_type == CountsMapType::LruPerCpu
+            || keys.len() >= self.counts_map(generation).info().unwrap().info.max_entries as usize;
+        let mut values: Vec<u64> = values.into_iter().map(u64::from).collect();
+        let mut sample_types = vec![SampleType::Cpu; keys.len()];
+        if self.off_cpu {
+            // off-cpu stacks are cleared as a whole below, a full off-cpu counts map leaks nothing
+            let (off_cpu_keys, off_cpu_values) = self.drain_off_cpu_counts(generation);
+            sample_types.resize(keys.len() + off_cpu_keys.len(), SampleType::OffCpu);
+            keys.extend(off_cpu_keys);
+            values.extend(off_cpu_values);
+        }
+        // allocation samples carry the objects in values and the bytes in values2
+        let mut values2 = vec![0u64; keys.len()];
+        if self.options.alloc_profiling {
+            let (alloc_keys, alloc_values) = self.drain_alloc_counts(generation);
+            counts_full |= alloc_keys.len() >= self.map_sizes.profile as usize;
+            sample_types.resize(keys.len() + alloc_keys.len(), SampleType::Mem);
+            keys.extend(alloc_keys);
+            values.extend(alloc_values.iter().map(|v| v.0));
+            values2.extend(alloc_values.iter().map(|v| v.1));
+        }
+        for ck in keys.iter() {
+            if ck.user_stack >= 0 && ck.user_stack & (OFF_CPU_CARRIED_STACK_ID_BIT | OFF_CPU_STACK_ID_BIT) == 0 {
+                if ck.user_stack & DWARF_STACK_ID_BIT != 0 {
+                    known_dwarf_stacks.insert(ck.user_stack as u32, true);
+                } else {
+                    known_stacks.insert(ck.user_stack as u32, true);
+                }
             }
-            if ck.kern_stack >= 0 {
+            if ck.kern_stack >= 0 && ck.kern_stack & (OFF_CPU_CARRIED_STACK_ID_BIT | OFF_CPU_STACK_ID_BIT) == 0 {
                 known_stacks.insert(ck.kern_stack as u32, true);
             }
-            let target_finder = self.target_finder.lock().unwrap();
-            if let Some(labels) = target_finder.find_target(&ck.pid) {
-                let (mut stats, proc) = {
-                    let mut pids = self.pids.lock().unwrap();
-                    if pids.dead.contains_key(&ck.pid) {
-                        debug!("pid {} is dead", &ck.pid);
-                        continue;
+        }
+
+        // Many sample keys share a stack id (pids of one binary, common kernel paths), each id is
+        // looked up and symbolized once per round. User stack ids only mean something in the
+        // address space of their pid, kernel ones are shared by everybody.
+        let mut groups: Vec<PidSamples> = Vec::new();
+        let mut group_index: HashMap<u32, Option<usize>> = HashMap::new();
+        for (i, ck) in keys.iter().enumerate() {
+            let index = *group_index.entry(ck.pid).or_insert_with(|| {
+                let labels = self.target_finder.lock().unwrap().find_target_by_cgroup(&ck.pid, ck.cgroup_id)?;
+                let proc = self.round_proc(ck.pid)?;
+                groups.push(PidSamples {
+                    labels,
+                    proc,
+                    keys: Vec::new(),
+                    user_stacks: HashMap::new(),
+                });
+                Some(groups.len() - 1)
+            });
+            if let Some(index) = index {
+                groups[index].keys.push(i);
+            }
+        }
+
+        // the maps are read here, the workers only symbolize
+        let mut kern_raw: HashMap<i64, Vec<u8>> = HashMap::new();
+        let mut jobs: Vec<SymbolizeJob> = Vec::new();
+        for (index, group) in groups.iter().enumerate() {
+            let mut user_raw: HashMap<i64, Vec<u8>> = HashMap::new();
+            for ck in group.keys.iter().map(|i| &keys[*i]) {
+                if self.options.collect_user && ck.user_stack >= 0 && !user_raw.contains_key(&ck.user_stack) {
+                    if let Some(stack) = self.get_stack(generation, ck.user_stack) {
+                        user_raw.insert(ck.user_stack, stack);
+                    }
+                }
+                if self.options.collect_kernel && ck.kern_stack >= 0 && !kern_raw.contains_key(&ck.kern_stack) {
+                    if let Some(stack) = self.get_stack(generation, ck.kern_stack) {
+                        kern_raw.insert(ck.kern_stack, stack);
                     }
-                    let stats = StackResolveStats::default();
-                    let proc = {
-                        // if self.tmp.is_none() {
-                        //     self.tmp = Some(Arc::new(Mutex::new(PerfSymbolTable::new(ck.pid as i32))));
-                        // }
-                        // self.tmp.clone().unwrap()
-                        let mut sym_cache = self.sym_cache.lock().unwrap();
-                        if sym_cache.get_proc_table(ck.pid).is_none() {
-                            pids.dead.insert(ck.pid, ());
-                        }
-                        sym_cache.get_proc_table(ck.pid).unwrap().clone()
-                    };
-                    (stats, proc)
-                };
-                {
-                    let mut a = proc.lock().unwrap();
-                    a.refresh_resource();
                 }
-                let u_stack = self.get_stack(ck.user_stack);
-                let k_stack = self.get_stack(ck.kern_stack);
-                sb.reset();
-                sb.append(self.comm(ck.pid));
+            }
+            if !user_raw.is_empty() {
+                jobs.push(SymbolizeJob {
+                    group: Some(index),
+                    resolver: StackResolver::Proc(group.proc.table.clone()),
+                    stacks: user_raw.into_iter().collect(),
+                });
+            }
+        }
+        if !kern_raw.is_empty() {
+            let kallsyms = self.sym_cache.lock().unwrap().get_kallsyms();
+            let kern_raw: Vec<(i64, Vec<u8>)> = kern_raw.into_iter().collect();
+            for chunk in kern_raw.chunks(KERNEL_STACKS_PER_JOB) {
+                jobs.push(SymbolizeJob {
+                    group: None,
+                    resolver: StackResolver::Kernel(kallsyms.clone()),
+                    stacks: chunk.to_vec(),
+                });
+            }
+        }
+        // the stacks of the drained generation are still there, they are cleared below
+        if self.off_cpu {
+            self.carry_off_cpu_entries(generation);
+        }
+        // largest first, the tail of the round is then made of small jobs
+        jobs.sort_by(|a, b| b.stacks.len().cmp(&a.stacks.len()));
+        let mut drain_time = drain_start.elapsed();
+        let symbolize_start = Instant::now();
+
+        let workers = worker_count(self.options.symbolize_workers);
+        let symbolize_options = SymbolizeOptions {
+            unknown_symbol_module_offset: self.options.unknown_symbol_module_offset,
+            unknown_symbol_address: self.options.unknown_symbol_address,
+        };
+        let results = run_jobs(jobs, workers, |job: SymbolizeJob| {
+            let resolved: Vec<(i64, ResolvedStack)> = job
+                .stacks
+                .iter()
+                .map(|(id, stack)| (*id, symbolize(stack, &job.resolver, symbolize_options)))
+                .collect();
+            (job.group, resolved)
+        });
+        self.options
+            .metrics
+            .overhead
+            .symbolize_duration
+            .observe(symbolize_start.elapsed().as_secs_f64());
+        let mut kern_stacks: HashMap<i64, ResolvedStack> = HashMap::new();
+        for (group, resolved) in results {
+            match group {
+                Some(index) => groups[index].user_stacks.extend(resolved),
+                None => kern_stacks.extend(resolved),
+            }
+        }
 
-                if self.options.collect_user && u_stack.is_some() {
-                    self.walk_stack(&mut sb, &u_stack.unwrap(), proc, &mut stats);
+        let mut stack: Vec<Arc<str>> = Vec::new();
+        for group in groups.iter() {
+            for i in group.keys.iter() {
+                let ck = &keys[*i];
+                let mut stats = StackResolveStats::default();
+                stack.clear();
+                if let Some(resolved) = kern_stacks.get(&ck.kern_stack) {
+                    stats.add(resolved.stats);
+                    stack.extend_from_slice(&resolved.frames);
                 }
-                if self.options.collect_kernel && k_stack.is_some() {
-                    let a = {
-                        let mut sym_cache = self.sym_cache.lock().unwrap();
-                        sym_cache.get_kallsyms().clone()
-                    };
-                    self.walk_stack(&mut sb, &k_stack.unwrap(), a, &mut stats);
+                if let Some(resolved) = group.user_stacks.get(&ck.user_stack) {
+                    stats.add(resolved.stats);
+                    stack.extend_from_slice(&resolved.frames);
                 }
-                if sb.stack.len() > 1 {
-                    sb.stack.reverse();
+                stack.push(group.proc.comm.clone());
+                if stack.len() > 1 {
+                    let stack_len = stack.len();
                     cb(ProfileSample {
-                        target: &labels,
+                        target: &group.labels,
                         pid: ck.pid,
+                        sample_type: sample_types[*i],
+                        aggregation: false,
+                        stack: &stack,
+                        value: values[*i],
+                        value2: values2[*i],
+                    });
+                    self.collect_metrics(&group.labels, &stats, stack_len);
+                }
+            }
+        }
+        debug!(
+            "collect_regular_profile: {} keys, {} pids, {} kernel stacks, {} workers",
+            keys.len(),
+            groups.len(),
+            kern_stacks.len(),
+            workers
+        );
+        let clear_start = Instant::now();
+        self.clear_stacks_map(self.stacks_map(generation), &known_stacks, counts_full)?;
+        if self.dwarf.is_some() {
+            let m = self.bpf.obj.map(DWARF_STACKS_MAPS[generation]).unwrap();
+            self.clear_stacks_map(m, &known_dwarf_stacks, counts_full)?;
+        }
+        if self.off_cpu {
+            // the blocks still running were carried, nothing else refers to these stacks
+            let m = self.bpf.obj.map(OFF_CPU_STACKS_MAPS[generation]).unwrap();
+            self.clear_stacks_map(m, &HashMap::new(), true)?;
+        }
+        drain_time += clear_start.elapsed();
+        self.options.metrics.overhead.drain_duration.observe(drain_time.as_secs_f64());
+        Ok(())
+    }
+
+    // The symbol table and comm of a live pid for this round. The pid cache refreshes the table
+    // the first time it is handed out in a round.
+    fn round_proc(&self, pid: u32) -> Option<RoundProc> {
+        let table = {
+            let mut pids = self.pids.lock().unwrap();
+            if pids.dead.contains_key(&pid) {
+                debug!("pid {} is dead", &pid);
+                return None;
+            }
+            let mut sym_cache = self.sym_cache.lock().unwrap();
+            let table = sym_cache.get_proc_table(pid);
+            if table.is_none() {
+                pids.dead.insert(pid, ());
+            }
+            table?
+        };
+        Some(RoundProc {
+            table,
+            comm: Arc::from(self.comm(pid)),
+        })
+    }
+
+    // Python samples carry native stack ids of the pyperf stacks map and the python symbol ids
+    // read by pyperf. The interpreter frames of the native stack are replaced with the python ones.
+    pub(crate) fn collect_python_profile<F>(&mut self, cb: &F) -> Result<()>
+    where
+        F: Fn(ProfileSample),
+    {
+        let samples = match self.pyperf.as_mut() {
+            Some(pyperf) => {
+                pyperf.next_round();
+                pyperf.take_samples()
+            }
+            None => return Ok(()),
+        };
+        if samples.is_empty() {
+            self.pyperf.as_mut().unwrap().sweep_stacks();
+            return Ok(());
+        }
+        self.pyperf
+            .as_mut()
+            .unwrap()
+            .prepare_symbols(samples.keys().flat_map(|k| k.stack.iter()));
+
+        let mut known_stacks: HashSet<u32> = HashSet::new();
+        let mut procs: HashMap<u32, Option<RoundProc>> = HashMap::new();
+        let mut kern_stacks: HashMap<i64, Option<ResolvedStack>> = HashMap::new();
+        let kallsyms = StackResolver::Kernel(self.sym_cache.lock().unwrap().get_kallsyms());
+        let mut native: Vec<Arc<str>> = Vec::new();
+        let mut stack: Vec<Arc<str>> = Vec::new();
+        for (key, value) in samples.iter() {
+            if key.user_stack >= 0 {
+                known_stacks.insert(key.user_stack as u32);
+            }
+            if key.kern_stack >= 0 {
+                known_stacks.insert(key.kern_stack as u32);
+            }
+            let labels = match self.target_finder.lock().unwrap().find_target(&key.pid) {
+                Some(labels) => labels,
+                None => continue,
+            };
+            let proc = match procs
+                .entry(key.pid)
+                .or_insert_with(|| self.round_proc(key.pid))
+            {
+                Some(proc) => proc.clone(),
+                None => continue,
+            };
+            let service_name = labels.service_name();
+            let mut stats = StackResolveStats::default();
+
+            // python user stacks differ in their python part, only the kernel ones are shared
+            let pyperf = self.pyperf.as_ref().unwrap();
+            native.clear();
+            if let Some(resolved) = self.resolve_stack(pyperf.get_stack(key.user_stack), &StackResolver::Proc(proc.table.clone())) {
+                stats.add(resolved.stats);
+                native.extend(resolved.frames.iter().rev().cloned());
+            }
+            stack.clear();
+            if key.kern_stack >= 0 {
+                let resolved = kern_stacks
+                    .entry(key.kern_stack)
+                    .or_insert_with(|| self.resolve_stack(pyperf.get_stack(key.kern_stack), &kallsyms));
+                if let Some(resolved) = resolved {
+                    stats.add(resolved.stats);
+                    stack.extend_from_slice(&resolved.frames);
+                }
+            }
+            let python = self
+                .pyperf
+                .as_mut()
+                .unwrap()
+                .resolve_stack(&key.stack, &service_name);
+            stack.extend(merge_native_python(&native, &python).into_iter().rev());
+            stack.push(proc.comm);
+            if stack.len() > 1 {
+                let stack_len = stack.len();
+                cb(ProfileSample {
+                    target: &labels,
+                    pid: key.pid,
+                    sample_type: SampleType::Cpu,
+                    aggregation: false,
+                    stack: &stack,
+                    value: *value,
+                    value2: 0,
+                });
+                self.collect_metrics(&labels, &stats, stack_len);
+            }
+        }
+        let pyperf = self.pyperf.as_mut().unwrap();
+        pyperf.clear_stacks(known_stacks.into_iter());
+        // lost and error events leave their ids behind
+        pyperf.sweep_stacks();
+        Ok(())
+    }
+
+    // Stack snapshots are unwound and symbolized here, on a worker per pid. Identical stacks of a
+    // pid are counted and symbolized once.
+    pub(crate) fn collect_snapshot_profile<F>(&mut self, cb: &F) -> Result<()>
+    where
+        F: Fn(ProfileSample),
+    {
+        if self.snapshots.is_none() {
+            return Ok(());
+        }
+        let (snapshots, dropped) = {
+            let mut queue = self.snapshot_queue.lock().unwrap();
+            (queue.take(), mem::take(&mut queue.dropped))
+        };
+        if snapshots.is_empty() {
+            return Ok(());
+        }
+        let total = snapshots.len();
+        let mut by_pid: HashMap<u32, Vec<StackSnapshot>> = HashMap::new();
+        for s in snapshots {
+            by_pid.entry(s.pid).or_insert_with(Vec::new).push(s);
+        }
+
+        let mut groups: Vec<(u32, EbpfTarget, RoundProc)> = Vec::new();
+        let mut jobs: Vec<SnapshotJob> = Vec::new();
+        for (pid, snapshots) in by_pid {
+            let labels = match self.target_finder.lock().unwrap().find_target(&pid) {
+                Some(labels) => labels,
+                None => continue,
+            };
+            let proc = match self.round_proc(pid) {
+                Some(proc) => proc,
+                None => continue,
+            };
+            jobs.push(SnapshotJob {
+                group: groups.len(),
+                resolver: StackResolver::Proc(proc.table.clone()),
+                mappings: self.snapshots.as_ref().unwrap().mappings(pid),
+                snapshots,
+            });
+            groups.push((pid, labels, proc));
+        }
+        jobs.sort_by(|a, b| b.snapshots.len().cmp(&a.snapshots.len()));
+
+        let kallsyms = StackResolver::Kernel(self.sym_cache.lock().unwrap().get_kallsyms());
+        let (collect_user, collect_kernel) = (self.options.collect_user, self.options.collect_kernel);
+        let workers = worker_count(self.options.symbolize_workers);
+        let options = SymbolizeOptions {
+            unknown_symbol_module_offset: self.options.unknown_symbol_module_offset,
+            unknown_symbol_address: self.options.unknown_symbol_address,
+        };
+        let results = run_jobs(jobs, workers, |job: SnapshotJob| {
+            let mut counts: HashMap<(Vec<u8>, Vec<u8>), u64> = HashMap::new();
+            let mut ips: Vec<u64> = Vec::new();
+            for s in job.snapshots.iter() {
+                ips.clear();
+                match &job.mappings {
+                    Some(mappings) if collect_user => unwind_snapshot(s, mappings, &mut ips),
+                    _ => {}
+                }
+                let kern: &[u64] = if collect_kernel { &s.kern_ips } else { &[] };
+                let kern: Vec<u8> = kern.iter().flat_map(|ip| ip.to_le_bytes()).collect();
+                let user: Vec<u8> = ips.iter().flat_map(|ip| ip.to_le_bytes()).collect();
+                *counts.entry((kern, user)).or_insert(0) += 1;
+            }
+            let resolved: Vec<(Option<ResolvedStack>, Option<ResolvedStack>, u64)> = counts
+                .into_iter()
+                .map(|((kern, user), count)| {
+                    let kern = (!kern.is_empty()).then(|| symbolize(&kern, &kallsyms, options));
+                    let user = (!user.is_empty()).then(|| symbolize(&user, &job.resolver, options));
+                    (kern, user, count)
+                })
+                .collect();
+            (job.group, resolved)
+        });
+
+        let mut stack: Vec<Arc<str>> = Vec::new();
+        for (group, resolved) in results {
+            let (pid, labels, proc) = &groups[group];
+            for (kern, user, count) in resolved.iter() {
+                let mut stats = StackResolveStats::default();
+                stack.clear();
+                for r in [kern, user].into_iter().flatten() {
+                    stats.add(r.stats);
+                    stack.extend_from_slice(&r.frames);
+                }
+                stack.push(proc.comm.clone());
+                if stack.len() > 1 {
+                    let stack_len = stack.len();
+                    cb(ProfileSample {
+                        target: labels,
+                        pid: *pid,
                         sample_type: SampleType::Cpu,
                         aggregation: false,
-                        stack: sb.stack.clone(),
-                        value: value as u64,
+                        stack: &stack,
+                        value: *count,
                         value2: 0,
                     });
-                    self.collect_metrics(&labels, &stats, &sb);
+                    self.collect_metrics(labels, &stats, stack_len);
                 }
             }
         }
-        self.clear_counts_map(&keys, batch).unwrap();
-        self.clear_stacks_map(&known_stacks).unwrap();
+        debug!(
+            "collect_snapshot_profile: {} snapshots, {} pids, {} dropped",
+            total,
+            groups.len(),
+            dropped
+        );
         Ok(())
     }
 
@@ -534,74 +1504,39 @@ impl Session<'_> {
         "pid_unknown".to_string()
     }
 
-    fn walk_stack(
+    fn resolve_stack(
         &self,
-        sb: &mut StackBuilder,
-        stack: &[u8],
-        resolver: Arc<Mutex<dyn SymbolTable>>,
-        stats: &mut StackResolveStats,
-    ) {
-        if stack.is_empty() {
-            info!("stack is empty");
-            return;
-        }
-        let mut stack_frames = Vec::new();
-        for i in 0..127 {
-            let start = i * 8;
-            let end = start + 8;
-            if end > stack.len() {
-                break;
-            }
-            let instruction_pointer_bytes = &stack[i * 8..(i + 1) * 8];
-            let instruction_pointer = u64::from_le_bytes(instruction_pointer_bytes.try_into().unwrap());
-            if instruction_pointer == 0 {
-                break;
-            }
-
-            let mut r = resolver.lock().unwrap();
-            let name = if let Some(sym) = r.resolve(instruction_pointer) {
-                if !sym.name.is_empty() {
-                    stats.known += 1;
-                    sym.name.clone()
-                } else {
-                    if !sym.module.is_empty() {
-                        if self.options.unknown_symbol_module_offset {
-                            format!("{}+{:x}", sym.module, sym.start)
-                        } else {
-                            sym.module.clone()
-                        }
-                    } else {
-                        if self.options.unknown_symbol_address {
-                            format!("{:x}", instruction_pointer)
-                        } else {
-                            "[unknown]".to_string()
-                        }
-                    }
-                }
-            } else {
-                "[unknown]".to_string()
-            };
-            stack_frames.push(name);
-        }
-        stack_frames.reverse();
-        for s in stack_frames {
-            sb.append(s);
-        }
+        stack: Option<Vec<u8>>,
+        resolver: &StackResolver,
+    ) -> Option<ResolvedStack> {
+        let options = SymbolizeOptions {
+            unknown_symbol_module_offset: self.options.unknown_symbol_module_offset,
+            unknown_symbol_address: self.options.unknown_symbol_address,
+        };
+        Some(symbolize(&stack?, resolver, options))
     }
 
-    fn get_stack(&self, stack_id: i64) -> Option<Vec<u8>> {
+    fn get_stack(&self, generation: usize, stack_id: i64) -> Option<Vec<u8>> {
         if stack_id < 0 {
             return None;
         }
+        if stack_id & OFF_CPU_CARRIED_STACK_ID_BIT != 0 {
+            return self.off_cpu_carried.get(&stack_id).cloned();
+        }
         let stack_id_u32 = stack_id as u32;
-        self.bpf
-            .maps()
-            .stacks()
-            .lookup(stack_id_u32.to_le_bytes().as_slice(), MapFlags::ANY)
+        let m = if stack_id & DWARF_STACK_ID_BIT != 0 {
+            self.bpf.obj.map(DWARF_STACKS_MAPS[generation]).unwrap()
+        } else if stack_id & OFF_CPU_STACK_ID_BIT != 0 {
+            self.bpf.obj.map(OFF_CPU_STACKS_MAPS[generation]).unwrap()
+        } else {
+            self.stacks_map(generation)
+        };
+        m
+            .lookup(stack_id_u32.to_ne_bytes().as_slice(), MapFlags::ANY)
             .unwrap_or_else(|_| None)
     }
 
-    fn collect_metrics(&self, labels: &EbpfTarget, stats: &StackResolveStats, sb: &StackBuilder) {
+    fn collect_metrics(&self, labels: &EbpfTarget, stats: &StackResolveStats, stack_len: usize) {
         let m = &self.options.metrics.symtab;
         let service_name = labels.service_name();
         m.known_symbols
@@ -614,11 +1549,59 @@ impl Session<'_> {
             .with_label_values(&[&service_name])
             .inc_by(stats.unknown_modules as f64);
 
-        if sb.stack.len() > 2 && stats.unknown_symbols + stats.unknown_modules > stats.known {
+        if stack_len > 2 && stats.unknown_symbols + stats.unknown_modules > stats.known {
             m.unknown_stacks.with_label_values(&[&service_name]).inc();
         }
     }
 
+    // Factor bringing cpu counts of the last round back to the configured sample rate, so
+    // profiles stay comparable while the rate is lowered.
+    pub(crate) fn cpu_sample_scale(&self) -> f64 {
+        self.rate_controller.as_ref().map_or(1.0, |c| c.scale())
+    }
+
+    // Called once per round after the counts were collected, a new rate applies from the next
+    // round on.
+    pub(crate) fn adjust_sample_rate(&mut self) {
+        let controller = match self.rate_controller.as_mut() {
+            Some(controller) => controller,
+            None => return,
+        };
+        let fds: Vec<RawFd> = self.bpf.obj.progs_iter().map(|p| p.as_fd().as_raw_fd()).collect();
+        let rate = match controller.update(&fds) {
+            Some(rate) => rate,
+            None => return,
+        };
+        for pe in self.perf_events.iter() {
+            if let Err(err) = pe.set_frequency(rate as u64) {
+                error!("set sample rate of perf event {}: {}", pe.fd, err);
+            }
+        }
+    }
+
+    // Program run times and map insert failures since the previous round.
+    pub(crate) fn record_overhead_metrics(&mut self) {
+        let metrics = &self.options.metrics.overhead;
+        if self.bpf_stats.is_some() {
+            for p in self.bpf.obj.progs_iter() {
+                self.costs.record_program(p.name(), p.as_fd().as_raw_fd(), metrics);
+            }
+            if let Some(pyperf) = &self.pyperf {
+                for (name, fd) in pyperf.programs() {
+                    self.costs.record_program(&name, fd, metrics);
+                }
+            }
+        }
+        let errors = read_map_errors(self.bpf.maps().map_errors());
+        self.costs.record_map_errors("counts", errors[MAP_ERROR_COUNTS], metrics);
+        self.costs.record_map_errors("stacks", errors[MAP_ERROR_STACKS], metrics);
+        if let Some(pyperf) = &self.pyperf {
+            let errors = pyperf.map_errors();
+            self.costs.record_map_errors("py_stacks", errors[MAP_ERROR_STACKS], metrics);
+            self.costs.record_map_errors("py_symbols", errors[MAP_ERROR_PY_SYMBOLS], metrics);
+        }
+    }
+
     pub(crate) fn cleanup(&mut self) {
         let mut sym_cache = self.sym_cache.lock().unwrap();
         sym_cache.cleanup();
@@ -635,6 +1618,16 @@ impl Session<'_> {
             pids.all.remove(pid);
             sym_cache.remove_dead_pid(pid);
             let _ = self.bpf.maps().pids().delete(&pid.to_le_bytes());
+            if let Some(pyperf) = &self.pyperf {
+                pyperf.remove_pid(*pid);
+            }
+            self.alloc_links.remove(pid);
+            if let Some(dwarf) = self.dwarf.as_mut() {
+                dwarf.remove_pid(*pid, self.bpf.maps().unwind_infos());
+            }
+            if let Some(snapshots) = self.snapshots.as_mut() {
+                snapshots.remove_pid(*pid);
+            }
 
             if let Ok(mut target_finder) = self.target_finder.lock() {
                 target_finder.remove_dead_pid(pid);
@@ -659,53 +1652,232 @@ impl Session<'_> {
         for pid in &unknown_pids_to_remove {
             pids.unknown.remove(pid);
         }
+        drop(pids);
+        drop(sym_cache);
+        if let Some(pyperf) = self.pyperf.as_mut() {
+            pyperf.cleanup();
+        }
+        self.collect_pid_events_dropped();
+    }
 
-        if self.round_number % 10 == 0 {
-            self.check_stale_pids();
-        }
-    }
-
-    fn check_stale_pids(&self) {
-        let m = &self.bpf.maps();
-        let pids = m.pids();
-        let map_size = pids.info().unwrap().info.max_entries as usize;
-        let nkey = 0u32;
-        let mut keys: Vec<u32> = Vec::with_capacity(map_size);
-        let mut values: Vec<pid_config> = Vec::with_capacity(map_size);
-        let mut count: u32 = 10;
-        unsafe {
-            let n = bpf_map_lookup_batch(
-                pids.as_fd().as_raw_fd(),
-                std::ptr::null_mut(),
-                nkey as *mut _,
-                keys.as_mut_ptr() as *mut c_void,
-                values.as_mut_ptr() as *mut c_void,
-                (&mut count) as *mut u32,
-                &bpf_map_batch_opts {
-                    sz: mem::size_of::<bpf_map_batch_opts>() as size_t,
-                    elem_flags: MapFlags::ANY.bits(),
-                    flags: MapFlags::ANY.bits(),
-                } as *const bpf_map_batch_opts,
-            );
+    fn collect_pid_events_dropped(&mut self) {
+        let dropped: u64 = match self
+            .bpf
+            .maps()
+            .pid_event_limiters()
+            .lookup_percpu(&0u32.to_ne_bytes(), MapFlags::ANY)
+        {
+            Ok(Some(cpus)) => cpus
+                .iter()
+                .filter_map(|v| byte_to_value::<pid_event_limiter>(v))
+                .map(|l| l.dropped)
+                .sum(),
+            _ => return,
+        };
+        if dropped > self.pid_events_dropped {
+            self.options
+                .metrics
+                .pid_events_dropped
+                .inc_by((dropped - self.pid_events_dropped) as f64);
+        }
+        self.pid_events_dropped = dropped;
+    }
+}
 
-            dbg!("check stale pids count: {}", n);
-            for i in 0..n {
-                if let Err(err) =
-                    fs::metadata(format!("/proc/{}/status", keys[i as usize] as __u32))
-                {
-                    if err.kind() == std::io::ErrorKind::NotFound {
-                        if let Err(_del_err) = pids.delete(&keys[i as usize].to_le_bytes()) {
-                            error!("delete stale pid pid");
-                        } else {
-                            dbg!("stale pid deleted pid");
-                        }
-                    } else {
-                        error!("check stale pids err: {}", err);
-                    }
-                } else {
-                    dbg!("stale pid check : alive");
-                }
-            }
+fn configure_counts_maps(skel: &mut OpenProfileSkel, typ: CountsMapType) -> Result<()> {
+    let map_type = match typ {
+        CountsMapType::Shared => return Ok(()),
+        CountsMapType::PerCpu => MapType::PercpuHash,
+        CountsMapType::LruPerCpu => MapType::LruPercpuHash,
+    };
+    for name in COUNTS_MAPS {
+        skel.obj
+            .map_mut(name)
+            .unwrap()
+            .set_type(map_type)
+            .map_err(|e| MapError(format!("set {} type: {:?}", name, e)))?;
+    }
+    Ok(())
+}
+
+// The maps compiled with PROFILE_MAPS_SIZE in stacks.h and the pids map. Maps of disabled features
+// are shrunk to a single entry afterwards.
+fn configure_map_sizes(skel: &mut OpenProfileSkel, sizes: &MapSizes) -> Result<()> {
+    let profile_maps = COUNTS_MAPS
+        .iter()
+        .chain(STACKS_MAPS.iter())
+        .chain(OFF_CPU_COUNTS_MAPS.iter())
+        .chain(OFF_CPU_STACKS_MAPS.iter())
+        .chain(ALLOC_COUNTS_MAPS.iter())
+        .chain(DWARF_STACKS_MAPS.iter());
+    for name in profile_maps {
+        skel.obj
+            .map_mut(name)
+            .unwrap()
+            .set_max_entries(sizes.profile)
+            .map_err(|e| MapError(format!("set {} size: {:?}", name, e)))?;
+    }
+    skel.maps_mut()
+        .pids()
+        .set_max_entries(sizes.pids)
+        .map_err(|e| MapError(format!("set pids size: {:?}", e)))
+}
+
+// sched_switch is only loaded, and so only attached by Skel::attach, in off-cpu mode.
+fn configure_off_cpu(skel: &mut OpenProfileSkel, enabled: bool, min_duration: Duration) -> Result<()> {
+    skel.rodata_mut().off_cpu_min_ns = min_duration.as_nanos() as u64;
+    if enabled {
+        return Ok(());
+    }
+    skel.progs_mut()
+        .sched_switch()
+        .set_autoload(false)
+        .map_err(|e| SessionError(format!("disable sched_switch: {:?}", e)))?;
+    for name in OFF_CPU_COUNTS_MAPS.iter().chain(OFF_CPU_STACKS_MAPS.iter()).chain(["off_cpu_start"].iter()) {
+        skel.obj
+            .map_mut(name)
+            .unwrap()
+            .set_max_entries(1)
+            .map_err(|e| MapError(format!("set {} size: {:?}", name, e)))?;
+    }
+    Ok(())
+}
+
+// unwind_dwarf is tail called from do_perf_event, so Skel::attach never attaches it.
+fn configure_dwarf_unwinding(skel: &mut OpenProfileSkel, enabled: bool, pid_map_size: u32) -> Result<()> {
+    if enabled {
+        return skel
+            .maps_mut()
+            .unwind_infos()
+            .set_max_entries(pid_map_size)
+            .map_err(|e| MapError(format!("set unwind_infos size: {:?}", e)));
+    }
+    skel.progs_mut()
+        .unwind_dwarf()
+        .set_autoload(false)
+        .map_err(|e| SessionError(format!("disable unwind_dwarf: {:?}", e)))?;
+    for name in DWARF_STACKS_MAPS.iter().chain(["unwind_rows", "unwind_infos"].iter()) {
+        skel.obj
+            .map_mut(name)
+            .unwrap()
+            .set_max_entries(1)
+            .map_err(|e| MapError(format!("set {} size: {:?}", name, e)))?;
+    }
+    Ok(())
+}
+
+// Without unwind_dwarf in progs the tail call fails and PROFILING_TYPE_DWARF pids would get frame
+// pointer stacks, dwarf unwinding is then disabled altogether.
+fn install_dwarf_unwinder(bpf: &ProfileSkel) -> Option<DwarfUnwinder> {
+    let fd = bpf.progs().unwind_dwarf().as_fd().as_raw_fd();
+    match bpf
+        .maps()
+        .progs()
+        .update(&PROG_IDX_DWARF.to_ne_bytes(), &fd.to_ne_bytes(), MapFlags::ANY)
+    {
+        Ok(()) => Some(DwarfUnwinder::new()),
+        Err(err) => {
+            error!("install unwind_dwarf failed, dwarf unwinding disabled: {:?}", err);
+            None
+        }
+    }
+}
+
+// The budget is enforced per cpu, each gets an equal share of the total.
+fn configure_stack_snapshots(skel: &mut OpenProfileSkel, enabled: bool, ringbuf: bool, opts: &SessionOptions) -> Result<()> {
+    let cpus = libbpf_rs::num_possible_cpus().unwrap_or(1).max(1) as u64;
+    skel.rodata_mut().snapshot_stack_size = opts.stack_snapshot_size;
+    skel.rodata_mut().snapshot_bytes_per_sec = if opts.stack_snapshot_bytes_per_sec == 0 {
+        0
+    } else {
+        (opts.stack_snapshot_bytes_per_sec / cpus).max(1)
+    };
+    if !enabled || !ringbuf {
+        disable_ringbuf_map(skel.maps_mut().snapshot_events_rb())?;
+    }
+    if enabled {
+        return Ok(());
+    }
+    skel.progs_mut()
+        .stack_snapshot()
+        .set_autoload(false)
+        .map_err(|e| SessionError(format!("disable stack_snapshot: {:?}", e)))
+}
+
+fn install_stack_snapshots(bpf: &ProfileSkel) -> Option<SnapshotUnwinder> {
+    let fd = bpf.progs().stack_snapshot().as_fd().as_raw_fd();
+    match bpf
+        .maps()
+        .progs()
+        .update(&PROG_IDX_STACK_SNAPSHOT.to_ne_bytes(), &fd.to_ne_bytes(), MapFlags::ANY)
+    {
+        Ok(()) => Some(SnapshotUnwinder::new()),
+        Err(err) => {
+            error!("install stack_snapshot failed, stack snapshots disabled: {:?}", err);
+            None
+        }
+    }
+}
+
+// The uprobes are attached per pid by start_alloc_profiling.
+fn configure_alloc_profiling(skel: &mut OpenProfileSkel, enabled: bool, sample_bytes: u64) -> Result<()> {
+    skel.rodata_mut().alloc_sample_bytes = sample_bytes;
+    if enabled {
+        return Ok(());
+    }
+    for func in ALLOC_FUNCS {
+        let mut progs = skel.progs_mut();
+        let prog = match func {
+            "malloc" => progs.malloc_enter(),
+            "calloc" => progs.calloc_enter(),
+            _ => progs.realloc_enter(),
+        };
+        prog.set_autoload(false)
+            .map_err(|e| SessionError(format!("disable {} uprobe: {:?}", func, e)))?;
+    }
+    for name in ALLOC_COUNTS_MAPS {
+        skel.obj
+            .map_mut(name)
+            .unwrap()
+            .set_max_entries(1)
+            .map_err(|e| MapError(format!("set {} size: {:?}", name, e)))?;
+    }
+    Ok(())
+}
+
+// A pyperf that fails to load only disables python profiling, python pids then fall back to
+// frame pointers in try_start_python_profiling.
+fn load_pyperf<'a>(bpf: &ProfileSkel, opts: &SessionOptions, sizes: &MapSizes) -> Option<Pyperf<'a>> {
+    let m = &opts.metrics.python;
+    let pyperf = Pyperf::new(PyperfOptions {
+        use_ringbuf: opts.use_ringbuf,
+        stack_depth: opts.python_stack_depth,
+        use_bpf_loop: opts.python_bpf_loop,
+        symbols_path: opts.python_symbols_path.clone(),
+        full_file_path: opts.cache_options.symbol_options.python_full_file_path,
+        keep_rounds: opts.cache_options.pid_cache_options.keep_rounds.max(0) as u32,
+        symbols_size: sizes.py_symbols,
+        pid_config_size: sizes.py_pid_config,
+        stacks_size: sizes.profile,
+        metrics: m.clone(),
+    })
+    .and_then(|pyperf| {
+        let fd = pyperf.collect_prog_fd();
+        bpf.maps()
+            .progs()
+            .update(&PROG_IDX_PYTHON.to_ne_bytes(), &fd.to_ne_bytes(), MapFlags::ANY)
+            .map_err(|e| MapError(format!("install pyperf_collect: {:?}", e)))?;
+        Ok(pyperf)
+    });
+    match pyperf {
+        Ok(pyperf) => {
+            m.load.inc();
+            Some(pyperf)
+        }
+        Err(err) => {
+            m.load_error.inc();
+            error!("loading pyperf failed, python profiling disabled: {}", err);
+            None
         }
     }
 }
@@ -715,10 +1887,12 @@ fn any_as_u8_slice<T: Sized>(p: &T) -> &[u8] {
 }
 
 // https://github.com/libbpf/libbpf-rs/blob/ed31040a86388b699524bdfa25893fb2e85a9eb2/examples/runqslower/src/main.rs#L41
-fn bump_memlock_rlimit() -> Result<()> {
+// Kernels before 5.11 charge map memory to RLIMIT_MEMLOCK, the sized maps may need more than 128MiB.
+fn bump_memlock_rlimit(map_bytes: u64) -> Result<()> {
+    let limit = (128 << 20).max(map_bytes + (64 << 20));
     let rlimit = libc::rlimit {
-        rlim_cur: 128 << 20,
-        rlim_max: 128 << 20,
+        rlim_cur: limit,
+        rlim_max: limit,
     };
     if unsafe { libc::setrlimit(libc::RLIMIT_MEMLOCK, &rlimit) } != 0 {
         return Err(InvalidData("Failed to increase rlimit".to_string()));
@@ -734,25 +1908,135 @@ fn attach_perf_events(sample_rate: u32, prog: &mut Program) -> Result<Vec<PerfEv
         .collect())
 }
 
-struct StackBuilder {
-    stack: Vec<String>,
+// kernel stacks all share kallsyms, they are split so they don't end up on a single worker
+const KERNEL_STACKS_PER_JOB: usize = 256;
+
+#[derive(Clone, Copy)]
+pub struct SymbolizeOptions {
+    pub unknown_symbol_module_offset: bool,
+    pub unknown_symbol_address: bool,
+}
+
+// User stacks resolve under the lock of their ProcTable, kernel ones through kallsyms, which is
+// shared by all workers without locking.
+#[derive(Clone)]
+pub enum StackResolver {
+    Proc(Arc<Mutex<dyn SymbolTable + Send>>),
+    Kernel(Arc<Kallsyms>),
 }
 
-impl StackBuilder {
-    fn new() -> Self {
-        StackBuilder { stack: Vec::new() }
+// Symbolizes the instruction pointers of a stack, leaf first. Public for the benchmarks.
+pub fn symbolize(stack: &[u8], resolver: &StackResolver, options: SymbolizeOptions) -> ResolvedStack {
+    let mut stats = StackResolveStats::default();
+    let mut stack_frames: Vec<Arc<str>> = Vec::new();
+    if stack.is_empty() {
+        info!("stack is empty");
+        return ResolvedStack {
+            frames: stack_frames.into(),
+            stats,
+        };
     }
-
-    fn reset(&mut self) {
-        self.stack.clear();
+    match resolver {
+        StackResolver::Proc(table) => {
+            let mut r = table.lock().unwrap();
+            for ip in stack_ips(stack) {
+                let name = match r.resolve(ip) {
+                    Some(sym) => frame_name(&sym.name, &sym.module, sym.start, ip, options, &mut stats),
+                    None => Arc::from("[unknown]"),
+                };
+                stack_frames.push(name);
+            }
+        }
+        StackResolver::Kernel(kallsyms) => {
+            for ip in stack_ips(stack) {
+                let name = match kallsyms.resolve(ip) {
+                    Some(sym) => frame_name(sym.name, sym.module, sym.start, ip, options, &mut stats),
+                    None => Arc::from("[unknown]"),
+                };
+                stack_frames.push(name);
+            }
+        }
+    }
+    ResolvedStack {
+        frames: stack_frames.into(),
+        stats,
     }
+}
+
+// The instruction pointers of a raw stack, up to the first zero.
+fn stack_ips(stack: &[u8]) -> impl Iterator<Item = u64> + '_ {
+    stack
+        .chunks_exact(8)
+        .take(127)
+        .map(|b| u64::from_le_bytes(b.try_into().unwrap()))
+        .take_while(|ip| *ip != 0)
+}
 
-    fn append(&mut self, sym: String) {
-        self.stack.push(sym);
+fn frame_name(
+    name: &str,
+    module: &str,
+    start: u64,
+    ip: u64,
+    options: SymbolizeOptions,
+    stats: &mut StackResolveStats,
+) -> Arc<str> {
+    if !name.is_empty() {
+        stats.known += 1;
+        return Arc::from(name);
+    }
+    if !module.is_empty() {
+        if options.unknown_symbol_module_offset {
+            Arc::from(format!("{}+{:x}", module, start))
+        } else {
+            Arc::from(module)
+        }
+    } else if options.unknown_symbol_address {
+        Arc::from(format!("{:x}", ip))
+    } else {
+        Arc::from("[unknown]")
     }
 }
 
-#[derive(Default, Debug)]
+// A symbolized stack id, shared by all samples of a round referencing it.
+#[derive(Clone)]
+pub struct ResolvedStack {
+    // leaf first
+    pub frames: Arc<[Arc<str>]>,
+    stats: StackResolveStats,
+}
+
+#[derive(Clone)]
+struct RoundProc {
+    table: Arc<Mutex<ProcTable>>,
+    comm: Arc<str>,
+}
+
+// The sample keys of one pid in a round, symbolized by a single worker.
+struct PidSamples {
+    labels: EbpfTarget,
+    proc: RoundProc,
+    // indexes into the drained keys
+    keys: Vec<usize>,
+    user_stacks: HashMap<i64, ResolvedStack>,
+}
+
+struct SnapshotJob {
+    // index of the pid in the groups of collect_snapshot_profile
+    group: usize,
+    resolver: StackResolver,
+    // None when the pid has no unwind tables any more, only the kernel stacks are kept then
+    mappings: Option<Arc<[SnapshotMapping]>>,
+    snapshots: Vec<StackSnapshot>,
+}
+
+struct SymbolizeJob {
+    // the PidSamples the user stacks belong to, None for kernel stacks
+    group: Option<usize>,
+    resolver: StackResolver,
+    stacks: Vec<(i64, Vec<u8>)>,
+}
+
+#[derive(Default, Debug, Clone, Copy)]
 struct StackResolveStats {
     known: u32,
     unknown_symbols: u32,
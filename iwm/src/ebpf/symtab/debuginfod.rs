@@ -0,0 +1,227 @@
+use std::collections::HashMap;
+use std::fs;
+#[cfg(feature = "debuginfod")]
+use std::fs::File;
+#[cfg(feature = "debuginfod")]
+use std::io::{self, Read};
+use std::path::PathBuf;
+use std::sync::mpsc::{channel, Receiver, Sender};
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant, SystemTime};
+
+#[cfg(feature = "debuginfod")]
+use log::{debug, error, info};
+
+use crate::error::Error::{NotFound, SymbolError};
+use crate::error::Result;
+
+// build ids nobody serves are asked for again after this long
+const UNAVAILABLE_RETRY: Duration = Duration::from_secs(3600);
+
+#[derive(Debug, Clone)]
+pub struct DebuginfodOptions {
+    // servers tried in order, as in DEBUGINFOD_URLS
+    pub urls: Vec<String>,
+    // fetched debug files, kept across restarts
+    pub cache_path: PathBuf,
+    pub timeout: Duration,
+    // larger debug files are not downloaded
+    pub max_file_size: u64,
+    // the debug files least recently asked for are removed above this total
+    pub max_cache_size: u64,
+}
+
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum DebugInfoState {
+    Pending,
+    Ready(PathBuf),
+    Unavailable,
+}
+
+// Downloads the debug files of stripped ELFs on its own thread. ElfTables of such files resolve
+// through their dynamic symbols until the file is there and reload in a later round.
+// The HTTP client is only built with the debuginfod feature, without it new always fails.
+pub struct DebuginfodFetcher {
+    states: Mutex<HashMap<String, (DebugInfoState, Instant)>>,
+    queue: Mutex<Sender<String>>,
+    cache_path: PathBuf,
+}
+
+impl DebuginfodFetcher {
+    pub fn new(mut options: DebuginfodOptions) -> Result<Arc<Self>> {
+        if !cfg!(feature = "debuginfod") {
+            return Err(NotFound("built without the debuginfod feature".to_string()));
+        }
+        if options.urls.is_empty() {
+            return Err(NotFound("no debuginfod urls".to_string()));
+        }
+        // a file that can't stay in the cache would be fetched again on every request
+        options.max_file_size = options.max_file_size.min(options.max_cache_size);
+        fs::create_dir_all(&options.cache_path)
+            .map_err(|e| SymbolError(format!("create debuginfod cache {:?}: {}", options.cache_path, e)))?;
+        let (tx, rx) = channel();
+        let fetcher = Arc::new(Self {
+            states: Mutex::new(HashMap::new()),
+            queue: Mutex::new(tx),
+            cache_path: options.cache_path.clone(),
+        });
+        let worker = fetcher.clone();
+        thread::Builder::new()
+            .name("debuginfod".to_string())
+            .spawn(move || worker.run(rx, options))
+            .map_err(|e| SymbolError(format!("start debuginfod fetcher: {}", e)))?;
+        Ok(fetcher)
+    }
+
+    // The state of a build id without asking for it.
+    pub fn state(&self, build_id: &str) -> Option<DebugInfoState> {
+        self.states.lock().unwrap().get(build_id).map(|(state, _)| state.clone())
+    }
+
+    // Queues the download of a build id seen for the first time. Files fetched by a previous run
+    // are ready right away.
+    pub fn request(&self, build_id: &str) -> DebugInfoState {
+        if build_id.len() < 2 || !build_id.bytes().all(|b| b.is_ascii_hexdigit()) {
+            return DebugInfoState::Unavailable;
+        }
+        let mut states = self.states.lock().unwrap();
+        match states.get(build_id) {
+            Some((DebugInfoState::Unavailable, since)) if since.elapsed() >= UNAVAILABLE_RETRY => {}
+            Some((state, _)) => return state.clone(),
+            None => {}
+        }
+        let path = self.file_path(build_id);
+        let state = if path.exists() {
+            // the modification time orders the files for max_cache_size
+            let _ = fs::File::options().write(true).open(&path).and_then(|f| f.set_modified(SystemTime::now()));
+            DebugInfoState::Ready(path)
+        } else if self.queue.lock().unwrap().send(build_id.to_string()).is_ok() {
+            DebugInfoState::Pending
+        } else {
+            DebugInfoState::Unavailable
+        };
+        states.insert(build_id.to_string(), (state.clone(), Instant::now()));
+        state
+    }
+
+    fn file_path(&self, build_id: &str) -> PathBuf {
+        self.cache_path.join(format!("{}.debug", build_id))
+    }
+
+    #[cfg(not(feature = "debuginfod"))]
+    fn run(&self, _rx: Receiver<String>, _options: DebuginfodOptions) {}
+
+    #[cfg(feature = "debuginfod")]
+    fn run(&self, rx: Receiver<String>, options: DebuginfodOptions) {
+        self.remove_old_files(options.max_cache_size);
+        let client = match reqwest::blocking::Client::builder().timeout(options.timeout).build() {
+            Ok(client) => client,
+            Err(err) => {
+                error!("debuginfod client: {}", err);
+                return;
+            }
+        };
+        for build_id in rx {
+            let state = match self.fetch(&client, &options, &build_id) {
+                Ok(path) => {
+                    info!("debuginfod: fetched {}", build_id);
+                    DebugInfoState::Ready(path)
+                }
+                Err(err) => {
+                    debug!("debuginfod: {}: {}", build_id, err);
+                    DebugInfoState::Unavailable
+                }
+            };
+            let fetched = matches!(state, DebugInfoState::Ready(_));
+            self.states.lock().unwrap().insert(build_id, (state, Instant::now()));
+            if fetched {
+                self.remove_old_files(options.max_cache_size);
+            }
+        }
+    }
+
+    // Tables already built from a removed file keep working, it stays mapped until they are
+    // dropped. Build ids whose file is removed are fetched again on their next request.
+    #[cfg(feature = "debuginfod")]
+    fn remove_old_files(&self, max_cache_size: u64) {
+        let entries = match fs::read_dir(&self.cache_path) {
+            Ok(entries) => entries,
+            Err(err) => {
+                error!("debuginfod: read {:?}: {}", self.cache_path, err);
+                return;
+            }
+        };
+        let mut files = Vec::new();
+        let mut total = 0;
+        for entry in entries.flatten() {
+            let path = entry.path();
+            if path.extension().and_then(|e| e.to_str()) != Some("debug") {
+                continue;
+            }
+            if let Ok(meta) = entry.metadata() {
+                total += meta.len();
+                files.push((meta.modified().unwrap_or(SystemTime::UNIX_EPOCH), meta.len(), path));
+            }
+        }
+        if total <= max_cache_size {
+            return;
+        }
+        files.sort();
+        let mut states = self.states.lock().unwrap();
+        for (_, size, path) in files {
+            if total <= max_cache_size {
+                break;
+            }
+            if fs::remove_file(&path).is_err() {
+                continue;
+            }
+            debug!("debuginfod: removed {:?}", path);
+            total -= size;
+            if let Some(build_id) = path.file_stem().and_then(|s| s.to_str()) {
+                states.remove(build_id);
+            }
+        }
+    }
+
+    #[cfg(feature = "debuginfod")]
+    fn fetch(&self, client: &reqwest::blocking::Client, options: &DebuginfodOptions, build_id: &str) -> Result<PathBuf> {
+        let path = self.file_path(build_id);
+        let tmp = self.cache_path.join(format!("{}.tmp", build_id));
+        for url in options.urls.iter() {
+            let url = format!("{}/buildid/{}/debuginfo", url.trim_end_matches('/'), build_id);
+            let response = match client.get(&url).send() {
+                Ok(response) if response.status().is_success() => response,
+                Ok(response) => {
+                    debug!("debuginfod: {} {}", url, response.status());
+                    continue;
+                }
+                Err(err) => {
+                    debug!("debuginfod: {} {}", url, err);
+                    continue;
+                }
+            };
+            if response.content_length().map_or(false, |len| len > options.max_file_size) {
+                return Err(SymbolError(format!("debug file larger than {} bytes", options.max_file_size)));
+            }
+            let written = File::create(&tmp).and_then(|mut file| {
+                io::copy(&mut response.take(options.max_file_size + 1), &mut file)
+            });
+            match written {
+                Ok(n) if n <= options.max_file_size => {
+                    fs::rename(&tmp, &path).map_err(|e| SymbolError(format!("rename {:?}: {}", tmp, e)))?;
+                    return Ok(path);
+                }
+                Ok(_) => {
+                    let _ = fs::remove_file(&tmp);
+                    return Err(SymbolError(format!("debug file larger than {} bytes", options.max_file_size)));
+                }
+                Err(err) => {
+                    let _ = fs::remove_file(&tmp);
+                    debug!("debuginfod: {} {}", url, err);
+                }
+            }
+        }
+        Err(NotFound("no server has it".to_string()))
+    }
+}
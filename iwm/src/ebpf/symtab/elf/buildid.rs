@@ -18,6 +18,14 @@ impl BuildID {
     pub fn is_gnu(&self) -> bool {
         self.typ == "gnu"
     }
+    // go build ids contain slashes, the others are hex already
+    pub fn file_name(&self) -> String {
+        if self.typ == "go" {
+            format!("{}-{}", self.typ, hex::encode(&self.id))
+        } else {
+            format!("{}-{}", self.typ, self.id)
+        }
+    }
 }
 
 pub trait BuildIdentified {
@@ -1,22 +1,48 @@
-use std::borrow::BorrowMut;
 use std::collections::HashMap;
 use std::fs::File;
-use std::io::{Read, Seek, SeekFrom};
+use std::io::Read;
+use std::ops::Deref;
 use std::path::PathBuf;
+use std::sync::Arc;
 
 use byteorder::{ByteOrder, LittleEndian};
 use goblin::elf::{Elf, Header, ProgramHeaders, SectionHeader, SectionHeaders};
 use goblin::elf::header::{EI_CLASS, ELFCLASS32, ELFCLASS64};
-use goblin::elf::section_header::{SHT_DYNSYM, SHT_SYMTAB};
+use goblin::elf::section_header::SHT_DYNSYM;
 use goblin::elf::sym::{STT_FUNC, sym32, sym64};
-use tokio::io::{AsyncReadExt, AsyncSeekExt};
+use memmap2::Mmap;
 
-use crate::ebpf::symtab::elf::pcindex::PCIndex;
-use crate::ebpf::symtab::elf::symbol_table::{FlatSymbolIndex, SECTION_TYPE_DYN_SYM, SECTION_TYPE_SYM, SectionLinkIndex, SymbolIndex, SymbolNameTable};
+use crate::ebpf::symtab::elf::symbol_table::{SECTION_TYPE_DYN_SYM, SECTION_TYPE_SYM, SectionLinkIndex, SymbolIndex};
 use crate::ebpf::symtab::elf::symbol_table::Name;
-use crate::error::Error::{MapError, NotFound, SymbolError};
+use crate::error::Error::{ELFError, MapError, NotFound, SymbolError};
 use crate::error::Result;
 
+// Files up to this size are read into memory instead of mapped.
+const COPY_MAX_SIZE: u64 = 1 << 20;
+
+// The bytes of an ELF or index file. The mapping stays valid when the file is unlinked or
+// replaced by a rename, as package managers and image layers do. A file truncated or rewritten
+// in place raises SIGBUS on the next access to the pages it lost, bounds checks against the
+// mapped length do not prevent that, so small files are copied to keep them out of reach.
+#[derive(Debug)]
+pub(crate) enum ElfData {
+    Mapped(Mmap),
+    Copied(Vec<u8>),
+}
+
+impl Deref for ElfData {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        match self {
+            ElfData::Mapped(m) => m,
+            ElfData::Copied(v) => v,
+        }
+    }
+}
+
+// An ELF file mapped read-only. The mapping is shared with the symbol tables built from it,
+// which decode names straight from it instead of reading and caching them.
 #[derive(Debug)]
 pub struct MappedElfFile {
     pub header: Header,
@@ -24,8 +50,7 @@ pub struct MappedElfFile {
     pub section_headers: SectionHeaders,
     pub strtab: HashMap<usize, String>,
     pub fpath: PathBuf,
-    pub fd: Option<File>,
-    pub string_cache: HashMap<usize, String>
+    pub(crate) data: Arc<ElfData>,
 }
 
 #[derive(Debug)]
@@ -36,18 +61,20 @@ pub struct SymbolsOptions {
 
 impl MappedElfFile {
     pub fn new(fpath: PathBuf) -> Result<Self> {
-        dbg!(&fpath);
-
-        let fd = File::open(&fpath);
-        if fd.is_err() {
-            return Err(MapError(fd.err().unwrap().to_string()));
-        }
-        let mut buffer = Vec::new();
-        fd.as_ref().borrow_mut().unwrap().read_to_end(&mut buffer).unwrap();
-        let elf = Elf::parse(buffer.as_slice()).unwrap();
+        let mut file = File::open(&fpath).map_err(|e| MapError(e.to_string()))?;
+        let size = file.metadata().map_err(|e| MapError(format!("stat {:?}: {}", fpath, e)))?.len();
+        let data = if size <= COPY_MAX_SIZE {
+            let mut buf = Vec::with_capacity(size as usize);
+            file.read_to_end(&mut buf).map_err(|e| MapError(format!("read {:?}: {}", fpath, e)))?;
+            ElfData::Copied(buf)
+        } else {
+            // safe as long as the file is not truncated in place, see ElfData
+            ElfData::Mapped(unsafe { Mmap::map(&file) }.map_err(|e| MapError(format!("mmap {:?}: {}", fpath, e)))?)
+        };
+        let elf = Elf::parse(&data).map_err(|e| ELFError(format!("{:?}: {}", fpath, e)))?;
 
         let strtab = elf.section_headers.iter()
-            .map(|s| (s.sh_name, elf.shdr_strtab.get_at(s.sh_name).unwrap().to_string()))
+            .map(|s| (s.sh_name, elf.shdr_strtab.get_at(s.sh_name).unwrap_or("").to_string()))
             .collect::<HashMap<usize, String>>();
 
         Ok(Self {
@@ -56,14 +83,13 @@ impl MappedElfFile {
             section_headers: elf.section_headers,
             strtab,
             fpath,
-            fd: Some(fd.unwrap()),
-            string_cache: HashMap::new(),
+            data: Arc::new(data),
         })
     }
 
     pub fn section(&self, name: &str) -> Option<&SectionHeader> {
         self.section_headers.iter()
-            .find(|s| self.strtab.get(&s.sh_name) == Some(&name.to_string()))
+            .find(|s| self.strtab.get(&s.sh_name).map(|n| n == name).unwrap_or(false))
     }
 
     fn section_by_type(&self, typ: u32) -> Option<&SectionHeader> {
@@ -71,75 +97,31 @@ impl MappedElfFile {
             .find(|s| s.sh_type == typ)
     }
 
-    fn open(&mut self) -> Result<()> {
-        let fd = File::open(&self.fpath).unwrap();
-        self.fd = Some(fd);
-        Ok(())
+    fn section_bytes(&self, section: &SectionHeader) -> Result<&[u8]> {
+        let start = section.sh_offset as usize;
+        let end = start.checked_add(section.sh_size as usize)
+            .filter(|end| *end <= self.data.len())
+            .ok_or_else(|| ELFError(format!("{:?}: section out of file bounds", self.fpath)))?;
+        Ok(&self.data[start..end])
     }
 
     pub(crate) fn section_data_by_section_name(&mut self, name: &str) -> Result<Vec<u8>> {
-        let section = match self.section_headers
-            .iter().find(|s| self.strtab.get(&s.sh_name) == Some(&name.to_string())) {
+        let section = match self.section(name) {
             Some(section) => section,
             None => return Err(NotFound(format!("Section data by section name '{}' not found", name)))
         };
-        let mut res = vec![0; section.sh_size as usize];
-
-        let mut fd = self.fd.borrow_mut().as_ref().unwrap();
-        fd.seek(SeekFrom::Start(section.sh_offset)).unwrap();
-        fd.read_exact(&mut res).unwrap();
-
-        Ok(res)
+        Ok(self.section_bytes(section)?.to_vec())
     }
 
     pub(crate) fn section_data(&mut self, typ: u32) -> Result<(Vec<u8>, &SectionHeader)> {
-        let section = match self.section_headers.iter().find(|s| s.sh_type == typ) {
+        let section = match self.section_by_type(typ) {
             Some(section) => section,
             None => return Err(NotFound("No symbol section".to_string())),
         };
-        let mut res = vec![0; section.sh_size as usize];
-
-        let mut fd = self.fd.borrow_mut().as_ref().unwrap();
-        fd.seek(SeekFrom::Start(section.sh_offset)).unwrap();
-        fd.read_exact(&mut res).unwrap();
-
-        Ok((res, section))
-    }
-
-    pub(crate) fn get_string(&mut self, start: usize) -> Result<(String, bool)> {
-        if let Some(s) = self.string_cache.get(&start).cloned() {
-            return Ok((s, true));
-        }
-        const TMP_BUF_SIZE: usize = 128;
-        let mut tmp_buf = [0; TMP_BUF_SIZE];
-        let mut sb = String::new();
-        for i in 0..10 {
-            let f = self.fd.borrow_mut().as_ref();
-            if f.is_none() { continue; }
-
-            let mut fd = f.unwrap();
-            fd.seek(SeekFrom::Start((start + i * TMP_BUF_SIZE) as u64)).unwrap();
-            fd.read_exact(&mut tmp_buf).unwrap();
-
-            if let Some(idx) = tmp_buf.iter().position(|&x| x == 0) {
-                sb.push_str(&String::from_utf8_lossy(&tmp_buf[..idx]));
-                let s = sb.clone();
-                self.string_cache.insert(start, s.clone());
-                return Ok((s, true));
-            } else {
-                sb.push_str(&String::from_utf8_lossy(&tmp_buf));
-            }
-        }
-        Ok((String::new(), false))
-    }
-
-    pub(crate) fn close(&mut self) {
-        self.fd = None;
-        self.string_cache.clear();
-        self.section_headers.clear();
+        Ok((self.section_bytes(section)?.to_vec(), section))
     }
 
-    pub(crate) fn get_symbols(&mut self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
+    pub(crate) fn get_symbols(&self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
         match self.header.e_ident[EI_CLASS] {
             ELFCLASS32 => self.get_symbols32(typ),
             ELFCLASS64 => self.get_symbols64(typ),
@@ -147,22 +129,16 @@ impl MappedElfFile {
         }
     }
 
-    fn get_symbols64(&mut self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
-        dbg!(typ);
-        let (mut data, section) = self.section_data(typ)?;
+    fn get_symbols64(&self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
+        let section = self.section_by_type(typ).ok_or_else(|| NotFound("No symbol section".to_string()))?;
+        let data = self.section_bytes(section)?;
         if data.len() % sym64::SIZEOF_SYM != 0 {
             return Err(SymbolError("Length of symbol section is not a multiple of Sym64Size".to_string()));
         }
 
-        data = data.split_off(sym64::SIZEOF_SYM);
         let mut symbols = Vec::new();
-        let mut i = 0;
-        let mut sym = [0; sym64::SIZEOF_SYM];
-
-        while !data.is_empty() {
-            sym.copy_from_slice(&data[..sym64::SIZEOF_SYM]);
-            data = data.split_off(sym64::SIZEOF_SYM);
-
+        // the first entry is the reserved null symbol
+        for sym in data.chunks_exact(sym64::SIZEOF_SYM).skip(1) {
             let name = LittleEndian::read_u32(&sym[0..4]);
             let value = LittleEndian::read_u64(&sym[8..16]);
             let info = sym[4];
@@ -171,34 +147,24 @@ impl MappedElfFile {
                 if name >= 0x7fffffff {
                     return Err(SymbolError("Wrong symbol name".to_string()));
                 }
-                let pc = value;
-
-                let link_index = get_link_index(typ);
                 symbols.push(SymbolIndex {
-                    name: Name::new(name, link_index.clone()),
-                    value: pc,
+                    name: Name::new(name, get_link_index(typ)),
+                    value,
                 });
-                i += 1;
             }
         }
         Ok((symbols, section.sh_link))
     }
 
-    fn get_symbols32(&mut self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
-        let (mut data, section)  = self.section_data(typ)?;
+    fn get_symbols32(&self, typ: u32) -> Result<(Vec<SymbolIndex>, u32)> {
+        let section = self.section_by_type(typ).ok_or_else(|| NotFound("No symbol section".to_string()))?;
+        let data = self.section_bytes(section)?;
         if data.len() % sym32::SIZEOF_SYM != 0 {
             return Err(SymbolError("Length of symbol section is not a multiple of Sym32Size".to_string()));
         }
 
-        data = data.split_off(sym32::SIZEOF_SYM);
         let mut symbols = Vec::new();
-        let mut i = 0;
-        let mut sym = [0; sym32::SIZEOF_SYM];
-
-        while !data.is_empty() {
-            sym.copy_from_slice(&data[..sym32::SIZEOF_SYM]);
-            data = data.split_off(sym32::SIZEOF_SYM);
-
+        for sym in data.chunks_exact(sym32::SIZEOF_SYM).skip(1) {
             let name = LittleEndian::read_u32(&sym[0..4]);
             let value = LittleEndian::read_u32(&sym[4..8]);
             let info = sym[12];
@@ -207,13 +173,10 @@ impl MappedElfFile {
                 if name >= 0x7fffffff {
                     return Err(SymbolError("Wrong symbol name".to_string()));
                 }
-                let pc = value as u64;
-                let link_index = get_link_index(typ);
                 symbols.push(SymbolIndex {
-                    name: Name::new(name, link_index),
-                    value: pc,
+                    name: Name::new(name, get_link_index(typ)),
+                    value: value as u64,
                 });
-                i += 1;
             }
         }
         Ok((symbols, section.sh_link))
@@ -228,10 +191,9 @@ fn get_link_index(typ: u32) -> SectionLinkIndex {
     }
 }
 
-impl Drop for MappedElfFile {
-    fn drop(&mut self) {
-        if let Some(fd) = self.fd.take() {
-            drop(fd);
-        }
-    }
+// The NUL terminated string at offset start of an ELF image.
+pub(crate) fn string_at(data: &[u8], start: usize) -> Option<String> {
+    let tail = data.get(start..)?;
+    let len = tail.iter().position(|&b| b == 0)?;
+    Some(String::from_utf8_lossy(&tail[..len]).into_owned())
 }
@@ -1,4 +1,4 @@
 pub mod symbol_table;
 pub mod elfmmap;
 pub mod buildid;
-mod pcindex;
\ No newline at end of file
+pub mod pcindex;
\ No newline at end of file
@@ -1,9 +1,69 @@
 use std::convert::From;
 
+// Below this many symbols the sorted array fits in the cache and a binary search is as fast.
+const EYTZINGER_MIN_LEN: usize = 1 << 13;
+
 #[derive(Debug)]
 pub struct PCIndex {
     i32: Option<Vec<u32>>,
     i64: Option<Vec<u64>>,
+    // search layout of large tables, built by freeze once every value is set
+    eytzinger: Option<EytzingerIndex>,
+}
+
+#[derive(Debug)]
+enum EytzingerIndex {
+    I32(Eytzinger<u32>),
+    I64(Eytzinger<u64>),
+}
+
+// The sorted values in breadth first order of the implicit binary search tree, so the first levels
+// of every search share a few cache lines and the next node is always at 2k or 2k+1.
+#[derive(Debug)]
+struct Eytzinger<T> {
+    // 1-based, keys[0] is unused
+    keys: Vec<T>,
+    // position of keys[k] in the sorted array
+    positions: Vec<u32>,
+}
+
+impl<T: Copy + Ord + Default> Eytzinger<T> {
+    fn new(sorted: &[T]) -> Self {
+        let mut res = Eytzinger {
+            keys: vec![T::default(); sorted.len() + 1],
+            positions: vec![0; sorted.len() + 1],
+        };
+        let mut next = 0;
+        res.fill(sorted, &mut next, 1);
+        res
+    }
+
+    fn fill(&mut self, sorted: &[T], next: &mut usize, k: usize) {
+        if k > sorted.len() {
+            return;
+        }
+        self.fill(sorted, next, 2 * k);
+        self.keys[k] = sorted[*next];
+        self.positions[k] = *next as u32;
+        *next += 1;
+        self.fill(sorted, next, 2 * k + 1);
+    }
+
+    // Sorted position of the first value greater than x, the length if there is none.
+    fn upper_bound(&self, x: T) -> usize {
+        let n = self.keys.len();
+        let mut k = 1;
+        while k < n {
+            k = 2 * k + (self.keys[k] <= x) as usize;
+        }
+        // drop the right turns taken after the last left one
+        k >>= k.trailing_ones() + 1;
+        if k == 0 {
+            n - 1
+        } else {
+            self.positions[k] as usize
+        }
+    }
 }
 
 impl PCIndex {
@@ -11,17 +71,18 @@ impl PCIndex {
         PCIndex {
             i32: Some(vec![0; sz]),
             i64: None,
+            eytzinger: None,
         }
     }
 
-    pub(crate) fn set(&mut self, idx: usize, value: u64) {
+    pub fn set(&mut self, idx: usize, value: u64) {
         if let Some(i32_vec) = &mut self.i32 {
             if value < u64::from(u32::MAX) {
                 i32_vec[idx] = value as u32;
                 return;
             }
-            self.set_impl(idx, value);
         }
+        self.set_impl(idx, value);
     }
 
     fn set_impl(&mut self, idx: usize, value: u64) {
@@ -52,7 +113,7 @@ impl PCIndex {
         }
     }
 
-    fn get(&self, idx: usize) -> u64 {
+    pub(crate) fn get(&self, idx: usize) -> u64 {
         if let Some(i32_vec) = &self.i32 {
             u64::from(i32_vec[idx])
         } else if let Some(i64_vec) = &self.i64 {
@@ -89,13 +150,33 @@ impl PCIndex {
     }
 
 
-    pub(crate) fn find_index(&self, addr: u64) -> Option<isize> {
+    // Builds the search layout of large tables, the values must be sorted and not change afterwards.
+    pub fn freeze(&mut self) {
+        if self.length() < EYTZINGER_MIN_LEN {
+            return;
+        }
+        if let Some(i32_vec) = &self.i32 {
+            self.eytzinger = Some(EytzingerIndex::I32(Eytzinger::new(i32_vec)));
+        } else if let Some(i64_vec) = &self.i64 {
+            self.eytzinger = Some(EytzingerIndex::I64(Eytzinger::new(i64_vec)));
+        }
+    }
+
+    pub fn find_index(&self, addr: u64) -> Option<isize> {
+        if let Some(eytzinger) = &self.eytzinger {
+            return self.find_index_eytzinger(eytzinger, addr);
+        }
         if let Some(i32_vec) = &self.i32 {
             if addr < u64::from(i32_vec[0]) {
                 return None;
             }
             match i32_vec.binary_search(&(addr as u32)) {
-                Ok(i) => return Some(i as isize),
+                Ok(mut i) => {
+                    while i > 0 && i32_vec[i - 1] == i32_vec[i] {
+                        i -= 1;
+                    }
+                    return Some(i as isize);
+                }
                 Err(mut i) => {
                     if i > 0 {
                         i -= 1;
@@ -112,7 +193,12 @@ impl PCIndex {
                 return None;
             }
             match i64_vec.binary_search(&addr) {
-                Ok(i) => return Some(i as isize),
+                Ok(mut i) => {
+                    while i > 0 && i64_vec[i - 1] == i64_vec[i] {
+                        i -= 1;
+                    }
+                    return Some(i as isize);
+                }
                 Err(mut i) => {
                     if i > 0 {
                         i -= 1;
@@ -127,4 +213,87 @@ impl PCIndex {
         }
         None
     }
+
+    fn find_index_eytzinger(&self, eytzinger: &EytzingerIndex, addr: u64) -> Option<isize> {
+        let upper = match eytzinger {
+            EytzingerIndex::I32(e) => e.upper_bound(addr.min(u64::from(u32::MAX)) as u32),
+            EytzingerIndex::I64(e) => e.upper_bound(addr),
+        };
+        if upper == 0 {
+            return None;
+        }
+        let mut i = upper - 1;
+        let v = self.get(i);
+        while i > 0 && self.get(i - 1) == v {
+            i -= 1;
+        }
+        Some(i as isize)
+    }
+}
+
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Index of the first of the equal values at or below addr.
+    fn expected(values: &[u64], addr: u64) -> Option<isize> {
+        let upper = values.partition_point(|&v| v <= addr);
+        if upper == 0 {
+            return None;
+        }
+        let v = values[upper - 1];
+        Some(values.partition_point(|&x| x < v) as isize)
+    }
+
+    fn check(values: &[u64]) {
+        let mut index = PCIndex::new(values.len());
+        for (i, &v) in values.iter().enumerate() {
+            index.set(i, v);
+        }
+        index.freeze();
+        assert_eq!(index.eytzinger.is_some(), values.len() >= EYTZINGER_MIN_LEN);
+
+        let last = *values.last().unwrap();
+        let mut addrs = vec![0, values[0].saturating_sub(1), last, last + 1, last + 1000, u64::MAX];
+        for &v in values.iter().step_by(7) {
+            addrs.extend_from_slice(&[v.saturating_sub(1), v, v + 1]);
+        }
+        for addr in addrs {
+            assert_eq!(index.find_index(addr), expected(values, addr), "len {} addr {:#x}", values.len(), addr);
+        }
+    }
+
+    fn lengths() -> Vec<usize> {
+        let mut res = vec![1, 2, 3];
+        for k in [4, 10, 13, 14] {
+            let n = 1usize << k;
+            res.extend_from_slice(&[n - 2, n - 1, n, n + 1]);
+        }
+        res
+    }
+
+    #[test]
+    fn find_index_32() {
+        for n in lengths() {
+            let values: Vec<u64> = (0..n as u64).map(|i| 0x1000 + i * 16 + i % 5).collect();
+            check(&values);
+        }
+    }
+
+    #[test]
+    fn find_index_64() {
+        for n in lengths() {
+            let values: Vec<u64> = (0..n as u64).map(|i| (1 << 40) + i * 32).collect();
+            check(&values);
+        }
+    }
+
+    #[test]
+    fn find_index_duplicates() {
+        for n in lengths() {
+            let values: Vec<u64> = (0..n as u64).map(|i| 0x2000 + (i / 3) * 8).collect();
+            check(&values);
+        }
+    }
 }
@@ -1,12 +1,27 @@
+use std::fs;
+use std::io::Write;
+use std::path::{Path, PathBuf};
+use std::process;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
 use goblin::elf32::section_header::{SHT_DYNSYM, SHT_SYMTAB};
 use goblin::elf::SectionHeader;
+use memmap2::Mmap;
 
-use crate::ebpf::symtab::elf::elfmmap::MappedElfFile;
+use crate::ebpf::symtab::elf::elfmmap::{string_at, ElfData, MappedElfFile};
 use crate::ebpf::symtab::elf::pcindex::PCIndex;
 use crate::ebpf::symtab::symtab::SymbolNameResolver;
-use crate::ebpf::symtab::gcache::Resource;
 use crate::error::{Error::NotFound, Result};
-use crate::error::Error::SymbolError;
+use crate::error::Error::{InvalidData, OSError, SymbolError};
+
+const SYMBOL_INDEX_FILE_MAGIC: &[u8; 8] = b"IWMSYMIX";
+const SYMBOL_INDEX_FILE_VERSION: u32 = 1;
+// magic, version, count
+const SYMBOL_INDEX_FILE_HEADER_SIZE: usize = 16;
+
+// temporary index files are unique per process and write
+static INDEX_FILE_SEQ: AtomicU64 = AtomicU64::new(0);
 
 #[derive(Clone, PartialEq, Eq, PartialOrd, Ord)]
 pub struct SymbolIndex {
@@ -24,11 +39,13 @@ pub(crate) const SECTION_TYPE_SYM: SectionLinkIndex = SectionLinkIndex(0);
 pub(crate) const SECTION_TYPE_DYN_SYM: SectionLinkIndex = SectionLinkIndex(1);
 
 impl Name {
+    const MAX_INDEX: u32 = 0x7FFFFFFF;
+
     pub(crate) fn new(name_index: u32, link_index: SectionLinkIndex) -> Self {
         Name(name_index | (link_index.0 as u32) << 31)
     }
     fn name_index(&self) -> u32 {
-        self.0 & 0x7FFFFFFF
+        self.0 & Name::MAX_INDEX
     }
     fn link_index(&self) -> SectionLinkIndex {
         SectionLinkIndex((self.0 >> 31) as u8)
@@ -41,30 +58,21 @@ pub struct FlatSymbolIndex {
     pub(crate) values: PCIndex
 }
 
+// Immutable once built, so one table per ELF is shared by every process mapping it without a
+// lock. Names stay in the mapped file and are only decoded for resolved addresses.
 pub struct SymbolNameTable {
     pub(crate) index: FlatSymbolIndex,
-    pub(crate) file: MappedElfFile
-}
-
-impl Resource for SymbolNameTable {
-    fn refresh_resource(&mut self) {}
-    fn cleanup_resource(&mut self) {
-        self.file.close();
-    }
+    data: Arc<ElfData>,
+    fpath: PathBuf,
 }
 
 impl SymbolNameResolver for SymbolNameTable {
 
-    fn refresh(&mut self) {}
-    fn cleanup(&mut self) {
-        self.file.close();
-    }
-
     fn debug_info(&self) -> SymTabDebugInfo {
         SymTabDebugInfo {
             name: format!("SymbolTable"), // add debug info
             size: self.index.names.len(),
-            file: self.file.fpath.clone().to_str().unwrap().to_string(),
+            file: self.fpath.to_string_lossy().to_string(),
             last_used_round: 0,
         }
     }
@@ -73,7 +81,7 @@ impl SymbolNameResolver for SymbolNameTable {
         false
     }
 
-    fn resolve(&mut self, addr: u64) -> Option<String> {
+    fn resolve(&self, addr: u64) -> Option<String> {
         if self.index.names.is_empty() {
             return None;
         }
@@ -92,19 +100,16 @@ impl SymbolNameTable {
         self.index.names.len()
     }
 
-    fn symbol_name(&mut self, idx: usize) -> Result<String> {
+    fn symbol_name(&self, idx: usize) -> Result<String> {
         let link_index = self.index.names[idx].link_index();
         let section_header_link = &self.index.links[link_index.0 as usize];
         let name_index = self.index.names[idx].name_index() as u64;
 
-        let (s, b) = self.file.get_string(
-            (name_index + section_header_link.sh_offset) as usize
-        ).unwrap();
-        if !b { return Err(NotFound(format!("failed to get symbols {:?}", link_index))); }
-        Ok(s)
+        string_at(&self.data, (name_index + section_header_link.sh_offset) as usize)
+            .ok_or_else(|| NotFound(format!("failed to get symbols {:?}", link_index)))
     }
 
-    pub fn new(mut elf_file: MappedElfFile) -> Result<SymbolNameTable> {
+    pub fn new(elf_file: MappedElfFile) -> Result<SymbolNameTable> {
         let (sym, section_sym) = elf_file.get_symbols(SHT_SYMTAB)?;
         let (dynsym, section_dynsym) = elf_file.get_symbols(SHT_DYNSYM)?;
         let total = dynsym.len() + sym.len();
@@ -115,7 +120,7 @@ impl SymbolNameTable {
         let mut all: Vec<SymbolIndex> = Vec::with_capacity(total);
         all.extend_from_slice(sym.as_slice());
         all.extend_from_slice(dynsym.as_slice());
-        all.sort();
+        all.sort_by_key(|s| s.value);
 
         let mut res = SymbolNameTable {
             index: FlatSymbolIndex {
@@ -126,17 +131,102 @@ impl SymbolNameTable {
                 names: Vec::with_capacity(total),
                 values: PCIndex::new(total)
             },
-            file: elf_file
+            data: elf_file.data.clone(),
+            fpath: elf_file.fpath.clone(),
         };
 
         for (i, symbol) in all.iter().enumerate() {
             res.index.names.push(symbol.name.clone());
             res.index.values.set(i, symbol.value.clone());
         }
+        res.index.values.freeze();
         Ok(res)
     }
 }
 
+// Index files keep a built table for the next agent start: the sorted start addresses, the
+// offset of each name in the string table and the NUL terminated names, little endian.
+impl SymbolNameTable {
+
+    pub fn open_index_file(path: &Path) -> Result<SymbolNameTable> {
+        let file = fs::File::open(path).map_err(|e| OSError(format!("open {:?}: {}", path, e)))?;
+        // index files are only ever replaced by a rename
+        let data = unsafe { Mmap::map(&file) }.map_err(|e| OSError(format!("mmap {:?}: {}", path, e)))?;
+        if data.len() < SYMBOL_INDEX_FILE_HEADER_SIZE || &data[..8] != SYMBOL_INDEX_FILE_MAGIC {
+            return Err(InvalidData(format!("{:?}: not a symbol index file", path)));
+        }
+        if u32::from_le_bytes(data[8..12].try_into().unwrap()) != SYMBOL_INDEX_FILE_VERSION {
+            return Err(InvalidData(format!("{:?}: incompatible symbol index file", path)));
+        }
+        let count = u32::from_le_bytes(data[12..16].try_into().unwrap()) as usize;
+        let names_start = SYMBOL_INDEX_FILE_HEADER_SIZE + count * 8;
+        let strings_start = names_start + count * 4;
+        if count == 0 || data.len() < strings_start {
+            return Err(InvalidData(format!("{:?}: truncated symbol index file", path)));
+        }
+
+        let mut strings = SectionHeader::default();
+        strings.sh_offset = strings_start as u64;
+        let mut index = FlatSymbolIndex {
+            links: vec![strings],
+            names: Vec::with_capacity(count),
+            values: PCIndex::new(count),
+        };
+        let values = data[SYMBOL_INDEX_FILE_HEADER_SIZE..names_start].chunks_exact(8);
+        let names = data[names_start..strings_start].chunks_exact(4);
+        let mut prev = 0;
+        for (i, (value, name)) in values.zip(names).enumerate() {
+            let value = u64::from_le_bytes(value.try_into().unwrap());
+            if value < prev {
+                return Err(InvalidData(format!("{:?}: unsorted symbol index file", path)));
+            }
+            prev = value;
+            index.values.set(i, value);
+            index.names.push(Name::new(u32::from_le_bytes(name.try_into().unwrap()), SECTION_TYPE_SYM));
+        }
+        index.values.freeze();
+        Ok(SymbolNameTable {
+            index,
+            data: Arc::new(ElfData::Mapped(data)),
+            fpath: path.to_path_buf(),
+        })
+    }
+
+    pub fn write_index_file(&self, path: &Path) -> Result<()> {
+        let count = self.size();
+        let mut data = Vec::with_capacity(SYMBOL_INDEX_FILE_HEADER_SIZE + count * 32);
+        data.extend_from_slice(SYMBOL_INDEX_FILE_MAGIC);
+        data.extend_from_slice(&SYMBOL_INDEX_FILE_VERSION.to_le_bytes());
+        data.extend_from_slice(&(count as u32).to_le_bytes());
+        for i in 0..count {
+            data.extend_from_slice(&self.index.values.get(i).to_le_bytes());
+        }
+        let mut strings = Vec::with_capacity(count * 16);
+        for i in 0..count {
+            if strings.len() > Name::MAX_INDEX as usize {
+                return Err(SymbolError(format!("{:?}: too many symbol names for an index file", self.fpath)));
+            }
+            data.extend_from_slice(&(strings.len() as u32).to_le_bytes());
+            strings.extend_from_slice(self.symbol_name(i).unwrap_or_default().as_bytes());
+            strings.push(0);
+        }
+        data.extend_from_slice(&strings);
+
+        let seq = INDEX_FILE_SEQ.fetch_add(1, Ordering::Relaxed);
+        let tmp = path.with_extension(format!("{}.{}.tmp", process::id(), seq));
+        let res = fs::File::options()
+            .write(true)
+            .create_new(true)
+            .open(&tmp)
+            .and_then(|mut f| f.write_all(&data))
+            .and_then(|_| fs::rename(&tmp, path));
+        if res.is_err() {
+            let _ = fs::remove_file(&tmp);
+        }
+        res.map_err(|e| OSError(format!("write {:?}: {}", path, e)))
+    }
+}
+
 #[derive(Debug)]
 pub struct SymTabDebugInfo {
     name: String,
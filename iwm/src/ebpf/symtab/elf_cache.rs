@@ -1,97 +1,276 @@
-use std::ops::Deref;
+use std::collections::HashMap;
+use std::fs;
+use std::hash::Hash;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicI32, Ordering};
+use std::sync::mpsc::{channel, Receiver, Sender};
 use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, SystemTime};
 
+use arc_swap::ArcSwap;
+use log::{debug, error};
 
 use crate::error::Result;
 use crate::ebpf::symtab::elf::buildid::BuildID;
 use crate::ebpf::symtab::elf::symbol_table::{SymbolNameTable, SymTabDebugInfo};
-use crate::ebpf::symtab::gcache::{debug_info, GCache, GCacheDebugInfo, GCacheOptions};
+use crate::ebpf::symtab::gcache::{GCacheDebugInfo, GCacheOptions};
 use crate::ebpf::symtab::stat::Stat;
 use crate::ebpf::symtab::symtab::SymbolNameResolver;
 
+// Loaded symbol tables by build id and by file stat. Tables are immutable, so a process mapping an
+// already loaded ELF shares its table and resolves without taking any lock.
+// With an index directory, tables of ELFs with a build id are also kept on disk, so after a
+// restart they are mapped again instead of being rebuilt from the ELF. They are written on their
+// own thread, which also keeps the directory under INDEX_DIR_MAX_SIZE by removing the files least
+// recently opened.
 pub struct ElfCache {
-    build_id_cache: Mutex<GCache<BuildID, SymbolNameTable>>,
-    same_file_cache: Mutex<GCache<Stat, SymbolNameTable>>,
+    build_id_cache: SharedTableCache<BuildID>,
+    same_file_cache: SharedTableCache<Stat>,
+    index_path: Option<PathBuf>,
+    index_writer: Option<Mutex<Sender<(PathBuf, Arc<SymbolNameTable>)>>>,
 }
 
+const INDEX_DIR_MAX_SIZE: u64 = 512 << 20;
+// left behind by a crash while writing
+const INDEX_TMP_FILE_MAX_AGE: Duration = Duration::from_secs(3600);
+
 impl ElfCache {
-    pub fn new(build_id_cache_options: GCacheOptions, same_file_cache_options: GCacheOptions) -> Result<Self> {
-        let build_id_cache = Mutex::new(GCache::<BuildID, SymbolNameTable>::new(build_id_cache_options));
-        let same_file_cache = Mutex::new(GCache::<Stat, SymbolNameTable>::new(same_file_cache_options));
-        Ok(Self { build_id_cache, same_file_cache })
-    }
-
-    pub fn get_symbols_by_build_id(&self, build_id: &BuildID) -> Option<Arc<Mutex<SymbolNameTable>>> {
-        if let Some(res) = self.build_id_cache.lock().unwrap().get(build_id) {
-            {
-                let sym_tab = res.lock().unwrap();
-                if sym_tab.is_dead() {
-                    self.build_id_cache.lock().unwrap().remove(build_id);
-                    return None;
-                }
+    pub fn new(build_id_cache_options: GCacheOptions, same_file_cache_options: GCacheOptions, index_path: Option<PathBuf>) -> Result<Self> {
+        let build_id_cache = SharedTableCache::new(build_id_cache_options);
+        let same_file_cache = SharedTableCache::new(same_file_cache_options);
+        let mut index_writer = None;
+        if let Some(path) = &index_path {
+            if let Err(err) = fs::create_dir_all(path) {
+                error!("create symbol index dir {:?}: {}", path, err);
+            }
+            let (tx, rx) = channel();
+            let dir = path.clone();
+            match thread::Builder::new().name("symbol-index".to_string()).spawn(move || write_index_files(rx, dir)) {
+                Ok(_) => index_writer = Some(Mutex::new(tx)),
+                Err(err) => error!("start symbol index writer: {}", err),
             }
-            return Some(res)
         }
-        return None;
+        Ok(Self { build_id_cache, same_file_cache, index_path, index_writer })
     }
 
-    pub fn cache_by_build_id(&self, build_id: BuildID, v: Arc<Mutex<SymbolNameTable>>) {
-        self.build_id_cache.lock().unwrap().cache(build_id, v.clone());
+    pub fn get_symbols_by_build_id(&self, build_id: &BuildID) -> Option<Arc<SymbolNameTable>> {
+        if let Some(table) = self.build_id_cache.get(build_id) {
+            return Some(table);
+        }
+        let path = self.index_file(build_id)?;
+        if !path.exists() {
+            return None;
+        }
+        match SymbolNameTable::open_index_file(&path) {
+            Ok(table) => {
+                debug!("symbol index {:?} loaded", path);
+                // the modification time orders the files for the size cap
+                let _ = fs::File::options().write(true).open(&path).and_then(|f| f.set_modified(SystemTime::now()));
+                let table = Arc::new(table);
+                self.build_id_cache.cache(build_id.clone(), table.clone());
+                Some(table)
+            }
+            Err(err) => {
+                error!("open symbol index: {}", err);
+                let _ = fs::remove_file(&path);
+                None
+            }
+        }
     }
 
-    pub fn get_symbols_by_stat(&self, s: Stat) -> Option<Arc<Mutex<SymbolNameTable>>> {
-        let res = self.same_file_cache.lock().unwrap().get(&s);
-        if res.is_none() {
-            return None
+    pub fn cache_by_build_id(&self, build_id: BuildID, v: Arc<SymbolNameTable>) {
+        if let (Some(path), Some(writer)) = (self.index_file(&build_id), &self.index_writer) {
+            let _ = writer.lock().unwrap().send((path, v.clone()));
         }
-        let st = res.unwrap();
-        {
-            let sym_tab = st.lock().unwrap();
-            if sym_tab.is_dead() {
-                self.same_file_cache.lock().unwrap().remove(&s);
-                return None;
-            }
+        self.build_id_cache.cache(build_id, v);
+    }
+
+    fn index_file(&self, build_id: &BuildID) -> Option<PathBuf> {
+        if build_id.is_empty() {
+            return None;
         }
-        Some(st)
+        Some(self.index_path.as_ref()?.join(format!("{}.idx", build_id.file_name())))
     }
 
-    pub fn cache_by_stat(&self, s: Stat, v: Arc<Mutex<SymbolNameTable>>) {
-        self.same_file_cache.lock().unwrap().cache(s, v.clone());
+    pub fn get_symbols_by_stat(&self, s: Stat) -> Option<Arc<SymbolNameTable>> {
+        self.same_file_cache.get(&s)
+    }
+
+    pub fn cache_by_stat(&self, s: Stat, v: Arc<SymbolNameTable>) {
+        self.same_file_cache.cache(s, v);
     }
 
     pub fn update(&self, build_id_cache_options: GCacheOptions, same_file_cache_options: GCacheOptions) {
-        self.build_id_cache.lock().unwrap().update(build_id_cache_options);
-        self.same_file_cache.lock().unwrap().update(same_file_cache_options);
+        self.build_id_cache.update(build_id_cache_options);
+        self.same_file_cache.update(same_file_cache_options);
     }
 
     pub fn next_round(&self) {
-        self.build_id_cache.lock().unwrap().next_round();
-        self.same_file_cache.lock().unwrap().next_round();
+        self.build_id_cache.next_round();
+        self.same_file_cache.next_round();
     }
 
     pub fn cleanup(&self) {
-        self.build_id_cache.lock().unwrap().cleanup();
-        self.same_file_cache.lock().unwrap().cleanup();
+        self.build_id_cache.cleanup();
+        self.same_file_cache.cleanup();
     }
 
     pub fn debug_info(&self) -> ElfCacheDebugInfo {
-        let build_id_cache = debug_info::<BuildID, SymbolNameTable, SymTabDebugInfo>(
-            self.build_id_cache.lock().unwrap().deref(),
-            |_b: &BuildID, v: &Arc<Mutex<SymbolNameTable>>, round: i32| {
-                let value = v.lock().unwrap();
-                let mut res = value.debug_info();
-                res.last_used_round = round;
-                res
-            });
-        let same_file_cache = debug_info::<Stat, SymbolNameTable, SymTabDebugInfo>(
-            self.same_file_cache.lock().unwrap().deref(),
-            |_s: &Stat, v: &Arc<Mutex<SymbolNameTable>>, round: i32| {
-                let value = v.lock().unwrap();
-                let mut res = value.debug_info();
-                res.last_used_round = round;
+        ElfCacheDebugInfo {
+            build_id_cache: self.build_id_cache.debug_info(),
+            same_file_cache: self.same_file_cache.debug_info(),
+        }
+    }
+}
+
+fn write_index_files(rx: Receiver<(PathBuf, Arc<SymbolNameTable>)>, dir: PathBuf) {
+    remove_old_index_files(&dir);
+    for (path, table) in rx {
+        if path.exists() {
+            continue;
+        }
+        match table.write_index_file(&path) {
+            Ok(_) => remove_old_index_files(&dir),
+            Err(err) => error!("write symbol index: {}", err),
+        }
+    }
+}
+
+fn remove_old_index_files(dir: &Path) {
+    let entries = match fs::read_dir(dir) {
+        Ok(entries) => entries,
+        Err(err) => {
+            error!("read symbol index dir {:?}: {}", dir, err);
+            return;
+        }
+    };
+    let mut files = Vec::new();
+    let mut total = 0;
+    for entry in entries.flatten() {
+        let path = entry.path();
+        let meta = match entry.metadata() {
+            Ok(meta) if meta.is_file() => meta,
+            _ => continue,
+        };
+        let modified = meta.modified().unwrap_or(SystemTime::UNIX_EPOCH);
+        match path.extension().and_then(|e| e.to_str()) {
+            Some("idx") => {
+                total += meta.len();
+                files.push((modified, meta.len(), path));
+            }
+            Some("tmp") if modified.elapsed().map_or(false, |age| age > INDEX_TMP_FILE_MAX_AGE) => {
+                let _ = fs::remove_file(&path);
+            }
+            _ => {}
+        }
+    }
+    if total <= INDEX_DIR_MAX_SIZE {
+        return;
+    }
+    files.sort();
+    for (_, size, path) in files {
+        if total <= INDEX_DIR_MAX_SIZE {
+            break;
+        }
+        debug!("symbol index {:?} removed", path);
+        let _ = fs::remove_file(&path);
+        total -= size;
+    }
+}
+
+struct CachedTable {
+    table: Arc<SymbolNameTable>,
+    last_used_round: AtomicI32,
+}
+
+// Readers load the current index snapshot and never block. Writers, which only run when an ELF is
+// loaded for the first time or at cleanup, publish a modified copy.
+// Like GCache, the `size` most recently used tables are kept plus everything used within
+// keep_rounds rounds.
+struct SharedTableCache<K: Eq + Hash + Clone> {
+    index: ArcSwap<HashMap<K, Arc<CachedTable>>>,
+    options: Mutex<GCacheOptions>,
+    round: AtomicI32,
+}
+
+impl<K: Eq + Hash + Clone> SharedTableCache<K> {
+    fn new(options: GCacheOptions) -> Self {
+        Self {
+            index: ArcSwap::from_pointee(HashMap::new()),
+            options: Mutex::new(options),
+            round: AtomicI32::new(0),
+        }
+    }
+
+    fn get(&self, k: &K) -> Option<Arc<SymbolNameTable>> {
+        let index = self.index.load();
+        let e = index.get(k)?;
+        if e.table.is_dead() {
+            drop(index);
+            self.remove(k);
+            return None;
+        }
+        e.last_used_round.store(self.round.load(Ordering::Relaxed), Ordering::Relaxed);
+        Some(e.table.clone())
+    }
+
+    fn cache(&self, k: K, v: Arc<SymbolNameTable>) {
+        let e = Arc::new(CachedTable {
+            table: v,
+            last_used_round: AtomicI32::new(self.round.load(Ordering::Relaxed)),
+        });
+        self.index.rcu(|index| {
+            let mut index = HashMap::clone(index);
+            index.insert(k.clone(), e.clone());
+            index
+        });
+    }
+
+    fn remove(&self, k: &K) {
+        self.index.rcu(|index| {
+            let mut index = HashMap::clone(index);
+            index.remove(k);
+            index
+        });
+    }
+
+    fn update(&self, options: GCacheOptions) {
+        *self.options.lock().unwrap() = options;
+    }
+
+    fn next_round(&self) {
+        self.round.fetch_add(1, Ordering::Relaxed);
+    }
+
+    fn cleanup(&self) {
+        let options = *self.options.lock().unwrap();
+        let round = self.round.load(Ordering::Relaxed);
+        self.index.rcu(|index| {
+            let mut by_use: Vec<(&K, &Arc<CachedTable>)> = index.iter().collect();
+            by_use.sort_by_key(|(_, e)| std::cmp::Reverse(e.last_used_round.load(Ordering::Relaxed)));
+            by_use
+                .into_iter()
+                .enumerate()
+                .filter(|(i, (_, e))| {
+                    *i < options.size || e.last_used_round.load(Ordering::Relaxed) >= round - options.keep_rounds
+                })
+                .map(|(_, (k, e))| (k.clone(), e.clone()))
+                .collect::<HashMap<K, Arc<CachedTable>>>()
+        });
+    }
+
+    fn debug_info(&self) -> GCacheDebugInfo<SymTabDebugInfo> {
+        let index = self.index.load();
+        let dump: Vec<SymTabDebugInfo> = index
+            .values()
+            .map(|e| {
+                let mut res = e.table.debug_info();
+                res.last_used_round = e.last_used_round.load(Ordering::Relaxed);
                 res
-            });
-        ElfCacheDebugInfo { build_id_cache, same_file_cache }
+            })
+            .collect();
+        GCacheDebugInfo::new(index.len(), 0, self.round.load(Ordering::Relaxed), dump, vec![])
     }
 }
 
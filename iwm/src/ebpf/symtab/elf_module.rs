@@ -7,10 +7,9 @@ use std::sync::{Arc, Mutex};
 use goblin::elf::header::ET_EXEC;
 use goblin::elf::program_header::{PF_X, PT_LOAD};
 
-use rustix::path::Arg;
-
 
 use crate::ebpf::metrics::symtab::SymtabMetrics;
+use crate::ebpf::symtab::debuginfod::{DebugInfoState, DebuginfodFetcher};
 use crate::ebpf::symtab::elf::buildid::{BuildID, BuildIdentified};
 use crate::ebpf::symtab::elf::elfmmap::{MappedElfFile};
 use crate::ebpf::symtab::elf::symbol_table::{SymbolNameTable};
@@ -24,7 +23,9 @@ use crate::error::Result;
 #[derive(Clone)]
 pub struct ElfTableOptions {
     pub(crate) elf_cache: Arc<ElfCache>,
-    pub(crate) metrics: Arc<SymtabMetrics>
+    pub(crate) metrics: Arc<SymtabMetrics>,
+    // fetches the debug files of stripped ELFs, None resolves them through .dynsym only
+    pub(crate) debuginfod: Option<Arc<DebuginfodFetcher>>,
 }
 
 #[derive(Copy, Clone, Eq, PartialEq, Ord, PartialOrd)]
@@ -46,26 +47,29 @@ impl SymbolOptions {
 
 pub struct ElfTable {
     fs: String,
-    pub(crate) table: Arc<Mutex<dyn SymbolNameResolver + Send>>,
+    pub(crate) table: Arc<dyn SymbolNameResolver + Send + Sync>,
     pub(crate) base: u64,
     loaded: bool,
     loaded_cached: bool,
     options: ElfTableOptions,
     proc_map: Arc<Mutex<ProcMap>>,
-    err: Option<crate::error::Error>
+    err: Option<crate::error::Error>,
+    // build id whose debug file is being fetched, the table is reloaded once it is done
+    debuginfo_pending: Option<String>,
 }
 
 impl ElfTable {
     pub fn new(proc_map: Arc<Mutex<ProcMap>>, fs: String, options: ElfTableOptions) -> Self {
         Self {
             fs,
-            table: Arc::new(Mutex::new(NoopSymbolNameResolver {})),
+            table: Arc::new(NoopSymbolNameResolver {}),
             base: 0,
             loaded: false,
             loaded_cached: false,
             options,
             proc_map,
             err: None,
+            debuginfo_pending: None,
         }
     }
 
@@ -102,6 +106,24 @@ impl ElfTable {
             }
         };
 
+        let debuginfod = match &self.options.debuginfod {
+            Some(fetcher) if build_id.is_gnu() && me.section(".symtab").is_none() => Some(fetcher.clone()),
+            _ => None,
+        };
+        if let Some(fetcher) = debuginfod {
+            if self.find_debug_file(&build_id, me.borrow_mut()).is_none() {
+                match fetcher.request(&build_id.id) {
+                    DebugInfoState::Ready(path) => {
+                        if self.load_debuginfod(&build_id, path) {
+                            return;
+                        }
+                    }
+                    DebugInfoState::Pending => self.debuginfo_pending = Some(build_id.id.clone()),
+                    DebugInfoState::Unavailable => {}
+                }
+            }
+        }
+
         if let Some(symbols) = self.options.elf_cache.get_symbols_by_build_id(&build_id) {
             self.table = symbols.clone();
             self.loaded_cached = true;
@@ -137,25 +159,25 @@ impl ElfTable {
                 }
             };
 
-            let symbols = Arc::new(Mutex::new(match SymbolNameTable::new(debug_me) {
+            let symbols = Arc::new(match SymbolNameTable::new(debug_me) {
                 Ok(sym) => sym,
                 Err(err) => {
                     dbg!(&err);
                     self.on_load_error(&err);
                     return;
                 }
-            }));
+            });
             self.table = symbols.clone();
             self.options.elf_cache.cache_by_build_id(build_id, symbols.clone());
             return;
         }
 
-        let symbols = Arc::new(Mutex::new(match SymbolNameTable::new(me) {
+        let symbols = Arc::new(match SymbolNameTable::new(me) {
             Ok(sym) => sym,
             Err(_err) => {
                 return;
             }
-        }));
+        });
 
         self.table = symbols.clone();
         if build_id.is_empty() {
@@ -166,6 +188,45 @@ impl ElfTable {
         }
     }
 
+    // The tables of fetched debug files are cached apart from the stripped ELFs they belong to.
+    fn load_debuginfod(&mut self, build_id: &BuildID, path: PathBuf) -> bool {
+        let id = BuildID::new(build_id.id.clone(), "debuginfod".to_string());
+        if let Some(symbols) = self.options.elf_cache.get_symbols_by_build_id(&id) {
+            self.table = symbols.clone();
+            self.loaded_cached = true;
+            return true;
+        }
+        match MappedElfFile::new(path).and_then(SymbolNameTable::new) {
+            Ok(symbols) => {
+                let symbols = Arc::new(symbols);
+                self.table = symbols.clone();
+                self.options.elf_cache.cache_by_build_id(id, symbols);
+                true
+            }
+            Err(err) => {
+                self.on_load_error(&err);
+                false
+            }
+        }
+    }
+
+    // Drops the table once the debug file it waits for was fetched or given up on, the next
+    // resolve loads it again.
+    pub fn poll_debuginfo(&mut self) {
+        let pending = match (&self.debuginfo_pending, &self.options.debuginfod) {
+            (Some(id), Some(fetcher)) => fetcher.state(id) == Some(DebugInfoState::Pending),
+            _ => return,
+        };
+        if pending {
+            return;
+        }
+        self.debuginfo_pending = None;
+        self.table = Arc::new(NoopSymbolNameResolver {});
+        self.loaded = false;
+        self.loaded_cached = false;
+        self.err = None;
+    }
+
     fn find_base(&mut self, e: &MappedElfFile) -> bool {
         if e.header.e_type == ET_EXEC {
             self.base = 0;
@@ -212,39 +273,28 @@ impl ElfTable {
         None
     }
 
+    // The link names a file next to the ELF, in its .debug directory or under /usr/lib/debug,
+    // all of them inside the root of the process.
     fn find_debug_file_with_debug_link(&self, elf_file: &mut MappedElfFile) -> Option<String> {
-        let pm = self.proc_map.lock().unwrap();
-        let elf_file_path = Path::new(&pm.pathname);
-        let d = elf_file.section_data_by_section_name(".gnu_debuglink");
-        if d.is_err() {
-            return None
-        }
-
-        let data = d.unwrap();
-        if data.len() < 6 {
+        let data = elf_file.section_data_by_section_name(".gnu_debuglink").ok()?;
+        // nul terminated name padded to 4 bytes, followed by the crc32 of the debug file
+        let name = data.split(|b| *b == 0).next()?;
+        if name.is_empty() || data.len() < name.len() + 5 || name.contains(&b'/') {
             return None;
         }
-        let raw_link = String::from_utf8_lossy(&data[..data.len() - 4]);
-        let debug_link = raw_link.as_str().unwrap();
+        let debug_link = String::from_utf8_lossy(name).to_string();
 
-        let check_debug_file = |subdir: &str| -> Option<String> {
-            let fs_debug_file = PathBuf::from(format!("{:?}{}", elf_file_path.with_file_name(subdir), &debug_link));
-            if fs::metadata(&fs_debug_file).is_ok() {
-                return Some(fs_debug_file.to_string_lossy().to_string());
-            }
-            None
-        };
-
-        if let Some(debug_file) = check_debug_file("") {
-            return Some(debug_file);
-        }
-        if let Some(debug_file) = check_debug_file(".debug") {
-            return Some(debug_file);
-        }
-        if let Some(debug_file) = check_debug_file("/usr/lib/debug") {
-            return Some(debug_file);
-        }
-        None
+        let pm = self.proc_map.lock().unwrap();
+        let dir = Path::new(&pm.pathname).parent()?;
+        let candidates = [
+            dir.join(&debug_link),
+            dir.join(".debug").join(&debug_link),
+            Path::new("/usr/lib/debug").join(dir.strip_prefix("/").unwrap_or(dir)).join(&debug_link),
+        ];
+        candidates
+            .iter()
+            .map(|p| p.to_string_lossy().to_string())
+            .find(|p| *p != pm.pathname && Path::new(&format!("{}{}", &self.fs, p)).is_file())
     }
 
     pub fn resolve(&mut self, mut pc: u64) -> Option<String> {
@@ -253,33 +303,23 @@ impl ElfTable {
         }
         if let Some(_err) = &self.err { return None; }
         pc -= self.base;
-        {
-            let mut table = self.table.lock().unwrap();
-            let res = table.resolve(pc);
-
-            if res.is_some() {
-                return res;
-            } else if !table.is_dead() {
-                return None;
-            } else if !self.loaded_cached {
-                self.err = Some(ELFError("Table is dead".to_string()));
-                return None;
-            }
+        let res = self.table.resolve(pc);
+        if res.is_some() {
+            return res;
+        } else if !self.table.is_dead() {
+            return None;
+        } else if !self.loaded_cached {
+            self.err = Some(ELFError("Table is dead".to_string()));
+            return None;
         }
 
-        self.table = Arc::new(Mutex::new(NoopSymbolNameResolver {}));
+        self.table = Arc::new(NoopSymbolNameResolver {});
         self.loaded = false;
         self.loaded_cached = false;
         self.load();
 
         if let Some(_err) = &self.err { return None; }
-        let mut table = self.table.lock().unwrap();
-        table.resolve(pc)
-    }
-
-    pub fn cleanup(&mut self) {
-        let mut table = self.table.lock().unwrap();
-        table.cleanup();
+        self.table.resolve(pc)
     }
 }
 
@@ -1,74 +1,208 @@
-use std::fs::File;
+use std::collections::hash_map::DefaultHasher;
+use std::fs::{self, File};
+use std::hash::{Hash, Hasher};
 use std::io::{BufRead, BufReader};
 use std::path::Path;
 
-use crate::ebpf::symtab::table::{Symbol, SymbolTab};
 use crate::error::Error::SymbolError;
 use crate::error::Result;
 
 const KALLSYMS_MODULE: &str = "kernel";
 
-pub fn new_kallsyms() -> Result<SymbolTab> {
-    new_kallsyms_from_file("/proc/kallsyms")
+// /proc/kallsyms kept as a sorted address array and a single string arena instead of a Symbol
+// per line. It is never modified once loaded, lookups only need a shared reference.
+pub struct Kallsyms {
+    // sorted
+    addrs: Vec<u64>,
+    // (offset, len) in names of the symbol at the same index in addrs
+    name_spans: Vec<(u32, u32)>,
+    names: String,
+    // sorted by start, from /proc/modules
+    modules: Vec<KernelModule>,
+    modules_fingerprint: u64,
 }
 
-fn new_kallsyms_from_file<P: AsRef<Path>>(path: P) -> Result<SymbolTab> {
-    let file = File::open(path).unwrap();
-    let reader = BufReader::new(file);
-    new_kallsyms_from_data(reader)
+struct KernelModule {
+    start: u64,
+    end: u64,
+    name: String,
 }
 
-fn new_kallsyms_from_data<B: BufRead>(buf: B) -> Result<SymbolTab> {
-    let mut syms = Vec::new();
-    let mut all_zeros = true;
+// A resolved kernel address, the name is empty when only the module is known.
+pub struct KernelSymbol<'a> {
+    pub start: u64,
+    pub name: &'a str,
+    pub module: &'a str,
+}
+
+impl Kallsyms {
+    pub fn empty() -> Self {
+        Self {
+            addrs: Vec::new(),
+            name_spans: Vec::new(),
+            names: String::new(),
+            modules: Vec::new(),
+            modules_fingerprint: 0,
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.addrs.is_empty()
+    }
+
+    pub fn len(&self) -> usize {
+        self.addrs.len()
+    }
+
+    pub fn resolve(&self, addr: u64) -> Option<KernelSymbol<'_>> {
+        let i = self.addrs.partition_point(|a| *a <= addr);
+        let module = self.module(addr);
+        let module_name = module.map_or(KALLSYMS_MODULE, |m| m.name.as_str());
+        // the closest symbol may belong to the kernel or to another module
+        let sym_start = if i > 0 { Some(self.addrs[i - 1]) } else { None };
+        match (sym_start, module) {
+            (Some(start), Some(m)) if start < m.start => Some(KernelSymbol {
+                start: m.start,
+                name: "",
+                module: module_name,
+            }),
+            (Some(start), _) => {
+                let (off, len) = self.name_spans[i - 1];
+                Some(KernelSymbol {
+                    start,
+                    name: &self.names[off as usize..(off + len) as usize],
+                    module: module_name,
+                })
+            }
+            (None, Some(m)) => Some(KernelSymbol {
+                start: m.start,
+                name: "",
+                module: module_name,
+            }),
+            (None, None) => None,
+        }
+    }
+
+    fn module(&self, addr: u64) -> Option<&KernelModule> {
+        let i = self.modules.partition_point(|m| m.start <= addr);
+        if i == 0 {
+            return None;
+        }
+        let m = &self.modules[i - 1];
+        if addr < m.end {
+            Some(m)
+        } else {
+            None
+        }
+    }
+
+    // Symbols only change with the set of loaded modules.
+    pub fn is_stale(&self) -> bool {
+        match fs::read_to_string("/proc/modules") {
+            Ok(modules) => modules_fingerprint(&modules) != self.modules_fingerprint,
+            Err(_) => false,
+        }
+    }
+}
+
+pub fn new_kallsyms() -> Result<Kallsyms> {
+    let modules = fs::read_to_string("/proc/modules").unwrap_or_default();
+    let mut kallsyms = new_kallsyms_from_file("/proc/kallsyms")?;
+    kallsyms.modules = parse_modules(&modules);
+    kallsyms.modules_fingerprint = modules_fingerprint(&modules);
+    Ok(kallsyms)
+}
 
+fn new_kallsyms_from_file<P: AsRef<Path>>(path: P) -> Result<Kallsyms> {
+    let file = File::open(path).map_err(|e| SymbolError(format!("open kallsyms: {}", e)))?;
+    new_kallsyms_from_data(BufReader::with_capacity(64 * 1024, file))
+}
+
+pub fn new_kallsyms_from_data<B: BufRead>(mut buf: B) -> Result<Kallsyms> {
     let kernel_addr_space = if cfg!(target_arch = "x86_64") {
         0x00ffffffffffffff
     } else {
         0
     };
 
-    for line in buf.lines() {
-        let line = line.unwrap();
-        if line.is_empty() {
-            continue;
+    let mut syms: Vec<(u64, u32, u32)> = Vec::new();
+    let mut names = String::new();
+    let mut all_zeros = true;
+    let mut line = String::new();
+    loop {
+        line.clear();
+        let n = buf.read_line(&mut line).map_err(|e| SymbolError(format!("read kallsyms: {}", e)))?;
+        if n == 0 {
+            break;
         }
-
-        let mut parts = line.split_whitespace();
-        let addr_part = parts.next().ok_or(SymbolError("no space found".to_string())).unwrap();
-        let typ = parts.next().ok_or(SymbolError("no space found".to_string())).unwrap();
-        let name_part = parts.next().unwrap_or(KALLSYMS_MODULE); // Assuming module name is always present after name
-
-        if typ.starts_with('b') || typ.starts_with('B') || typ.starts_with('d') ||
-            typ.starts_with('D') || typ.starts_with('r') || typ.starts_with('R') {
+        let mut parts = line.split_ascii_whitespace();
+        let (addr_part, typ, name) = match (parts.next(), parts.next(), parts.next()) {
+            (Some(addr), Some(typ), Some(name)) => (addr, typ, name),
+            _ => continue,
+        };
+        if matches!(typ.as_bytes()[0], b'b' | b'B' | b'd' | b'D' | b'r' | b'R') {
             continue;
         }
-
-        let istart = u64::from_str_radix(addr_part, 16).map_err(|e| SymbolError(e.to_string())).unwrap();
+        let istart = u64::from_str_radix(addr_part, 16).map_err(|e| SymbolError(e.to_string()))?;
         if istart < kernel_addr_space {
             continue;
         }
-
-        let mod_name = if name_part.starts_with('[') && name_part.ends_with(']') {
-            &name_part[1..name_part.len() - 1]
-        } else {
-            name_part
-        };
-
         if istart != 0 {
             all_zeros = false;
         }
-
-        syms.push(Symbol {
-            start: istart,
-            name: name_part.to_string(),
-            module: mod_name.to_string(),
-        });
+        syms.push((istart, names.len() as u32, name.len() as u32));
+        names.push_str(name);
     }
-
     if all_zeros {
-        Ok(SymbolTab::new(Vec::new()))
-    } else {
-        Ok(SymbolTab::new(syms))
+        return Ok(Kallsyms::empty());
+    }
+
+    // module symbols follow the kernel ones and are not sorted
+    syms.sort_by_key(|s| s.0);
+    names.shrink_to_fit();
+    Ok(Kallsyms {
+        addrs: syms.iter().map(|s| s.0).collect(),
+        name_spans: syms.iter().map(|s| (s.1, s.2)).collect(),
+        names,
+        modules: Vec::new(),
+        modules_fingerprint: 0,
+    })
+}
+
+// "name size refcount deps state address", the address is 0 without CAP_SYSLOG
+fn parse_modules(data: &str) -> Vec<KernelModule> {
+    let mut modules: Vec<KernelModule> = data
+        .lines()
+        .filter_map(|line| {
+            let parts: Vec<&str> = line.split_ascii_whitespace().collect();
+            if parts.len() < 6 {
+                return None;
+            }
+            let size: u64 = parts[1].parse().ok()?;
+            let start = u64::from_str_radix(parts[5].trim_start_matches("0x"), 16).ok()?;
+            if start == 0 {
+                return None;
+            }
+            Some(KernelModule {
+                start,
+                end: start + size,
+                name: parts[0].to_string(),
+            })
+        })
+        .collect();
+    modules.sort_by_key(|m| m.start);
+    modules
+}
+
+// Names and load addresses only, reference counts change all the time.
+fn modules_fingerprint(data: &str) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    for line in data.lines() {
+        let parts: Vec<&str> = line.split_ascii_whitespace().collect();
+        if parts.len() >= 6 {
+            parts[0].hash(&mut hasher);
+            parts[5].hash(&mut hasher);
+        }
     }
+    hasher.finish()
 }
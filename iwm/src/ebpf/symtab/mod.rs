@@ -9,4 +9,5 @@ pub mod table;
 pub mod elf_module;
 pub mod elf;
 pub mod stat;
-pub mod perf_symbol_table;
\ No newline at end of file
+pub mod perf_symbol_table;
+pub mod debuginfod;
\ No newline at end of file
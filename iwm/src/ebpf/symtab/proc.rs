@@ -2,7 +2,6 @@ use std::cmp::Ordering::{Equal, Greater, Less};
 use std::collections::HashMap;
 use std::fs;
 
-use std::ops::Deref;
 use std::path::PathBuf;
 use std::sync::{Arc, Mutex};
 use log::info;
@@ -54,25 +53,25 @@ impl SymbolTable for ProcTable {
         if self.err.is_some() {
             return;
         }
+        for table in self.file_to_table.values() {
+            table.lock().unwrap().poll_debuginfo();
+        }
         let path = format!("/proc/{}/maps", self.pid.to_string());
-        self.ranges.clear();
-        match fs::read_to_string(&path) {
-            Ok(proc_maps) => match self.push_proc_maps(proc_maps) {
-                Err(e) => { self.err = Some(e); }
-                _ => {}
-            },
+        match fs::read(&path) {
+            Ok(proc_maps) => {
+                if !self.same_maps(&proc_maps) {
+                    self.push_proc_maps(&proc_maps);
+                }
+            }
             Err(e) => {
                 self.err = Some(ProcError(e.to_string()));
             }
         }
     }
 
-    fn cleanup(&mut self) {
-        self.file_to_table.iter_mut().for_each(|(_, table)| {
-            let mut t = table.lock().unwrap();
-            t.cleanup()
-        })
-    }
+    // symbol tables are immutable and shared through the ElfCache, their mappings are released
+    // with the last table referencing them
+    fn cleanup(&mut self) {}
 
     fn resolve(&mut self, pc: u64) -> Option<Symbol> {
         if pc == 0xcccccccccccccccc || pc == 0x9090909090909090 {
@@ -94,9 +93,11 @@ impl SymbolTable for ProcTable {
         let rr = &self.ranges.get_mut(i.unwrap()).unwrap();
         let r = rr.lock().unwrap();
         let mut et = r.elf_table.lock().unwrap();
+        // the base is known once resolve loaded the table
+        let res = et.resolve(pc);
         let module_offset = pc - et.base;
 
-        return match et.resolve(pc) {
+        return match res {
             Some(s) => {
                 let mr = r.map_range.lock().unwrap();
                 Some(Symbol {
@@ -163,14 +164,27 @@ impl ProcTable {
         }
     }
 
-    fn push_proc_maps(&mut self, proc_maps: String) -> Result<()> {
-        let mut files_to_keep: HashMap<File, ()> = HashMap::new();
-        let maps = match parse_proc_maps_executable_modules(proc_maps.deref(), true) {
-            Ok(maps) => maps,
-            Err(err) => return Err(err),
-        };
+    // Whether the mapped ELFs are still the ones of the last refresh, checked without allocating
+    // so that most refreshes only cost reading the file.
+    fn same_maps(&self, proc_maps: &[u8]) -> bool {
+        let mut ranges = self.ranges.iter();
+        for line in proc_map_lines(proc_maps).filter(|m| m.perms.execute && is_elf_path(m.pathname)) {
+            let same = match ranges.next() {
+                Some(r) => line.same_as(&r.lock().unwrap().map_range.lock().unwrap()),
+                None => false,
+            };
+            if !same {
+                return false;
+            }
+        }
+        ranges.next().is_none()
+    }
 
-        for map in maps {
+    fn push_proc_maps(&mut self, proc_maps: &[u8]) {
+        let mut files_to_keep: HashMap<File, ()> = HashMap::new();
+        self.ranges.clear();
+        for line in proc_map_lines(proc_maps).filter(|m| m.perms.execute) {
+            let map = line.to_proc_map();
             files_to_keep.insert(map.file(), ());
             let m = Arc::new(Mutex::new(map));
             if let Some(elf_table) = self.get_elf_table(m.clone()) {
@@ -190,7 +204,6 @@ impl ProcTable {
         for key in keys_to_remove.iter() {
             self.file_to_table.remove(key);
         }
-        Ok(())
     }
 
     pub(crate) fn debug_info(&self) -> ProcTableDebugInfo {
@@ -202,8 +215,7 @@ impl ProcTable {
         };
         for (file, elf) in &self.file_to_table {
             let e = elf.lock().unwrap();
-            let table = e.table.lock().unwrap();
-            let d = table.debug_info();
+            let d = e.table.debug_info();
             if d.size != 0 {
                 res.elf_tables.insert(format!("{} {} {}", file.dev, file.inode, file.path), d);
             }
@@ -235,11 +247,8 @@ impl ProcTable {
     }
 
     fn create_elf_table(&self, m: Arc<Mutex<ProcMap>>) -> Option<Arc<Mutex<ElfTable>>> {
-        {
-            let pathname = &m.lock().unwrap().pathname;
-            if !pathname.starts_with('/') {
-                return None;
-            }
+        if !is_elf_path(&m.lock().unwrap().pathname) {
+            return None;
         }
         Some(Arc::new(Mutex::new(ElfTable::new(
             m,
@@ -249,62 +258,111 @@ impl ProcTable {
     }
 }
 
+fn is_elf_path(pathname: &str) -> bool {
+    pathname.starts_with('/') && !pathname.ends_with(" (deleted)")
+}
+
 pub fn parse_proc_maps_executable_modules(
     proc_maps: &str,
     executable_only: bool,
 ) -> Result<Vec<ProcMap>> {
-    let mut modules = Vec::new();
-    let mut remaining = proc_maps;
-    while !remaining.is_empty() {
-        let nl = remaining
-            .chars()
-            .position(|x| x == '\n')
-            .unwrap_or(remaining.len());
-        let (line, rest) = remaining.split_at(nl);
-        remaining = if rest.is_empty() { rest } else { &rest[1..] };
-        if line.is_empty() {
-            continue;
-        }
-        if let Some(module) = parse_proc_map_line(line, executable_only) {
-            modules.push(module);
-        }
-    }
-    Ok(modules)
+    Ok(proc_map_lines(proc_maps.as_bytes())
+        .filter(|m| !executable_only || m.perms.execute)
+        .map(|m| m.to_proc_map())
+        .collect())
 }
 
-// 7f5822ebe000-7f5822ec0000 r--p 00000000 09:00 533429  /usr/lib/x86_64-linux-gnu/ld-linux-x86-64.so.2
-fn parse_proc_map_line(line: &str, executable_only: bool) -> Option<ProcMap> {
-    let mut parts = line.split(' ');
-    let addresses_bytes = parts.next().unwrap();
-    let perms_bytes = parts.next().unwrap();
-    let offset_bytes = parts.next().unwrap();
-    let device_bytes = parts.next().unwrap();
-    let inode_bytes = parts.next().unwrap();
-    let pathname = line.rsplit(' ').next().unwrap();
-
-    let perms = parse_permissions(perms_bytes).unwrap();
-    if executable_only && !perms.execute {
-        return None;
+// A line of /proc/pid/maps borrowing its pathname from the file contents.
+struct ProcMapLine<'a> {
+    start_addr: u64,
+    end_addr: u64,
+    perms: ProcMapPermissions,
+    offset: i64,
+    dev: u64,
+    inode: u64,
+    pathname: &'a str,
+}
+
+impl ProcMapLine<'_> {
+    fn same_as(&self, m: &ProcMap) -> bool {
+        self.start_addr == m.start_addr
+            && self.end_addr == m.end_addr
+            && self.offset == m.offset
+            && self.dev == m.dev
+            && self.inode == m.inode
+            && self.pathname == m.pathname
     }
 
-    let (start_addr, end_addr) = parse_addresses(addresses_bytes).unwrap();
-    let offset = i64::from_str_radix(offset_bytes, 16).unwrap();
-    let dev = parse_device(device_bytes).unwrap();
-    let inode = u64::from_str_radix(inode_bytes, 10).unwrap();
+    fn to_proc_map(&self) -> ProcMap {
+        ProcMap {
+            start_addr: self.start_addr,
+            end_addr: self.end_addr,
+            perms: self.perms.clone(),
+            offset: self.offset,
+            dev: self.dev,
+            inode: self.inode,
+            pathname: self.pathname.to_string(),
+        }
+    }
+}
+
+// Malformed lines are skipped.
+fn proc_map_lines(proc_maps: &[u8]) -> impl Iterator<Item = ProcMapLine<'_>> {
+    proc_maps
+        .split(|&b| b == b'\n')
+        .filter(|line| !line.is_empty())
+        .filter_map(parse_proc_map_line)
+}
 
-    let res = ProcMap {
+// 7f5822ebe000-7f5822ec0000 r--p 00000000 09:00 533429  /usr/lib/x86_64-linux-gnu/ld-linux-x86-64.so.2
+fn parse_proc_map_line(line: &[u8]) -> Option<ProcMapLine<'_>> {
+    let mut rest = line;
+    let start_addr = parse_hex(next_token(&mut rest, b'-')?)?;
+    let end_addr = parse_hex(next_token(&mut rest, b' ')?)?;
+    let perms = parse_permissions(next_token(&mut rest, b' ')?);
+    let offset = parse_hex(next_token(&mut rest, b' ')?)? as i64;
+    let major = parse_hex(next_token(&mut rest, b':')?)?;
+    let minor = parse_hex(next_token(&mut rest, b' ')?)?;
+    let inode = parse_dec(next_token(&mut rest, b' ')?)?;
+    let start = rest.iter().position(|&b| b != b' ').unwrap_or(rest.len());
+    let pathname = std::str::from_utf8(&rest[start..]).ok()?;
+    Some(ProcMapLine {
         start_addr,
         end_addr,
         perms,
         offset,
-        dev,
+        dev: (major << 20) | minor,
         inode,
-        pathname: pathname.to_string(),
-    };
-    Some(res)
+        pathname,
+    })
+}
+
+fn next_token<'a>(rest: &mut &'a [u8], sep: u8) -> Option<&'a [u8]> {
+    let i = rest.iter().position(|&b| b == sep).unwrap_or(rest.len());
+    let tok = &rest[..i];
+    *rest = if i < rest.len() { &rest[i + 1..] } else { &rest[i..] };
+    if tok.is_empty() {
+        None
+    } else {
+        Some(tok)
+    }
 }
 
-fn parse_permissions(perms_bytes: &str) -> Result<ProcMapPermissions> {
+fn parse_hex(tok: &[u8]) -> Option<u64> {
+    tok.iter().try_fold(0u64, |acc, &b| {
+        let d = (b as char).to_digit(16)? as u64;
+        acc.checked_mul(16)?.checked_add(d)
+    })
+}
+
+fn parse_dec(tok: &[u8]) -> Option<u64> {
+    tok.iter().try_fold(0u64, |acc, &b| {
+        let d = (b as char).to_digit(10)? as u64;
+        acc.checked_mul(10)?.checked_add(d)
+    })
+}
+
+fn parse_permissions(perms_bytes: &[u8]) -> ProcMapPermissions {
     let mut perms = ProcMapPermissions {
         read: false,
         write: false,
@@ -313,34 +371,16 @@ fn parse_permissions(perms_bytes: &str) -> Result<ProcMapPermissions> {
         shared: false
     };
 
-    for b in perms_bytes.chars() {
+    for b in perms_bytes {
         match b {
-            'r' => perms.read = true,
-            'w' => perms.write = true,
-            'x' => perms.execute = true,
-            'p' => perms.private = true,
+            b'r' => perms.read = true,
+            b'w' => perms.write = true,
+            b'x' => perms.execute = true,
+            b'p' => perms.private = true,
             _ => {},
         }
     }
-    Ok(perms)
-}
-
-fn parse_addresses(addresses_bytes: &str) -> Result<(u64, u64), ()> {
-    let mut parts = addresses_bytes.split(|b| b == '-');
-    let start_addr_str = parts.next().unwrap();
-    let end_addr_str = parts.next().unwrap();
-
-    let start_addr = u64::from_str_radix(start_addr_str, 16).unwrap();
-    let end_addr = u64::from_str_radix(end_addr_str, 16).unwrap();
-
-    Ok((start_addr, end_addr))
-}
-
-fn parse_device(device_str: &str) -> Result<u64, ()> {
-    let mut parts = device_str.split(':');
-    let major = u64::from_str_radix(parts.next().unwrap_or(""), 16).unwrap();
-    let minor = u64::from_str_radix(parts.next().unwrap_or(""), 16).unwrap();
-    Ok((major << 20) | minor)
+    perms
 }
 
 fn token_to_string_unsafe(tok: &[u8]) -> String {
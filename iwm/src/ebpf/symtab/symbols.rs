@@ -1,16 +1,17 @@
+use std::path::PathBuf;
 use std::sync::{Arc, Mutex};
 use log::{error, info};
 
 use crate::ebpf::metrics::symtab::SymtabMetrics;
 
 
+use crate::ebpf::symtab::debuginfod::DebuginfodFetcher;
 use crate::ebpf::symtab::elf_cache::{ElfCache, ElfCacheDebugInfo};
 use crate::ebpf::symtab::elf_module::{ElfTableOptions, SymbolOptions};
 use crate::ebpf::symtab::gcache::{debug_info, GCache, GCacheDebugInfo, GCacheOptions};
-use crate::ebpf::symtab::kallsyms::new_kallsyms;
+use crate::ebpf::symtab::kallsyms::{new_kallsyms, Kallsyms};
 use crate::ebpf::symtab::proc::{ProcTable, ProcTableDebugInfo};
 use crate::ebpf::symtab::symtab::SymbolNameResolver;
-use crate::ebpf::symtab::table::SymbolTab;
 use crate::error::Result;
 
 pub type PidKey = u32;
@@ -21,9 +22,12 @@ pub type PidKey = u32;
 pub struct SymbolCache {
     pid_cache: GCache<PidKey, ProcTable>,
     elf_cache: Arc<ElfCache>,
-    kallsyms: Option<Arc<Mutex<SymbolTab>>>,
+    kallsyms: Option<Arc<Kallsyms>>,
+    // /proc/modules is compared once per round
+    kallsyms_checked: bool,
     options: CacheOptions,
     metrics: Arc<SymtabMetrics>,
+    debuginfod: Option<Arc<DebuginfodFetcher>>,
 }
 
 #[derive(Copy, Clone)]
@@ -35,25 +39,33 @@ pub struct CacheOptions {
 }
 
 impl SymbolCache {
-    pub fn new(options: CacheOptions, metrics: &SymtabMetrics) -> Result<Self> {
+    pub fn new(
+        options: CacheOptions,
+        index_path: Option<PathBuf>,
+        debuginfod: Option<Arc<DebuginfodFetcher>>,
+        metrics: &SymtabMetrics,
+    ) -> Result<Self> {
         // if metrics.is_none() {
         //     panic!("metrics is nil");
         // }
-        let elf_cache = ElfCache::new(options.build_id_cache_options, options.same_file_cache_options).unwrap();
+        let elf_cache = ElfCache::new(options.build_id_cache_options, options.same_file_cache_options, index_path).unwrap();
         let pid_cache = GCache::<PidKey, ProcTable>::new(options.pid_cache_options);
 
         Ok(Self {
             pid_cache,
             kallsyms: None,
+            kallsyms_checked: false,
             elf_cache: Arc::new(elf_cache),
             options,
             metrics: Arc::new(metrics.clone()),
+            debuginfod,
         })
     }
 
     pub fn next_round(&mut self) {
         self.pid_cache.next_round();
         self.elf_cache.next_round();
+        self.kallsyms_checked = false;
     }
 
     pub fn cleanup(&mut self) {
@@ -71,33 +83,43 @@ impl SymbolCache {
             pid as i32,
             ElfTableOptions {
                 elf_cache: self.elf_cache.clone(),
-                metrics: self.metrics.clone()
+                metrics: self.metrics.clone(),
+                debuginfod: self.debuginfod.clone(),
             },
         )));
         self.pid_cache.cache(pid, fresh.clone());
         Some(fresh.clone())
     }
 
-    pub fn get_kallsyms(&mut self) -> Arc<Mutex<SymbolTab>> {
+    // Workers resolve through the returned table without locking. It is reloaded when a module
+    // was loaded or unloaded, tables handed out before stay valid until dropped.
+    pub fn get_kallsyms(&mut self) -> Arc<Kallsyms> {
         if let Some(kallsyms) = &self.kallsyms {
-            return kallsyms.clone();
+            if self.kallsyms_checked || !kallsyms.is_stale() {
+                self.kallsyms_checked = true;
+                return kallsyms.clone();
+            }
+            info!("kernel modules changed, reloading kallsyms");
         }
         self.init_kallsyms()
     }
 
-    fn init_kallsyms(&mut self) -> Arc<Mutex<SymbolTab>> {
+    fn init_kallsyms(&mut self) -> Arc<Kallsyms> {
         let kallsyms = new_kallsyms().unwrap_or_else(|err| {
             error!("kallsyms init fail err: {}", err);
-            SymbolTab::new(Vec::new())
+            Kallsyms::empty()
         });
 
-        if kallsyms.symbols.is_empty() {
+        if kallsyms.is_empty() {
             let _ = error!("kallsyms is empty. check your permissions kptr_restrict==0 && sysctl_perf_event_paranoid <= 1 or kptr_restrict==1 &&  CAP_SYSLOG");
+        } else {
+            info!("kallsyms loaded, {} symbols", kallsyms.len());
         }
 
-        let ks = Arc::new(Mutex::new(kallsyms));
+        let ks = Arc::new(kallsyms);
         self.kallsyms = Some(ks.clone());
-        ks.clone()
+        self.kallsyms_checked = true;
+        ks
     }
 
     pub fn update_options(&mut self, options: CacheOptions) {
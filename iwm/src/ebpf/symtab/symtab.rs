@@ -1,5 +1,4 @@
 use crate::ebpf::symtab::elf::symbol_table::SymTabDebugInfo;
-use crate::ebpf::symtab::gcache::Resource;
 use crate::ebpf::symtab::table::Symbol;
 
 pub trait SymbolTable {
@@ -8,36 +7,24 @@ pub trait SymbolTable {
     fn resolve(&mut self, addr: u64) -> Option<Symbol>;
 }
 
+// Loaded ELF symbol tables, read-only and shared between processes.
 pub trait SymbolNameResolver {
-    fn refresh(&mut self);
-    fn cleanup(&mut self);
     fn debug_info(&self) -> SymTabDebugInfo;
     fn is_dead(&self) -> bool;
-    fn resolve(&mut self, addr: u64) -> Option<String>;
-}
-
-impl Resource for dyn SymbolNameResolver {
-    fn refresh_resource(&mut self) {
-        self.refresh()
-    }
-    fn cleanup_resource(&mut self) {
-        self.cleanup()
-    }
+    fn resolve(&self, addr: u64) -> Option<String>;
 }
 
 #[derive(Eq, PartialEq, Ord, PartialOrd)]
 pub struct NoopSymbolNameResolver;
 
 impl SymbolNameResolver for NoopSymbolNameResolver {
-    fn refresh(&mut self) {}
-    fn cleanup(&mut self) {}
     fn debug_info(&self) -> SymTabDebugInfo {
         SymTabDebugInfo::default()
     }
     fn is_dead(&self) -> bool {
         false
     }
-    fn resolve(&mut self, _addr: u64) -> Option<String> {
+    fn resolve(&self, _addr: u64) -> Option<String> {
         None
     }
 }
@@ -4,6 +4,8 @@ pub enum ProfilingType {
     FramePointers,
     Python,
     TypeError,
+    Dwarf,
+    StackSnapshot,
 }
 
 impl ProfilingType {
@@ -13,6 +15,8 @@ impl ProfilingType {
             ProfilingType::FramePointers => { 2 }
             ProfilingType::Python => { 3 }
             ProfilingType::TypeError => { 4 }
+            ProfilingType::Dwarf => { 5 }
+            ProfilingType::StackSnapshot => { 6 }
         }
     }
 }
@@ -20,12 +24,14 @@ impl ProfilingType {
 // #define OP_REQUEST_UNKNOWN_PROCESS_INFO 1
 // #define OP_PID_DEAD 2
 // #define OP_REQUEST_EXEC_PROCESS_INFO 3
+// #define OP_PID_EVENT_BATCH 4
 
 #[derive(Debug)]
 pub enum PidOp {
     RequestUnknownProcessInfo = 1,
     Dead = 2,
     RequestExecProcessInfo = 3,
+    Batch = 4,
 }
 
 impl PidOp {
@@ -34,6 +40,43 @@ impl PidOp {
             PidOp::RequestUnknownProcessInfo => { 1 }
             PidOp::Dead => { 2 }
             PidOp::RequestExecProcessInfo => { 3 }
+            PidOp::Batch => { 4 }
         }
     }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PidEvent {
+    pub op: u32,
+    pub pid: u32,
+}
+
+// must match PID_EVENT_BATCH_SIZE and struct pid_event_batch in profile.bpf.h
+pub const PID_EVENT_BATCH_SIZE: usize = 16;
+const PID_EVENT_SIZE: usize = 8;
+const PID_EVENT_BATCH_HEADER_SIZE: usize = 16;
+
+// Decodes a raw record from the events map, either a single pid_event or a pid_event_batch.
+pub fn decode_pid_events(raw: &[u8], out: &mut Vec<PidEvent>) -> bool {
+    if raw.len() < PID_EVENT_SIZE {
+        return false;
+    }
+    let read_u32 = |off: usize| u32::from_ne_bytes(raw[off..off + 4].try_into().unwrap());
+    let op = read_u32(0);
+    if op != PidOp::Batch.to_u32() {
+        out.push(PidEvent { op, pid: read_u32(4) });
+        return true;
+    }
+    if raw.len() < PID_EVENT_BATCH_HEADER_SIZE {
+        return false;
+    }
+    let count = (read_u32(4) as usize).min(PID_EVENT_BATCH_SIZE);
+    for i in 0..count {
+        let off = PID_EVENT_BATCH_HEADER_SIZE + i * PID_EVENT_SIZE;
+        if off + PID_EVENT_SIZE > raw.len() {
+            return false;
+        }
+        out.push(PidEvent { op: read_u32(off), pid: read_u32(off + 4) });
+    }
+    true
 }
\ No newline at end of file
@@ -0,0 +1,3 @@
+pub mod snapshot;
+pub mod table;
+pub mod unwinder;
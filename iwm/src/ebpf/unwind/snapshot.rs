@@ -0,0 +1,232 @@
+use std::collections::HashMap;
+use std::mem;
+use std::sync::{Arc, Mutex};
+
+use libbpf_rs::libbpf_sys;
+use log::{debug, error};
+
+use crate::ebpf::ring::reader::EventsReader;
+use crate::ebpf::unwind::table::{UnwindRow, UnwindTable, CFA_END, CFA_NONE, CFA_RSP, RBP_CFA_OFFSET};
+use crate::ebpf::unwind::unwinder::{read_unwind_mappings, FileKey};
+use crate::error::Result;
+
+// must match PERF_MAX_STACK_DEPTH in stacks.h and struct stack_snapshot in profile.bpf.h
+const MAX_STACK_DEPTH: usize = 127;
+// offsetof(stack_snapshot, kern_ips) and offsetof(stack_snapshot, stack)
+const SNAPSHOT_KERN_IPS_OFFSET: usize = 40;
+const SNAPSHOT_HEADER_SIZE: usize = SNAPSHOT_KERN_IPS_OFFSET + MAX_STACK_DEPTH * 8;
+
+// snapshots waiting for the next collection are dropped beyond this many bytes of stack
+const SNAPSHOT_QUEUE_BYTES: usize = 64 * 1024 * 1024;
+
+// The registers of samples taken in the kernel come from bpf_task_pt_regs, available since 5.15
+pub fn stack_snapshots_supported() -> bool {
+    unsafe {
+        libbpf_sys::libbpf_probe_bpf_helper(
+            libbpf_sys::BPF_PROG_TYPE_PERF_EVENT,
+            libbpf_sys::BPF_FUNC_task_pt_regs,
+            std::ptr::null(),
+        ) == 1
+    }
+}
+
+#[derive(Debug)]
+pub struct StackSnapshot {
+    pub pid: u32,
+    pub ip: u64,
+    pub sp: u64,
+    pub bp: u64,
+    // leaf first
+    pub kern_ips: Vec<u64>,
+    // the user stack from sp up
+    pub stack: Vec<u8>,
+}
+
+pub fn decode_stack_snapshot(raw: &[u8]) -> Option<StackSnapshot> {
+    if raw.len() < SNAPSHOT_HEADER_SIZE {
+        return None;
+    }
+    let read_u32 = |off: usize| u32::from_ne_bytes(raw[off..off + 4].try_into().unwrap());
+    let read_u64 = |off: usize| u64::from_ne_bytes(raw[off..off + 8].try_into().unwrap());
+    let kern_len = (read_u32(4) as usize / 8).min(MAX_STACK_DEPTH);
+    let stack_len = (read_u32(32) as usize).min(raw.len() - SNAPSHOT_HEADER_SIZE);
+    Some(StackSnapshot {
+        pid: read_u32(0),
+        ip: read_u64(8),
+        sp: read_u64(16),
+        bp: read_u64(24),
+        kern_ips: (0..kern_len)
+            .map(|i| read_u64(SNAPSHOT_KERN_IPS_OFFSET + i * 8))
+            .take_while(|ip| *ip != 0)
+            .collect(),
+        stack: raw[SNAPSHOT_HEADER_SIZE..SNAPSHOT_HEADER_SIZE + stack_len].to_vec(),
+    })
+}
+
+#[derive(Default)]
+pub struct SnapshotQueue {
+    pub snapshots: Vec<StackSnapshot>,
+    bytes: usize,
+    pub dropped: u64,
+}
+
+impl SnapshotQueue {
+    pub fn take(&mut self) -> Vec<StackSnapshot> {
+        self.bytes = 0;
+        mem::take(&mut self.snapshots)
+    }
+}
+
+// Reads stack snapshots on its own thread, like PyEventsConsumer. They are only queued here and
+// unwound with the collection that takes them.
+pub struct SnapshotConsumer {
+    pub(crate) reader: EventsReader,
+    pub(crate) queue: Arc<Mutex<SnapshotQueue>>,
+}
+
+impl SnapshotConsumer {
+    pub fn run(&mut self) {
+        let mut snapshots = Vec::new();
+        loop {
+            let record = match self.reader.read_events() {
+                Ok(record) => record,
+                Err(err) => {
+                    error!("reading stack snapshots: {}", err);
+                    continue;
+                }
+            };
+            if record.lost_samples != 0 {
+                debug!("stack snapshot buffer full, lost: {}", record.lost_samples);
+            }
+            snapshots.clear();
+            for raw in record.raw_samples.iter() {
+                match decode_stack_snapshot(raw) {
+                    Some(s) => snapshots.push(s),
+                    None => error!("stack snapshot too small: {}", raw.len()),
+                }
+            }
+            if snapshots.is_empty() {
+                continue;
+            }
+            let mut queue = self.queue.lock().unwrap();
+            for s in snapshots.drain(..) {
+                if queue.bytes + s.stack.len() > SNAPSHOT_QUEUE_BYTES {
+                    queue.dropped += 1;
+                    continue;
+                }
+                queue.bytes += s.stack.len();
+                queue.snapshots.push(s);
+            }
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct SnapshotMapping {
+    begin: u64,
+    end: u64,
+    bias: u64,
+    table: Arc<UnwindTable>,
+}
+
+// The unwind tables of the PROFILING_TYPE_STACK_SNAPSHOT pids. Unlike DwarfUnwinder nothing is
+// uploaded, so there is no limit on the size of the tables.
+pub struct SnapshotUnwinder {
+    tables: HashMap<FileKey, Option<Arc<UnwindTable>>>,
+    pids: HashMap<u32, Arc<[SnapshotMapping]>>,
+}
+
+impl SnapshotUnwinder {
+    pub fn new() -> Self {
+        Self {
+            tables: HashMap::new(),
+            pids: HashMap::new(),
+        }
+    }
+
+    pub fn add_pid(&mut self, pid: u32) -> Result<()> {
+        self.pids.remove(&pid);
+        let mappings = read_unwind_mappings(pid, &mut self.tables)?;
+        let mappings: Vec<SnapshotMapping> = mappings
+            .iter()
+            .filter_map(|m| {
+                let table = self.tables.get(&m.file)?.clone()?;
+                Some(SnapshotMapping { begin: m.begin, end: m.end, bias: m.bias, table })
+            })
+            .collect();
+        self.pids.insert(pid, mappings.into());
+        Ok(())
+    }
+
+    // Tables only referenced from here are dropped with the last pid mapping them.
+    pub fn remove_pid(&mut self, pid: u32) {
+        if self.pids.remove(&pid).is_some() {
+            self.tables.retain(|_, t| t.as_ref().map_or(true, |t| Arc::strong_count(t) > 1));
+        }
+    }
+
+    pub fn mappings(&self, pid: u32) -> Option<Arc<[SnapshotMapping]>> {
+        self.pids.get(&pid).cloned()
+    }
+}
+
+fn find_row<'a>(mappings: &'a [SnapshotMapping], pc: u64) -> Option<&'a UnwindRow> {
+    let m = mappings.iter().find(|m| pc >= m.begin && pc < m.end)?;
+    let addr = pc.wrapping_sub(m.bias);
+    let rows = &m.table.rows;
+    let i = rows.partition_point(|r| r.pc <= addr);
+    if i == 0 {
+        return None;
+    }
+    Some(&rows[i - 1])
+}
+
+// Same walk as unwind_dwarf_frame in profile.bpf.c, with memory reads limited to the copied stack.
+// The instruction pointers are appended to ips, leaf first.
+pub fn unwind_snapshot(s: &StackSnapshot, mappings: &[SnapshotMapping], ips: &mut Vec<u64>) {
+    let read = |addr: u64| -> Option<u64> {
+        let off = addr.checked_sub(s.sp)? as usize;
+        let bytes = s.stack.get(off..off.checked_add(8)?)?;
+        Some(u64::from_ne_bytes(bytes.try_into().unwrap()))
+    };
+    let (mut ip, mut sp, mut bp) = (s.ip, s.sp, s.bp);
+    for depth in 0..MAX_STACK_DEPTH {
+        if ip == 0 {
+            break;
+        }
+        ips.push(ip);
+        let pc = if depth == 0 { ip } else { ip - 1 };
+        let row = find_row(mappings, pc);
+        let cfa;
+        let mut next_bp = bp;
+        match row {
+            Some(r) if r.cfa_type == CFA_END => break,
+            Some(r) if r.cfa_type != CFA_NONE => {
+                let base = if r.cfa_type == CFA_RSP { sp } else { bp };
+                cfa = base.wrapping_add(r.cfa_offset as i64 as u64);
+                if r.rbp_type == RBP_CFA_OFFSET {
+                    match read(cfa.wrapping_add(r.rbp_offset as i64 as u64)) {
+                        Some(v) => next_bp = v,
+                        None => break,
+                    }
+                }
+            }
+            _ => {
+                if bp == 0 {
+                    break;
+                }
+                cfa = bp.wrapping_add(16);
+                match read(bp) {
+                    Some(v) => next_bp = v,
+                    None => break,
+                }
+            }
+        }
+        match read(cfa.wrapping_sub(8)) {
+            Some(ra) => ip = ra,
+            None => break,
+        }
+        sp = cfa;
+        bp = next_bp;
+    }
+}
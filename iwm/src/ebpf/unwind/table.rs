@@ -0,0 +1,193 @@
+use std::fs;
+use std::path::Path;
+
+use gimli::{BaseAddresses, CfaRule, CieOrFde, EhFrame, LittleEndian, RegisterRule, UnwindContext, UnwindSection, X86_64};
+use object::{Architecture, Object, ObjectSection, ObjectSegment, SegmentFlags};
+
+use crate::error::Error::{ELFError, NotFound};
+use crate::error::Result;
+
+// must match DWARF_CFA_* and DWARF_RBP_* in profile.bpf.h
+pub const CFA_END: u8 = 0;
+pub const CFA_RSP: u8 = 1;
+pub const CFA_RBP: u8 = 2;
+pub const CFA_NONE: u8 = 3;
+pub const RBP_UNCHANGED: u8 = 0;
+pub const RBP_CFA_OFFSET: u8 = 1;
+
+// Mirror of unwind_row in profile.bpf.h, the rule applies from pc until the next row.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone, PartialEq, Eq)]
+pub struct UnwindRow {
+    pub pc: u64,
+    pub cfa_type: u8,
+    pub rbp_type: u8,
+    pub cfa_offset: i16,
+    pub rbp_offset: i16,
+    pub padding: u16,
+}
+
+impl UnwindRow {
+    fn same_rule(&self, other: &UnwindRow) -> bool {
+        self.cfa_type == other.cfa_type
+            && self.rbp_type == other.rbp_type
+            && self.cfa_offset == other.cfa_offset
+            && self.rbp_offset == other.rbp_offset
+    }
+}
+
+#[derive(Debug, Clone, Copy)]
+pub struct LoadSegment {
+    pub offset: u64,
+    pub size: u64,
+    pub address: u64,
+    pub executable: bool,
+}
+
+// The compact unwind rows of an ELF and its PT_LOAD segments, which relate the mappings of the
+// file to the addresses the rows are expressed in.
+#[derive(Debug)]
+pub struct UnwindTable {
+    pub rows: Vec<UnwindRow>,
+    pub segments: Vec<LoadSegment>,
+}
+
+impl UnwindTable {
+    // The bias of a mapping of the file: the address in the file of pc is pc - bias.
+    pub fn bias(&self, start: u64, end: u64, offset: u64) -> Option<u64> {
+        let overlaps = |s: &&LoadSegment| s.offset < offset + (end - start) && offset < s.offset + s.size;
+        let s = self
+            .segments
+            .iter()
+            .filter(overlaps)
+            .find(|s| s.executable)
+            .or_else(|| self.segments.iter().find(overlaps))?;
+        Some(start.wrapping_sub(offset).wrapping_add(s.offset).wrapping_sub(s.address))
+    }
+}
+
+// Compiles the .eh_frame of an x86_64 ELF into rows of a CFA rule (rsp or rbp plus an offset) and
+// an rbp rule. Rules the BPF unwinder can't evaluate, like the expressions of PLT entries, become
+// CFA_NONE rows and are unwound with frame pointers; the end of every FDE is marked the same way.
+pub fn build_unwind_table(path: &Path) -> Result<UnwindTable> {
+    let data = fs::read(path).map_err(|e| ELFError(format!("{:?}: {}", path, e)))?;
+    let file = object::File::parse(&*data).map_err(|e| ELFError(format!("{:?}: {}", path, e)))?;
+    if file.architecture() != Architecture::X86_64 {
+        return Err(NotFound(format!("{:?} is not an x86_64 ELF", path)));
+    }
+    let section = file
+        .section_by_name(".eh_frame")
+        .ok_or_else(|| NotFound(format!("{:?} has no .eh_frame", path)))?;
+    let section_data = section
+        .uncompressed_data()
+        .map_err(|e| ELFError(format!("{:?}: {}", path, e)))?;
+    let mut eh_frame = EhFrame::new(&section_data, LittleEndian);
+    eh_frame.set_address_size(8);
+    let mut bases = BaseAddresses::default().set_eh_frame(section.address());
+    if let Some(text) = file.section_by_name(".text") {
+        bases = bases.set_text(text.address());
+    }
+
+    let mut rows: Vec<UnwindRow> = Vec::new();
+    let mut ctx = UnwindContext::new();
+    let mut entries = eh_frame.entries(&bases);
+    while let Some(entry) = entries.next().map_err(dwarf_error)? {
+        let partial = match entry {
+            CieOrFde::Cie(_) => continue,
+            CieOrFde::Fde(partial) => partial,
+        };
+        let fde = match partial.parse(EhFrame::cie_from_offset) {
+            Ok(fde) => fde,
+            Err(_) => continue,
+        };
+        let mut table = match fde.rows(&eh_frame, &bases, &mut ctx) {
+            Ok(table) => table,
+            Err(_) => continue,
+        };
+        while let Ok(Some(row)) = table.next_row() {
+            let mut r = UnwindRow { pc: row.start_address(), ..Default::default() };
+            match row.cfa() {
+                CfaRule::RegisterAndOffset { register, offset } if *register == X86_64::RSP || *register == X86_64::RBP => {
+                    match i16::try_from(*offset) {
+                        Ok(offset) => {
+                            r.cfa_type = if *register == X86_64::RSP { CFA_RSP } else { CFA_RBP };
+                            r.cfa_offset = offset;
+                        }
+                        Err(_) => r.cfa_type = CFA_NONE,
+                    }
+                }
+                _ => r.cfa_type = CFA_NONE,
+            }
+            match row.register(X86_64::RBP) {
+                RegisterRule::Undefined | RegisterRule::SameValue => {}
+                RegisterRule::Offset(offset) => match i16::try_from(offset) {
+                    Ok(offset) => {
+                        r.rbp_type = RBP_CFA_OFFSET;
+                        r.rbp_offset = offset;
+                    }
+                    Err(_) => r.cfa_type = CFA_NONE,
+                },
+                _ => r.cfa_type = CFA_NONE,
+            }
+            // the return address is always expected at cfa - 8
+            match row.register(X86_64::RA) {
+                RegisterRule::Undefined => r.cfa_type = CFA_END,
+                RegisterRule::Offset(-8) => {}
+                _ => r.cfa_type = CFA_NONE,
+            }
+            rows.push(r);
+        }
+        rows.push(UnwindRow {
+            pc: fde.initial_address() + fde.len(),
+            cfa_type: CFA_NONE,
+            ..Default::default()
+        });
+    }
+    if rows.is_empty() {
+        return Err(NotFound(format!("{:?} has no unwind rows", path)));
+    }
+
+    Ok(UnwindTable {
+        rows: compact_rows(rows),
+        segments: load_segments(&file),
+    })
+}
+
+// Sorts the rows and drops the ones that don't change the rule. At equal pcs the start of an FDE
+// wins over the end marker of the previous one.
+fn compact_rows(mut rows: Vec<UnwindRow>) -> Vec<UnwindRow> {
+    rows.sort_by_key(|r| r.pc);
+    let mut res: Vec<UnwindRow> = Vec::with_capacity(rows.len());
+    for r in rows {
+        if let Some(last) = res.last_mut() {
+            if last.pc == r.pc {
+                if r.cfa_type != CFA_NONE || last.cfa_type == CFA_NONE {
+                    *last = r;
+                }
+                continue;
+            }
+            if last.same_rule(&r) {
+                continue;
+            }
+        }
+        res.push(r);
+    }
+    res
+}
+
+fn load_segments(file: &object::File) -> Vec<LoadSegment> {
+    file.segments()
+        .map(|s| {
+            let (offset, size) = s.file_range();
+            let executable = match s.flags() {
+                SegmentFlags::Elf { p_flags } => p_flags & object::elf::PF_X != 0,
+                _ => false,
+            };
+            LoadSegment { offset, size, address: s.address(), executable }
+        })
+        .collect()
+}
+
+fn dwarf_error(e: gimli::Error) -> crate::error::Error {
+    ELFError(format!("eh_frame: {}", e))
+}
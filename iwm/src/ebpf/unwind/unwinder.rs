@@ -0,0 +1,279 @@
+use std::collections::{HashMap, HashSet};
+use std::ffi::c_void;
+use std::fs;
+use std::mem;
+use std::os::fd::{AsFd, AsRawFd};
+use std::path::PathBuf;
+use std::sync::Arc;
+
+use libbpf_rs::libbpf_sys::{bpf_map_batch_opts, bpf_map_update_batch, size_t};
+use libbpf_rs::{Map, MapFlags};
+use log::{debug, error, info};
+
+use crate::ebpf::symtab::proc::parse_proc_maps_executable_modules;
+use crate::ebpf::wait_for_bpf_programs;
+use crate::ebpf::unwind::table::{build_unwind_table, UnwindRow, UnwindTable};
+use crate::error::Error::{MapError, NotFound, ProcError};
+use crate::error::Result;
+
+// must match UNWIND_MAX_MAPPINGS in profile.bpf.h
+pub const UNWIND_MAX_MAPPINGS: usize = 32;
+
+// Mirror of unwind_mapping in profile.bpf.h
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+struct UnwindMapping {
+    begin: u64,
+    end: u64,
+    bias: u64,
+    first_row: u32,
+    rows: u32,
+}
+
+// Mirror of unwind_info in profile.bpf.h
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+struct UnwindInfo {
+    len: u32,
+    padding: u32,
+    mappings: [UnwindMapping; UNWIND_MAX_MAPPINGS],
+}
+
+impl UnwindInfo {
+    fn as_bytes(&self) -> &[u8] {
+        unsafe { std::slice::from_raw_parts((self as *const UnwindInfo) as *const u8, mem::size_of::<UnwindInfo>()) }
+    }
+}
+
+// (dev, inode) of a mapped file
+pub type FileKey = (u64, u64);
+
+#[derive(Debug, Clone, Copy)]
+pub struct PidMapping {
+    pub begin: u64,
+    pub end: u64,
+    pub bias: u64,
+    pub file: FileKey,
+}
+
+// The executable mappings of the pid that have an unwind table, the tables of new files are
+// compiled into `tables`.
+pub fn read_unwind_mappings(pid: u32, tables: &mut HashMap<FileKey, Option<Arc<UnwindTable>>>) -> Result<Vec<PidMapping>> {
+    let maps = fs::read_to_string(format!("/proc/{}/maps", pid))
+        .map_err(|e| ProcError(format!("read maps of {}: {}", pid, e)))?;
+    let maps = parse_proc_maps_executable_modules(&maps, true)?;
+    let root = PathBuf::from(format!("/proc/{}/root", pid));
+
+    let mut mappings: Vec<PidMapping> = Vec::new();
+    for m in maps.iter().filter(|m| m.pathname.starts_with('/')) {
+        if mappings.len() >= UNWIND_MAX_MAPPINGS {
+            debug!("pid {} has more than {} executable mappings", pid, UNWIND_MAX_MAPPINGS);
+            break;
+        }
+        let file = (m.dev, m.inode);
+        let table = tables.entry(file).or_insert_with(|| {
+            let path = root.join(m.pathname.trim_start_matches('/'));
+            match build_unwind_table(&path) {
+                Ok(table) => {
+                    debug!("unwind table of {}: {} rows", m.pathname, table.rows.len());
+                    Some(Arc::new(table))
+                }
+                Err(err) => {
+                    debug!("no unwind table for {}: {}", m.pathname, err);
+                    None
+                }
+            }
+        });
+        let bias = match table.as_ref().and_then(|t| t.bias(m.start_addr, m.end_addr, m.offset as u64)) {
+            Some(bias) => bias,
+            None => continue,
+        };
+        mappings.push(PidMapping { begin: m.start_addr, end: m.end_addr, bias, file });
+    }
+    if mappings.is_empty() {
+        return Err(NotFound(format!("no unwind tables for pid {}", pid)));
+    }
+    Ok(mappings)
+}
+
+// Keeps unwind_rows and unwind_infos of profile.bpf.c for the PROFILING_TYPE_DWARF pids.
+// Files are compiled and uploaded once and shared by the pids mapping them. Rows of exited pids
+// are left in place until unwind_rows runs out of room, it is then repacked with the files still
+// in use.
+pub struct DwarfUnwinder {
+    // None for files without usable unwind info
+    tables: HashMap<FileKey, Option<Arc<UnwindTable>>>,
+    // first row and number of rows of each uploaded file
+    loaded: HashMap<FileKey, (u32, u32)>,
+    next_row: u32,
+    pids: HashMap<u32, Vec<PidMapping>>,
+}
+
+impl DwarfUnwinder {
+    pub fn new() -> Self {
+        Self {
+            tables: HashMap::new(),
+            loaded: HashMap::new(),
+            next_row: 0,
+            pids: HashMap::new(),
+        }
+    }
+
+    // Uploads the tables of the executable mappings of the pid and fills its unwind_info. Fails
+    // when a table does not fit into unwind_rows, the pid is better off with another unwinder.
+    pub fn add_pid(&mut self, pid: u32, rows_map: &Map, infos_map: &Map) -> Result<()> {
+        if self.pids.remove(&pid).is_some() {
+            let _ = infos_map.delete(&pid.to_ne_bytes());
+        }
+        let mappings = read_unwind_mappings(pid, &mut self.tables)?;
+        let max_rows = rows_map.info().map(|i| i.info.max_entries).unwrap_or(0);
+        let needed_rows: u64 = self.needed(&mappings).iter().map(|f| self.table_len(f) as u64).sum();
+        if self.next_row as u64 + needed_rows > max_rows as u64 {
+            self.repack(&mappings, rows_map, infos_map);
+        }
+        // a repack starts the rows over, what is still missing is only known after it
+        for file in self.needed(&mappings) {
+            self.load(file, max_rows, rows_map);
+        }
+        if mappings.iter().any(|m| !self.loaded.contains_key(&m.file)) {
+            return Err(NotFound(format!("unwind tables of pid {} do not fit into unwind_rows", pid)));
+        }
+        self.write_info(pid, &mappings, infos_map)?;
+        self.pids.insert(pid, mappings);
+        Ok(())
+    }
+
+    pub fn remove_pid(&mut self, pid: u32, infos_map: &Map) {
+        if self.pids.remove(&pid).is_some() {
+            let _ = infos_map.delete(&pid.to_ne_bytes());
+        }
+    }
+
+    // files of the mappings that are not uploaded
+    fn needed(&self, mappings: &[PidMapping]) -> HashSet<FileKey> {
+        mappings
+            .iter()
+            .map(|m| m.file)
+            .filter(|f| !self.loaded.contains_key(f))
+            .collect()
+    }
+
+    fn table_len(&self, file: &FileKey) -> u32 {
+        match self.tables.get(file) {
+            Some(Some(table)) => table.rows.len() as u32,
+            _ => 0,
+        }
+    }
+
+    fn load(&mut self, file: FileKey, max_rows: u32, rows_map: &Map) {
+        if self.loaded.contains_key(&file) {
+            return;
+        }
+        let table = match self.tables.get(&file) {
+            Some(Some(table)) => table.clone(),
+            _ => return,
+        };
+        let len = table.rows.len() as u32;
+        if self.next_row as u64 + len as u64 > max_rows as u64 {
+            info!("unwind_rows is full, no room for the {} rows of {:?}", len, file);
+            return;
+        }
+        if let Err(err) = upload_rows(rows_map, self.next_row, &table.rows) {
+            error!("upload unwind rows: {}", err);
+            return;
+        }
+        self.loaded.insert(file, (self.next_row, len));
+        self.next_row += len;
+    }
+
+    // Starts unwind_rows over with the files of the live pids, then of the pid being added, and
+    // points the live pids at the new positions. Tables of files nobody maps are dropped.
+    // The live pids are pointed at no rows before any row is overwritten, they are unwound with
+    // frame pointers until their new infos are written.
+    fn repack(&mut self, adding: &[PidMapping], rows_map: &Map, infos_map: &Map) {
+        let max_rows = rows_map.info().map(|i| i.info.max_entries).unwrap_or(0);
+        let mut in_use: HashSet<FileKey> = adding.iter().map(|m| m.file).collect();
+        in_use.extend(self.pids.values().flatten().map(|m| m.file));
+        self.tables.retain(|f, t| t.is_none() || in_use.contains(f));
+        self.loaded.clear();
+        self.next_row = 0;
+        for (pid, mappings) in self.pids.iter() {
+            if let Err(err) = self.write_info(*pid, mappings, infos_map) {
+                error!("clear unwind info of pid {}: {}", pid, err);
+            }
+        }
+        wait_for_bpf_programs();
+        let live: HashSet<FileKey> = self.pids.values().flatten().map(|m| m.file).collect();
+        for file in live {
+            self.load(file, max_rows, rows_map);
+        }
+        for m in adding.iter() {
+            self.load(m.file, max_rows, rows_map);
+        }
+        for (pid, mappings) in self.pids.iter() {
+            if let Err(err) = self.write_info(*pid, mappings, infos_map) {
+                error!("rewrite unwind info of pid {}: {}", pid, err);
+            }
+        }
+        debug!("unwind_rows repacked, {} rows in use", self.next_row);
+    }
+
+    // Mappings of files that are not uploaded any more after a repack are left out, BPF falls
+    // back to frame pointers in them.
+    fn write_info(&self, pid: u32, mappings: &[PidMapping], infos_map: &Map) -> Result<()> {
+        let mut info = UnwindInfo {
+            len: 0,
+            padding: 0,
+            mappings: [UnwindMapping::default(); UNWIND_MAX_MAPPINGS],
+        };
+        for m in mappings.iter() {
+            if let Some((first_row, rows)) = self.loaded.get(&m.file) {
+                info.mappings[info.len as usize] = UnwindMapping {
+                    begin: m.begin,
+                    end: m.end,
+                    bias: m.bias,
+                    first_row: *first_row,
+                    rows: *rows,
+                };
+                info.len += 1;
+            }
+        }
+        info.mappings[..info.len as usize].sort_by_key(|m| m.begin);
+        infos_map
+            .update(&pid.to_ne_bytes(), info.as_bytes(), MapFlags::ANY)
+            .map_err(|e| MapError(format!("update unwind_infos: {:?}", e)))
+    }
+}
+
+// One batch update when the kernel has it (5.6+), element by element otherwise.
+fn upload_rows(rows_map: &Map, first: u32, rows: &[UnwindRow]) -> Result<()> {
+    let keys: Vec<u32> = (first..first + rows.len() as u32).collect();
+    let mut count = rows.len() as u32;
+    let opts = bpf_map_batch_opts {
+        sz: mem::size_of::<bpf_map_batch_opts>() as size_t,
+        elem_flags: MapFlags::ANY.bits(),
+        flags: MapFlags::ANY.bits(),
+    };
+    let ret = unsafe {
+        bpf_map_update_batch(
+            rows_map.as_fd().as_raw_fd(),
+            keys.as_ptr() as *const c_void,
+            rows.as_ptr() as *const c_void,
+            &mut count,
+            &opts,
+        )
+    };
+    if ret == 0 {
+        return Ok(());
+    }
+    debug!("batch update of unwind rows failed: {}, falling back to per key updates", -ret);
+    for (key, row) in keys.iter().zip(rows.iter()) {
+        let value = unsafe {
+            std::slice::from_raw_parts((row as *const UnwindRow) as *const u8, mem::size_of::<UnwindRow>())
+        };
+        rows_map
+            .update(&key.to_ne_bytes(), value, MapFlags::ANY)
+            .map_err(|e| MapError(format!("update unwind_rows: {:?}", e)))?;
+    }
+    Ok(())
+}